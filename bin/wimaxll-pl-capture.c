@@ -0,0 +1,237 @@
+/*
+ * Linux WiMax
+ * Traffic capture plugin
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <argp.h>
+#include <signal.h>
+#include <time.h>
+#include <wimaxll.h>
+#include <wimaxll/version.h>
+#include <wimaxll/cmd.h>
+
+
+struct capture_args
+{
+	const char *file_name;
+	struct wimaxll_capture_attr attr;
+	unsigned seconds;
+};
+
+
+static
+struct argp_option capture_options[] = {
+	{ "rotate-size",  'C', "MBYTES",     0,
+	  "Start a new file when the current one grows past MBYTES "
+	  "megabytes (default: never)." },
+	{ "rotate-count", 'W', "COUNT",      0,
+	  "Rotate over COUNT files, overwriting the oldest (default: "
+	  "no limit)." },
+	{ "time",         't', "SECONDS",    0,
+	  "Capture for SECONDS seconds (default: until interrupted)." },
+	{ 0 }
+};
+
+
+static
+int capture_parser(int key, char *arg, struct argp_state *state)
+{
+	int result = 0;
+	struct capture_args *args = state->input;
+	unsigned value;
+
+	switch (key)
+	{
+	case 'C':
+		if (sscanf(arg, "%u", &value) != 1)
+			argp_error(state, "E: %s: cannot parse as a size "
+				   "(in megabytes)\n", arg);
+		args->attr.rotate_size = (size_t) value * 1000000;
+		break;
+	case 'W':
+		if (sscanf(arg, "%u", &args->attr.rotate_count) != 1)
+			argp_error(state, "E: %s: cannot parse as a count\n",
+				   arg);
+		break;
+	case 't':
+		if (sscanf(arg, "%u", &args->seconds) != 1)
+			argp_error(state, "E: %s: cannot parse as a time "
+				   "(in seconds)\n", arg);
+		break;
+	case ARGP_KEY_ARG:
+		if (args->file_name != NULL)
+			argp_error(state, "E: %s: only one file can be "
+				   "given\n", arg);
+		args->file_name = arg;
+		break;
+	case ARGP_KEY_END:
+		if (args->file_name == NULL)
+			argp_error(state, "E: missing file name\n");
+		break;
+	default:
+		result = ARGP_ERR_UNKNOWN;
+	}
+	return result;
+}
+
+
+static volatile sig_atomic_t capture_interrupted;
+
+static
+void capture_sighandler(int signal)
+{
+	capture_interrupted = 1;
+}
+
+
+/* We can't capture what we don't receive */
+static
+int capture_msg_to_user_cb(struct wimaxll_handle *wmx, void *priv,
+			   const char *pipe_name,
+			   const void *data, size_t size)
+{
+	return 0;
+}
+
+
+static
+long capture_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+static
+int capture_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
+	       int argc, char **argv)
+{
+	int result;
+	ssize_t r;
+	struct capture_args args;
+	struct wimaxll_stats stats;
+	unsigned long long msgs;
+	struct sigaction sa, sa_int, sa_term;
+	long left, deadline;
+	int slice;
+	wimaxll_msg_to_user_cb_f old_cb;
+	void *old_priv;
+
+	memset(&args, 0, sizeof(args));
+	result = w_cmd_argp_parse(cmd, argc, argv, 0, &args);
+	if (result < 0)
+		goto error_argp_parse;
+	result = w_cmd_need_if(wmx);
+	if (result < 0)
+		goto error_need_if;
+	result = wimaxll_capture_start(wmx, args.file_name, &args.attr);
+	if (result < 0) {
+		w_error("%s: cannot start capture: %d (%s)\n",
+			args.file_name, result, strerror(-result));
+		goto error_capture_start;
+	}
+	wimaxll_stats_get(wmx, &stats);
+	msgs = stats.rx_msgs;
+	wimaxll_get_cb_msg_to_user(wmx, &old_cb, &old_priv);
+	wimaxll_set_cb_msg_to_user(wmx, capture_msg_to_user_cb, NULL);
+
+	capture_interrupted = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = capture_sighandler;
+	sigaction(SIGINT, &sa, &sa_int);
+	sigaction(SIGTERM, &sa, &sa_term);
+	deadline = capture_now_ms() + args.seconds * 1000L;
+	while (!capture_interrupted) {
+		/* Wake up every now and then to check for signals */
+		slice = 1000;
+		if (args.seconds > 0) {
+			left = deadline - capture_now_ms();
+			if (left <= 0)
+				break;
+			if (left < slice)
+				slice = left;
+		}
+		r = wimaxll_recv_timeout(wmx, slice);
+		if (r < 0 && r != -ETIMEDOUT && r != -ENODEV
+		    && r != -EINTR) {
+			w_error("receive failed: %zd (%s)\n",
+				r, strerror(-r));
+			break;
+		}
+	}
+	sigaction(SIGINT, &sa_int, NULL);
+	sigaction(SIGTERM, &sa_term, NULL);
+	wimaxll_set_cb_msg_to_user(wmx, old_cb, old_priv);
+
+	result = wimaxll_capture_stop(wmx);
+	if (result < 0)
+		w_error("%s: capture failed: %d (%s)\n",
+			args.file_name, result, strerror(-result));
+	wimaxll_stats_get(wmx, &stats);
+	w_print("%llu messages captured\n", stats.rx_msgs - msgs);
+error_capture_start:
+error_need_if:
+error_argp_parse:
+	return result;
+}
+
+static
+struct cmd capture_cmd = {
+	.name = "capture",
+	.argp = {
+		.options = capture_options,
+		.parser = capture_parser,
+		.args_doc = "FILE",
+		.doc = "Save the messages a WiMAX device sends to FILE "
+		"(in pcapng format, as the nlmon device would capture "
+		"them)\n",
+	},
+	.fn = capture_fn,
+};
+
+
+static
+int capture_init(void)
+{
+	return w_cmd_register(&capture_cmd);
+}
+
+static
+void capture_exit(void)
+{
+	w_cmd_unregister(&capture_cmd);
+}
+
+PLUGIN("capture", WIMAXLL_VERSION, capture_init, capture_exit);
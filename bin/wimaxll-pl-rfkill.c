@@ -116,11 +116,13 @@ int rfkill_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 
 	args.cmd = cmd;
 	args.op = WIMAX_RF_QUERY;
-	result = argp_parse(&cmd->argp, argc, argv,
-			    0, 0, &args);
+	result = w_cmd_argp_parse(cmd, argc, argv,
+				  0, &args);
 	if (result < 0)
 		goto error_argp_parse;
-	w_cmd_need_if(wmx);
+	result = w_cmd_need_if(wmx);
+	if (result < 0)
+		goto error_need_if;
 	result = wimaxll_rfkill(wmx, args.op);
 	if (result < 0) {
 		w_error("rfkill failed: %d (%s)\n", result, strerror(-result));
@@ -133,6 +135,7 @@ int rfkill_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 		result = -EIO;
 	}
 error_rfkill:
+error_need_if:
 error_argp_parse:
 	return result;
 }
@@ -56,14 +56,17 @@ int state_get_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 	      int argc, char **argv)
 {
 	int result;
-	result = argp_parse(&cmd->argp, argc, argv,
-			    ARGP_IN_ORDER | ARGP_PARSE_ARGV0, 0, NULL);
+	result = w_cmd_argp_parse(cmd, argc, argv,
+				  ARGP_IN_ORDER | ARGP_PARSE_ARGV0, NULL);
 	if (result < 0)
 		goto error_argp_parse;
-	w_cmd_need_if(wmx);
+	result = w_cmd_need_if(wmx);
+	if (result < 0)
+		goto error_need_if;
 	result = wimaxll_state_get(wmx);
 	if (result >= 0)
 		w_print("%s\n", wimaxll_state_to_name(result));
+error_need_if:
 error_argp_parse:
 	return result;
 }
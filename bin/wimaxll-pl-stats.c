@@ -0,0 +1,246 @@
+/*
+ * Linux WiMax
+ * Performance counters plugin
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE
+#include <argp.h>
+#include <time.h>
+#include <wimaxll.h>
+#include <wimaxll/version.h>
+#include <wimaxll/cmd.h>
+
+
+struct stats_args
+{
+	unsigned count;
+	unsigned listen;
+};
+
+
+static
+struct argp_option stats_options[] = {
+	{ "count",  'c', "COUNT",       0,
+	  "Number of state-get round trips to measure (default 10)." },
+	{ "listen", 't', "SECONDS",     0,
+	  "Time (in seconds) to receive notifications for before "
+	  "printing (default 0)." },
+	{ 0 }
+};
+
+
+static
+int stats_parser(int key, char *arg, struct argp_state *state)
+{
+	int result = 0;
+	struct stats_args *args = state->input;
+
+	switch (key)
+	{
+	case 'c':
+		if (sscanf(arg, "%u", &args->count) != 1)
+			argp_error(state, "E: %s: cannot parse as a count\n",
+				   arg);
+		break;
+	case 't':
+		if (sscanf(arg, "%u", &args->listen) != 1)
+			argp_error(state, "E: %s: cannot parse as a time "
+				   "(in seconds)\n", arg);
+		break;
+	default:
+		result = ARGP_ERR_UNKNOWN;
+	}
+	return result;
+}
+
+
+static
+int stats_msg_to_user_cb(struct wimaxll_handle *wmx, void *priv,
+			 const char *pipe_name,
+			 const void *data, size_t size)
+{
+	return 0;
+}
+
+
+static
+int stats_state_change_cb(struct wimaxll_handle *wmx, void *priv,
+			  enum wimax_st old_state, enum wimax_st new_state)
+{
+	return 0;
+}
+
+
+static
+long stats_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+static
+void stats_listen(struct wimaxll_handle *wmx, unsigned seconds)
+{
+	ssize_t result;
+	long left, deadline = stats_now_ms() + seconds * 1000L;
+	wimaxll_msg_to_user_cb_f old_msg_to_user_cb;
+	void *old_msg_to_user_priv;
+	wimaxll_state_change_cb_f old_state_change_cb;
+	void *old_state_change_priv;
+
+	/* In shell mode the handle outlives us; put them back after */
+	wimaxll_get_cb_msg_to_user(wmx, &old_msg_to_user_cb,
+				   &old_msg_to_user_priv);
+	wimaxll_get_cb_state_change(wmx, &old_state_change_cb,
+				    &old_state_change_priv);
+	wimaxll_set_cb_msg_to_user(wmx, stats_msg_to_user_cb, NULL);
+	wimaxll_set_cb_state_change(wmx, stats_state_change_cb, NULL);
+	while ((left = deadline - stats_now_ms()) > 0) {
+		result = wimaxll_recv_timeout(wmx, left);
+		if (result == -ETIMEDOUT)
+			break;
+		if (result < 0 && result != -ENODEV)
+			w_error("receive failed: %zd (%s)\n",
+				result, strerror(-result));
+	}
+	wimaxll_set_cb_state_change(wmx, old_state_change_cb,
+				    old_state_change_priv);
+	wimaxll_set_cb_msg_to_user(wmx, old_msg_to_user_cb,
+				   old_msg_to_user_priv);
+}
+
+
+static
+void stats_print(const struct wimaxll_stats *stats)
+{
+	unsigned cnt;
+	const struct wimaxll_stats_hist *hist;
+	const struct wimaxll_stats_pipe *pipe;
+
+	w_print("rx: %llu messages (%llu bytes), %llu state changes\n",
+		stats->rx_msgs, stats->rx_bytes, stats->rx_state_changes);
+	w_print("rx skipped: %llu other devices, %llu filtered, "
+		"%llu parse errors, %llu out of memory\n",
+		stats->rx_other, stats->rx_filtered,
+		stats->rx_parse_errors, stats->rx_nomem);
+	w_print("rx overruns: %llu\n", stats->rx_overruns);
+	w_print("tx: %llu messages (%llu bytes), %llu errors\n",
+		stats->tx_msgs, stats->tx_bytes, stats->tx_errors);
+	for (cnt = 0; cnt < stats->pipes; cnt++) {
+		pipe = &stats->pipe[cnt];
+		w_print("pipe '%s': rx %llu (%llu bytes) tx %llu "
+			"(%llu bytes)\n",
+			pipe->name[0] ? pipe->name : "(default)",
+			pipe->rx_msgs, pipe->rx_bytes,
+			pipe->tx_msgs, pipe->tx_bytes);
+	}
+	if (stats->pipe_overflow)
+		w_print("pipes not listed: %llu messages\n",
+			stats->pipe_overflow);
+	w_print("%-10s %8s %6s %8s %8s %8s %8s %8s %8s (us)\n",
+		"op", "count", "errors", "min", "mean", "p50", "p90", "p99",
+		"max");
+	for (cnt = 0; cnt < WIMAXLL_STATS_OP_MAX; cnt++) {
+		hist = &stats->ack[cnt];
+		if (hist->count == 0)
+			continue;
+		w_print("%-10s %8llu %6llu %8llu %8llu %8llu %8llu %8llu "
+			"%8llu\n",
+			wimaxll_stats_op_name(cnt), hist->count, hist->errors,
+			hist->min_us, hist->sum_us / hist->count,
+			wimaxll_stats_hist_percentile(hist, 50),
+			wimaxll_stats_hist_percentile(hist, 90),
+			wimaxll_stats_hist_percentile(hist, 99),
+			hist->max_us);
+	}
+}
+
+
+static
+int stats_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
+	     int argc, char **argv)
+{
+	int result;
+	unsigned cnt;
+	struct stats_args args;
+	struct wimaxll_stats stats;
+
+	args.count = 10;
+	args.listen = 0;
+	result = w_cmd_argp_parse(cmd, argc, argv,
+				  ARGP_IN_ORDER | ARGP_PARSE_ARGV0, &args);
+	if (result < 0)
+		goto error_argp_parse;
+	result = w_cmd_need_if(wmx);
+	if (result < 0)
+		goto error_need_if;
+	for (cnt = 0; cnt < args.count; cnt++)
+		wimaxll_state_get(wmx);
+	if (args.listen > 0)
+		stats_listen(wmx, args.listen);
+	wimaxll_stats_get(wmx, &stats);
+	stats_print(&stats);
+error_need_if:
+error_argp_parse:
+	return result;
+}
+
+static
+struct cmd stats_cmd = {
+	.name = "stats",
+	.argp = {
+		.options = stats_options,
+		.parser = stats_parser,
+		.args_doc = "",
+		.doc = "Measure a WiMAX device's control round trip times "
+		"and print the library's performance counters\n",
+	},
+	.fn = stats_fn,
+};
+
+
+static
+int stats_init(void)
+{
+	return w_cmd_register(&stats_cmd);
+}
+
+static
+void stats_exit(void)
+{
+	w_cmd_unregister(&stats_cmd);
+}
+
+PLUGIN("stats", WIMAXLL_VERSION, stats_init, stats_exit);
@@ -34,11 +34,23 @@
  */
 #define _GNU_SOURCE
 #include <argp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 #include <wimaxll.h>
 #include <wimaxll/version.h>
 #include <wimaxll/cmd.h>
 
 
+enum wfsc_format {
+	WFSC_FORMAT_TEXT,
+	WFSC_FORMAT_JSON,
+	WFSC_FORMAT_BINARY,
+};
+
+
 struct wfsc_args
 {
 	struct cmd *cmd;
@@ -46,6 +58,38 @@ struct wfsc_args
 	char **argv;
 	size_t argc;
 	unsigned timeout;
+	int follow;
+	int help_states;
+	enum wfsc_format format;
+};
+
+
+/*
+ * Record written for each transition with --follow --format=binary
+ *
+ * In host byte order; @ts_ns is the time it was received
+ * (CLOCK_REALTIME, in nanoseconds). @state holds the last @count
+ * states the device went through, oldest first; when @transitions
+ * were collapsed into the record, @old_state is the state before the
+ * first of them and @new_state the one after the last.
+ */
+struct wfsc_record {
+	uint64_t ts_ns;
+	uint32_t ifidx;
+	uint32_t transitions;
+	uint8_t old_state;
+	uint8_t new_state;
+	uint8_t flags;
+	uint8_t count;
+	uint8_t state[WIMAXLL_STATE_LOG_SIZE];
+} __attribute__((packed));
+
+enum {
+	/* Notifications were lost; @new_state is the state the device
+	 * was found in afterwards, if known. */
+	WFSC_RECORD_LOST = 0x01,
+	/* More transitions than fit in @state */
+	WFSC_RECORD_TRUNCATED = 0x02,
 };
 
 
@@ -60,6 +104,12 @@ struct argp_option wfsc_options[] = {
 #endif
 	{ "help-states",  's', 0,       0,
 	  "List known WiMAX states." },
+	{ "follow",       'f', 0,       0,
+	  "Keep printing state changes until interrupted; without an "
+	  "interface, for all of them." },
+	{ "format",       'F', "FORMAT", 0,
+	  "Output format for --follow: text (default), json (one "
+	  "object per line) or binary." },
 	{ 0 }
 };
 
@@ -69,7 +119,6 @@ int wfsc_parser(int key, char *arg, struct argp_state *state)
 {
 	int result = 0;
 	struct wfsc_args *args = state->input;
-	char str[256];
 	
 	switch (key)
 	{
@@ -79,11 +128,24 @@ int wfsc_parser(int key, char *arg, struct argp_state *state)
 				   arg);
 		break;
 		
+	case 'f':
+		args->follow = 1;
+		break;
+
+	case 'F':
+		if (!strcmp(arg, "text"))
+			args->format = WFSC_FORMAT_TEXT;
+		else if (!strcmp(arg, "json"))
+			args->format = WFSC_FORMAT_JSON;
+		else if (!strcmp(arg, "binary"))
+			args->format = WFSC_FORMAT_BINARY;
+		else
+			argp_error(state, "E: %s: unknown format (text, json "
+				   "or binary)\n", arg);
+		break;
+
 	case 's':
-		wimaxll_states_snprintf(str, sizeof(str));
-		w_print("%s: known WiMAX device states: %s\n",
-			args->cmd->name, str);
-		exit(0);
+		args->help_states = 1;
 		break;
 		
 	case ARGP_KEY_ARG:
@@ -96,6 +158,12 @@ int wfsc_parser(int key, char *arg, struct argp_state *state)
 		state->next = state->argc;
 		break;
 
+	case ARGP_KEY_END:
+		if (args->follow && args->state != __WIMAX_ST_INVALID)
+			argp_error(state, "E: --follow reports all state "
+				   "changes, no state can be given\n");
+		break;
+
 	default:
 		result = ARGP_ERR_UNKNOWN;
 	}
@@ -103,6 +171,333 @@ int wfsc_parser(int key, char *arg, struct argp_state *state)
 }
 
 
+/*
+ * Output for --follow
+ *
+ * Records are accumulated and written in one go after each time we
+ * wake up to receive (or when the buffer fills up), so a burst of
+ * state changes is a single write and readers never see partial
+ * lines.
+ */
+enum {
+	/* Largest record we print (a coalesced one in JSON) */
+	WFSC_RECORD_MAX = 1024,
+};
+
+struct wfsc_out {
+	enum wfsc_format format;
+	int fd;
+	int error;
+	/* notifications were lost and we can query the state */
+	int can_resync, resync;
+	size_t used;
+	char buf[16384];
+};
+
+
+static
+void wfsc_out_flush(struct wfsc_out *out)
+{
+	ssize_t r;
+	size_t done = 0;
+
+	while (done < out->used && out->error == 0) {
+		r = write(out->fd, out->buf + done, out->used - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			out->error = -errno;
+		else
+			done += r;
+	}
+	out->used = 0;
+}
+
+
+/* Make room for @size bytes, flushing if needed */
+static
+char *wfsc_out_reserve(struct wfsc_out *out, size_t size)
+{
+	if (out->used + size > sizeof(out->buf))
+		wfsc_out_flush(out);
+	return out->buf + out->used;
+}
+
+
+static
+void wfsc_out_printf(struct wfsc_out *out, const char *fmt, ...)
+	__attribute__ ((format(printf, 2, 3)));
+
+static
+void wfsc_out_printf(struct wfsc_out *out, const char *fmt, ...)
+{
+	va_list vargs;
+	int size;
+
+	va_start(vargs, fmt);
+	size = vsnprintf(out->buf + out->used, sizeof(out->buf) - out->used,
+			 fmt, vargs);
+	va_end(vargs);
+	if (size >= 0 && out->used + size >= sizeof(out->buf)) {
+		/* didn't fit, flush and retry (a record always fits) */
+		wfsc_out_flush(out);
+		va_start(vargs, fmt);
+		size = vsnprintf(out->buf, sizeof(out->buf), fmt, vargs);
+		va_end(vargs);
+	}
+	if (size > 0)
+		out->used += size;
+}
+
+
+static
+const char *wfsc_state_name(enum wimax_st state)
+{
+	const char *name = wimaxll_state_to_name(state);
+
+	return name == NULL ? "unknown" : name;
+}
+
+
+/* Interface names can have about anything */
+static
+void wfsc_out_json_str(struct wfsc_out *out, const char *str)
+{
+	wfsc_out_printf(out, "\"");
+	for (; *str; str++)
+		if (*str == '"' || *str == '\\')
+			wfsc_out_printf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			wfsc_out_printf(out, "\\u%04x", *str);
+		else
+			wfsc_out_printf(out, "%c", *str);
+	wfsc_out_printf(out, "\"");
+}
+
+
+/*
+ * Called with the state changes collapsed since we last woke up
+ *
+ * With an "any" handle, wimaxll_ifidx() gives the device they came
+ * from.
+ */
+static
+int wfsc_follow_cb(struct wimaxll_handle *wmx, void *priv,
+		   enum wimax_st old_state, enum wimax_st new_state,
+		   const struct wimaxll_state_log *log)
+{
+	struct wfsc_out *out = priv;
+	struct timespec ts;
+	unsigned ifidx = wimaxll_ifidx(wmx), itr;
+	char ifname[IF_NAMESIZE];
+	int lost = old_state == WIMAXLL_STATE_LOST;
+	int truncated = log->transitions >= log->count;
+	struct wfsc_record *rec;
+
+	if (lost && new_state == __WIMAX_ST_INVALID && out->can_resync) {
+		/* The library doesn't know the state now; stop
+		 * receiving so wfsc_follow() can ask before printing
+		 * what comes after. */
+		out->resync = 1;
+		return -EBUSY;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	wfsc_out_reserve(out, WFSC_RECORD_MAX);
+	if (if_indextoname(ifidx, ifname) == NULL)
+		strcpy(ifname, "?");
+	switch (out->format) {
+	case WFSC_FORMAT_BINARY:
+		rec = (void *) wfsc_out_reserve(out, sizeof(*rec));
+		memset(rec, 0, sizeof(*rec));
+		rec->ts_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		rec->ifidx = ifidx;
+		rec->transitions = log->transitions;
+		rec->old_state = old_state;
+		rec->new_state = new_state;
+		rec->flags = (lost ? WFSC_RECORD_LOST : 0)
+			| (truncated ? WFSC_RECORD_TRUNCATED : 0);
+		rec->count = log->count;
+		memcpy(rec->state, log->state, log->count);
+		out->used += sizeof(*rec);
+		break;
+	case WFSC_FORMAT_JSON:
+		wfsc_out_printf(out, "{\"ts\":%ld.%06ld,\"ifidx\":%u,"
+				"\"ifname\":", (long) ts.tv_sec,
+				ts.tv_nsec / 1000, ifidx);
+		wfsc_out_json_str(out, ifname);
+		if (lost) {
+			wfsc_out_printf(out, ",\"overflow\":true,"
+					"\"new\":\"%s\"}\n",
+					wfsc_state_name(new_state));
+			break;
+		}
+		wfsc_out_printf(out, ",\"old\":\"%s\",\"new\":\"%s\"",
+				wfsc_state_name(old_state),
+				wfsc_state_name(new_state));
+		if (log->transitions > 1) {
+			wfsc_out_printf(out, ",\"coalesced\":%u,\"path\":[",
+					log->transitions);
+			for (itr = 0; itr < log->count; itr++)
+				wfsc_out_printf(out, "%s\"%s\"",
+						itr ? "," : "",
+						wfsc_state_name(log->state[itr]));
+			wfsc_out_printf(out, "]%s", truncated ?
+					",\"truncated\":true" : "");
+		}
+		wfsc_out_printf(out, "}\n");
+		break;
+	default:
+		wfsc_out_printf(out, "%ld.%06ld %s ", (long) ts.tv_sec,
+				ts.tv_nsec / 1000, ifname);
+		if (lost) {
+			wfsc_out_printf(out, "overflow (state changes lost), "
+					"now %s\n", wfsc_state_name(new_state));
+			break;
+		}
+		wfsc_out_printf(out, "%s -> %s", wfsc_state_name(old_state),
+				wfsc_state_name(new_state));
+		if (log->transitions > 1) {
+			wfsc_out_printf(out, " (coalesced %u:%s",
+					log->transitions,
+					truncated ? " ..." : "");
+			for (itr = 0; itr < log->count; itr++)
+				wfsc_out_printf(out, " %s",
+						wfsc_state_name(log->state[itr]));
+			wfsc_out_printf(out, ")");
+		}
+		wfsc_out_printf(out, "\n");
+	}
+	return out->error;
+}
+
+
+/* Messages are not for us */
+static
+int wfsc_msg_to_user_cb(struct wimaxll_handle *wmx, void *priv,
+			const char *pipe_name,
+			const void *data, size_t size)
+{
+	return 0;
+}
+
+
+static volatile sig_atomic_t wfsc_interrupted;
+
+static
+void wfsc_sighandler(int signal)
+{
+	wfsc_interrupted = 1;
+}
+
+
+/*
+ * Print the overflow record wfsc_follow_cb() left for us
+ *
+ * Outside of the callbacks, we can wait for the device to tell us
+ * the state it is in now.
+ */
+static
+void wfsc_resync(struct wimaxll_handle *wmx, struct wfsc_out *out)
+{
+	int result;
+	struct wimaxll_state_log log;
+
+	out->resync = 0;
+	result = wimaxll_state_get(wmx);
+	memset(&log, 0, sizeof(log));
+	log.state[log.count++] = result < 0 ? __WIMAX_ST_INVALID : result;
+	out->can_resync = 0;
+	wfsc_follow_cb(wmx, out, WIMAXLL_STATE_LOST, log.state[0], &log);
+	out->can_resync = 1;
+}
+
+
+/*
+ * Stream the state changes of one device (or of all of them)
+ *
+ * Using the coalesced callback, all the state changes queued when we
+ * wake up come in one callback per device, which is also where we
+ * find out notifications were lost.
+ */
+static
+int wfsc_follow(struct cmd *cmd, struct wimaxll_handle *wmx,
+		const struct wfsc_args *args)
+{
+	int result = 0;
+	ssize_t r;
+	struct wimaxll_handle *any = NULL;
+	struct wfsc_out *out;
+	struct sigaction sa, sa_int, sa_term;
+	wimaxll_msg_to_user_cb_f old_msg_to_user_cb;
+	void *old_msg_to_user_priv;
+	wimaxll_state_change_coalesced_cb_f old_coalesced_cb;
+	void *old_coalesced_priv;
+
+	out = calloc(1, sizeof(*out));
+	if (out == NULL) {
+		result = -ENOMEM;
+		goto error_alloc;
+	}
+	out->format = args->format;
+	out->fd = STDOUT_FILENO;
+	/* A handle for any device has no state to ask for */
+	out->can_resync = wmx != NULL;
+	if (wmx == NULL) {
+		any = wimaxll_open(NULL);
+		if (any == NULL) {
+			result = -errno;
+			w_error("cannot open handle for all devices: %m\n");
+			goto error_open;
+		}
+		wmx = any;
+	}
+	/* In shell mode the handle outlives us; put them back after */
+	wimaxll_get_cb_msg_to_user(wmx, &old_msg_to_user_cb,
+				   &old_msg_to_user_priv);
+	wimaxll_get_cb_state_change_coalesced(wmx, &old_coalesced_cb,
+					      &old_coalesced_priv);
+	wimaxll_set_cb_msg_to_user(wmx, wfsc_msg_to_user_cb, NULL);
+	wimaxll_set_cb_state_change_coalesced(wmx, wfsc_follow_cb, out);
+
+	wfsc_interrupted = 0;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wfsc_sighandler;
+	sigaction(SIGINT, &sa, &sa_int);
+	sigaction(SIGTERM, &sa, &sa_term);
+	while (!wfsc_interrupted && out->error == 0) {
+		/* Wake up every now and then to check for signals */
+		r = wimaxll_recv_timeout(wmx, 1000);
+		if (out->resync)
+			wfsc_resync(wmx, out);
+		wfsc_out_flush(out);
+		if (r < 0 && r != -ETIMEDOUT && r != -ENODEV
+		    && r != -EINTR) {
+			w_error("receive failed: %zd (%s)\n",
+				r, strerror(-r));
+			result = r;
+			break;
+		}
+	}
+	sigaction(SIGINT, &sa_int, NULL);
+	sigaction(SIGTERM, &sa_term, NULL);
+	wimaxll_set_cb_state_change_coalesced(wmx, old_coalesced_cb,
+					      old_coalesced_priv);
+	wimaxll_set_cb_msg_to_user(wmx, old_msg_to_user_cb,
+				   old_msg_to_user_priv);
+	wfsc_out_flush(out);
+	if (out->error < 0 && out->error != -EPIPE) {
+		w_error("cannot write: %d (%s)\n", out->error,
+			strerror(-out->error));
+		result = out->error;
+	}
+	wimaxll_close(any);
+error_open:
+	free(out);
+error_alloc:
+	return result;
+}
+
+
 static
 int wfsc_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 	      int argc, char **argv)
@@ -110,19 +505,33 @@ int wfsc_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 	int result;
 	struct wfsc_args args;
 	enum wimax_st old_state, new_state;
+	char str[256];
 	
+	memset(&args, 0, sizeof(args));
 	args.cmd = cmd;
 	args.state = __WIMAX_ST_INVALID;	/* meaning any */
-	result = argp_parse(&cmd->argp, argc, argv,
-			    0, 0, &args);
+	result = w_cmd_argp_parse(cmd, argc, argv,
+				  0, &args);
 	if (result < 0)
 		goto error_argp_parse;
-	w_cmd_need_if(wmx);
+	if (args.help_states) {
+		wimaxll_states_snprintf(str, sizeof(str));
+		w_print("%s: known WiMAX device states: %s\n",
+			cmd->name, str);
+		return 0;
+	}
+	if (args.follow)
+		return wfsc_follow(cmd, wmx, &args);
+	result = w_cmd_need_if(wmx);
+	if (result < 0)
+		goto error_need_if;
 	while(1) {
 		result = wimaxll_wait_for_state_change(wmx, &old_state, &new_state);
-		if (result < 0)
-			w_abort(1, "%s: error waiting: %d (%s)\n", cmd->name,
-				result, strerror(result));
+		if (result < 0) {
+			w_error("%s: error waiting: %d (%s)\n", cmd->name,
+				result, strerror(-result));
+			break;
+		}
 		w_info("%d: %s\n", new_state, wimaxll_state_to_name(new_state));
 		w_print("%d: %s\n", new_state, wimaxll_state_to_name(new_state));
 		if (new_state == args.state)
@@ -130,6 +539,7 @@ int wfsc_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
 		if (args.state == __WIMAX_ST_INVALID)
 			break;
 	}
+error_need_if:
 error_argp_parse:
 	return result;
 }
@@ -142,7 +552,15 @@ struct cmd wfsc_cmd = {
 		.parser = wfsc_parser,
 		.args_doc = "[STATE]",
 		.doc = "Wait for a device state change; if no state is "
-		"specified, waits until any state transition happens\n",
+		"specified, waits until any state transition happens.\n"
+		"\v"
+		"With --follow, prints each state change (with the time it "
+		"was received and the interface) until interrupted. "
+		"State changes that happen faster than they are read are "
+		"collapsed into one, listing the states the device went "
+		"through; when notifications are lost, an overflow record "
+		"is printed with the state the device is now in (unknown "
+		"when following all of them).\n",
 	},
 	.fn = wfsc_fn,
 };
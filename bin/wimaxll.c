@@ -39,20 +39,40 @@
  *
  * A plugin must declare a non-static 'struct plugin plugin' data
  * structure, with DECLARE_PLUGIN() [wimaxll-tool.h] in order to count.
+ *
+ * Lean builds (WIMAXLL_STATIC_PLUGINS) link the plugins into the tool
+ * instead of loading them from PLUGINDIR, and don't need GLib.
  */
 #define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <setjmp.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <error.h>
 #include <net/if.h>
 #include <errno.h>
 #include <argp.h>
+#ifndef WIMAXLL_STATIC_PLUGINS
 #include <dlfcn.h>
+#endif
 #include <wimaxll.h>
 #include <wimaxll/version.h>
 #include "config.h"
 #include <wimaxll/cmd.h>
+#ifndef WIMAXLL_STATIC_PLUGINS
 #include <glib.h>
+#endif
+
+/* Lean builds have the trace API only if the tracepoints are in */
+#if !defined(WIMAXLL_LEAN) || defined(WIMAXLL_TRACE)
+#define W_TRACE
+#endif
 #include <stdarg.h>
 
 
@@ -63,6 +83,7 @@ struct main_args
 	char ifname[IFNAMSIZ];
 	unsigned ifindex;
 	int verbosity;
+	int trace;
 	char **cmd_argv;
 	size_t cmd_argc;
 } main_args;
@@ -104,17 +125,153 @@ void w_abort(int result, const char *fmt, ...)
 	va_start(vargs, fmt);
 	w_vmsg(W_ERROR, __FILE__, __LINE__, fmt, vargs);
 	va_end(vargs);
-	exit(result);
+	w_cmd_exit(result);
 }
 
 
 /* Command handling */
 
+/*
+ * State of the shell (see shell_fn())
+ *
+ * \param active commands are being run from the shell; w_cmd_exit()
+ *     jumps back to \a jmp instead of exiting.
+ * \param exit_status what the command passed to w_cmd_exit()
+ * \param argp_error the command's argp parser complained (see
+ *     w_cmd_argp_parse())
+ * \param argp_err_stream where argp's complains go in the shell
+ */
+static struct {
+	int active;
+	int exit_status;
+	int argp_error;
+	sigjmp_buf jmp;
+	FILE *argp_err_stream;
+} shell;
+
+
+/*
+ * Terminate a command
+ *
+ * Normally this exits the program; when running in the shell, the
+ * command is just abandoned and the shell goes on. Whatever the
+ * command had to undo (callbacks set in the handle, signal
+ * handlers...) is left as it is, so commands should rather return
+ * their errors; this is for the few places that can't (eg: argp
+ * parsers).
+ */
+void w_cmd_exit(int result)
+{
+	if (shell.active) {
+		shell.exit_status = result;
+		siglongjmp(shell.jmp, 1);
+	}
+	exit(result);
+}
+
+
+enum {
+	SHELL_ARGP_USAGE = 0x100,
+};
+
+static
+struct argp_option shell_argp_options[] = {
+	{ "help", '?', 0, 0, "Give this help list" },
+	{ "usage", SHELL_ARGP_USAGE, 0, 0, "Give a short usage message" },
+	{ 0 }
+};
+
+
+/*
+ * Parent of the commands' parsers in the shell
+ *
+ * argp's help options exit, so we provide our own, which just stop
+ * the parsing; we also redirect argp's complains (argp_error(),
+ * argp_usage()) to a stream that flags them, as with ARGP_NO_EXIT
+ * the parsing would just go on.
+ */
+static
+int shell_argp_parser(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case ARGP_KEY_INIT:
+		state->child_inputs[0] = state->input;
+		state->err_stream = shell.argp_err_stream;
+		return 0;
+	case '?':
+		argp_state_help(state, state->out_stream, ARGP_HELP_STD_HELP);
+		return ECANCELED;
+	case SHELL_ARGP_USAGE:
+		argp_state_help(state, state->out_stream, ARGP_HELP_USAGE);
+		return ECANCELED;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+}
+
+
+/*
+ * Parse a command's arguments
+ *
+ * \param flags ARGP_* flags for argp_parse()
+ * \param input passed to the command's argp parser
+ * \return 0 if ok, < 0 errno code on error
+ *
+ * Commands have to use this instead of calling argp_parse() on their
+ * own, so that, in the shell, bad arguments or --help don't exit the
+ * program.
+ */
+int w_cmd_argp_parse(struct cmd *cmd, int argc, char **argv, unsigned flags,
+		     void *input)
+{
+	int result;
+	struct argp_child children[] = {
+		{ .argp = &cmd->argp },
+		{ 0 }
+	};
+	struct argp argp = {
+		.options = shell_argp_options,
+		.parser = shell_argp_parser,
+		.children = children,
+	};
+
+	if (!shell.active)
+		return -argp_parse(&cmd->argp, argc, argv, flags, 0, input);
+	shell.argp_error = 0;
+	result = argp_parse(&argp, argc, argv,
+			    flags | ARGP_NO_EXIT | ARGP_NO_HELP, 0, input);
+	if (result == 0 && shell.argp_error)
+		result = EINVAL;
+	return -result;
+}
+
+/*
+ * Check a command was given an interface
+ *
+ * \return 0 if so, -ENODEV otherwise (and an error is printed);
+ *     commands return it.
+ */
+int w_cmd_need_if(struct wimaxll_handle *wmx)
+{
+	if (wmx != NULL)
+		return 0;
+	w_error("E: no interface specified; use -i or environment "
+		"WIMAXLL_IF\n");
+	return -ENODEV;
+}
+
+#ifndef WIMAXLL_STATIC_PLUGINS
+
 static GList *__cmd_list = NULL;
 
+static void plugin_manifest_add(const char *);
+static void plugin_load_all(void);
+static void plugin_load_for(const char *);
+
 int w_cmd_register(struct cmd *cmd)
 {
 	__cmd_list = g_list_append(__cmd_list, cmd);
+	plugin_manifest_add(cmd->name);
 	return 0;
 }
 
@@ -123,13 +280,6 @@ void w_cmd_unregister(struct cmd *cmd)
 	__cmd_list = g_list_remove(__cmd_list, cmd);
 }
 
-void w_cmd_need_if(struct wimaxll_handle *wmx)
-{
-	if (wmx == NULL)
-		w_abort(1, "E: no interface specified; use -i or environment "
-			"WIMAXLL_IF\n");
-}
-
 static
 void __cmd_list_itr(gpointer _cmd, gpointer _f)
 {
@@ -142,6 +292,7 @@ void __cmd_list_itr(gpointer _cmd, gpointer _f)
 static
 void cmd_list(void)
 {
+	plugin_load_all();
 	g_list_foreach(__cmd_list, __cmd_list_itr, NULL);
 	w_print("\nFor each command, --help is available\n");
 }
@@ -160,113 +311,806 @@ struct cmd * cmd_get(const char *name)
 {
 	GList *l;
 	l = g_list_find_custom(__cmd_list, name, __cmd_get_itr);
+	if (l == NULL) {
+		/* Not loaded yet? */
+		plugin_load_for(name);
+		l = g_list_find_custom(__cmd_list, name, __cmd_get_itr);
+	}
 	return l == NULL? NULL : l->data;
 }
 
 
-/* Plugin handling */
+/* Plugin handling
+ *
+ * Loading every plugin at startup makes it slower the more plugins
+ * there are, while most of the time we run only one command. So we
+ * keep a manifest (in the user's cache directory) of which plugin
+ * provides each command and load only the one that is needed.
+ *
+ * The manifest is rebuilt (loading all the plugins to see what
+ * commands they register) when the plugin directory's modification
+ * time or the tool's version don't match what it was built for.
+ */
 
 static GList *plugin_list = NULL;
+/* Plugin being initialized, to know who registers each command */
+static const gchar *plugin_loading;
+/* Command name -> plugin file name */
+static GHashTable *plugin_manifest;
+static int plugin_all_loaded;
+
 
 static
-int plugin_init(void)
+int plugin_load(const gchar *file)
+{
+	int result;
+	void *handle;
+	gchar *filename;
+	struct plugin *plugin;
+
+	filename = g_build_filename(PLUGINDIR, file, NULL);
+	handle = dlopen(filename, RTLD_LAZY | RTLD_NOLOAD);
+	if (handle != NULL) {	/* already loaded */
+		dlclose(handle);
+		result = 0;
+		goto error_pl_loaded;
+	}
+	result = -ENOENT;
+	handle = dlopen(filename, RTLD_LAZY);
+	if (handle == NULL) {
+		w_error("Can't load %s: %s\n", filename, dlerror());
+		goto error_pl_dlopen;
+	}
+
+	plugin = dlsym(handle, "plugin");
+	if (plugin == NULL) {
+		w_error("Can't load symbol 'plugin': %s\n", dlerror());
+		goto error_pl_dlsym;
+	}
+	plugin->dl_handle = handle;
+	plugin->active = 0;
+
+	if (plugin->init == NULL) {
+		w_error("Plugin %s lacks init method\n", plugin->name);
+		goto error_pl_noinit;
+	}
+
+	if (strcmp(plugin->version, WIMAXLL_VERSION)) {
+		w_error("Plugin '%s': version mismatch (%s vs %s needed)\n",
+			plugin->name, plugin->version, WIMAXLL_VERSION);
+		goto error_pl_version;
+	}
+
+	plugin_list = g_list_append(plugin_list, plugin);
+	plugin_loading = file;
+	result = plugin->init();
+	plugin_loading = NULL;
+	if (result < 0)
+		w_error("Plugin '%s' failed to initialize: %d\n",
+			plugin->name, result);
+	else
+		plugin->active = 1;
+	g_free(filename);
+	return result;
+
+error_pl_version:
+error_pl_noinit:
+error_pl_dlsym:
+	dlclose(handle);
+error_pl_dlopen:
+error_pl_loaded:
+	g_free(filename);
+	return result;
+}
+
+
+static
+void plugin_load_all(void)
 {
-	GList *itr;
 	GDir *dir;
 	const gchar *file;
-	gchar *filename;
 	GPatternSpec *pattern;
-	
+
+	if (plugin_all_loaded)
+		return;
+	plugin_all_loaded = 1;
 	dir = g_dir_open(PLUGINDIR, 0, NULL);
 	if (dir == NULL)
 		goto error_no_plugindir;
-	
 	pattern = g_pattern_spec_new("wimaxll-pl-*.so");
 	if (pattern == NULL)
 		goto error_pattern;
-	
 	while ((file = g_dir_read_name(dir)) != NULL) {
-		void *handle;
-		struct plugin *plugin;
-
 		if (g_pattern_match(pattern, strlen(file), file, NULL) == FALSE) {
 			w_d2("skipping %s\n", file);
 			continue;
 		}
-		filename = g_build_filename(PLUGINDIR, file, NULL);
-		
-		handle = dlopen(filename, RTLD_NOW);
-		if (handle == NULL) {
-			w_error("Can't load %s: %s\n", filename, dlerror());
-			goto error_pl_dlopen;
-		}
+		plugin_load(file);
+	}
+	g_pattern_spec_free(pattern);
+error_pattern:
+	g_dir_close(dir);
+error_no_plugindir:
+	return;
+}
 
-		plugin = dlsym(handle, "plugin");
-		if (plugin == NULL) {
-			w_error("Can't load symbol 'plugin': %s\n", plugin->name);
-			goto error_pl_dlsym;
-		}
-		plugin->dl_handle = handle;
-		plugin->active = 0;
-		
+
+/*
+ * Note a command provided by the plugin being initialized
+ */
+static
+void plugin_manifest_add(const char *name)
+{
+	if (plugin_loading == NULL)	/* built in */
+		return;
+	g_hash_table_insert(plugin_manifest, g_strdup(name),
+			    g_strdup(plugin_loading));
+}
+
+
+/*
+ * Return the file where the manifest is kept and the header it must
+ * start with to be valid for the current plugin directory
+ */
+static
+gchar *plugin_manifest_file(gchar **header)
+{
+	struct stat st;
+
+	if (stat(PLUGINDIR, &st) < 0)
+		return NULL;
+	*header = g_strdup_printf("wimaxll %s %s %ld.%09ld\n", VERSION,
+				  PLUGINDIR, (long) st.st_mtim.tv_sec,
+				  (long) st.st_mtim.tv_nsec);
+	return g_build_filename(g_get_user_cache_dir(), "wimaxll",
+				"plugin-manifest", NULL);
+}
+
+
+/*
+ * Load the manifest
+ *
+ * Returns 0 if it is valid, < 0 errno code if it has to be rebuilt.
+ */
+static
+int plugin_manifest_load(void)
+{
+	int result = -ENOENT;
+	gchar *filename, *header;
+	char *line = NULL, name[64], file[256];
+	size_t line_size = 0;
+	FILE *f;
+
+	filename = plugin_manifest_file(&header);
+	if (filename == NULL)
+		goto error_file;
+	f = fopen(filename, "r");
+	if (f == NULL)
+		goto error_fopen;
+	result = -ESTALE;
+	if (getline(&line, &line_size, f) < 0 || strcmp(line, header))
+		goto error_stale;
+	while (getline(&line, &line_size, f) > 0) {
+		if (sscanf(line, "%63s %255s", name, file) != 2)
+			continue;
+		g_hash_table_insert(plugin_manifest, g_strdup(name),
+				    g_strdup(file));
+	}
+	result = 0;
+error_stale:
+	free(line);
+	fclose(f);
+error_fopen:
+	g_free(header);
+	g_free(filename);
+error_file:
+	w_d2("plugin manifest: %s\n", result == 0 ? "valid" : "rebuilding");
+	return result;
+}
+
+
+static
+void __plugin_manifest_save_itr(gpointer name, gpointer file, gpointer f)
+{
+	fprintf(f, "%s %s\n", (gchar *) name, (gchar *) file);
+}
+
+
+/*
+ * Save the manifest
+ *
+ * It's just a cache, so if we can't write it, we'll just load all the
+ * plugins next time too. It is written to a temporary file which is
+ * then renamed, so concurrent invocations never see a partial one.
+ */
+static
+void plugin_manifest_save(void)
+{
+	gchar *filename, *header, *dirname, *tmpname;
+	FILE *f;
+
+	filename = plugin_manifest_file(&header);
+	if (filename == NULL)
+		return;
+	dirname = g_path_get_dirname(filename);
+	tmpname = g_strdup_printf("%s.%d", filename, getpid());
+	if (g_mkdir_with_parents(dirname, 0700) < 0)
+		goto error_mkdir;
+	f = fopen(tmpname, "w");
+	if (f == NULL)
+		goto error_fopen;
+	fputs(header, f);
+	g_hash_table_foreach(plugin_manifest, __plugin_manifest_save_itr, f);
+	if (fclose(f) != 0 || rename(tmpname, filename) < 0)
+		goto error_write;
+	goto out;
+
+error_write:
+	unlink(tmpname);
+error_fopen:
+error_mkdir:
+	w_d1("cannot save plugin manifest %s: %m\n", filename);
+out:
+	g_free(tmpname);
+	g_free(dirname);
+	g_free(header);
+	g_free(filename);
+}
+
+
+/*
+ * Load the plugin that provides a command, as per the manifest
+ */
+static
+void plugin_load_for(const char *name)
+{
+	const gchar *file;
+
+	if (plugin_all_loaded)
+		return;
+	file = g_hash_table_lookup(plugin_manifest, name);
+	if (file != NULL)
+		plugin_load(file);
+}
+
+
+static
+int plugin_init(void)
+{
+	plugin_manifest = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, g_free);
+	if (plugin_manifest_load() == 0)
+		return 0;
+	g_hash_table_remove_all(plugin_manifest);
+	plugin_load_all();
+	plugin_manifest_save();
+	return 0;
+}
+
+static
+void plugin_exit(void)
+{
+	GList *itr;
+
+	for (itr = plugin_list; itr; itr = itr->next) {
+		struct plugin *plugin = itr->data;
+		if (plugin->active && plugin->exit)
+			plugin->exit();
+		dlclose(plugin->dl_handle);
+	}
+	g_list_free(plugin_list);
+	g_hash_table_destroy(plugin_manifest);
+}
+
+
+#else /* #ifndef WIMAXLL_STATIC_PLUGINS */
+
+
+/* Plugins linked into the tool
+ *
+ * PLUGIN() leaves a pointer to each one in the wimaxll_plugins
+ * section, delimited by the symbols the linker defines for it; the
+ * commands they register go in a fixed size table.
+ */
+
+extern struct plugin *__start_wimaxll_plugins[] __attribute__((weak));
+extern struct plugin *__stop_wimaxll_plugins[] __attribute__((weak));
+
+enum { CMD_MAX = 32 };
+static struct cmd *cmd_table[CMD_MAX];
+static unsigned cmd_count;
+
+int w_cmd_register(struct cmd *cmd)
+{
+	if (cmd_count >= CMD_MAX)
+		return -ENOSPC;
+	cmd_table[cmd_count++] = cmd;
+	return 0;
+}
+
+void w_cmd_unregister(struct cmd *cmd)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < cmd_count; itr++)
+		if (cmd_table[itr] == cmd)
+			break;
+	if (itr == cmd_count)
+		return;
+	memmove(&cmd_table[itr], &cmd_table[itr + 1],
+		(cmd_count - itr - 1) * sizeof(cmd_table[0]));
+	cmd_count--;
+}
+
+
+static
+void cmd_list(void)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < cmd_count; itr++)
+		w_print("%s\n", cmd_table[itr]->name);
+	w_print("\nFor each command, --help is available\n");
+}
+
+
+static
+struct cmd * cmd_get(const char *name)
+{
+	unsigned itr;
+
+	for (itr = 0; itr < cmd_count; itr++)
+		if (!strcmp(name, cmd_table[itr]->name))
+			return cmd_table[itr];
+	return NULL;
+}
+
+
+static
+int plugin_init(void)
+{
+	int result;
+	struct plugin **itr, *plugin;
+
+	for (itr = __start_wimaxll_plugins;
+	     itr < __stop_wimaxll_plugins; itr++) {
+		plugin = *itr;
 		if (plugin->init == NULL) {
-			w_error("Plugin %s lacks init method\n", dlerror());
-			goto error_pl_noinit;
+			w_error("Plugin %s lacks init method\n", plugin->name);
+			continue;
 		}
-		
 		if (strcmp(plugin->version, WIMAXLL_VERSION)) {
-			w_error("Plugin '%s': version mismatch (%s vs %s needed)\n",
-				plugin->name, plugin->version, WIMAXLL_VERSION);
-			goto error_pl_version;
+			w_error("Plugin '%s': version mismatch (%s vs %s "
+				"needed)\n", plugin->name, plugin->version,
+				WIMAXLL_VERSION);
+			continue;
 		}
-		
-		plugin_list = g_list_append(plugin_list, plugin);
-		g_free(filename);
-		continue;
-
-	error_pl_version:
-	error_pl_noinit:
-	error_pl_dlsym:
-		dlclose(handle);
-	error_pl_dlopen:
-		g_free(filename);
-		continue;
-	}
-	
-	for (itr = plugin_list; itr; itr = itr->next) {
-		int result;
-		struct plugin *plugin = itr->data;
-		
 		result = plugin->init();
 		if (result < 0) {
 			w_error("Plugin '%s' failed to initialize: %d\n",
-				plugin->name, result);			
+				plugin->name, result);
 			continue;
 		}
 		plugin->active = 1;
 	}
-	
-	g_pattern_spec_free(pattern);
-error_pattern:
-	g_dir_close(dir);
-error_no_plugindir:
 	return 0;
 }
-	
+
 static
 void plugin_exit(void)
 {
-	GList *itr;
+	struct plugin **itr, *plugin;
 
-	for (itr = plugin_list; itr; itr = itr->next) {
-		struct plugin *plugin = itr->data;
+	for (itr = __start_wimaxll_plugins;
+	     itr < __stop_wimaxll_plugins; itr++) {
+		plugin = *itr;
 		if (plugin->active && plugin->exit)
 			plugin->exit();
-		dlclose(plugin->dl_handle);
 	}
-	g_list_free(plugin_list);
 }
 
+#endif /* #ifndef WIMAXLL_STATIC_PLUGINS */
+
+
+/* Shell mode */
+
+static
+ssize_t shell_argp_err_write(void *cookie, const char *buf, size_t size)
+{
+	shell.argp_error = 1;
+	return fwrite(buf, 1, size, stderr);
+}
+
+
+static
+void shell_reply(int result)
+{
+	if (result < 0)
+		w_print("= %d %s\n", result, strerror(-result));
+	else
+		w_print("= %d\n", result);
+	fflush(stdout);
+}
+
+
+static struct cmd shell_cmd;
+
+/*
+ * Run a command line in the shell
+ *
+ * Commands that abort (w_abort(), w_cmd_exit()) are reported
+ * as cancelled.
+ */
+static
+int shell_cmd_run(struct wimaxll_handle *wmx, int argc, char **argv)
+{
+	struct cmd *cmd;
+
+	if (!strcmp(argv[0], "commands")) {
+		cmd_list();
+		return 0;
+	}
+	cmd = cmd_get(argv[0]);
+	if (cmd == NULL) {
+		w_error("command '%s' unrecognized; check 'commands'\n",
+			argv[0]);
+		return -EINVAL;
+	}
+	if (cmd == &shell_cmd) {
+		w_error("already in the shell\n");
+		return -EBUSY;
+	}
+	if (sigsetjmp(shell.jmp, 0))
+		return shell.exit_status == 0 ? 0 : -ECANCELED;
+	return cmd->fn(cmd, wmx, argc, argv);
+}
+
+
+#ifndef WIMAXLL_STATIC_PLUGINS
+/*
+ * Split a command line into arguments
+ *
+ * Returns -ENODATA for blank lines and comments; free \a argv with
+ * shell_argv_free().
+ */
+static
+int shell_parse(char *line, int *argc, char ***argv)
+{
+	GError *error = NULL;
+
+	g_strstrip(line);
+	if (line[0] == 0 || line[0] == '#')
+		return -ENODATA;
+	if (g_shell_parse_argv(line, argc, argv, &error) == FALSE) {
+		w_error("cannot parse command: %s\n", error->message);
+		g_clear_error(&error);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static
+void shell_argv_free(char **argv)
+{
+	g_strfreev(argv);
+}
+
+#else /* #ifndef WIMAXLL_STATIC_PLUGINS */
+
+/*
+ * Split a command line into arguments
+ *
+ * Without GLib, a subset of the shell's rules: blanks separate
+ * arguments, single quotes keep everything up to the next one as is,
+ * double quotes keep blanks and a backslash quotes the next
+ * character (except inside single quotes). A '#' starting an argument
+ * starts a comment.
+ *
+ * Returns -ENODATA for blank lines and comments; the arguments are
+ * copied after the array, all in one allocation (free it with
+ * shell_argv_free()).
+ */
+static
+int shell_parse(char *line, int *argc, char ***argv)
+{
+	size_t len = strlen(line), words = len / 2 + 2;
+	char **v, *dst, *src = line, c, quote;
+	int cnt = 0;
+
+	/* Each argument but the last takes a separator too */
+	v = malloc(words * sizeof(v[0]) + len + 1);
+	if (v == NULL)
+		return -ENOMEM;
+	dst = (char *) (v + words);
+	while (1) {
+		while (isspace((unsigned char) *src))
+			src++;
+		if (*src == 0 || *src == '#')
+			break;
+		v[cnt++] = dst;
+		quote = 0;
+		while (*src && (quote || !isspace((unsigned char) *src))) {
+			c = *src++;
+			if (quote == '\'') {
+				if (c == '\'')
+					quote = 0;
+				else
+					*dst++ = c;
+			} else if (c == '\\') {
+				if (*src == 0)
+					goto error_trailing_backslash;
+				*dst++ = *src++;
+			} else if (c == '"' && quote == '"')
+				quote = 0;
+			else if ((c == '"' || c == '\'') && quote == 0)
+				quote = c;
+			else
+				*dst++ = c;
+		}
+		if (quote)
+			goto error_unterminated;
+		*dst++ = 0;
+	}
+	if (cnt == 0) {
+		free(v);
+		return -ENODATA;
+	}
+	v[cnt] = NULL;
+	*argc = cnt;
+	*argv = v;
+	return 0;
+
+error_unterminated:
+	w_error("cannot parse command: unterminated %c quote\n", quote);
+	free(v);
+	return -EINVAL;
+error_trailing_backslash:
+	w_error("cannot parse command: trailing backslash\n");
+	free(v);
+	return -EINVAL;
+}
+
+static
+void shell_argv_free(char **argv)
+{
+	free(argv);
+}
+#endif /* #ifndef WIMAXLL_STATIC_PLUGINS */
+
+
+/*
+ * Read command lines from a stream and run them
+ *
+ * Returns when the stream is closed or when asked to quit.
+ */
+static
+void shell_run(struct wimaxll_handle *wmx, FILE *in)
+{
+	int result;
+	char *line = NULL;
+	size_t line_size = 0;
+	int argc;
+	char **argv;
+
+	while (getline(&line, &line_size, in) > 0) {
+		result = shell_parse(line, &argc, &argv);
+		if (result == -ENODATA)
+			continue;
+		if (result < 0) {
+			shell_reply(result);
+			continue;
+		}
+		if (!strcmp(argv[0], "quit") || !strcmp(argv[0], "exit")) {
+			shell_argv_free(argv);
+			break;
+		}
+		result = shell_cmd_run(wmx, argc, argv);
+		shell_argv_free(argv);
+		shell_reply(result);
+	}
+	free(line);
+}
+
+
+/*
+ * Tell if a client of the shell's socket runs as we do
+ *
+ * The socket is only accessible to our user (see shell_socket()), but
+ * the directory it is in might let others replace it.
+ */
+static
+int shell_peer_ok(int client)
+{
+	struct ucred cred;
+	socklen_t cred_size = sizeof(cred);
+
+	if (getsockopt(client, SOL_SOCKET, SO_PEERCRED,
+		       &cred, &cred_size) < 0) {
+		w_error("cannot get client's credentials: %m\n");
+		return 0;
+	}
+	if (cred.uid != geteuid()) {
+		w_error("client (pid %d uid %u) rejected: not uid %u\n",
+			(int) cred.pid, (unsigned) cred.uid,
+			(unsigned) geteuid());
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Serve the shell over a Unix socket
+ *
+ * Clients are served one at a time; while a client is connected, the
+ * standard output and error go to it.
+ *
+ * The socket is created accessible only to our user and clients
+ * running as other users are rejected. A stale socket left at \a
+ * path is replaced; anything else there is left alone.
+ */
+static
+int shell_socket(struct wimaxll_handle *wmx, const char *path)
+{
+	int result, fd, client, stdout_fd, stderr_fd;
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t old_umask;
+	FILE *in;
+
+	result = -ENAMETOOLONG;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		goto error_path;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		result = -errno;
+		w_error("cannot create socket: %m\n");
+		goto error_socket;
+	}
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			result = -EEXIST;
+			w_error("%s: exists and is not a socket\n", path);
+			goto error_stale;
+		}
+		unlink(path);
+	}
+	old_umask = umask(077);
+	result = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(old_umask);
+	if (result < 0 || listen(fd, 4) < 0) {
+		result = -errno;
+		w_error("%s: cannot listen: %m\n", path);
+		goto error_bind;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	stdout_fd = dup(1);
+	stderr_fd = dup(2);
+	while (1) {
+		client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			result = -errno;
+			w_error("%s: cannot accept: %m\n", path);
+			break;
+		}
+		if (!shell_peer_ok(client)) {
+			close(client);
+			continue;
+		}
+		in = fdopen(client, "r");
+		if (in == NULL) {
+			close(client);
+			continue;
+		}
+		fflush(stdout);
+		dup2(client, 1);
+		dup2(client, 2);
+		shell_run(wmx, in);
+		fflush(stdout);
+		dup2(stdout_fd, 1);
+		dup2(stderr_fd, 2);
+		fclose(in);
+	}
+	close(stdout_fd);
+	close(stderr_fd);
+	unlink(path);
+error_bind:
+error_stale:
+	close(fd);
+error_socket:
+error_path:
+	return result;
+}
+
+
+struct shell_args
+{
+	char *socket;
+};
+
+
+static
+struct argp_option shell_options[] = {
+	{ "socket", 'S', "PATH", 0,
+	  "Serve clients connecting to the Unix socket PATH instead of "
+	  "reading commands from the standard input; only the user "
+	  "running the shell can connect." },
+	{ 0 }
+};
+
+
+static
+int shell_parser(int key, char *arg, struct argp_state *state)
+{
+	struct shell_args *args = state->input;
+
+	switch (key) {
+	case 'S':
+		args->socket = arg;
+		return 0;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+}
+
+
+static
+int shell_fn(struct cmd *cmd, struct wimaxll_handle *wmx,
+	     int argc, char **argv)
+{
+	int result;
+	struct shell_args args = { .socket = NULL };
+	cookie_io_functions_t err_io = { .write = shell_argp_err_write };
+
+	result = w_cmd_argp_parse(cmd, argc, argv,
+				  ARGP_IN_ORDER | ARGP_PARSE_ARGV0, &args);
+	if (result < 0)
+		goto error_argp_parse;
+	result = -ENOMEM;
+	shell.argp_err_stream = fopencookie(NULL, "w", err_io);
+	if (shell.argp_err_stream == NULL)
+		goto error_fopencookie;
+	setvbuf(shell.argp_err_stream, NULL, _IONBF, 0);
+	shell.active = 1;
+	if (args.socket)
+		result = shell_socket(wmx, args.socket);
+	else {
+		shell_run(wmx, stdin);
+		result = 0;
+	}
+	shell.active = 0;
+	fclose(shell.argp_err_stream);
+error_fopencookie:
+error_argp_parse:
+	return result;
+}
+
+
+static
+struct cmd shell_cmd = {
+	.name = "shell",
+	.argp = {
+		.options = shell_options,
+		.parser = shell_parser,
+		.args_doc = "",
+		.doc = "Run commands read one per line, keeping the plugins "
+		"loaded and the device open\n"
+		"\v"
+		"Each line is a command with its arguments (quoted as in "
+		"the shell), as it would be given to wimaxll; after its "
+		"output, a line '= RESULT' (followed by an error "
+		"description if RESULT is negative) is printed. 'commands' "
+		"lists the commands; 'quit' (or end of file) ends the "
+		"session.\n",
+	},
+	.fn = shell_fn,
+};
+
 
 /* Main program & cmd line handling */
 
@@ -283,6 +1127,11 @@ struct argp_option main_options[] = {
 	{ "quiet",    'q', 0,       0,
 	  "Don't produce any output" },
 	{ "silent",   's', 0,       OPTION_ALIAS },
+#ifdef W_TRACE
+	{ "trace",    't', "LEVEL", OPTION_ARG_OPTIONAL,
+	  "Trace the library's debug messages up to LEVEL (default 7) and "
+	  "print them to stderr when done (or when sent SIGUSR1)" },
+#endif
 
 	{ 0, 0, 0, 0, " " },
 	{ "interface",'i', "INTERFACE", 0, 
@@ -346,6 +1195,9 @@ int main_parser(int key, char *arg, struct argp_state *state)
 	case 'v':
 		args->verbosity++;
 		break;
+	case 't':
+		args->trace = arg ? atoi(arg) : 7;
+		break;
 	case 'i':
 		result = parse_if(args, arg);
 		break;
@@ -394,6 +1246,7 @@ int main(int argc, char **argv)
 	main_args.verbosity = str? atoi(str) : 0;
 	parse_if(&main_args, getenv("WIMAXLL_IF"));
 
+	w_cmd_register(&shell_cmd);
 	plugin_init();
 	
 	result = argp_parse(&main_argp, argc, argv, ARGP_IN_ORDER, 0, &main_args);
@@ -411,6 +1264,17 @@ int main(int argc, char **argv)
 	for(cnt = 0; cnt < main_args.cmd_argc; cnt++)
 		w_d3("     %s\n", main_args.cmd_argv[cnt]);
 
+#ifdef W_TRACE
+	if (main_args.trace > 0) {
+		result = wimaxll_trace_enable(main_args.trace, 0);
+		if (result < 0)
+			w_error("cannot enable tracing: %s\n",
+				strerror(-result));
+		else
+			wimaxll_trace_dump_on_signal(SIGUSR1, 2);
+	}
+#endif
+
 	cmd = cmd_get(main_args.cmd_argv[0]);
 	if (cmd == NULL) {
 		w_error("command '%s' unrecognized; "
@@ -436,6 +1300,10 @@ int main(int argc, char **argv)
 	result = 0;
 error_wimaxll_open:
 error_cmd_get:
+#ifdef W_TRACE
+	if (main_args.trace > 0)
+		wimaxll_trace_dump(2);
+#endif
 error_argp_parse:
 	plugin_exit();
 	return result;
@@ -132,6 +132,19 @@
  * for delivery. Calling said function will execute, for each
  * notification, the callback associated to it.
  *
+ * Applications handling many devices can instead register all their
+ * handles in a single \ref main_loop "event loop", that will execute
+ * the callbacks for each:
+ *
+ * @code
+ * struct wimaxll_loop *loop = wimaxll_loop_create();
+ * ...
+ * wimaxll_loop_add(loop, wmx0);
+ * wimaxll_loop_add(loop, wmx1);
+ * ...
+ * wimaxll_loop_run(loop);
+ * @endcode
+ *
  * To wait for a \e state \e change notification, for example:
  *
  * @code
@@ -161,16 +174,50 @@
  * sent by the driver. When done with \a msg it has to be freed with
  * wimaxll_msg_free().
  *
+ * High rate readers can use wimaxll_msg_read_borrow() or
+ * wimaxll_msg_read_buf() instead, which avoid allocating and copying
+ * each message.
+ *
  * As with \e state \e change notifications, a callback can be set
  * that will be executed from a mainloop every time a message is
- * received from a message pipe. See
- * wimaxll_pipe_set_cb_msg_to_user().
+ * received from a message pipe. See wimaxll_set_cb_msg_to_user() for
+ * one that gets the messages of all the pipes and
+ * wimaxll_pipe_set_cb_msg_to_user() to set one for each pipe (see
+ * \ref pipe_group).
  *
  * A message can be sent to the driver with wimaxll_msg_write().
  * not the default \e message pipe.
  *
+ * Applications that have to keep up with bursts of notifications can
+ * use wimaxll_recv_batch() instead of callbacks; it drains everything
+ * queued in one go and returns an array of \ref wimaxll_event
+ * "events" (both messages and state changes):
+ *
+ * @code
+ * struct wimaxll_event events[16];
+ * ...
+ * count = wimaxll_recv_batch(wmx, events, 16, -1);
+ * for (cnt = 0; cnt < count; cnt++)
+ *         ... <act on events[cnt]>
+ * @endcode
+ *
  * For more details, see \ref the_messaging_interface.
  *
+ * @section timeouts Timeouts
+ *
+ * By default, blocking calls wait for ever. A default timeout can be
+ * set for a handle with wimaxll_set_timeout(); after it, blocking
+ * calls return -%ETIMEDOUT if what they wait for doesn't happen in
+ * time. Some calls also have a \e _timeout variant that takes the
+ * timeout for that call only:
+ *
+ * - wimaxll_recv_timeout()
+ * - wimaxll_msg_read_timeout()
+ * - wimaxll_wait_for_state_change_timeout()
+ *
+ * This allows a single thread to watch over many devices without
+ * getting stuck on any of them.
+ *
  * @section miscellaneous Miscellaneous
  *
  * @subsection diagnostics Controlling the ouput of diagnostics
@@ -198,7 +245,8 @@
  *   wimaxll handle (need to be serialized):
  *   <ul>
  *     <li> wimaxll_msg_write(), wimaxll_rfkill(), wimax_reset()
- *     <li> wimaxll_recv(), wimaxll_msg_read(),
+ *     <li> wimaxll_recv(), wimaxll_recv_batch(), wimaxll_msg_read*(),
+ *          wimaxll_msg_release(),
  *          wimaxll_wait_for_state_change()
  *     <li> wimax_get_cb_*() and wimax_set_cb_*().
  *     <li> wimaxll_recv_fd(), as long as the handle is valid.
@@ -211,6 +259,10 @@
  *     <li> wimax_get_cb_*() and wimax_set_cb_*().
  *   </ul>
  *
+ * - Handles opened with %WIMAXLL_OPEN_SHARED_RX (see
+ *   wimaxll_open_ex()) have to be received on from a single thread,
+ *   as receiving on any of them executes the callbacks of all.
+ *
  * - callbacks are all executed serially; don't call wimax_recv() from
  *   inside a callback.
  *
@@ -222,6 +274,8 @@
 #define __lib_wimaxll_h__
 #include <sys/errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <endian.h>
 #include <byteswap.h>
 #include <stdarg.h>
@@ -245,8 +299,9 @@ struct nlattr;
  *
  * Callbacks can return -%EBUSY to have wimaxll_recv() stop processing
  * messages and pass control to the caller (which will see it
- * returning -%EBUSY). Callbacks *SHOULD NOT* return -%EINPROGRESS, as
- * it is used internally by wimaxll_recv().
+ * returning 0; the event loop returns -%EBUSY instead). Callbacks
+ * *SHOULD NOT* return -%EINPROGRESS, as it is used internally by
+ * wimaxll_recv().
  */
 
 
@@ -264,6 +319,7 @@ struct nlattr;
  *
  * \param wmx WiMAX device handle
  * \param priv Context passed by the user with
+ *     wimaxll_set_cb_msg_to_user() or
  *     wimaxll_pipe_set_cb_msg_to_user().
  * \param pipe_name Name of the pipe the message is sent for
  * \param data Pointer to a buffer with the message data.
@@ -306,6 +362,103 @@ typedef int (*wimaxll_state_change_cb_f)(
 	struct wimaxll_handle *, void *priv,
 	enum wimax_st old_state, enum wimax_st new_state);
 
+/**
+ * Old state reported when state change notifications were lost
+ *
+ * When the kernel drops notifications because the handle's receive
+ * buffer overflowed, the library calls the state change callback
+ * with this as \a old_state and %__WIMAX_ST_INVALID as \a new_state
+ * (the state cache, if enabled, is invalidated too), so the
+ * application can resynchronize, eg: calling wimaxll_state_get()
+ * once it is out of the callback. The library doesn't ask itself, as
+ * that could block the receive path for a whole request timeout.
+ *
+ * \ingroup state_change_group
+ */
+#define WIMAXLL_STATE_LOST ((enum wimax_st) (__WIMAX_ST_INVALID + 1))
+
+
+enum {
+	/** Number of states kept in a struct wimaxll_state_log */
+	WIMAXLL_STATE_LOG_SIZE = 16,
+};
+
+
+/**
+ * Log of the transitions collapsed in a coalesced state change
+ *
+ * \param transitions number of state changes collapsed
+ * \param count number of entries used in \a state
+ * \param state states the device went through, oldest first; the
+ *     last one is the state the device is in now. If there are more
+ *     than %WIMAXLL_STATE_LOG_SIZE, only the most recent are kept.
+ *
+ * \ingroup state_change_group
+ */
+struct wimaxll_state_log {
+	unsigned transitions;
+	unsigned count;
+	unsigned char state[WIMAXLL_STATE_LOG_SIZE];
+};
+
+
+/**
+ * Callback for coalesced \e state \e change notifications
+ *
+ * \param wmx WiMAX device handle
+ * \param priv ctx Context passed by the user with
+ *     wimaxll_set_cb_state_change_coalesced().
+ * \param old_state State the WiMAX device was in before the first
+ *     of the state changes
+ * \param new_state State the WiMAX device entered last
+ * \param log States the device went through
+ * \return Same as for \ref wimaxll_state_change_cb_f.
+ *
+ * \ingroup state_change_group
+ */
+typedef int (*wimaxll_state_change_coalesced_cb_f)(
+	struct wimaxll_handle *, void *priv,
+	enum wimax_st old_state, enum wimax_st new_state,
+	const struct wimaxll_state_log *log);
+
+
+/**
+ * What happened to a handle's device or the WiMAX stack
+ *
+ * \ingroup device_hotplug
+ */
+enum wimaxll_hotplug_event {
+	/** The WiMAX stack went away (eg: its modules were unloaded);
+	 * operations on the handle fail until it is back. */
+	WIMAXLL_HOTPLUG_STACK_GONE,
+	/** The WiMAX stack registered again; the handle has been moved
+	 * to its new IDs and works again. */
+	WIMAXLL_HOTPLUG_STACK_BACK,
+	/** The handle's network interface was removed */
+	WIMAXLL_HOTPLUG_DEVICE_GONE,
+	/** A network interface with the handle's name appeared; the
+	 * handle now refers to it (see wimaxll_ifidx()). */
+	WIMAXLL_HOTPLUG_DEVICE_BACK,
+};
+
+
+/**
+ * Callback for hotplug events
+ *
+ * \param wmx WiMAX device handle
+ * \param priv Context passed by the user with
+ *     wimaxll_set_cb_hotplug().
+ * \param event What happened
+ *
+ * The state the device is in might have changed, so the handle's
+ * state cache is dropped before this is called.
+ *
+ * \ingroup device_hotplug
+ */
+typedef void (*wimaxll_hotplug_cb_f)(struct wimaxll_handle *wmx,
+				     void *priv,
+				     enum wimaxll_hotplug_event event);
+
 
 
 /**
@@ -434,36 +587,301 @@ void wimaxll_cb_maybe_set_result(struct wimaxll_cb_ctx *ctx, int val)
 }
 
 
+/**
+ * Type of event returned by wimaxll_recv_batch()
+ *
+ * \ingroup the_messaging_interface
+ */
+enum wimaxll_event_type {
+	WIMAXLL_EVENT_MSG_TO_USER,	/**< Message to user from a pipe */
+	WIMAXLL_EVENT_STATE_CHANGE,	/**< Device changed states */
+};
+
+
+/**
+ * Event received from the kernel by wimaxll_recv_batch()
+ *
+ * \param type What kind of event this is; selects which member of
+ *     the union is valid.
+ * \param ifidx Index of the interface the event is for (useful for
+ *     handles opened for \e any device).
+ * \param msg For %WIMAXLL_EVENT_MSG_TO_USER: name of the pipe (NULL
+ *     for the default one) and payload of the message.
+ * \param state_change For %WIMAXLL_EVENT_STATE_CHANGE: state the
+ *     device left and state it entered.
+ *
+ * Pointers in the event point into the receive buffers of the
+ * handle; they are valid only until the next call to
+ * wimaxll_recv_batch() or wimaxll_close().
+ *
+ * \ingroup the_messaging_interface
+ */
+struct wimaxll_event {
+	enum wimaxll_event_type type;
+	unsigned ifidx;
+	union {
+		struct {
+			const char *pipe_name;
+			const void *data;
+			size_t size;
+		} msg;
+		struct {
+			enum wimax_st old_state;
+			enum wimax_st new_state;
+		} state_change;
+	};
+};
+
+
+/**
+ * Flags for wimaxll_open_ex()
+ *
+ * \ingroup device_management
+ */
+enum wimaxll_open_flags {
+	/** Share the RX socket with other handles opened with this flag */
+	WIMAXLL_OPEN_SHARED_RX = 0x1,
+	/** Don't check if the device is a WiMAX device */
+	WIMAXLL_OPEN_NO_PROBE = 0x2,
+};
+
+
+/**
+ * Options for opening a handle with wimaxll_open_ex()
+ *
+ * \param flags Bitmask of \ref wimaxll_open_flags "enum
+ *     wimaxll_open_flags".
+ * \param rcvbuf Size (in bytes) of the kernel receive buffer for
+ *     notifications; 0 leaves the system's default. Bursts of
+ *     notifications larger than this are lost (see
+ *     %WIMAXLL_STATE_LOST). Raising it past the system's limit
+ *     (/proc/sys/net/core/rmem_max) needs CAP_NET_ADMIN. For handles
+ *     that share the RX socket, the largest size asked for is used.
+ * \param state_cache_ms If not 0, enable the state cache with this
+ *     maximum age (see wimaxll_set_state_cache()); not allowed for
+ *     handles for \e any device.
+ *
+ * Clear it with memset() (or initialize it with {}) before filling
+ * it in, so fields added in the future get their default value.
+ *
+ * \ingroup device_management
+ */
+struct wimaxll_open_attr {
+	unsigned flags;
+	int rcvbuf;
+	int state_cache_ms;
+};
+
+
 /* Basic handle management */
 struct wimaxll_handle *wimaxll_open(const char *device_name);
+struct wimaxll_handle *wimaxll_open_ex(const char *device_name,
+				       const struct wimaxll_open_attr *);
 void *wimaxll_priv_get(struct wimaxll_handle *);
 void wimaxll_priv_set(struct wimaxll_handle *, void *);
 void wimaxll_close(struct wimaxll_handle *);
+void wimaxll_set_timeout(struct wimaxll_handle *, int);
+int wimaxll_get_timeout(const struct wimaxll_handle *);
 const char *wimaxll_ifname(const struct wimaxll_handle *);
 unsigned wimaxll_ifidx(const struct wimaxll_handle *);
+ssize_t wimaxll_discover(struct wimaxll_handle **, size_t,
+			 const struct wimaxll_open_attr *);
 
 /* Wait for data from the kernel, execute callbacks */
 int wimaxll_recv_fd(struct wimaxll_handle *);
 ssize_t wimaxll_recv(struct wimaxll_handle *);
+ssize_t wimaxll_recv_timeout(struct wimaxll_handle *, int);
+ssize_t wimaxll_recv_batch(struct wimaxll_handle *,
+			   struct wimaxll_event *, size_t, int);
 
 /* Default (bidirectional) message pipe from the kernel */
 ssize_t wimaxll_msg_write(struct wimaxll_handle *, const char *,
 			  const void *, size_t);
+ssize_t wimaxll_msg_write_batch(struct wimaxll_handle *, const char *,
+				const struct iovec *, size_t, int *);
 
 void wimaxll_get_cb_msg_to_user(struct wimaxll_handle *,
 				wimaxll_msg_to_user_cb_f *, void **);
 void wimaxll_set_cb_msg_to_user(struct wimaxll_handle *,
 				wimaxll_msg_to_user_cb_f, void *);
+void wimaxll_pipe_get_cb_msg_to_user(struct wimaxll_handle *, const char *,
+				     wimaxll_msg_to_user_cb_f *, void **);
+int wimaxll_pipe_set_cb_msg_to_user(struct wimaxll_handle *, const char *,
+				    wimaxll_msg_to_user_cb_f, void *);
 
 #define WIMAX_PIPE_ANY (NULL-1)
 ssize_t wimaxll_msg_read(struct wimaxll_handle *, const char *pine_name,
 			 void **);
+ssize_t wimaxll_msg_read_timeout(struct wimaxll_handle *, const char *,
+				 void **, int);
 void wimaxll_msg_free(void *);
+ssize_t wimaxll_msg_read_borrow(struct wimaxll_handle *, const char *,
+				const void **);
+ssize_t wimaxll_msg_read_buf(struct wimaxll_handle *, const char *,
+			     void *, size_t);
+void wimaxll_msg_release(struct wimaxll_handle *);
+int wimaxll_set_rx_pipe_filter(struct wimaxll_handle *, const char *);
+
+/* Event loop for many handles */
+struct wimaxll_loop;
+struct wimaxll_timer;
+
+/**
+ * Callback for a timer that expired in an event loop
+ *
+ * \param loop Event loop descriptor
+ * \param timer Timer descriptor (as returned by
+ *     wimaxll_loop_timer_add())
+ * \param priv Private pointer passed to wimaxll_loop_timer_add()
+ * \return -%EBUSY to have the loop stop and return, anything else
+ *     to keep going.
+ *
+ * \ingroup main_loop
+ */
+typedef int (*wimaxll_timer_cb_f)(struct wimaxll_loop *loop,
+				  struct wimaxll_timer *timer, void *priv);
+
+struct wimaxll_loop *wimaxll_loop_create(void);
+void wimaxll_loop_destroy(struct wimaxll_loop *);
+int wimaxll_loop_add(struct wimaxll_loop *, struct wimaxll_handle *);
+int wimaxll_loop_remove(struct wimaxll_loop *, struct wimaxll_handle *);
+struct wimaxll_timer *wimaxll_loop_timer_add(
+	struct wimaxll_loop *, unsigned, unsigned, wimaxll_timer_cb_f, void *);
+int wimaxll_loop_timer_mod(struct wimaxll_loop *, struct wimaxll_timer *,
+			   unsigned, unsigned);
+void wimaxll_loop_timer_del(struct wimaxll_loop *, struct wimaxll_timer *);
+ssize_t wimaxll_loop_run_once(struct wimaxll_loop *, int);
+ssize_t wimaxll_loop_run(struct wimaxll_loop *);
+
+/* Performance counters */
+enum {
+	WIMAXLL_STATS_PIPES = 8,
+	WIMAXLL_STATS_PIPE_NAME_SIZE = 32,
+	WIMAXLL_STATS_HIST_BUCKETS = 224,
+};
+
+/**
+ * Operations whose round trip time (request to ack) is measured
+ *
+ * \ingroup stats_group
+ */
+enum wimaxll_stats_op {
+	WIMAXLL_STATS_OP_RFKILL,
+	WIMAXLL_STATS_OP_RESET,
+	WIMAXLL_STATS_OP_STATE_GET,
+	WIMAXLL_STATS_OP_MSG_WRITE,
+	WIMAXLL_STATS_OP_MAX
+};
+
+/**
+ * Message counters for a pipe
+ *
+ * \param name name of the pipe ("" for the default pipe)
+ *
+ * \ingroup stats_group
+ */
+struct wimaxll_stats_pipe {
+	char name[WIMAXLL_STATS_PIPE_NAME_SIZE];
+	unsigned long long rx_msgs, rx_bytes;
+	unsigned long long tx_msgs, tx_bytes;
+};
+
+/**
+ * Latency histogram
+ *
+ * \param count number of samples
+ * \param errors number of operations that failed
+ * \param min_us minimum latency in microseconds
+ * \param max_us maximum latency in microseconds
+ * \param sum_us sum of all the latencies (for the mean)
+ * \param bucket number of samples in each bucket; see
+ *     wimaxll_stats_hist_value().
+ *
+ * \ingroup stats_group
+ */
+struct wimaxll_stats_hist {
+	unsigned long long count, errors;
+	unsigned long long min_us, max_us, sum_us;
+	unsigned long long bucket[WIMAXLL_STATS_HIST_BUCKETS];
+};
+
+/**
+ * Performance counters of a handle
+ *
+ * \param rx_msgs messages to user received (and accepted)
+ * \param rx_bytes payload bytes of \a rx_msgs
+ * \param rx_state_changes state change notifications received
+ * \param rx_other notifications skipped because they were for other
+ *     devices
+ * \param rx_filtered messages to user skipped because they were for
+ *     a pipe filtered out with wimaxll_set_rx_pipe_filter()
+ * \param rx_parse_errors notifications that could not be parsed
+ * \param rx_nomem messages lost because memory could not be
+ *     allocated
+ * \param rx_overruns times the kernel dropped notifications because
+ *     the receive buffer was full
+ * \param tx_msgs messages written with wimaxll_msg_write()
+ * \param tx_bytes payload bytes of \a tx_msgs
+ * \param tx_errors messages that failed to be written
+ * \param pipes number of entries used in \a pipe
+ * \param pipe_overflow messages on pipes that didn't fit in \a pipe
+ * \param pipe per-pipe counters
+ * \param ack round trip times for each \ref wimaxll_stats_op
+ *
+ * \ingroup stats_group
+ */
+struct wimaxll_stats {
+	unsigned long long rx_msgs, rx_bytes, rx_state_changes;
+	unsigned long long rx_other, rx_filtered, rx_parse_errors, rx_nomem;
+	unsigned long long rx_overruns;
+	unsigned long long tx_msgs, tx_bytes, tx_errors;
+	unsigned pipes;
+	unsigned long long pipe_overflow;
+	struct wimaxll_stats_pipe pipe[WIMAXLL_STATS_PIPES];
+	struct wimaxll_stats_hist ack[WIMAXLL_STATS_OP_MAX];
+};
+
+int wimaxll_stats_get(const struct wimaxll_handle *, struct wimaxll_stats *);
+void wimaxll_stats_reset(struct wimaxll_handle *);
+const char *wimaxll_stats_op_name(enum wimaxll_stats_op);
+unsigned long long wimaxll_stats_hist_value(unsigned);
+unsigned long long wimaxll_stats_hist_percentile(
+	const struct wimaxll_stats_hist *, double);
+
+/* Traffic capture */
+
+/**
+ * Options for capturing a handle's traffic with wimaxll_capture_start()
+ *
+ * \param rotate_size Start a new file when the current one grows
+ *     past this size (in bytes); 0 means never.
+ * \param rotate_count Number of files to rotate over (the oldest is
+ *     overwritten); 0 for no limit.
+ * \param buffer_size Size (in bytes) of the buffer where the messages
+ *     are collected before writing them; 0 for the default (64KiB).
+ *
+ * Clear it with memset() (or initialize it with {}) before filling
+ * it in, so fields added in the future get their default value.
+ *
+ * \ingroup capture_group
+ */
+struct wimaxll_capture_attr {
+	size_t rotate_size;
+	unsigned rotate_count;
+	size_t buffer_size;
+};
+
+int wimaxll_capture_start(struct wimaxll_handle *, const char *,
+			  const struct wimaxll_capture_attr *);
+int wimaxll_capture_flush(struct wimaxll_handle *);
+int wimaxll_capture_stop(struct wimaxll_handle *);
 
 /* generic API */
 int wimaxll_rfkill(struct wimaxll_handle *, enum wimax_rf_state);
 int wimaxll_reset(struct wimaxll_handle *);
 int wimaxll_state_get(struct wimaxll_handle *);
+int wimaxll_state_get_cached(struct wimaxll_handle *, struct timespec *);
+int wimaxll_set_state_cache(struct wimaxll_handle *, int);
 
 void wimaxll_get_cb_state_change(
 	struct wimaxll_handle *, wimaxll_state_change_cb_f *,
@@ -471,9 +889,31 @@ void wimaxll_get_cb_state_change(
 void wimaxll_set_cb_state_change(
 	struct wimaxll_handle *, wimaxll_state_change_cb_f,
 	void *);
+void wimaxll_get_cb_state_change_coalesced(
+	struct wimaxll_handle *, wimaxll_state_change_coalesced_cb_f *,
+	void **);
+void wimaxll_set_cb_state_change_coalesced(
+	struct wimaxll_handle *, wimaxll_state_change_coalesced_cb_f,
+	void *);
 ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
 				      enum wimax_st *old_state,
 				      enum wimax_st *new_state);
+ssize_t wimaxll_wait_for_state_change_timeout(struct wimaxll_handle *wmx,
+					      enum wimax_st *old_state,
+					      enum wimax_st *new_state,
+					      int timeout_ms);
+
+/* Devices and the WiMAX stack coming and going */
+void wimaxll_get_cb_hotplug(struct wimaxll_handle *,
+			    wimaxll_hotplug_cb_f *, void **);
+int wimaxll_set_cb_hotplug(struct wimaxll_handle *,
+			   wimaxll_hotplug_cb_f, void *);
+int wimaxll_hotplug_fd(struct wimaxll_handle *);
+
+/* Debug tracing */
+int wimaxll_trace_enable(int, unsigned);
+int wimaxll_trace_dump(int);
+int wimaxll_trace_dump_on_signal(int, int);
 
 
 /**
@@ -59,6 +59,7 @@ struct plugin {
 	int active;
 };
 
+#ifndef WIMAXLL_STATIC_PLUGINS
 #define PLUGIN(_name, _version, _init, _exit)		\
 struct plugin plugin = {				\
 	.name = _name,					\
@@ -66,6 +67,22 @@ struct plugin plugin = {				\
 	.init = _init,					\
 	.exit = _exit,					\
 };
+#else
+/*
+ * Plugins linked into the tool (lean builds) can't all be called
+ * 'plugin'; each leaves a pointer to its own in the wimaxll_plugins
+ * section, which the linker gathers into an array.
+ */
+#define PLUGIN(_name, _version, _init, _exit)		\
+static struct plugin plugin = {				\
+	.name = _name,					\
+	.version = _version,				\
+	.init = _init,					\
+	.exit = _exit,					\
+};							\
+static struct plugin *plugin_ptr			\
+	__attribute__((used, section("wimaxll_plugins"))) = &plugin;
+#endif
 
 /* Definining support for a command */
 struct cmd {
@@ -77,9 +94,12 @@ struct cmd {
 
 int w_cmd_register(struct cmd *);
 void w_cmd_unregister(struct cmd *);
+int w_cmd_argp_parse(struct cmd *, int argc, char **argv, unsigned flags,
+		     void *input);
+void w_cmd_exit(int result) __attribute__ ((noreturn));
 
 /* Misc utilities */
-void w_cmd_need_if(struct wimaxll_handle *);
+int w_cmd_need_if(struct wimaxll_handle *);
 void w_abort(int result, const char *fmt, ...)
 	__attribute__ ((format(printf, 2, 3)));
 void w_msg(unsigned, const char *, unsigned, const char *fmt, ...)
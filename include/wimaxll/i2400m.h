@@ -42,7 +42,8 @@ struct i2400m;
 struct wimaxll_handle;
 
 /*
- * Callback called by i2400m_msg_to_dev() when a reply to the executed
+ * Callback called by i2400m_msg_to_dev() (or for commands submitted
+ * with i2400m_msg_to_dev_async()) when a reply to the executed
  * command arrives.
  *
  * In struct i2400m, the fields mt_cb_priv, mt_orig, and mt_orig_size are
@@ -65,7 +66,8 @@ typedef int (*i2400m_reply_cb)(
  *
  * You cannot execute commands or wait for other reports from this
  * callback or it woul deadlock. You need to spawn off a thread or do
- * some other arrangement for it.
+ * some other arrangement for it; i2400m_report_ring_enable() provides
+ * one.
  *
  * @param i2400m i2400m device descriptor; use i2400m_priv() to obtain
  *     the private pointer for it
@@ -78,12 +80,49 @@ typedef void (*i2400m_report_cb)(
 	struct i2400m *i2400m,
 	const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size);
 
+struct i2400m_tlv_index;
+
+/**
+ * Handler for a type of i2400m report
+ *
+ * Called instead of the report callback for the reports of the type
+ * it was set for with i2400m_report_handler_set(); the same
+ * limitations apply (see i2400m_report_cb()).
+ *
+ * @param i2400m i2400m device descriptor
+ * @param priv private pointer given to i2400m_report_handler_set()
+ * @param l3l4 Pointer to the report data in L3L4 message format
+ *     (only valid during the call)
+ * @param l3l4_size Size of the buffer pointed to by l3l4.
+ * @param idx index of the report's TLVs (with types and lengths in
+ *     CPU byte order); look them up with i2400m_tlv_index_get() and
+ *     friends. If the report is malformed, only the TLVs before the
+ *     problem are in it.
+ */
+typedef void (*i2400m_report_handler_cb)(
+	struct i2400m *i2400m, void *priv,
+	const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size,
+	const struct i2400m_tlv_index *idx);
+
 int i2400m_create(struct i2400m **, const char *, void *, i2400m_report_cb);
 int i2400m_create_from_handle(struct i2400m **, struct wimaxll_handle *,
 			      void *, i2400m_report_cb);
 void i2400m_destroy(struct i2400m *);
 int i2400m_msg_to_dev(struct i2400m *, const struct i2400m_l3l4_hdr *, size_t,
 		      i2400m_reply_cb, void *);
+int i2400m_msg_to_dev_timeout(struct i2400m *,
+			      const struct i2400m_l3l4_hdr *, size_t,
+			      i2400m_reply_cb, void *, int);
+int i2400m_msg_to_dev_async(struct i2400m *, const struct i2400m_l3l4_hdr *,
+			    size_t, i2400m_reply_cb, void *, int, unsigned *);
+int i2400m_ticket_wait(struct i2400m *, unsigned);
+int i2400m_ticket_cancel(struct i2400m *, unsigned);
+int i2400m_report_ring_enable(struct i2400m *, unsigned, size_t);
+ssize_t i2400m_report_pop(struct i2400m *, void *, size_t, int);
+int i2400m_report_fd(struct i2400m *);
+unsigned long i2400m_report_dropped(struct i2400m *);
+int i2400m_report_handler_set(struct i2400m *, enum i2400m_mt,
+			      i2400m_report_handler_cb, void *);
 void *i2400m_priv(struct i2400m *);
 struct wimaxll_handle *i2400m_wmx(struct i2400m *);
 
@@ -96,4 +135,49 @@ const struct i2400m_tlv_hdr *i2400m_tlv_buffer_walk(
 const struct i2400m_tlv_hdr *i2400m_tlv_find(
 	const struct i2400m_tlv_hdr *, size_t, enum i2400m_tlv, ssize_t);
 
+enum {
+	/** Max number of TLVs a struct i2400m_tlv_index can hold */
+	I2400M_TLV_INDEX_ENTRIES = 48,
+	/** Size of the type hash of a struct i2400m_tlv_index */
+	I2400M_TLV_INDEX_HASH = 64,
+};
+
+/**
+ * Entry of a TLV index
+ *
+ * @param tlv pointer to the TLV in the buffer
+ * @param type type of the TLV (in CPU byte order)
+ * @param length length of the TLV's payload (in CPU byte order,
+ *     header not included)
+ * @param next (internal) next entry of the same type, -1 if none
+ */
+struct i2400m_tlv_entry {
+	const struct i2400m_tlv_hdr *tlv;
+	unsigned short type;
+	unsigned short length;
+	short next;
+};
+
+/**
+ * Index of a buffer of TLVs
+ *
+ * Filled out by i2400m_tlv_index_build(); the fields are internal.
+ * Small enough to be declared on the stack.
+ */
+struct i2400m_tlv_index {
+	unsigned count;
+	short hash[I2400M_TLV_INDEX_HASH];
+	struct i2400m_tlv_entry entry[I2400M_TLV_INDEX_ENTRIES];
+};
+
+int i2400m_tlv_index_build(struct i2400m_tlv_index *, const void *, size_t);
+int i2400m_tlv_index_build_nested(struct i2400m_tlv_index *,
+				  const struct i2400m_tlv_entry *);
+const struct i2400m_tlv_entry *i2400m_tlv_index_find(
+	const struct i2400m_tlv_index *, enum i2400m_tlv);
+const struct i2400m_tlv_entry *i2400m_tlv_index_next(
+	const struct i2400m_tlv_index *, const struct i2400m_tlv_entry *);
+const struct i2400m_tlv_hdr *i2400m_tlv_index_get(
+	const struct i2400m_tlv_index *, enum i2400m_tlv, ssize_t);
+
 #endif /* #define __wimaxll__i2400m_h__ */
@@ -75,11 +75,17 @@
  * FUNCTION:LINE)") and deliver the message to \e stdout if it is a
  * normal message (\e W_PRINT) or else if it is an error, warning,
  * info or debug message, it is sent to \e stderr.
+ *
+ * wimaxll_vlmsg_async() is an alternative sink that queues the
+ * messages and writes them from a background thread (or a poll()
+ * loop), so the threads logging never block on a slow \e stderr
+ * (see wimaxll_log_async_start()).
  */
 
 #ifndef __wimaxll__log_h__
 #define __wimaxll__log_h__
 
+#include <sys/types.h>
 #include <stdio.h>
 #include <stdarg.h>
 
@@ -117,6 +123,18 @@ extern void (*wimaxll_vlmsg_cb)(struct wimaxll_handle *, unsigned,
 				const char *, const char *, va_list);
 void wimaxll_vlmsg_stderr(struct wimaxll_handle *, unsigned,
 			  const char *, const char *, va_list);
+void wimaxll_vlmsg_default(struct wimaxll_handle *, unsigned,
+			   const char *, const char *, va_list);
+
+/* Asynchronous sink */
+void wimaxll_vlmsg_async(struct wimaxll_handle *, unsigned,
+			 const char *, const char *, va_list);
+int wimaxll_log_async_start(int, unsigned, int);
+void wimaxll_log_async_stop(void);
+int wimaxll_log_async_fd(void);
+ssize_t wimaxll_log_async_flush(void);
+void wimaxll_log_async_ratelimit(unsigned, unsigned);
+void wimaxll_log_async_stats(unsigned long *, unsigned long *);
 
 extern void (*wimaxll_msg_hdr_cb)(char *, size_t, struct wimaxll_handle *,
 				  enum w_levels, const char *, unsigned);
@@ -0,0 +1,157 @@
+/*
+ * Linux WiMax
+ * Mock WiMAX device for testing and benchmarking
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/**
+ *
+ * \defgroup mock_group Mock WiMAX device
+ *
+ * A mock device is a WiMAX handle that instead of talking to the
+ * kernel talks to a thread in the same process that plays the kernel
+ * side. It allows exercising (and benchmarking) code that uses the
+ * library without the hardware or the kernel's WiMAX stack:
+ *
+ * @code
+ * struct wimaxll_mock *mock;
+ * struct wimaxll_handle *wmx;
+ *
+ * mock = wimaxll_mock_create("wmx-mock", 1);
+ * wmx = wimaxll_mock_handle(mock);
+ * wimaxll_mock_load(mock, "trace.pcapng");
+ * while (wimaxll_mock_replay(mock, 0) > 0)
+ * 	while (wimaxll_recv_timeout(wmx, 0) >= 0)
+ * 		;
+ * ...
+ * wimaxll_mock_destroy(mock);
+ * @endcode
+ *
+ * The handle is used like any other with the library's functions;
+ * requests sent with it are answered by the mock:
+ *
+ * - wimaxll_rfkill(): keeps track of the software switch; the
+ *   hardware switch is always on.
+ *
+ * - wimaxll_state_get(): returns the state set with
+ *   wimaxll_mock_set_state() or the last
+ *   wimaxll_mock_state_change() (%WIMAX_ST_READY by default).
+ *
+ * - wimaxll_reset(): always succeeds.
+ *
+ * - wimaxll_msg_write(): passes the message to the callback set
+ *   with wimaxll_mock_set_cb_request() and acks with what it
+ *   returns (success if none is set).
+ *
+ * Notifications (messages to user and state changes) can be sent
+ * from the mock right away (wimaxll_mock_msg_to_user(),
+ * wimaxll_mock_state_change(), wimaxll_mock_inject()) or queued in a
+ * trace, that wimaxll_mock_replay() pushes to the handle as fast as
+ * it can read them. Traces are built with the %WIMAXLL_MOCK_QUEUE
+ * flag or loaded from captures done with wimaxll_capture_start().
+ *
+ * Socket overflows (and the lost notifications they report) can be
+ * forced with wimaxll_mock_overrun(); stack reloads are simulated by
+ * injecting the generic netlink controller's messages with
+ * wimaxll_mock_inject() (joining the new multicast group always
+ * succeeds).
+ *
+ * Limitations: the handle can't be used with
+ * %WIMAXLL_OPEN_SHARED_RX-like socket sharing and its file
+ * descriptors are not netlink sockets (but they can be poll()ed as
+ * usual).
+ */
+#ifndef __wimaxll__mock_h__
+#define __wimaxll__mock_h__
+
+#include <sys/types.h>
+#include <linux/wimax.h>
+
+struct wimaxll_mock;
+struct wimaxll_handle;
+struct nlmsghdr;
+
+/**
+ * Callback for requests a mock device gets
+ *
+ * \param mock mock device
+ * \param priv private pointer given to wimaxll_mock_set_cb_request()
+ * \param pipe_name pipe the message is sent over (%NULL for the
+ *     default one)
+ * \param data message payload
+ * \param size size of \a data
+ *
+ * \return what the request will be acked with: 0 for success, a
+ *     negative errno code for error.
+ *
+ * Called from the mock's thread for each message sent with
+ * wimaxll_msg_write() (or similar) on the mock's handle; it might
+ * send messages with wimaxll_mock_msg_to_user() (eg: replies) but it
+ * can't use the handle.
+ *
+ * \ingroup mock_group
+ */
+typedef int (*wimaxll_mock_request_cb_f)(struct wimaxll_mock *mock,
+					 void *priv, const char *pipe_name,
+					 const void *data, size_t size);
+
+/**
+ * Flags for queuing notifications in mock devices
+ *
+ * \ingroup mock_group
+ */
+enum {
+	/** Queue to the trace (see wimaxll_mock_replay()) */
+	WIMAXLL_MOCK_QUEUE = 0x01,
+	/** Replay the trace over and over */
+	WIMAXLL_MOCK_LOOP = 0x02,
+};
+
+struct wimaxll_mock *wimaxll_mock_create(const char *, unsigned);
+void wimaxll_mock_destroy(struct wimaxll_mock *);
+struct wimaxll_handle *wimaxll_mock_handle(struct wimaxll_mock *);
+void wimaxll_mock_set_cb_request(struct wimaxll_mock *,
+				 wimaxll_mock_request_cb_f, void *);
+void wimaxll_mock_set_state(struct wimaxll_mock *, enum wimax_st);
+void wimaxll_mock_overrun(struct wimaxll_mock *);
+unsigned long long wimaxll_mock_requests(struct wimaxll_mock *);
+
+int wimaxll_mock_inject(struct wimaxll_mock *, const struct nlmsghdr *,
+			unsigned);
+int wimaxll_mock_msg_to_user(struct wimaxll_mock *, const char *,
+			     const void *, size_t, unsigned);
+int wimaxll_mock_state_change(struct wimaxll_mock *, enum wimax_st,
+			      unsigned);
+ssize_t wimaxll_mock_load(struct wimaxll_mock *, const char *);
+ssize_t wimaxll_mock_replay(struct wimaxll_mock *, unsigned);
+size_t wimaxll_mock_trace_count(struct wimaxll_mock *);
+
+#endif /* #ifndef __wimaxll__mock_h__ */
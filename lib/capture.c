@@ -0,0 +1,533 @@
+/*
+ * Linux WiMax
+ * Traffic capture
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \defgroup capture_group Traffic capture
+ *
+ * A handle can save the messages it exchanges with the device (the
+ * messages to user it receives and the ones it writes with
+ * wimaxll_msg_write() or wimaxll_msg_write_batch()) to a file, to
+ * analyze later:
+ *
+ * @code
+ * struct wimaxll_capture_attr attr;
+ * ...
+ * memset(&attr, 0, sizeof(attr));
+ * attr.rotate_size = 16 * 1024 * 1024;
+ * attr.rotate_count = 8;
+ * result = wimaxll_capture_start(wmx, "/var/log/wmx0.pcapng", &attr);
+ * ...
+ * wimaxll_capture_stop(wmx);
+ * @endcode
+ *
+ * The file is in pcapng format, with the whole generic netlink
+ * message of each, as the \e nlmon device would capture it (link type
+ * %LINKTYPE_NETLINK, each packet starting with a Linux cooked
+ * header), so it can be opened with wireshark or tcpdump.
+ *
+ * Messages are accumulated in a buffer and written when it is full
+ * or when a message is recorded more than a second after the last
+ * write, so a capture costs a memory copy per message and a system
+ * call every now and then. There is no timer: an idle capture keeps
+ * what is buffered until the next message, wimaxll_capture_flush()
+ * or wimaxll_capture_stop().
+ *
+ * If a size to rotate at is given, when the file grows past it a new
+ * one is started (FILE.1, FILE.2...); if a count of files is given
+ * too, after the last one it goes back to FILE, overwriting the
+ * oldest.
+ *
+ * Only the handle's own traffic is seen; to capture what other
+ * processes write to the device, use the \e nlmon device.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	WIMAXLL_CAPTURE_BUFFER_SIZE = 64 * 1024,
+	/* Write the buffer if the last write was this long ago */
+	WIMAXLL_CAPTURE_FLUSH_MS = 1000,
+};
+
+
+/*
+ * Capture state of a handle
+ *
+ * \param mutex protects the rest, as messages from different threads
+ *     can be recorded at the same time.
+ * \param fd file being written to
+ * \param file_name base name of the files
+ * \param file_idx index of the file being written (0 is \a
+ *     file_name, N is file_name.N)
+ * \param file_size bytes written to \a fd so far
+ * \param buf messages waiting to be written (\a buf_used bytes out of
+ *     \a buf_size)
+ * \param last_write when \a buf was last written (CLOCK_MONOTONIC, ms)
+ * \param error first error writing; once set, nothing else is
+ *     recorded.
+ */
+struct wimaxll_capture {
+	pthread_mutex_t mutex;
+	int fd;
+	char *file_name;
+	unsigned file_idx;
+	size_t file_size;
+	size_t rotate_size;
+	unsigned rotate_count;
+	unsigned char *buf;
+	size_t buf_size, buf_used;
+	long last_write;
+	int error;
+	char if_name[__WIMAXLL_IFNAME_LEN];
+};
+
+
+static
+long wimaxll_capture_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Write a buffer whole to the capture file
+ */
+static
+int wimaxll_capture_write(struct wimaxll_capture *cap,
+			  const struct iovec *iov, int iov_count)
+{
+	ssize_t result;
+	struct iovec iov_left[2];
+	int cnt;
+
+	memcpy(iov_left, iov, iov_count * sizeof(iov[0]));
+	while (iov_count > 0) {
+		result = writev(cap->fd, iov_left, iov_count);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 0)
+			return -errno;
+		cap->file_size += result;
+		for (cnt = 0; cnt < iov_count; cnt++) {
+			if ((size_t) result < iov_left[cnt].iov_len)
+				break;
+			result -= iov_left[cnt].iov_len;
+		}
+		memmove(iov_left, iov_left + cnt,
+			(iov_count - cnt) * sizeof(iov_left[0]));
+		iov_count -= cnt;
+		if (iov_count > 0) {
+			iov_left[0].iov_base += result;
+			iov_left[0].iov_len -= result;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Write what is in the buffer (and \a data, if not NULL), remember
+ * the first error
+ */
+static
+int wimaxll_capture_buf_write(struct wimaxll_capture *cap,
+			      const void *data, size_t size, long now)
+{
+	int result;
+	struct iovec iov[2] = {
+		{ .iov_base = cap->buf, .iov_len = cap->buf_used },
+		{ .iov_base = (void *) data, .iov_len = size },
+	};
+
+	if (cap->error)
+		return cap->error;
+	result = wimaxll_capture_write(cap, iov, data ? 2 : 1);
+	cap->buf_used = 0;
+	cap->last_write = now;
+	if (result < 0) {
+		wimaxll_msg(NULL, "E: capture: %s: cannot write: %d\n",
+			    cap->file_name, result);
+		cap->error = result;
+	}
+	return result;
+}
+
+
+static
+void *wimaxll_capture_opt_put(void *itr, unsigned code,
+			      const void *data, size_t size)
+{
+	struct pcapng_opt *opt = itr;
+
+	opt->code = code;
+	opt->len = size;
+	memcpy(itr + sizeof(*opt), data, size);
+	memset(itr + sizeof(*opt) + size, 0, PCAPNG_ALIGN(size) - size);
+	return itr + sizeof(*opt) + PCAPNG_ALIGN(size);
+}
+
+
+/*
+ * Open the capture file number cap->file_idx and write its headers
+ */
+static
+int wimaxll_capture_file_open(struct wimaxll_capture *cap)
+{
+	int result;
+	char file_name[strlen(cap->file_name) + 16];
+	unsigned char hdr[sizeof(struct pcapng_shb) + 4
+			  + sizeof(struct pcapng_idb)
+			  + 2 * sizeof(struct pcapng_opt)
+			  + PCAPNG_ALIGN(__WIMAXLL_IFNAME_LEN) + 4];
+	struct pcapng_shb *shb = (void *) hdr;
+	struct pcapng_idb *idb;
+	struct pcapng_opt *opt;
+	void *itr;
+	struct iovec iov;
+
+	if (cap->file_idx == 0)
+		strcpy(file_name, cap->file_name);
+	else
+		sprintf(file_name, "%s.%u", cap->file_name, cap->file_idx);
+	cap->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		       0644);
+	if (cap->fd < 0) {
+		result = -errno;
+		wimaxll_msg(NULL, "E: capture: %s: cannot open: %m\n",
+			    file_name);
+		goto error_open;
+	}
+	cap->file_size = 0;
+
+	shb->hdr.type = PCAPNG_SHB;
+	shb->hdr.len = sizeof(*shb) + 4;
+	shb->magic = PCAPNG_BYTE_ORDER_MAGIC;
+	shb->major = 1;
+	shb->minor = 0;
+	shb->section_len = -1;
+	memcpy(hdr + sizeof(*shb), &shb->hdr.len, 4);
+
+	idb = (void *) hdr + shb->hdr.len;
+	idb->hdr.type = PCAPNG_IDB;
+	idb->link_type = LINKTYPE_NETLINK;
+	idb->reserved = 0;
+	idb->snap_len = 0;
+	itr = (void *) idb + sizeof(*idb);
+	if (cap->if_name[0] != 0)
+		itr = wimaxll_capture_opt_put(itr, PCAPNG_OPT_IF_NAME,
+					      cap->if_name,
+					      strlen(cap->if_name));
+	opt = itr;
+	opt->code = PCAPNG_OPT_END;
+	opt->len = 0;
+	itr += sizeof(*opt);
+	idb->hdr.len = itr + 4 - (void *) idb;
+	memcpy(itr, &idb->hdr.len, 4);
+
+	iov.iov_base = hdr;
+	iov.iov_len = shb->hdr.len + idb->hdr.len;
+	result = wimaxll_capture_write(cap, &iov, 1);
+	if (result < 0) {
+		wimaxll_msg(NULL, "E: capture: %s: cannot write: %d\n",
+			    file_name, result);
+		goto error_write;
+	}
+	return 0;
+
+error_write:
+	close(cap->fd);
+	cap->fd = -1;
+error_open:
+	return result;
+}
+
+
+/*
+ * Start writing to the next file
+ */
+static
+int wimaxll_capture_rotate(struct wimaxll_capture *cap)
+{
+	int result;
+
+	close(cap->fd);
+	cap->file_idx++;
+	if (cap->rotate_count > 0 && cap->file_idx >= cap->rotate_count)
+		cap->file_idx = 0;
+	result = wimaxll_capture_file_open(cap);
+	if (result < 0)
+		cap->error = result;
+	return result;
+}
+
+
+/*
+ * Record a message in the capture file
+ *
+ * \internal
+ *
+ * \param wmx WiMAX handle (that is capturing)
+ * \param nl_hdr message (header and all the payload)
+ * \param outbound !0 if the message is being sent to the kernel
+ *
+ * Doesn't fail; if the capture file can't be written, the error is
+ * reported by wimaxll_capture_flush() or wimaxll_capture_stop().
+ *
+ * Use the wimaxll_capture() wrapper, which checks first if the
+ * handle is capturing at all.
+ */
+void wimaxll_capture_record(struct wimaxll_handle *wmx,
+			    const struct nlmsghdr *nl_hdr, int outbound)
+{
+	struct wimaxll_capture *cap = wmx->capture;
+	struct timespec ts;
+	unsigned long long ts_us;
+	size_t size, block_size;
+	__u32 flags;
+	long now;
+	struct pcapng_epb *epb;
+	struct wimaxll_capture_cooked_hdr *cooked;
+	unsigned char trailer[sizeof(struct pcapng_opt) + 4
+			      + sizeof(struct pcapng_opt) + 4];
+	void *itr;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	size = sizeof(*cooked) + nl_hdr->nlmsg_len;
+	block_size = sizeof(*epb) + PCAPNG_ALIGN(size) + sizeof(trailer);
+
+	pthread_mutex_lock(&cap->mutex);
+	if (cap->error)
+		goto out;
+	now = wimaxll_capture_now_ms();
+	if (cap->buf_used + block_size > cap->buf_size)
+		if (wimaxll_capture_buf_write(cap, NULL, 0, now) < 0)
+			goto out;
+
+	/* Everything but the message itself goes in the buffer */
+	epb = (void *) cap->buf + cap->buf_used;
+	epb->hdr.type = PCAPNG_EPB;
+	epb->hdr.len = block_size;
+	epb->if_id = 0;
+	epb->ts_high = ts_us >> 32;
+	epb->ts_low = ts_us;
+	epb->cap_len = epb->len = size;
+	cooked = (void *) epb + sizeof(*epb);
+	memset(cooked, 0, sizeof(*cooked));
+	cooked->pkt_type = htons(outbound ? WIMAXLL_CAPTURE_PACKET_OUTGOING
+				 : WIMAXLL_CAPTURE_PACKET_HOST);
+	cooked->ha_type = htons(WIMAXLL_CAPTURE_ARPHRD_NETLINK);
+	cooked->protocol = htons(NETLINK_GENERIC);
+	cap->buf_used += sizeof(*epb) + sizeof(*cooked);
+
+	flags = outbound ?
+		PCAPNG_EPB_FLAGS_OUTBOUND : PCAPNG_EPB_FLAGS_INBOUND;
+	itr = wimaxll_capture_opt_put(trailer, PCAPNG_OPT_EPB_FLAGS,
+				      &flags, sizeof(flags));
+	memset(itr, 0, sizeof(struct pcapng_opt));
+	itr += sizeof(struct pcapng_opt);
+	memcpy(itr, &epb->hdr.len, 4);
+
+	if (block_size > cap->buf_size) {
+		/* Too big to buffer, write it along with the buffer */
+		if (wimaxll_capture_buf_write(cap, nl_hdr,
+					      nl_hdr->nlmsg_len, now) < 0)
+			goto out;
+	} else {
+		memcpy(cap->buf + cap->buf_used, nl_hdr, nl_hdr->nlmsg_len);
+		cap->buf_used += nl_hdr->nlmsg_len;
+	}
+	memset(cap->buf + cap->buf_used, 0, PCAPNG_ALIGN(size) - size);
+	cap->buf_used += PCAPNG_ALIGN(size) - size;
+	memcpy(cap->buf + cap->buf_used, trailer, sizeof(trailer));
+	cap->buf_used += sizeof(trailer);
+
+	if (cap->rotate_size > 0
+	    && cap->file_size + cap->buf_used >= cap->rotate_size) {
+		if (wimaxll_capture_buf_write(cap, NULL, 0, now) == 0)
+			wimaxll_capture_rotate(cap);
+	} else if (now - cap->last_write >= WIMAXLL_CAPTURE_FLUSH_MS)
+		wimaxll_capture_buf_write(cap, NULL, 0, now);
+out:
+	pthread_mutex_unlock(&cap->mutex);
+}
+
+
+/**
+ * Start capturing a handle's traffic to a file
+ *
+ * \param wmx WiMAX handle
+ * \param file_name name of the file to write to (if it exists, it is
+ *     overwritten); when rotating, the next files are named
+ *     FILE_NAME.1, FILE_NAME.2...
+ * \param attr capture options (or NULL for the defaults: no rotation)
+ * \return 0 if ok, < 0 errno code on error; -%EBUSY if the handle is
+ *     already capturing.
+ *
+ * From now until wimaxll_capture_stop() is called, all the messages
+ * to user received and the messages written with the handle are
+ * saved to \a file_name, in pcapng format.
+ *
+ * Not to be called while other threads are using the handle.
+ *
+ * \ingroup capture_group
+ */
+int wimaxll_capture_start(struct wimaxll_handle *wmx, const char *file_name,
+			  const struct wimaxll_capture_attr *attr)
+{
+	int result;
+	struct wimaxll_capture *cap;
+
+	d_fnstart(3, wmx, "(wmx %p file_name %s attr %p)\n",
+		  wmx, file_name, attr);
+	result = -EBUSY;
+	if (wmx->capture != NULL)
+		goto error_busy;
+	result = -ENOMEM;
+	cap = calloc(1, sizeof(*cap));
+	if (cap == NULL)
+		goto error_alloc;
+	pthread_mutex_init(&cap->mutex, NULL);
+	cap->fd = -1;
+	if (attr) {
+		cap->rotate_size = attr->rotate_size;
+		cap->rotate_count = attr->rotate_count;
+		cap->buf_size = attr->buffer_size;
+	}
+	if (cap->buf_size == 0)
+		cap->buf_size = WIMAXLL_CAPTURE_BUFFER_SIZE;
+	/* Room for at least the headers of a message */
+	if (cap->buf_size < 256)
+		cap->buf_size = 256;
+	strncpy(cap->if_name, wmx->name, sizeof(cap->if_name) - 1);
+	cap->file_name = strdup(file_name);
+	cap->buf = malloc(cap->buf_size);
+	if (cap->file_name == NULL || cap->buf == NULL)
+		goto error_buf_alloc;
+	result = wimaxll_capture_file_open(cap);
+	if (result < 0)
+		goto error_file_open;
+	cap->last_write = wimaxll_capture_now_ms();
+	wmx->capture = cap;
+	d_fnend(3, wmx, "(wmx %p file_name %s attr %p) = 0\n",
+		wmx, file_name, attr);
+	return 0;
+
+error_file_open:
+error_buf_alloc:
+	free(cap->buf);
+	free(cap->file_name);
+	pthread_mutex_destroy(&cap->mutex);
+	free(cap);
+error_alloc:
+error_busy:
+	d_fnend(3, wmx, "(wmx %p file_name %s attr %p) = %d\n",
+		wmx, file_name, attr, result);
+	return result;
+}
+
+
+/**
+ * Write the captured messages that are still buffered
+ *
+ * \param wmx WiMAX handle
+ * \return 0 if ok, < 0 errno code if writing failed (now or
+ *     before); -%ENOENT if the handle is not capturing.
+ *
+ * \ingroup capture_group
+ */
+int wimaxll_capture_flush(struct wimaxll_handle *wmx)
+{
+	int result;
+	struct wimaxll_capture *cap = wmx->capture;
+
+	if (cap == NULL)
+		return -ENOENT;
+	pthread_mutex_lock(&cap->mutex);
+	result = wimaxll_capture_buf_write(cap, NULL, 0,
+					   wimaxll_capture_now_ms());
+	pthread_mutex_unlock(&cap->mutex);
+	return result;
+}
+
+
+/**
+ * Stop capturing a handle's traffic
+ *
+ * \param wmx WiMAX handle
+ * \return 0 if ok, < 0 errno code if writing the capture file failed
+ *     at any point; -%ENOENT if the handle is not capturing.
+ *
+ * Writes what is left in the buffer and closes the file.
+ *
+ * Not to be called while other threads are using the handle.
+ *
+ * \ingroup capture_group
+ */
+int wimaxll_capture_stop(struct wimaxll_handle *wmx)
+{
+	int result;
+	struct wimaxll_capture *cap = wmx->capture;
+
+	if (cap == NULL)
+		return -ENOENT;
+	result = wimaxll_capture_flush(wmx);
+	wmx->capture = NULL;
+	if (cap->fd >= 0 && close(cap->fd) < 0 && result == 0)
+		result = -errno;
+	pthread_mutex_destroy(&cap->mutex);
+	free(cap->buf);
+	free(cap->file_name);
+	free(cap);
+	return result;
+}
@@ -42,11 +42,23 @@
  * #include "debug.h"
  *
  * At the end of your include files.
+ *
+ * Each message is a tracepoint, recorded if tracing is enabled at
+ * runtime for its level (see trace.c); if not, it is printed to
+ * stderr if enabled by D_LOCAL at compile time. Either way, the
+ * arguments are evaluated only once.
  */
+#include <config.h>
 #include <wimaxll.h>
 
-/* Master debug switch; !0 enables, 0 disables */
+/* Master debug switch; !0 enables, 0 disables. Lean builds leave the
+ * stderr messages (and their formatting code) out, whatever D_LOCAL
+ * says. */
+#ifdef WIMAXLL_LEAN
+#define D_MASTER 0
+#else
 #define D_MASTER (!0)
+#endif
 
 /* Local (per-file) debug switch; #define before #including */
 #ifndef D_LOCAL
@@ -54,6 +66,8 @@
 #endif
 
 #undef __d_printf
+#undef __d_printf_stderr
+#undef d_trace_test
 #undef d_fnstart
 #undef d_fnend
 #undef d_printf
@@ -74,16 +88,47 @@ void __d_dev_head(char *head, size_t size, const struct wimaxll_handle *_dev)
 }
 
 
+#ifndef __wimaxll_trace_declared
+#define __wimaxll_trace_declared
+extern int __wimaxll_trace_level;
+void __wimaxll_trace(int, const char *, const char *,
+		     const struct wimaxll_handle *, const char *, ...)
+	__attribute__((format(printf, 5, 6)));
+void __wimaxll_trace_dump(int, const char *,
+			  const struct wimaxll_handle *, const void *, size_t);
+#endif
+
+#ifdef WIMAXLL_TRACE
+#define d_trace_test(l) __builtin_expect(__wimaxll_trace_level >= (l), 0)
+
+#define __d_printf(l, _tag, _dev, f, a...)				\
+do {									\
+	const struct wimaxll_handle *__dev = (_dev);			\
+	if (d_trace_test(l))						\
+		__wimaxll_trace(l, __func__, _tag, __dev, f, ## a);	\
+	else								\
+		__d_printf_stderr(l, _tag, __dev, f, ## a);		\
+} while (0)
+#else
+/* No reference to trace.c, which lean builds leave out */
+#define d_trace_test(l) 0
+
 #define __d_printf(l, _tag, _dev, f, a...)				\
 do {									\
 	const struct wimaxll_handle *__dev = (_dev);			\
+	__d_printf_stderr(l, _tag, __dev, f, ## a);			\
+} while (0)
+#endif
+
+#define __d_printf_stderr(l, _tag, __dev, f, a...)			\
+do {									\
 	if (D_MASTER && D_LOCAL >= (l)) {				\
 		char __head[64] = "";					\
 		__d_dev_head(__head, sizeof(__head), __dev);		\
 		fprintf(stderr, "%s%s" _tag ": " f, __head,		\
 			__func__, ## a);				\
 	}								\
-} while (0 && _dev)
+} while (0)
 
 #define d_fnstart(l, _dev, f, a...) __d_printf(l, " FNSTART", _dev, f, ## a)
 #define d_fnend(l, _dev, f, a...) __d_printf(l, " FNEND", _dev, f, ## a)
@@ -101,14 +146,24 @@ void __d_dump(const struct wimaxll_handle *dev,
 		itr += snprintf(str + itr, sizeof(str) - itr,
 				"%02x ", ptr[cnt]);
 		if ((cnt > 0 && (cnt + 1) % 8 == 0) || (cnt == size - 1)) {
-			__d_printf(D_LOCAL, "", dev, "%s\n", str);
+			__d_printf_stderr(D_LOCAL, "", dev, "%s\n", str);
 			itr = 0;
 		}
 	}
 }
 
+#ifdef WIMAXLL_TRACE
+#define d_dump(l, dev, ptr, size)		\
+do {						\
+	if (d_trace_test(l))			\
+		__wimaxll_trace_dump(l, __func__, dev, ptr, size); \
+	else if (d_test(l))			\
+		__d_dump(dev, ptr, size);	\
+} while (0)
+#else
 #define d_dump(l, dev, ptr, size)		\
 do {						\
 	if (d_test(l))				\
 		__d_dump(dev, ptr, size);	\
 } while (0)
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Linux WiMax
+ * Discovery of WiMAX devices
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \defgroup device_discovery Discovering WiMAX devices
+ *
+ * A daemon that manages all the WiMAX devices in the system can
+ * open handles for all of them at once:
+ *
+ * @code
+ * struct wimaxll_handle *wmxs[8];
+ * struct wimaxll_open_attr attr = { .state_cache_ms = -1 };
+ * ssize_t cnt, found;
+ *
+ * found = wimaxll_discover(wmxs, 8, &attr);
+ * for (cnt = 0; cnt < found && cnt < 8; cnt++)
+ *         wimaxll_loop_add(loop, wmxs[cnt]);
+ * @endcode
+ *
+ * Opening each with wimaxll_open() costs (at least) a round trip to
+ * the kernel per device to check it is a WiMAX device, plus another
+ * one to seed its state cache. Instead, wimaxll_discover() lists the
+ * network interfaces (one RTNL dump done by if_nameindex()) and asks
+ * the state of all of them with a batch of STATE_GET requests sent
+ * over a single socket; the kernel fails them with -ENODEV for the
+ * interfaces that are not WiMAX devices. That's about one round
+ * trip no matter how many interfaces there are. The handles are then
+ * opened without probing (which needs no talking to the kernel, as
+ * the generic netlink family is cached) and the state they answered
+ * with seeds their caches.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/types.h>
+#include <net/if.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/* STATE_GET requests sent with a single system call */
+	WIMAXLL_DISCOVER_BATCH = 64,
+};
+
+
+/*
+ * Ask the state of many interfaces at the same time
+ *
+ * \param wmx "any" handle to send the requests with
+ * \param ifs interfaces to ask for
+ * \param count number of interfaces in \a ifs
+ * \param results for each interface, where to store its state (or
+ *     the negative errno code the kernel failed the request with;
+ *     -ENODEV if it is not a WiMAX device).
+ * \return 0 if all the requests were sent and acked, < 0 errno code
+ *     otherwise (and the requests not acked are left with it as
+ *     result).
+ *
+ * Requests are built by hand in chunks of %WIMAXLL_DISCOVER_BATCH
+ * and their acks collected by sequence number as
+ * wimaxll_msg_write_batch() does.
+ */
+static
+int wimaxll_discover_probe(struct wimaxll_handle *wmx,
+			   const struct if_nameindex *ifs, size_t count,
+			   int *results)
+{
+	int result = 0;
+	size_t cnt, first, size;
+	void *buf;
+	struct nlmsghdr *nl_hdr;
+	struct genlmsghdr *gnl_hdr;
+	struct nlattr *nla;
+	struct wimaxll_ack_wait wait;
+	struct timespec deadline;
+	unsigned pid;
+	const size_t msg_size =
+		NLMSG_SPACE(GENL_HDRLEN + nla_total_size(sizeof(__u32)));
+
+	for (cnt = 0; cnt < count; cnt++)
+		results[cnt] = -EINPROGRESS;
+	result = -ENOMEM;
+	buf = malloc(WIMAXLL_DISCOVER_BATCH * msg_size);
+	if (buf == NULL)
+		goto error_buf_alloc;
+	pid = nl_socket_get_local_port(wmx->tx->nlh);
+	wimaxll_deadline_init(&deadline, wmx->timeout_ms);
+	result = 0;
+	pthread_mutex_lock(&wmx->tx->mutex);
+	for (first = 0; first < count; first = cnt) {
+		size = 0;
+		for (cnt = first; cnt < count
+			     && cnt - first < WIMAXLL_DISCOVER_BATCH; cnt++) {
+			nl_hdr = buf + size;
+			nl_hdr->nlmsg_len = msg_size;
+			nl_hdr->nlmsg_type = wimaxll_family_id(wmx);
+			nl_hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+			nl_hdr->nlmsg_seq = nl_socket_use_seq(wmx->tx->nlh);
+			nl_hdr->nlmsg_pid = pid;
+			if (cnt == first)
+				wait.seq = nl_hdr->nlmsg_seq;
+			gnl_hdr = NLMSG_DATA(nl_hdr);
+			memset(gnl_hdr, 0, GENL_HDRLEN);
+			gnl_hdr->cmd = WIMAX_GNL_OP_STATE_GET;
+			gnl_hdr->version = WIMAX_GNL_VERSION;
+			nla = (void *) gnl_hdr + GENL_HDRLEN;
+			nla->nla_type = WIMAX_GNL_STGET_IFIDX;
+			nla->nla_len = nla_attr_size(sizeof(__u32));
+			*(__u32 *) nla_data(nla) = ifs[cnt].if_index;
+			size += msg_size;
+		}
+		wait.count = wait.pending = cnt - first;
+		wait.results = results + first;
+		d_printf(3, wmx, "D: STATE_GET %zu interfaces seq 0x%x\n",
+			 wait.count, wait.seq);
+		result = nl_sendto(wmx->tx->nlh, buf, size);
+		if (result < 0) {
+			wimaxll_msg(wmx, "E: %s: error sending requests: %d\n",
+				    __func__, result);
+			break;
+		}
+		result = wimaxll_ack_wait(wmx, &wait, &deadline,
+					  wmx->timeout_ms);
+		if (result < 0)
+			break;
+	}
+	pthread_mutex_unlock(&wmx->tx->mutex);
+	free(buf);
+error_buf_alloc:
+	for (cnt = 0; cnt < count; cnt++)
+		if (results[cnt] == -EINPROGRESS)	/* never sent */
+			results[cnt] = result;
+	return result < 0 ? result : 0;
+}
+
+
+/**
+ * Open handles for all the WiMAX devices in the system
+ *
+ * \param wmxs Where to store the handles (can be %NULL if \a size
+ *     is zero).
+ * \param size Number of handles that fit in \a wmxs.
+ * \param attr Options for opening the handles (see
+ *     wimaxll_open_ex()); %NULL for the defaults. If \a
+ *     attr->state_cache_ms is set, the state caches are enabled and
+ *     seeded with what the devices answered when probed.
+ *
+ * \return Number of WiMAX devices found (like snprintf(), handles
+ *     are opened only for the first \a size); on error, a negative
+ *     errno code and no handles are left open.
+ *
+ * Handles are returned in the order of the devices' interface
+ * indexes; close them with wimaxll_close() as usual. Devices that go
+ * away while this runs are skipped.
+ *
+ * \note This is a blocking call; the timeout is applied to all
+ *     the devices at the same time, so it takes about as long as
+ *     opening a single one.
+ *
+ * \ingroup device_discovery
+ */
+ssize_t wimaxll_discover(struct wimaxll_handle **wmxs, size_t size,
+			 const struct wimaxll_open_attr *attr)
+{
+	ssize_t result;
+	int *results, state_cache_ms;
+	size_t count, cnt, found;
+	char name[16];
+	struct if_nameindex *ifs;
+	struct wimaxll_handle probe, *wmx;
+	struct wimaxll_open_attr open_attr;
+	struct timespec ts;
+
+	d_fnstart(3, NULL, "(wmxs %p size %zu attr %p)\n", wmxs, size, attr);
+	ifs = if_nameindex();
+	if (ifs == NULL) {
+		result = -errno;
+		wimaxll_msg(NULL, "E: %s: cannot list network interfaces: "
+			    "%m\n", __func__);
+		goto error_if_nameindex;
+	}
+	for (count = 0; ifs[count].if_index != 0; count++)
+		;
+	result = -ENOMEM;
+	results = malloc((count + 1) * sizeof(results[0]));
+	if (results == NULL)
+		goto error_results_alloc;
+
+	memset(&probe, 0, sizeof(probe));
+	wimaxll_handle_init(&probe);
+	result = wimaxll_tx_open(&probe);
+	if (result < 0)
+		goto error_tx_open;
+	result = wimaxll_discover_probe(&probe, ifs, count, results);
+	for (cnt = 0; result == 0 && cnt < count; cnt++)
+		if (results[cnt] == -ENOENT)
+			break;
+	if (result == 0 && cnt < count) {
+		/* The WiMAX modules were reloaded, the family ID we had
+		 * cached is stale; look it up again and retry */
+		d_printf(1, NULL, "D: stale genl family ID %d, retrying\n",
+			 probe.gnl_family_id);
+		wimaxll_gnl_family_invalidate(probe.gnl_family_id);
+		wimaxll_tx_close(&probe);
+		result = wimaxll_tx_open(&probe);
+		if (result < 0)
+			goto error_tx_open;
+		result = wimaxll_discover_probe(&probe, ifs, count, results);
+	}
+	wimaxll_tx_close(&probe);
+	if (result < 0)
+		goto error_probe;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	/* Open the ones that answered; we already know they are
+	 * WiMAX devices and in which state */
+	memset(&open_attr, 0, sizeof(open_attr));
+	if (attr)
+		open_attr = *attr;
+	state_cache_ms = open_attr.state_cache_ms;
+	open_attr.state_cache_ms = 0;
+	open_attr.flags |= WIMAXLL_OPEN_NO_PROBE;
+	found = 0;
+	for (cnt = 0; cnt < count; cnt++) {
+		if (results[cnt] < 0) {
+			if (results[cnt] != -ENODEV)
+				d_printf(1, NULL, "D: %s: STATE_GET failed: "
+					 "%d\n", ifs[cnt].if_name,
+					 results[cnt]);
+			continue;
+		}
+		if (found >= size) {
+			found++;
+			continue;
+		}
+		snprintf(name, sizeof(name), "#%u", ifs[cnt].if_index);
+		wmx = wimaxll_open_ex(name, &open_attr);
+		if (wmx == NULL && errno == ENODEV)
+			continue;	/* gone meanwhile */
+		if (wmx == NULL) {
+			result = -errno;
+			goto error_open;
+		}
+		wimaxll_state_cache_seed(wmx, state_cache_ms,
+					 results[cnt], &ts);
+		wmxs[found++] = wmx;
+	}
+	result = found;
+	d_printf(1, NULL, "D: %zu WiMAX devices in %zu interfaces\n",
+		 found, count);
+	goto out;
+
+error_open:
+	while (found > 0)
+		wimaxll_close(wmxs[--found]);
+out:
+error_probe:
+error_tx_open:
+	wimaxll_handle_release(&probe);
+	free(results);
+error_results_alloc:
+	if_freenameindex(ifs);
+error_if_nameindex:
+	d_fnend(3, NULL, "(wmxs %p size %zu attr %p) = %zd\n",
+		wmxs, size, attr, result);
+	return result;
+}
@@ -39,6 +39,8 @@
  */
 
 #include <asm/errno.h>
+#include <string.h>
+#include <pthread.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/family.h>
 #include <netlink/genl/ctrl.h>
@@ -46,9 +48,26 @@
 #include <netlink/attr.h>
 #include "internal.h"
 
+/*
+ * Process-wide cache of the WiMAX generic netlink family information
+ *
+ * All the handles talk to the same family, so there is no need for
+ * each wimaxll_open() to go ask the controller. Once a lookup
+ * succeeds we keep the result until wimaxll_gnl_family_invalidate()
+ * is called (because the family ID we had was rejected by the
+ * kernel, which means the module was reloaded).
+ */
+static pthread_mutex_t wimaxll_gnl_family_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct wimaxll_gnl_family wimaxll_gnl_family_cache;
+static int wimaxll_gnl_family_cached;
+
+/* ID of the controller's multicast group (-1 until looked up) */
+static int wimaxll_gnl_ctrl_mcg_id = -1;
+
+
 struct handler_arg {
-	void (*cb)(void *, const char *, int);
-	void *priv;
+	const char *mcg_name;
+	struct wimaxll_gnl_family *family;
 };
 
 
@@ -72,17 +91,15 @@ static int ack_handler(struct nl_msg *msg, void *arg)
 	return NL_OK;
 }
 
-static int family_handler(struct nl_msg *msg, void *_arg)
+static int family_parse(struct nlattr **tb, struct handler_arg *arg)
 {
-	struct handler_arg *arg = _arg;
-	struct nlattr *tb[CTRL_ATTR_MAX + 1];
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
 	struct nlattr *mcgrp;
 	int rem_mcgrp;
 
-	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
-		  genlmsg_attrlen(gnlh, 0), NULL);
-
+	if (tb[CTRL_ATTR_FAMILY_ID])
+		arg->family->id = nla_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
+	if (tb[CTRL_ATTR_VERSION])
+		arg->family->version = nla_get_u32(tb[CTRL_ATTR_VERSION]);
 	if (!tb[CTRL_ATTR_MCAST_GROUPS])
 		return NL_SKIP;
 
@@ -95,39 +112,53 @@ static int family_handler(struct nl_msg *msg, void *_arg)
 		if (!tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME] ||
 		    !tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID])
 			continue;
-		arg->cb(arg->priv,
-			nla_data(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME]),
-			nla_get_u32(tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID]));
+		if (strcmp(nla_data(tb_mcgrp[CTRL_ATTR_MCAST_GRP_NAME]),
+			   arg->mcg_name))
+			continue;
+		arg->family->mcg_id =
+			nla_get_u32(tb_mcgrp[CTRL_ATTR_MCAST_GRP_ID]);
 	}
 	return NL_OK;
 }
 
-/**
- * Enumerates the list of available multicast groups for a family
- *
- * \param handle netlink handle to use for querying the list
- * \param family name of family to query for multicast groups
- * \param cbf callback function to call with each multicast group's information.
- * \param priv pointer to pass to the callback function
+static int family_handler(struct nl_msg *msg, void *_arg)
+{
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+
+	nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+	return family_parse(tb, _arg);
+}
+
+
+/*
+ * Ask the generic netlink controller about a family
  *
- * Returns: 0 if ok, < 0 errno code on error.
+ * A single CTRL_CMD_GETFAMILY request returns the family ID, the
+ * version and the list of multicast groups, so we get everything in
+ * one round trip. The controller has a fixed ID (GENL_ID_CTRL), no
+ * need to resolve it.
  *
- * Enumerates the multicast groups available for a generic netlink
- * family and calls the callback with the arguments of each.
+ * Fields which are not in the reply are set to -1.
  */
-int nl_get_multicast_groups(struct nl_handle *handle,
-			    const char *family,
-			    void (*cbf)(void *, const char *, int),
-			    void *priv)
+static
+int wimaxll_gnl_family_query(struct nl_handle *handle, const char *family,
+			     const char *mcg_name,
+			     struct wimaxll_gnl_family *result_family)
 {
 	struct nl_msg *msg;
 	struct nl_cb *cb;
-	int ret, ctrlid;
+	int ret;
 	struct handler_arg arg = {
-		.priv = priv,
-		.cb = cbf
+		.mcg_name = mcg_name,
+		.family = result_family,
 	};
 
+	result_family->id = -1;
+	result_family->mcg_id = -1;
+	result_family->version = -1;
+
 	msg = nlmsg_alloc();
 	if (!msg)
 		return -ENOMEM;
@@ -138,10 +169,8 @@ int nl_get_multicast_groups(struct nl_handle *handle,
 		goto out_fail_cb;
 	}
 
-	ctrlid = genl_ctrl_resolve(handle, "nlctrl");
-
-	genlmsg_put(msg, 0, 0, ctrlid, 0,
-		    0, CTRL_CMD_GETFAMILY, 0);
+	genlmsg_put(msg, 0, 0, GENL_ID_CTRL, 0,
+		    0, CTRL_CMD_GETFAMILY, 1);
 
 	ret = -ENOBUFS;
 	NLA_PUT_STRING(msg, CTRL_ATTR_FAMILY_NAME, family);
@@ -159,6 +188,8 @@ int nl_get_multicast_groups(struct nl_handle *handle,
 
 	while (ret > 0)
 		ret = nl_recvmsgs(handle, cb);
+	if (ret == 0 && result_family->id == -1)
+		ret = -ENOENT;
  nla_put_failure:
  out:
 	nl_cb_put(cb);
@@ -168,21 +199,164 @@ int nl_get_multicast_groups(struct nl_handle *handle,
 }
 
 
-int genl_ctrl_get_version(struct nl_handle *nlh, const char *name)
+/**
+ * Get the generic netlink information for the WiMAX family
+ *
+ * \internal
+ *
+ * \param handle netlink handle to use for querying the controller
+ *     if the information is not cached
+ * \param family where to store the information
+ * \return 0 if ok, < 0 errno code on error (-%ENOENT if the kernel
+ *     has no WiMAX family).
+ *
+ * Returns the cached copy if there is one; otherwise the controller
+ * is queried and the result cached for the next caller.
+ *
+ * \a family->mcg_id will be -1 if the kernel doesn't export a
+ * \e msg multicast group.
+ */
+int wimaxll_gnl_family_get(struct nl_handle *handle,
+			   struct wimaxll_gnl_family *family)
 {
-	int result = -ENOENT;
-	struct genl_family *fam;
-	struct nl_cache *cache;
-
-	cache = genl_ctrl_alloc_cache(nlh);
-	if (cache == NULL)
-		return nl_get_errno();
-
-	fam = genl_ctrl_search_by_name(cache, name);
-	if (fam) {
-		result = genl_family_get_version(fam);
-		genl_family_put(fam);
+	int result = 0;
+
+	pthread_mutex_lock(&wimaxll_gnl_family_mutex);
+	if (!wimaxll_gnl_family_cached) {
+		result = wimaxll_gnl_family_query(
+			handle, "WiMAX", "msg", &wimaxll_gnl_family_cache);
+		if (result >= 0)
+			wimaxll_gnl_family_cached = 1;
+	}
+	if (result >= 0)
+		*family = wimaxll_gnl_family_cache;
+	pthread_mutex_unlock(&wimaxll_gnl_family_mutex);
+	return result;
+}
+
+
+/**
+ * Drop the cached generic netlink information for the WiMAX family
+ *
+ * \internal
+ *
+ * \param id Family ID that the kernel refused
+ *
+ * The cache is only dropped if it still holds \a id, so many handles
+ * finding out about the same module reload cause only one new query.
+ */
+void wimaxll_gnl_family_invalidate(int id)
+{
+	pthread_mutex_lock(&wimaxll_gnl_family_mutex);
+	if (wimaxll_gnl_family_cached && wimaxll_gnl_family_cache.id == id)
+		wimaxll_gnl_family_cached = 0;
+	pthread_mutex_unlock(&wimaxll_gnl_family_mutex);
+}
+
+
+/**
+ * Get the ID of the generic netlink controller's multicast group
+ *
+ * \internal
+ *
+ * \param handle netlink handle to use for querying the controller
+ *     if the ID is not known yet
+ * \return the ID of the \e notify group, < 0 errno code on error.
+ *
+ * The controller announces there the families (and their multicast
+ * groups) as they are registered and unregistered. It is always
+ * there and doesn't change, so it is looked up only once.
+ */
+int wimaxll_gnl_ctrl_mcg_get(struct nl_handle *handle)
+{
+	int result;
+	struct wimaxll_gnl_family ctrl;
+
+	pthread_mutex_lock(&wimaxll_gnl_family_mutex);
+	result = wimaxll_gnl_ctrl_mcg_id;
+	if (result < 0) {
+		result = wimaxll_gnl_family_query(handle, "nlctrl", "notify",
+						  &ctrl);
+		if (result >= 0 && ctrl.mcg_id < 0)
+			result = -ENOENT;
+		else if (result >= 0)
+			result = wimaxll_gnl_ctrl_mcg_id = ctrl.mcg_id;
+	}
+	pthread_mutex_unlock(&wimaxll_gnl_family_mutex);
+	return result;
+}
+
+
+/**
+ * Update the cached information with a notification from the
+ * generic netlink controller
+ *
+ * \internal
+ *
+ * \param nl_hdr notification (received from GENL_ID_CTRL)
+ * \param family where to store the WiMAX family's information as
+ *     known after the notification (fields still unknown are -1).
+ * \return CTRL_CMD_NEWFAMILY if the WiMAX family has been (or is
+ *     being) registered, CTRL_CMD_DELFAMILY if it was unregistered;
+ *     -%ENOMSG if the notification is about something else.
+ *
+ * Depending on the kernel version, the family is announced with its
+ * multicast groups (CTRL_CMD_NEWFAMILY) or without them and then
+ * each group separately (CTRL_CMD_NEWMCAST_GRP); we put the pieces
+ * together here, so all the handles in the process pick up the new
+ * IDs without asking the controller. The cache is valid again once
+ * the \e msg group is known.
+ */
+int wimaxll_gnl_family_notify(struct nlmsghdr *nl_hdr,
+			      struct wimaxll_gnl_family *family)
+{
+	int result;
+	struct genlmsghdr *gnlh = nlmsg_data(nl_hdr);
+	struct nlattr *tb[CTRL_ATTR_MAX + 1];
+	struct wimaxll_gnl_family update = { -1, -1, -1 };
+	struct handler_arg arg = {
+		.mcg_name = "msg",
+		.family = &update,
+	};
+
+	if (nlmsg_len(nl_hdr) < GENL_HDRLEN
+	    || nla_parse(tb, CTRL_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+			 genlmsg_attrlen(gnlh, 0), NULL) < 0
+	    || tb[CTRL_ATTR_FAMILY_NAME] == NULL
+	    || strcmp(nla_data(tb[CTRL_ATTR_FAMILY_NAME]), "WiMAX"))
+		return -ENOMSG;
+	family_parse(tb, &arg);
+	pthread_mutex_lock(&wimaxll_gnl_family_mutex);
+	switch (gnlh->cmd) {
+	case CTRL_CMD_DELFAMILY:
+		wimaxll_gnl_family_cached = 0;
+		wimaxll_gnl_family_cache.id = -1;
+		result = CTRL_CMD_DELFAMILY;
+		break;
+	case CTRL_CMD_NEWFAMILY:
+	case CTRL_CMD_NEWMCAST_GRP:
+		if (update.id == -1) {
+			result = -ENOMSG;
+			break;
+		}
+		if (wimaxll_gnl_family_cache.id != update.id) {
+			wimaxll_gnl_family_cache.id = update.id;
+			wimaxll_gnl_family_cache.mcg_id = -1;
+			wimaxll_gnl_family_cache.version = -1;
+		}
+		if (update.mcg_id != -1)
+			wimaxll_gnl_family_cache.mcg_id = update.mcg_id;
+		if (update.version != -1)
+			wimaxll_gnl_family_cache.version = update.version;
+		wimaxll_gnl_family_cached =
+			wimaxll_gnl_family_cache.mcg_id != -1
+			&& wimaxll_gnl_family_cache.version != -1;
+		result = CTRL_CMD_NEWFAMILY;
+		break;
+	default:
+		result = -ENOMSG;
 	}
-	nl_cache_free(cache);
+	*family = wimaxll_gnl_family_cache;
+	pthread_mutex_unlock(&wimaxll_gnl_family_mutex);
 	return result;
 }
@@ -0,0 +1,434 @@
+/*
+ * Linux WiMax
+ * Devices and the WiMAX stack coming and going
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \defgroup device_hotplug Hotplug
+ *
+ * Handles survive the WiMAX stack being reloaded and their devices
+ * being unplugged and plugged back, without having to close and open
+ * them again:
+ *
+ * - When the kernel's WiMAX stack unregisters (eg: its modules are
+ *   unloaded) and registers again, the handles are moved to the new
+ *   generic netlink family and multicast group IDs, that the
+ *   generic netlink controller announces. The announcement reaches
+ *   every handle's RX socket, so each one is rebound as it reads it
+ *   (no queries to the controller) and the process-wide cache of the
+ *   IDs is updated once for all of them.
+ *
+ * - Handles for a device with a hotplug callback set also listen to
+ *   the kernel's link events: when a network interface with the
+ *   device's name appears again (with a new interface index), the
+ *   handle is moved to it.
+ *
+ * In both cases the application is told with the callback set with
+ * wimaxll_set_cb_hotplug(), executed as the rest of callbacks when
+ * receiving on the handle (or from the \ref main_loop "event loop"):
+ *
+ * @code
+ * static
+ * void my_hotplug_cb(struct wimaxll_handle *wmx, void *priv,
+ *                    enum wimaxll_hotplug_event event)
+ * {
+ *         if (event == WIMAXLL_HOTPLUG_STACK_BACK
+ *             || event == WIMAXLL_HOTPLUG_DEVICE_BACK)
+ *                 resync(wmx, wimaxll_state_get(wmx));
+ * }
+ * ...
+ * wimaxll_set_cb_hotplug(wmx, my_hotplug_cb, my_priv);
+ * @endcode
+ *
+ * Link events come over a socket of their own; applications that
+ * wait for notifications with their own poll() loop on
+ * wimaxll_recv_fd() should also wait on wimaxll_hotplug_fd() and
+ * call wimaxll_recv_timeout() (with a zero timeout) when it is
+ * readable. The event loop does this by itself for the handles that
+ * have the callback set when they are added to it.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <net/if.h>
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <netlink/attr.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/* Link events come in bursts of small messages */
+	WIMAXLL_HOTPLUG_BUF_SIZE = 8192,
+};
+
+
+static
+void wimaxll_hotplug_notify(struct wimaxll_handle *wmx,
+			    enum wimaxll_hotplug_event event)
+{
+	d_printf(1, wmx, "D: hotplug: event %u ifidx %u\n",
+		 event, wmx->ifidx);
+	wimaxll_state_cache_invalidate(wmx);
+	if (wmx->hotplug_cb)
+		wmx->hotplug_cb(wmx, wmx->hotplug_priv, event);
+}
+
+
+/*
+ * Process a notification from the generic netlink controller
+ *
+ * \internal
+ *
+ * \param wmx handle that read the notification from its RX socket
+ * \param nl_hdr notification
+ *
+ * Called by the receive paths for the messages from GENL_ID_CTRL;
+ * the ones that are not about the WiMAX family are ignored. When it
+ * unregisters, the handles reading from the socket are marked as
+ * unbound (see wimaxll_rx_unbind()); when it registers again with a
+ * compatible version, they are moved to the new IDs and join the
+ * group again (see wimaxll_rx_rebind()).
+ */
+void wimaxll_hotplug_ctrl(struct wimaxll_handle *wmx, struct nlmsghdr *nl_hdr)
+{
+	int result;
+	struct wimaxll_gnl_family family;
+	struct wimaxll_handle **handles;
+	size_t cnt, count;
+	enum wimaxll_hotplug_event event;
+
+	result = wimaxll_gnl_family_notify(nl_hdr, &family);
+	switch (result) {
+	case CTRL_CMD_DELFAMILY:
+		wimaxll_msg(wmx, "W: WiMAX stack unregistered\n");
+		wimaxll_rx_unbind(wmx);
+		event = WIMAXLL_HOTPLUG_STACK_GONE;
+		break;
+	case CTRL_CMD_NEWFAMILY:
+		/* Still missing the multicast group? Or already
+		 * rebound by a previous notification? (if the
+		 * unregistration was missed, the IDs tell) */
+		if (family.mcg_id == -1 || family.version == -1
+		    || (wmx->mcg_id != -1
+			&& family.id == wmx->gnl_family_id
+			&& family.mcg_id == wmx->mcg_id))
+			return;
+		if (family.version / 10 != WIMAX_GNL_VERSION / 10) {
+			wimaxll_msg(wmx, "E: WiMAX stack registered with "
+				    "major WiMAX GNL interface version %d, "
+				    "different than supported %d\n",
+				    family.version / 10,
+				    WIMAX_GNL_VERSION / 10);
+			return;
+		}
+		if (wimaxll_rx_rebind(wmx, &family) < 0)
+			return;
+		d_printf(1, wmx, "D: WiMAX stack back, genl family ID %d "
+			 "mcg ID %d\n", family.id, family.mcg_id);
+		event = WIMAXLL_HOTPLUG_STACK_BACK;
+		break;
+	default:
+		return;
+	}
+	handles = wimaxll_rx_handles_get(&wmx, &count);
+	for (cnt = 0; cnt < count; cnt++)
+		if (!wimaxll_rx_handle_closed(handles[cnt]))
+			wimaxll_hotplug_notify(handles[cnt], event);
+	wimaxll_rx_handles_put(handles, &wmx, count);
+}
+
+
+/*
+ * Process a link event
+ *
+ * RTM_NEWLINK is also sent when an interface changes flags, so we
+ * only care about the ones for a different index with our name (the
+ * device is back) or for our index with a different name (it was
+ * renamed, so we follow it).
+ */
+static
+void wimaxll_hotplug_link(struct wimaxll_handle *wmx,
+			  struct nlmsghdr *nl_hdr)
+{
+	struct ifinfomsg *ifi = nlmsg_data(nl_hdr);
+	struct nlattr *nla;
+	char name[__WIMAXLL_IFNAME_LEN];
+
+	if (nlmsg_len(nl_hdr) < sizeof(*ifi))
+		return;
+	switch (nl_hdr->nlmsg_type) {
+	case RTM_DELLINK:
+		if (ifi->ifi_index != wmx->ifidx)
+			return;
+		wimaxll_hotplug_notify(wmx, WIMAXLL_HOTPLUG_DEVICE_GONE);
+		break;
+	case RTM_NEWLINK:
+		nla = nlmsg_find_attr(nl_hdr, sizeof(*ifi), IFLA_IFNAME);
+		if (nla == NULL)
+			return;
+		nla_strlcpy(name, nla, sizeof(name));
+		if (ifi->ifi_index == wmx->ifidx) {
+			if (strcmp(name, wmx->name))
+				d_printf(1, wmx, "D: hotplug: renamed to %s\n",
+					 name);
+			strcpy(wmx->name, name);
+		} else if (strcmp(name, wmx->name) == 0) {
+			wimaxll_rx_ifidx_set(wmx, ifi->ifi_index);
+			wimaxll_hotplug_notify(wmx,
+					       WIMAXLL_HOTPLUG_DEVICE_BACK);
+		}
+		break;
+	}
+}
+
+
+/*
+ * Process the link events queued in a handle's link socket
+ *
+ * \internal
+ *
+ * \return number of messages processed, < 0 errno code on error.
+ *
+ * Doesn't block; the caller must have the reader role (see
+ * wimaxll_rx_reader_get()), so the hotplug callback is not run in
+ * parallel with the other callbacks (and wmx->link_buf is ours).
+ * If the socket overflowed, we can't know what we missed, so we just
+ * look up by name the index the device has now.
+ */
+ssize_t wimaxll_hotplug_link_process(struct wimaxll_handle *wmx)
+{
+	ssize_t result, processed = 0;
+	int size;
+	unsigned ifidx;
+	struct nlmsghdr *nl_hdr;
+	void *buf = wmx->link_buf;
+
+	while (1) {
+		result = recv(nl_socket_get_fd(wmx->nlh_link), buf,
+			      WIMAXLL_HOTPLUG_BUF_SIZE, MSG_DONTWAIT);
+		if (result < 0 && errno == ENOBUFS) {
+			wimaxll_msg(wmx, "W: hotplug: link events lost; "
+				    "resyncing\n");
+			ifidx = if_nametoindex(wmx->name);
+			if (ifidx > 0 && ifidx != wmx->ifidx) {
+				wimaxll_rx_ifidx_set(wmx, ifidx);
+				wimaxll_hotplug_notify(
+					wmx, WIMAXLL_HOTPLUG_DEVICE_BACK);
+			}
+			continue;
+		}
+		if (result < 0) {
+			result = errno == EAGAIN ? processed : -errno;
+			break;
+		}
+		size = result;
+		for (nl_hdr = buf; NLMSG_OK(nl_hdr, size);
+		     nl_hdr = NLMSG_NEXT(nl_hdr, size)) {
+			wimaxll_hotplug_link(wmx, nl_hdr);
+			processed++;
+		}
+	}
+	return result;
+}
+
+
+/*
+ * Service a handle's link socket from the event loop
+ *
+ * \internal
+ *
+ * Waits for the thread receiving on the handle (if any) to be done,
+ * so the callbacks are not executed in parallel.
+ */
+ssize_t wimaxll_hotplug_dispatch(struct wimaxll_handle *wmx)
+{
+	ssize_t result;
+
+	result = wimaxll_rx_reader_get(wmx, NULL, NULL, -1);
+	if (result < 0)
+		return result;
+	result = wimaxll_hotplug_link_process(wmx);
+	wimaxll_rx_reader_put(wmx);
+	return result;
+}
+
+
+static
+int wimaxll_hotplug_link_open(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	/* Allocated once, as this is polled on every receive */
+	wmx->link_buf = malloc(WIMAXLL_HOTPLUG_BUF_SIZE);
+	if (wmx->link_buf == NULL) {
+		result = -ENOMEM;
+		goto error_link_buf_alloc;
+	}
+	wmx->nlh_link = nl_handle_alloc();
+	if (wmx->nlh_link == NULL) {
+		result = nl_get_errno();
+		wimaxll_msg(wmx, "E: hotplug: cannot allocate handle: "
+			    "%d (%s)\n", result, nl_geterror());
+		goto error_nl_handle_alloc;
+	}
+	result = nl_connect(wmx->nlh_link, NETLINK_ROUTE);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: hotplug: cannot connect netlink: "
+			    "%d (%s)\n", result, nl_geterror());
+		goto error_nl_connect;
+	}
+	result = nl_socket_add_membership(wmx->nlh_link, RTNLGRP_LINK);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: hotplug: cannot subscribe to link "
+			    "events: %d (%s)\n", result, nl_geterror());
+		goto error_nl_add_membership;
+	}
+	return 0;
+
+error_nl_add_membership:
+	nl_close(wmx->nlh_link);
+error_nl_connect:
+	nl_handle_destroy(wmx->nlh_link);
+error_nl_handle_alloc:
+	wmx->nlh_link = NULL;
+	free(wmx->link_buf);
+	wmx->link_buf = NULL;
+error_link_buf_alloc:
+	return result;
+}
+
+
+/*
+ * Close the link socket, if any
+ *
+ * \internal
+ */
+void wimaxll_hotplug_release(struct wimaxll_handle *wmx)
+{
+	if (wmx->nlh_link == NULL)
+		return;
+	nl_close(wmx->nlh_link);
+	nl_handle_destroy(wmx->nlh_link);
+	wmx->nlh_link = NULL;
+	free(wmx->link_buf);
+	wmx->link_buf = NULL;
+}
+
+
+/**
+ * Get the callback and priv pointer for hotplug events
+ *
+ * \param wmx WiMAX handle.
+ * \param cb Where to store the current callback function.
+ * \param priv Where to store the private data pointer passed to the
+ *     callback.
+ *
+ * \ingroup device_hotplug
+ */
+void wimaxll_get_cb_hotplug(struct wimaxll_handle *wmx,
+			    wimaxll_hotplug_cb_f *cb, void **priv)
+{
+	*cb = wmx->hotplug_cb;
+	*priv = wmx->hotplug_priv;
+}
+
+
+/**
+ * Set the callback and priv pointer for hotplug events
+ *
+ * \param wmx WiMAX handle.
+ * \param cb Function to call when the handle's device or the WiMAX
+ *     stack come or go (%NULL for none).
+ * \param priv Private data pointer to pass to the callback.
+ * \return 0 if ok, < 0 errno code on error (and the callback is not
+ *     set).
+ *
+ * For handles for a device, setting a callback subscribes the handle
+ * to the kernel's link events (see wimaxll_hotplug_fd()); clearing
+ * it unsubscribes. Handles for \e any device only get the WiMAX
+ * stack events.
+ *
+ * The handle is moved to the WiMAX stack's new IDs when it comes
+ * back whether there is a callback or not.
+ *
+ * \ingroup device_hotplug
+ */
+int wimaxll_set_cb_hotplug(struct wimaxll_handle *wmx,
+			   wimaxll_hotplug_cb_f cb, void *priv)
+{
+	int result = 0;
+
+	d_fnstart(3, wmx, "(wmx %p cb %p priv %p)\n", wmx, cb, priv);
+	if (cb == NULL)
+		wimaxll_hotplug_release(wmx);
+	else if (wmx->ifidx > 0 && wmx->nlh_link == NULL)
+		result = wimaxll_hotplug_link_open(wmx);
+	if (result == 0) {
+		wmx->hotplug_cb = cb;
+		wmx->hotplug_priv = priv;
+	}
+	d_fnend(3, wmx, "(wmx %p cb %p priv %p) = %d\n", wmx, cb, priv,
+		result);
+	return result;
+}
+
+
+/**
+ * Return the file descriptor link events arrive on
+ *
+ * \param wmx WiMAX handle.
+ * \return file descriptor that becomes readable when there are link
+ *     events to process (with wimaxll_recv_timeout() or any of the
+ *     receive functions); -%EBADF if the handle has no hotplug
+ *     callback or is for \e any device.
+ *
+ * \ingroup device_hotplug
+ */
+int wimaxll_hotplug_fd(struct wimaxll_handle *wmx)
+{
+	if (wmx->nlh_link == NULL)
+		return -EBADF;
+	return nl_socket_get_fd(wmx->nlh_link);
+}
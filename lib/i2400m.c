@@ -38,19 +38,31 @@
  * This set of helpers simplify the task of sending commands / waiting
  * for the acks and receiving reports/indications from the i2400m.
  *
- * It boils down to a framework to support that only one thread can
- * send a command at the same time; this is because the commands don't
- * have a cookie to identify the issuer -- so a place is needed where
- * to store the "I am waiting for a response for command X".
+ * It boils down to a framework to track which commands are waiting
+ * for a response; this is needed because the commands don't have a
+ * cookie to identify the issuer -- so a place is needed where to
+ * store the "I am waiting for a response for command X". As replies
+ * can only be matched by message type, there can be many commands in
+ * flight at the same time, but only one of each type.
  *
  * When the callback from libwimaxll comes back with the response, if
- * it was a reply to said message, then the waiter for that is woken
- * up (using pthread mutexes and conditional variables). See \ref
- * cancellation for more information on what happens when the thread
- * is cancelled.
+ * it was a reply to one of said messages, then the waiter for that is
+ * woken up (using pthread mutexes and conditional variables). See
+ * \ref cancellation for more information on what happens when the
+ * thread is cancelled.
  *
  * When a report is received, the report callback is called; care has
- * to be taken not to deadlock. See i2400m_report_cb().
+ * to be taken not to deadlock. See i2400m_report_cb(). Alternatively,
+ * reports can be queued for worker threads to pick them up (see
+ * i2400m_report_ring_enable()):
+ *
+ * @code
+ * 	r = i2400m_report_ring_enable(i2400m, 0, 0);
+ * 	...
+ * 	// in a worker thread
+ * 	while ((r = i2400m_report_pop(i2400m, buf, sizeof(buf), -1)) > 0)
+ * 		// handle the report in buf; can execute commands
+ * @endcode
  *
  * For usage, create a handle:
  *
@@ -78,6 +90,48 @@
  * calling i2400m_msg_to_dev() will deadlock, as well as waiting for a
  * report.
  *
+ * To avoid waiting for each command to finish before sending the
+ * next one, they can be submitted with i2400m_msg_to_dev_async(),
+ * which returns a ticket that can be waited for later on:
+ *
+ * @code
+ * 	unsigned ticket1, ticket2;
+ * 	...
+ * 	r = i2400m_msg_to_dev_async(i2400m, &msg1, msg1_size,
+ * 				    msg1_cb, msg1_cb_priv, 500, &ticket1);
+ * 	...
+ * 	r = i2400m_msg_to_dev_async(i2400m, &msg2, msg2_size,
+ * 				    msg2_cb, msg2_cb_priv, 500, &ticket2);
+ * 	...
+ * 	r1 = i2400m_ticket_wait(i2400m, ticket1);
+ * 	r2 = i2400m_ticket_wait(i2400m, ticket2);
+ * @endcode
+ *
+ * Each command has its own deadline, so a slow reply to one doesn't
+ * hold the others back.
+ *
+ * Instead of one callback that gets all the reports, handlers can be
+ * set for each report type; they are passed the TLVs of the report
+ * already indexed (see i2400m_tlv_index_build()):
+ *
+ * @code
+ * static
+ * void my_state_report(struct i2400m *i2400m, void *priv,
+ * 		     const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size,
+ * 		     const struct i2400m_tlv_index *idx)
+ * {
+ * 	tlv = i2400m_tlv_index_get(idx, I2400M_TLV_SYSTEM_STATE, -1);
+ * 	...
+ * }
+ * ...
+ * 	i2400m_report_handler_set(i2400m, I2400M_MT_REPORT_STATE,
+ * 				  my_state_report, my_priv);
+ * @endcode
+ *
+ * Finding the handler is an array lookup; reports that have no
+ * handler (and no report callback or ring to go to) are dropped
+ * without looking at their TLVs.
+ *
  * A report callback with some TLV processing example would be:
  *
  * @code
@@ -102,6 +156,12 @@
  * 	tlv = i2400m_tlv_find(l3l4->pl, l3l4_size - sizeof(*l3l4),
  * 			      I2400M_TLV_SOMETHING, -1);
  *
+ * 	// or, to find many, index the buffer once
+ * 	struct i2400m_tlv_index idx;
+ * 	i2400m_tlv_index_build(&idx, l3l4->pl, l3l4_size - sizeof(*l3l4));
+ * 	tlv = i2400m_tlv_index_get(&idx, I2400M_TLV_SOMETHING, -1);
+ * 	tlv2 = i2400m_tlv_index_get(&idx, I2400M_TLV_SOMETHING_ELSE, -1);
+ *
  * }
  * @endcode
  *
@@ -113,37 +173,129 @@
  * more information.
  */
 #include <wimaxll/i2400m.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <wimaxll.h>
 #include <internal.h>
 
 
+enum {
+	/** Max number of commands in flight */
+	I2400M_CMDS_MAX = 8,
+	/** Bits of a ticket used for the index in the command table */
+	I2400M_TICKET_IDX_BITS = 4,
+	I2400M_TICKET_IDX_MASK = (1 << I2400M_TICKET_IDX_BITS) - 1,
+	/** Default number of slots in the report ring */
+	I2400M_REPORT_RING_SLOTS = 64,
+	/** Default max size of a report kept in the report ring */
+	I2400M_REPORT_RING_SIZE = 4096,
+	/** Report types are 0x8000 | GROUP << 8 | INDEX; handlers are
+	 * kept in a table per group */
+	I2400M_REPORT_GROUPS = 0x80,
+	I2400M_REPORT_GROUP_SIZE = 0x100,
+};
+
+
+/*
+ * State of an entry in the command table
+ *
+ * @internal
+ */
+enum i2400m_cmd_state {
+	I2400M_CMD_FREE = 0,	/* slot not in use */
+	I2400M_CMD_PENDING,	/* sent, waiting for a reply */
+	I2400M_CMD_DONE,	/* result ready, waiting to be collected */
+};
+
+
+/**
+ * Command in flight
+ *
+ * @param i2400m Handle this command belongs to
+ * @param state Where in its lifecycle this command is
+ * @param mt Message type of the reply we are waiting for
+ * @param generation Identifies this use of the slot; tickets encode
+ *     it so stale tickets are not mistaken for new commands
+ * @param detached No ticket was handed out; free the slot as soon as
+ *     the command completes
+ * @param cb Callback to execute when the \e mt reply arrives.
+ * @param cb_priv Private data to pass to the \e cb
+ * @param result Updated with the result of executing the \e cb
+ *     callback. If cancelled, it will be -%EINTR; if no reply comes
+ *     before the deadline, -%ETIMEDOUT.
+ * @param has_deadline If non-zero, \e deadline is valid
+ * @param deadline When to give up waiting for the reply
+ *     (CLOCK_MONOTONIC)
+ *
+ * @internal
+ * @ingroup i2400m_group
+ */
+struct i2400m_cmd {
+	struct i2400m *i2400m;
+	enum i2400m_cmd_state state;
+	enum i2400m_mt mt;
+	unsigned generation;
+	int detached;
+	i2400m_reply_cb cb;
+	void *cb_priv;
+	int result;
+	int has_deadline;
+	struct timespec deadline;
+};
+
+
+/*
+ * Handler for a report type (see i2400m_report_handler_set())
+ *
+ * @internal
+ */
+struct i2400m_report_handler {
+	i2400m_report_handler_cb cb;
+	void *priv;
+};
+
+
 /**
  * Descriptor for a Intel 2400m
  *
  * @param wmx libwimaxll handle
  * @param priv Private storage as set by the owner
  *
- * @param mutex Mutex for command execution (protects mt_*)
+ * @param mutex Mutex for command execution (protects \e cmd and \e
+ *     generation)
  * @param cond Conditional variable for command execution (protected
  *     by \e mutex). Threads wait on this conditional variable waiting
- *     for commands to finish executing (at which point the mt_cb is
- *     called back).
+ *     for commands to finish executing (at which point the command's
+ *     callback is called back) or for slots in \e cmd to be freed.
+ * @param tx_mutex Serializes writing commands to the device (the
+ *     TX side of the libwimaxll handle can't be used in parallel).
  *
- * @param mt_pending Message type of the reply that a thread is
- *     waiting for.
- * @param mt_cb Callback to execute when the \e mt_pending reply
- *     arrives.
- * @param mt_cb_priv Private data to pass to the \e mt_cb
- * @param mt_result Updated with the result of executing the \e mt_cb
- *     callback. If cancelled, it will be -%EINTR.
+ * @param cmd Table of commands in flight
+ * @param generation Counter for assigning generations to commands
  *
  * @param report_cb Callback to execute when a report/indication is
  *     received.
  * @param report_cb_priv Private data passed to the report callback.
  *
+ * @param report_ring If enabled with i2400m_report_ring_enable(),
+ *     where reports are queued for i2400m_report_pop() instead of
+ *     calling \e report_cb.
+ * @param report_fd eventfd (in semaphore mode) for waking up
+ *     threads waiting for reports to appear in \e report_ring; it
+ *     gets a count for each report pushed (before pushing it) and
+ *     whoever pops a report takes one. -1 if there is no ring.
+ * @param report_dropped Number of reports that didn't fit in \e
+ *     report_ring.
+ *
+ * @param report_handler Handlers for each report type, in a table
+ *     per group of types (allocated when the first handler of the
+ *     group is set); protected by \e mutex.
+ *
  * @internal
  * @ingroup i2400m_group
  */
@@ -153,29 +305,202 @@ struct i2400m {
 
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	pthread_mutex_t tx_mutex;
 
-	enum i2400m_mt mt_pending;
-	i2400m_reply_cb mt_cb;
-	void *mt_cb_priv;
-	int mt_result;
+	struct i2400m_cmd cmd[I2400M_CMDS_MAX];
+	unsigned generation;
 
 	i2400m_report_cb report_cb;
 	void *report_cb_priv;
+
+	struct wimaxll_ring *report_ring;
+	int report_fd;
+	unsigned long report_dropped;
+
+	struct i2400m_report_handler *report_handler[I2400M_REPORT_GROUPS];
 };
 
 
+/*
+ * Return the command a ticket refers to
+ *
+ * NULL if the ticket is not valid anymore (the command was collected
+ * or cancelled). Call with i2400m->mutex held.
+ */
+static
+struct i2400m_cmd *__i2400m_ticket_cmd(struct i2400m *i2400m,
+				       unsigned ticket)
+{
+	unsigned idx = ticket & I2400M_TICKET_IDX_MASK;
+	struct i2400m_cmd *cmd;
+
+	if (idx >= I2400M_CMDS_MAX)
+		return NULL;
+	cmd = &i2400m->cmd[idx];
+	if (cmd->state == I2400M_CMD_FREE
+	    || cmd->generation != ticket >> I2400M_TICKET_IDX_BITS)
+		return NULL;
+	return cmd;
+}
+
+
+/*
+ * Release a slot in the command table
+ *
+ * Wakes up anybody waiting for a free slot. Call with
+ * i2400m->mutex held.
+ */
+static
+void __i2400m_cmd_free(struct i2400m_cmd *cmd)
+{
+	cmd->state = I2400M_CMD_FREE;
+	cmd->mt = I2400M_MT_INVALID;
+	pthread_cond_broadcast(&cmd->i2400m->cond);
+}
+
+
+/*
+ * Mark a command as completed with the given result
+ *
+ * If nobody is going to collect it, free the slot; otherwise wake up
+ * the waiters. Call with i2400m->mutex held.
+ */
+static
+void __i2400m_cmd_complete(struct i2400m_cmd *cmd, int result)
+{
+	cmd->mt = I2400M_MT_INVALID;
+	cmd->result = result;
+	if (cmd->detached)
+		__i2400m_cmd_free(cmd);
+	else {
+		cmd->state = I2400M_CMD_DONE;
+		pthread_cond_broadcast(&cmd->i2400m->cond);
+	}
+}
+
+
+/*
+ * Complete with -ETIMEDOUT all the commands whose deadline passed
+ *
+ * Call with i2400m->mutex held.
+ */
+static
+void __i2400m_cmds_expire(struct i2400m *i2400m)
+{
+	unsigned cnt;
+	struct timespec now;
+	struct i2400m_cmd *cmd;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (cnt = 0; cnt < I2400M_CMDS_MAX; cnt++) {
+		cmd = &i2400m->cmd[cnt];
+		if (cmd->state != I2400M_CMD_PENDING || !cmd->has_deadline)
+			continue;
+		if (now.tv_sec > cmd->deadline.tv_sec
+		    || (now.tv_sec == cmd->deadline.tv_sec
+			&& now.tv_nsec >= cmd->deadline.tv_nsec))
+			__i2400m_cmd_complete(cmd, -ETIMEDOUT);
+	}
+}
+
+
+/*
+ * Get a free slot in the command table for a message type
+ *
+ * Returns -EBUSY if there is already a command waiting for a reply
+ * of the same type (as we would not be able to tell the replies
+ * apart) or if the table is full. Call with i2400m->mutex held.
+ */
+static
+int __i2400m_cmd_alloc(struct i2400m *i2400m, enum i2400m_mt mt,
+		       struct i2400m_cmd **_cmd)
+{
+	unsigned cnt;
+	struct i2400m_cmd *cmd, *free_cmd = NULL;
+
+	for (cnt = 0; cnt < I2400M_CMDS_MAX; cnt++) {
+		cmd = &i2400m->cmd[cnt];
+		if (cmd->state == I2400M_CMD_PENDING && cmd->mt == mt)
+			return -EBUSY;
+		if (cmd->state == I2400M_CMD_FREE && free_cmd == NULL)
+			free_cmd = cmd;
+	}
+	if (free_cmd == NULL)
+		return -EBUSY;
+	i2400m->generation++;
+	/* Generation 0 is never used, so a zeroed ticket is invalid */
+	if ((i2400m->generation << I2400M_TICKET_IDX_BITS)
+	    >> I2400M_TICKET_IDX_BITS != i2400m->generation
+	    || i2400m->generation == 0)
+		i2400m->generation = 1;
+	free_cmd->generation = i2400m->generation;
+	free_cmd->state = I2400M_CMD_PENDING;
+	free_cmd->mt = mt;
+	*_cmd = free_cmd;
+	return 0;
+}
+
+
+/*
+ * Take one count from the report eventfd
+ *
+ * Doesn't block (the eventfd is non-blocking and in semaphore mode,
+ * so a read takes just one).
+ */
+static
+void __i2400m_report_uncount(struct i2400m *i2400m)
+{
+	uint64_t count;
+
+	if (read(i2400m->report_fd, &count, sizeof(count)) < 0
+	    && errno != EAGAIN)
+		wimaxll_msg(i2400m->wmx, "E: i2400m: cannot read report "
+			    "eventfd: %m\n");
+}
+
+
+/*
+ * Queue a report in the report ring and wake up a waiter
+ *
+ * Never blocks; if the ring is full (or the report too big for a
+ * slot), the report is dropped and counted.
+ *
+ * The report is counted in the eventfd before it is pushed, so the
+ * thread that pops it always finds its count to take.
+ */
+static
+void __i2400m_report_push(struct i2400m *i2400m,
+			  const void *data, size_t size)
+{
+	uint64_t one = 1;
+
+	if (write(i2400m->report_fd, &one, sizeof(one)) < 0)
+		wimaxll_msg(i2400m->wmx, "E: i2400m: cannot write report "
+			    "eventfd: %m\n");
+	if (wimaxll_ring_push(i2400m->report_ring, data, size) < 0) {
+		__i2400m_report_uncount(i2400m);
+		if (__sync_fetch_and_add(&i2400m->report_dropped, 1) == 0)
+			wimaxll_msg(i2400m->wmx, "W: i2400m: report ring "
+				    "full or report too big (%zu bytes); "
+				    "dropping\n", size);
+	}
+}
+
+
 /*
  * When a message comes with an ack or report, chew it
  *
  * Only takes messages on the default pipe, as that's where the device
  * passes them. Executes the callback for a command ack if it's
- * message type is the one that was waited for, otherwise they are
- * ignored.
+ * message type is the one that a command in flight is waiting for,
+ * otherwise they are ignored.
  *
- * The driver takes care of coordinating so that only one command is
- * executed at the same time.
+ * Commands whose deadline passed are expired first, so a late reply
+ * is not taken for them.
  *
- * If it is a report, just run the callback.
+ * If it is a report, run the handler set for its type (with its TLVs
+ * indexed) or, if there is none, the callback (or queue it in the
+ * report ring, if enabled).
  */
 static
 int i2400m_msg_to_user_cb(struct wimaxll_handle *wmx, void *_i2400m,
@@ -185,28 +510,50 @@ int i2400m_msg_to_user_cb(struct wimaxll_handle *wmx, void *_i2400m,
 	struct i2400m *i2400m = _i2400m;
 	const struct i2400m_l3l4_hdr *hdr = data;
 	enum i2400m_mt mt;
+	struct i2400m_cmd *cmd;
+	unsigned cnt;
+	int result;
+	struct i2400m_report_handler handler = { NULL, NULL }, *group;
+	struct i2400m_tlv_index idx;
 
-	if (pipe_name != NULL)
+	if (pipe_name != NULL || size < sizeof(*hdr))
 		goto out;
 
 	mt = wimaxll_le16_to_cpu(hdr->type);
 	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
 			     &i2400m->mutex);
 	pthread_mutex_lock(&i2400m->mutex);
-	if (mt == i2400m->mt_pending) {
-		i2400m->mt_pending = I2400M_MT_INVALID;
-		if (i2400m->mt_cb != NULL)
-			i2400m->mt_result = i2400m->mt_cb(
-				i2400m, i2400m->mt_cb_priv, data, size);
+	__i2400m_cmds_expire(i2400m);
+	for (cnt = 0; cnt < I2400M_CMDS_MAX; cnt++) {
+		cmd = &i2400m->cmd[cnt];
+		if (cmd->state != I2400M_CMD_PENDING || cmd->mt != mt)
+			continue;
+		if (cmd->cb != NULL)
+			result = cmd->cb(i2400m, cmd->cb_priv, data, size);
 		else
-			i2400m->mt_result = 0;
-		pthread_cond_signal(&i2400m->cond);
+			result = 0;
+		__i2400m_cmd_complete(cmd, result);
+		break;
+	}
+	if (mt & I2400M_MT_REPORT_MASK) {
+		group = i2400m->report_handler[
+			(mt >> 8) & (I2400M_REPORT_GROUPS - 1)];
+		if (group)
+			handler = group[mt & (I2400M_REPORT_GROUP_SIZE - 1)];
 	}
 	pthread_mutex_unlock(&i2400m->mutex);
 	pthread_cleanup_pop(0);
 	/* this is ran outside of the lock because it doesn't need
 	 * much tracking info. */
-	if (mt & I2400M_MT_REPORT_MASK && i2400m->report_cb)
+	if (!(mt & I2400M_MT_REPORT_MASK))
+		goto out;
+	if (handler.cb) {
+		/* On error, what could be indexed is still passed */
+		i2400m_tlv_index_build(&idx, hdr->pl, size - sizeof(*hdr));
+		handler.cb(i2400m, handler.priv, hdr, size, &idx);
+	} else if (i2400m->report_ring)
+		__i2400m_report_push(i2400m, data, size);
+	else if (i2400m->report_cb)
 		i2400m->report_cb(i2400m, data, size);
 out:
 	return 0;
@@ -217,11 +564,23 @@ static
 void __i2400m_create(struct i2400m *i2400m, 
 		    void *priv, i2400m_report_cb report_cb)
 {
+	unsigned cnt;
+	pthread_condattr_t cond_attr;
+
 	pthread_mutex_init(&i2400m->mutex, NULL);
-	pthread_cond_init(&i2400m->cond, NULL);
+	pthread_condattr_init(&cond_attr);
+	/* Deadlines are kept in CLOCK_MONOTONIC */
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&i2400m->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	pthread_mutex_init(&i2400m->tx_mutex, NULL);
 	i2400m->priv = priv;
 	i2400m->report_cb = report_cb;
-	i2400m->mt_pending = I2400M_MT_INVALID;
+	i2400m->report_fd = -1;
+	for (cnt = 0; cnt < I2400M_CMDS_MAX; cnt++) {
+		i2400m->cmd[cnt].i2400m = i2400m;
+		i2400m->cmd[cnt].mt = I2400M_MT_INVALID;
+	}
 
 	wimaxll_set_cb_msg_to_user(
 		i2400m->wmx, i2400m_msg_to_user_cb, i2400m);
@@ -319,18 +678,230 @@ error_calloc:
  */
 void i2400m_destroy(struct i2400m *i2400m)
 {
+	unsigned cnt;
+
 	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
 			     &i2400m->mutex);
 	pthread_mutex_lock(&i2400m->mutex);
-	i2400m->mt_result = -EINTR;
+	for (cnt = 0; cnt < I2400M_CMDS_MAX; cnt++)
+		if (i2400m->cmd[cnt].state == I2400M_CMD_PENDING)
+			__i2400m_cmd_complete(&i2400m->cmd[cnt], -EINTR);
 	pthread_cond_broadcast(&i2400m->cond);
 	pthread_mutex_unlock(&i2400m->mutex);
 	pthread_cleanup_pop(0);
 	wimaxll_close(i2400m->wmx);
+	if (i2400m->report_ring) {
+		wimaxll_ring_destroy(i2400m->report_ring);
+		close(i2400m->report_fd);
+	}
+	for (cnt = 0; cnt < I2400M_REPORT_GROUPS; cnt++)
+		free(i2400m->report_handler[cnt]);
 	free(i2400m);
 }
 
 
+/**
+ * Set the handler for a type of report
+ *
+ * @param i2400m i2400m handle
+ * @param mt report type (one of the I2400M_MT_REPORT_*)
+ * @param cb function to call when a report of type \e mt arrives;
+ *     NULL to remove the current one.
+ * @param priv private pointer to pass to \e cb
+ * @returns 0 if ok, < 0 errno code on error (-%EINVAL if \e mt is
+ *     not a report type).
+ *
+ * Reports with a handler are passed to it instead of to the report
+ * callback or the report ring; as the report callback, it runs in
+ * the thread that receives from the WiMAX handle and the same
+ * limitations apply (see i2400m_report_cb()).
+ *
+ * Can be called at any time, from any thread.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_report_handler_set(struct i2400m *i2400m, enum i2400m_mt mt,
+			      i2400m_report_handler_cb cb, void *priv)
+{
+	int result = 0;
+	struct i2400m_report_handler **group;
+
+	if (!(mt & I2400M_MT_REPORT_MASK) || mt == I2400M_MT_INVALID)
+		return -EINVAL;
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	group = &i2400m->report_handler[(mt >> 8) & (I2400M_REPORT_GROUPS - 1)];
+	if (*group == NULL) {
+		if (cb == NULL)
+			goto out;
+		*group = calloc(I2400M_REPORT_GROUP_SIZE, sizeof(**group));
+		if (*group == NULL) {
+			result = -ENOMEM;
+			goto out;
+		}
+	}
+	(*group)[mt & (I2400M_REPORT_GROUP_SIZE - 1)].cb = cb;
+	(*group)[mt & (I2400M_REPORT_GROUP_SIZE - 1)].priv = priv;
+out:
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	return result;
+}
+
+
+/**
+ * Queue reports for worker threads instead of calling the report
+ * callback
+ *
+ * @param i2400m i2400m handle
+ * @param slots how many reports can be queued (0 for a default);
+ *     when the ring is full, new reports are dropped (see
+ *     i2400m_report_dropped()).
+ * @param max_size max size of a report that can be queued (0 for a
+ *     default large enough for any L3/L4 report); bigger ones are
+ *     dropped.
+ * @returns 0 if ok, < 0 errno code on error (-%EEXIST if already
+ *     enabled).
+ *
+ * The report callback set at i2400m_create() time runs in the thread
+ * that receives from the WiMAX handle, so it can't issue commands or
+ * wait. With the report ring enabled, the receive path just copies
+ * each report into a preallocated slot of a lock-free ring (it never
+ * blocks on the consumers) and any number of worker threads can take
+ * them out with i2400m_report_pop(); from there, they are free to
+ * execute commands.
+ *
+ * Once enabled, the report callback is not called any more; the ring
+ * stays until i2400m_destroy().
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_report_ring_enable(struct i2400m *i2400m, unsigned slots,
+			      size_t max_size)
+{
+	int result, fd;
+	struct wimaxll_ring *ring;
+
+	if (i2400m->report_ring)
+		return -EEXIST;
+	result = -ENOMEM;
+	ring = wimaxll_ring_create(slots ? slots : I2400M_REPORT_RING_SLOTS,
+				   max_size ? max_size
+				   : I2400M_REPORT_RING_SIZE);
+	if (ring == NULL)
+		goto error_ring_create;
+	fd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (fd < 0) {
+		result = -errno;
+		goto error_eventfd;
+	}
+	/* Publish the ring only once it is fully set up; the fd is
+	 * set only by whoever wins, so a loser doesn't clobber it */
+	if (!__sync_bool_compare_and_swap(&i2400m->report_fd, -1, fd)) {
+		result = -EEXIST;
+		goto error_exists;
+	}
+	__sync_synchronize();
+	i2400m->report_ring = ring;
+	return 0;
+
+error_exists:
+	close(fd);
+error_eventfd:
+	wimaxll_ring_destroy(ring);
+error_ring_create:
+	return result;
+}
+
+
+/**
+ * Take the oldest report out of the report ring
+ *
+ * @param i2400m i2400m handle
+ * @param buf where to copy the report (in L3/L4 message format)
+ * @param size size of \e buf; it has to be at least as big as the
+ *     max report size given to i2400m_report_ring_enable() (4096
+ *     bytes by default).
+ * @param timeout_ms how long to wait for a report to arrive, in
+ *     milliseconds; -1 waits for ever, 0 doesn't wait.
+ * @returns size of the report, or < 0 errno code on error: -%EAGAIN
+ *     if there is no report (and \e timeout_ms is 0), -%ETIMEDOUT if
+ *     none arrived in time, -%EMSGSIZE if \e buf is too small and
+ *     -%EINVAL if the report ring is not enabled.
+ *
+ * Can be called from any number of threads at the same time; each
+ * report is returned only once.
+ *
+ * @ingroup i2400m_group
+ */
+ssize_t i2400m_report_pop(struct i2400m *i2400m, void *buf, size_t size,
+			  int timeout_ms)
+{
+	ssize_t result;
+	struct timespec deadline;
+
+	if (i2400m->report_ring == NULL)
+		return -EINVAL;
+	wimaxll_deadline_init(&deadline, timeout_ms);
+	while (1) {
+		result = wimaxll_ring_pop(i2400m->report_ring, buf, size);
+		if (result >= 0) {
+			/* Each report popped takes its count, so the
+			 * fd is readable only while there are any */
+			__i2400m_report_uncount(i2400m);
+			break;
+		}
+		if (result != -EAGAIN || timeout_ms == 0)
+			break;
+		/* Readable with the ring empty only for the moment a
+		 * report is being pushed or its count taken */
+		result = wimaxll_wait_fd(
+			i2400m->report_fd,
+			wimaxll_deadline_left(&deadline, timeout_ms));
+		if (result < 0)
+			break;
+	}
+	return result;
+}
+
+
+/**
+ * Return a file descriptor that can be polled for reports
+ *
+ * @param i2400m i2400m handle
+ * @returns file descriptor, -%EINVAL if the report ring is not
+ *     enabled.
+ *
+ * The descriptor is readable while there are reports queued in the
+ * report ring; take them with i2400m_report_pop() with a zero
+ * timeout (each report popped clears its part of the readiness).
+ * Don't read from it.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_report_fd(struct i2400m *i2400m)
+{
+	if (i2400m->report_ring == NULL)
+		return -EINVAL;
+	return i2400m->report_fd;
+}
+
+
+/**
+ * Return how many reports were dropped because the report ring was
+ * full
+ *
+ * @param i2400m i2400m handle
+ *
+ * @ingroup i2400m_group
+ */
+unsigned long i2400m_report_dropped(struct i2400m *i2400m)
+{
+	return i2400m->report_dropped;
+}
+
+
 /**
  * Return the private data associated to a \e i2400m
  *
@@ -359,8 +930,263 @@ struct wimaxll_handle * i2400m_wmx(struct i2400m *i2400m)
 }
 
 
+/*
+ * Register a command in the command table and send it to the device
+ *
+ * If \e wait_for_slot is set, block until the command can be
+ * registered (a spot in the table is free and no other command is
+ * waiting for the same reply type) or the timeout expires (then fail
+ * with -ETIMEDOUT); otherwise fail with -EBUSY.
+ */
+static
+int __i2400m_msg_to_dev_submit(struct i2400m *i2400m,
+			       const struct i2400m_l3l4_hdr *l3l4,
+			       size_t l3l4_size,
+			       i2400m_reply_cb cb, void *cb_priv,
+			       int timeout_ms, int wait_for_slot,
+			       unsigned *ticket)
+{
+	int result;
+	enum i2400m_mt msg_type;
+	struct i2400m_cmd *cmd = NULL;
+	unsigned generation = 0;
+	struct timespec deadline;
+
+	msg_type = wimaxll_le16_to_cpu(l3l4->type);
+	wimaxll_deadline_init(&deadline, timeout_ms);
+	/* No need to check msg & payload consistency, the kernel will do for us */
+	/* Setup the slot in the command table ("we are waiting")
+	 * and send the message to the device */
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	while (1) {
+		__i2400m_cmds_expire(i2400m);
+		result = __i2400m_cmd_alloc(i2400m, msg_type, &cmd);
+		if (result != -EBUSY || !wait_for_slot)
+			break;
+		if (timeout_ms < 0)
+			pthread_cond_wait(&i2400m->cond, &i2400m->mutex);
+		else if (pthread_cond_timedwait(&i2400m->cond, &i2400m->mutex,
+						&deadline) == ETIMEDOUT) {
+			result = -ETIMEDOUT;
+			break;
+		}
+	}
+	if (result == 0) {
+		cmd->cb = cb;
+		cmd->cb_priv = cb_priv;
+		cmd->result = -EINPROGRESS;
+		cmd->detached = ticket == NULL;
+		cmd->has_deadline = timeout_ms >= 0;
+		cmd->deadline = deadline;
+		generation = cmd->generation;
+		if (ticket)
+			*ticket = generation << I2400M_TICKET_IDX_BITS
+				| (cmd - i2400m->cmd);
+	}
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	if (result < 0)
+		goto error_cmd_alloc;
+
+	/* The mutex is not held while writing, so the RX side can
+	 * keep completing other commands. */
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->tx_mutex);
+	pthread_mutex_lock(&i2400m->tx_mutex);
+	result = wimaxll_msg_write(i2400m->wmx, NULL, l3l4, l3l4_size);
+	pthread_mutex_unlock(&i2400m->tx_mutex);
+	pthread_cleanup_pop(0);
+	if (result < 0) {
+		/* Not sent, no reply will come; drop the slot (unless
+		 * it was already reused) */
+		pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+				     &i2400m->mutex);
+		pthread_mutex_lock(&i2400m->mutex);
+		if (cmd->state != I2400M_CMD_FREE
+		    && cmd->generation == generation)
+			__i2400m_cmd_free(cmd);
+		pthread_mutex_unlock(&i2400m->mutex);
+		pthread_cleanup_pop(0);
+	}
+error_cmd_alloc:
+	return result;
+}
+
+
 /**
- * Execute an i2400m command and wait for a response
+ * Submit an i2400m command without waiting for the response
+ *
+ * @param i2400m i2400m handle
+ *
+ * @param l3l4 Pointer to buffer containing a L3L4 message to send to
+ *     the device.
+ *
+ * @param l3l4_size size of the buffer pointed to by \e l3l4 (this
+ *     includes the message header and the TLV payloads, if any)
+ *
+ * @param cb Callback function to execute when the reply is received.
+ *
+ * @param cb_priv Private pointer to pass to the callback function.
+ *
+ * @param timeout_ms How long to wait for the reply (in milliseconds)
+ *     before giving up on it; -1 to wait forever.
+ *
+ * @param ticket Where to store the ticket that identifies the
+ *     command, to use with i2400m_ticket_wait() or
+ *     i2400m_ticket_cancel(). If NULL, nobody will wait for the
+ *     command and its resources are released as soon as the reply
+ *     arrives (after executing \e cb) or the timeout expires.
+ *
+ * @returns 0 if the command was sent to the device, < 0 errno code
+ *     on error. -%EBUSY if a command with the same message type is
+ *     already waiting for a reply or too many commands are in
+ *     flight.
+ *
+ * Once a command has been submitted, i2400m_ticket_wait() has to be
+ * called to collect its result (or i2400m_ticket_cancel() to throw
+ * it away); until then it uses one of the slots for commands in
+ * flight.
+ *
+ * Commands are matched to their replies by message type, so only one
+ * command of each type can be in flight at the same time. A reply
+ * that arrives after its command timed out or was cancelled is
+ * ignored, unless a new command of the same type was sent in the
+ * meantime; then it is taken as the reply to the new one.
+ *
+ * @note
+ *
+ * Replies are processed (and \e cb called) from the thread that
+ * calls wimaxll_recv() on the libwimaxll handle; the same
+ * restrictions as for i2400m_msg_to_dev() callbacks apply.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_msg_to_dev_async(struct i2400m *i2400m,
+			    const struct i2400m_l3l4_hdr *l3l4,
+			    size_t l3l4_size,
+			    i2400m_reply_cb cb, void *cb_priv,
+			    int timeout_ms, unsigned *ticket)
+{
+	return __i2400m_msg_to_dev_submit(i2400m, l3l4, l3l4_size,
+					  cb, cb_priv, timeout_ms, 0, ticket);
+}
+
+
+/*
+ * Drop a command if the thread waiting for it is cancelled
+ */
+struct i2400m_ticket_wait_ctx {
+	struct i2400m *i2400m;
+	unsigned ticket;
+};
+
+static
+void i2400m_ticket_wait_cleanup(void *_ctx)
+{
+	struct i2400m_ticket_wait_ctx *ctx = _ctx;
+	struct i2400m_cmd *cmd;
+
+	cmd = __i2400m_ticket_cmd(ctx->i2400m, ctx->ticket);
+	if (cmd != NULL)
+		__i2400m_cmd_free(cmd);
+}
+
+
+/**
+ * Wait for a command submitted with i2400m_msg_to_dev_async()
+ *
+ * @param i2400m i2400m handle
+ *
+ * @param ticket Ticket returned by i2400m_msg_to_dev_async()
+ *
+ * @returns Value returned by the reply callback (or 0 if there was
+ *     none); -%ETIMEDOUT if the reply didn't arrive before the
+ *     deadline given at submission time; -%EINTR if the handle was
+ *     destroyed, -%ECANCELED if the command was cancelled while
+ *     waiting and -%ENOENT if the ticket is not valid (was already
+ *     collected).
+ *
+ * Blocks until the reply for the command arrives or its deadline
+ * passes. The ticket is not valid after this returns.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_ticket_wait(struct i2400m *i2400m, unsigned ticket)
+{
+	int result;
+	struct i2400m_cmd *cmd;
+	struct i2400m_ticket_wait_ctx ctx = {
+		.i2400m = i2400m, .ticket = ticket
+	};
+
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	pthread_cleanup_push(i2400m_ticket_wait_cleanup, &ctx);
+	cmd = __i2400m_ticket_cmd(i2400m, ticket);
+	result = -ENOENT;
+	while (cmd != NULL && cmd->state == I2400M_CMD_PENDING) {
+		result = -ECANCELED;
+		if (cmd->has_deadline) {
+			if (pthread_cond_timedwait(&i2400m->cond,
+						   &i2400m->mutex,
+						   &cmd->deadline) == ETIMEDOUT)
+				__i2400m_cmds_expire(i2400m);
+		} else
+			pthread_cond_wait(&i2400m->cond, &i2400m->mutex);
+		cmd = __i2400m_ticket_cmd(i2400m, ticket);
+	}
+	if (cmd != NULL) {
+		result = cmd->result;
+		__i2400m_cmd_free(cmd);
+	}
+	pthread_cleanup_pop(0);
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	return result;
+}
+
+
+/**
+ * Cancel a command submitted with i2400m_msg_to_dev_async()
+ *
+ * @param i2400m i2400m handle
+ *
+ * @param ticket Ticket returned by i2400m_msg_to_dev_async()
+ *
+ * @returns 0 if ok, -%ENOENT if the ticket is not valid.
+ *
+ * Stops waiting for the reply to the command, frees its slot and
+ * invalidates the ticket. The command itself has already been sent
+ * to the device, so it can't be undone; if the reply arrives later,
+ * it is ignored. Anybody blocked in i2400m_ticket_wait() on the
+ * ticket gets -%ECANCELED.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_ticket_cancel(struct i2400m *i2400m, unsigned ticket)
+{
+	int result = -ENOENT;
+	struct i2400m_cmd *cmd;
+
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+			     &i2400m->mutex);
+	pthread_mutex_lock(&i2400m->mutex);
+	cmd = __i2400m_ticket_cmd(i2400m, ticket);
+	if (cmd != NULL) {
+		__i2400m_cmd_free(cmd);
+		result = 0;
+	}
+	pthread_mutex_unlock(&i2400m->mutex);
+	pthread_cleanup_pop(0);
+	return result;
+}
+
+
+/**
+ * Execute an i2400m command and wait for a response, with a timeout
  *
  * @param i2400m i2400m handle
  *
@@ -374,15 +1200,24 @@ struct wimaxll_handle * i2400m_wmx(struct i2400m *i2400m)
  *
  * @param cb_priv Private pointer to pass to the callback function.
  *
+ * @param timeout_ms How long to wait (in milliseconds) for the
+ *     command to be executed (this includes waiting for other
+ *     commands of the same type to finish); -1 to wait forever.
+ *
+ * @returns Value returned by the reply callback (or 0 if there was
+ *     none); -%ETIMEDOUT if the reply didn't come in time; other
+ *     negative errno codes on error.
+ *
  * If the message execution fails in the device, the return value from
  * wimaxll_msg_write() will tell it. It can also be taken (with more
  * detail) by setting a callback function and parsing the reply.
  *
  * This call can be executed from multiple threads on the same \e
- * i2400m handle at the same time, as it will be mutexed properly and
- * only one will execute at the same time (likewise, the driver will
- * make sure only one command from different threads is ran at the
- * same time).
+ * i2400m handle at the same time; commands of different types will
+ * be in flight at the same time, while commands of the same type
+ * wait for the previous one to finish (likewise, the driver will make
+ * sure only one command from different threads is ran at the same
+ * time).
  *
  * @note
  *
@@ -393,40 +1228,60 @@ struct wimaxll_handle * i2400m_wmx(struct i2400m *i2400m)
  *
  * @ingroup i2400m_group
  */
-int i2400m_msg_to_dev(struct i2400m *i2400m,
-		      const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size,
-		      i2400m_reply_cb cb, void *cb_priv)
+int i2400m_msg_to_dev_timeout(struct i2400m *i2400m,
+			      const struct i2400m_l3l4_hdr *l3l4,
+			      size_t l3l4_size,
+			      i2400m_reply_cb cb, void *cb_priv,
+			      int timeout_ms)
 {
 	int result;
-	enum i2400m_mt msg_type;
+	unsigned ticket;
 
-	msg_type = wimaxll_le16_to_cpu(l3l4->type);
-	/* No need to check msg & payload consistency, the kernel will do for us */
-	/* Setup the completion, ack_skb ("we are waiting") and send
-	 * the message to the device */
-	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
-			     &i2400m->mutex);
-	pthread_mutex_lock(&i2400m->mutex);
-	i2400m->mt_pending = msg_type;
-	i2400m->mt_cb = cb;
-	i2400m->mt_cb_priv = cb_priv;
-	result = wimaxll_msg_write(i2400m->wmx, NULL, l3l4, l3l4_size);
-	if (result < 0)
-		goto error_msg_write;
 	/* The driver guarantees that either we get the response to
 	 * the command or only a notification, so we just need to wait
 	 * for the reply to come */
-#warning FIXME: _timeout?
-	pthread_cond_wait(&i2400m->cond, &i2400m->mutex);
-	result = i2400m->mt_result;
-error_msg_write:
-	i2400m->mt_pending = I2400M_MT_INVALID;
-	pthread_mutex_unlock(&i2400m->mutex);
-	pthread_cleanup_pop(0);
+	result = __i2400m_msg_to_dev_submit(i2400m, l3l4, l3l4_size,
+					    cb, cb_priv, timeout_ms, 1,
+					    &ticket);
+	if (result < 0)
+		goto error_submit;
+	result = i2400m_ticket_wait(i2400m, ticket);
+error_submit:
 	return result;
 }
 
 
+/**
+ * Execute an i2400m command and wait for a response
+ *
+ * @param i2400m i2400m handle
+ *
+ * @param l3l4 Pointer to buffer containing a L3L4 message to send to
+ *     the device.
+ *
+ * @param l3l4_size size of the buffer pointed to by \e l3l4 (this
+ *     includes the message header and the TLV payloads, if any)
+ *
+ * @param cb Callback function to execute when the reply is received.
+ *
+ * @param cb_priv Private pointer to pass to the callback function.
+ *
+ * Same as i2400m_msg_to_dev_timeout(), using the default timeout of
+ * the libwimaxll handle (see wimaxll_set_timeout()); by default,
+ * there is none.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_msg_to_dev(struct i2400m *i2400m,
+		      const struct i2400m_l3l4_hdr *l3l4, size_t l3l4_size,
+		      i2400m_reply_cb cb, void *cb_priv)
+{
+	return i2400m_msg_to_dev_timeout(i2400m, l3l4, l3l4_size, cb,
+					 cb_priv,
+					 wimaxll_get_timeout(i2400m->wmx));
+}
+
+
 /**
  * Return if a TLV is of a give type and size
  *
@@ -562,3 +1417,218 @@ const struct i2400m_tlv_hdr *i2400m_tlv_find(
 	}
 	return tlv;
 }
+
+
+/*
+ * Slot of the type hash of a TLV index where type \e type is (or
+ * would be).
+ */
+static
+unsigned __i2400m_tlv_index_slot(const struct i2400m_tlv_index *idx,
+				 unsigned type)
+{
+	unsigned slot = (type * 2654435761U) % I2400M_TLV_INDEX_HASH;
+
+	while (idx->hash[slot] != -1
+	       && idx->entry[idx->hash[slot]].type != type)
+		slot = (slot + 1) % I2400M_TLV_INDEX_HASH;
+	return slot;
+}
+
+
+/**
+ * Index a buffer of TLVs for fast lookup
+ *
+ * @param idx index to fill out (can be on the stack)
+ *
+ * @param tlv_buf pointer to the beginning of the TLV buffer
+ *
+ * @param buf_size buffer size in bytes
+ *
+ * @returns 0 if ok, < 0 errno code on error: -%EBADMSG if a TLV
+ *     doesn't fit in the buffer, -%E2BIG if there are more than
+ *     %I2400M_TLV_INDEX_ENTRIES TLVs. In both cases, the TLVs before
+ *     the problem are indexed and can be looked up.
+ *
+ * i2400m_tlv_find() walks (and validates) the buffer from the start
+ * in every call; when many TLVs are to be pulled out of the same
+ * buffer, it is cheaper to walk it once, validating and converting
+ * the headers and building a table of where each TLV type is:
+ *
+ * @code
+ * struct i2400m_tlv_index idx;
+ * const struct i2400m_tlv_entry *entry;
+ *
+ * r = i2400m_tlv_index_build(&idx, l3l4->pl, l3l4_size - sizeof(*l3l4));
+ * ...
+ * tlv = i2400m_tlv_index_get(&idx, I2400M_TLV_SOMETHING, -1);
+ * ...
+ * for (entry = i2400m_tlv_index_find(&idx, I2400M_TLV_REPEATED);
+ *      entry != NULL; entry = i2400m_tlv_index_next(&idx, entry))
+ * 	// do something with entry->tlv, entry->length
+ * @endcode
+ *
+ * Lookups then take constant time and TLVs of the same type are
+ * returned in the order they are in the buffer. Nested TLVs can be
+ * indexed with i2400m_tlv_index_build_nested().
+ *
+ * The index points into \e tlv_buf, so it is valid only as long as
+ * the buffer is.
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_tlv_index_build(struct i2400m_tlv_index *idx,
+			   const void *tlv_buf, size_t buf_size)
+{
+	int result = 0;
+	size_t offset = 0, length;
+	unsigned cnt, slot, type;
+	const struct i2400m_tlv_hdr *tlv;
+	struct i2400m_tlv_entry *entry;
+	short tail[I2400M_TLV_INDEX_HASH];
+
+	idx->count = 0;
+	for (cnt = 0; cnt < I2400M_TLV_INDEX_HASH; cnt++)
+		idx->hash[cnt] = -1;
+	while (offset < buf_size) {
+		tlv = tlv_buf + offset;
+		if (buf_size - offset < sizeof(*tlv)) {
+			wimaxll_msg(NULL,
+				    "HW BUG? tlv_buf %p [%zu bytes], tlv @%zu: "
+				    "short header\n", tlv_buf, buf_size, offset);
+			result = -EBADMSG;
+			break;
+		}
+		type = wimaxll_le16_to_cpu(tlv->type);
+		length = wimaxll_le16_to_cpu(tlv->length);
+		if (buf_size - offset < sizeof(*tlv) + length) {
+			wimaxll_msg(NULL,
+				    "HW BUG? tlv_buf %p [%zu bytes], "
+				    "tlv type 0x%04x @%zu: "
+				    "short data (%zu bytes vs %zu needed)\n",
+				    tlv_buf, buf_size, type, offset,
+				    buf_size - offset, sizeof(*tlv) + length);
+			result = -EBADMSG;
+			break;
+		}
+		if (idx->count >= I2400M_TLV_INDEX_ENTRIES) {
+			result = -E2BIG;
+			break;
+		}
+		entry = &idx->entry[idx->count];
+		entry->tlv = tlv;
+		entry->type = type;
+		entry->length = length;
+		entry->next = -1;
+		slot = __i2400m_tlv_index_slot(idx, type);
+		if (idx->hash[slot] == -1)	/* first of its type */
+			idx->hash[slot] = idx->count;
+		else
+			idx->entry[tail[slot]].next = idx->count;
+		tail[slot] = idx->count;
+		idx->count++;
+		offset += sizeof(*tlv) + length;
+	}
+	return result;
+}
+
+
+/**
+ * Index the TLVs nested inside a TLV
+ *
+ * @param idx index to fill out
+ *
+ * @param parent entry of the TLV whose payload is a buffer of TLVs,
+ *     as returned by i2400m_tlv_index_find() on the parent's index.
+ *
+ * @returns same as i2400m_tlv_index_build().
+ *
+ * @ingroup i2400m_group
+ */
+int i2400m_tlv_index_build_nested(struct i2400m_tlv_index *idx,
+				  const struct i2400m_tlv_entry *parent)
+{
+	return i2400m_tlv_index_build(idx, parent->tlv->pl, parent->length);
+}
+
+
+/**
+ * Find the first TLV of a type in an index
+ *
+ * @param idx index built with i2400m_tlv_index_build()
+ *
+ * @param tlv_type type of the TLV we are looking for
+ *
+ * @returns entry for the first TLV of the type (in buffer order) or
+ *     NULL if there are none. Use i2400m_tlv_index_next() for the
+ *     rest of that type.
+ *
+ * @ingroup i2400m_group
+ */
+const struct i2400m_tlv_entry *i2400m_tlv_index_find(
+	const struct i2400m_tlv_index *idx, enum i2400m_tlv tlv_type)
+{
+	short first = idx->hash[__i2400m_tlv_index_slot(idx, tlv_type)];
+
+	return first == -1 ? NULL : &idx->entry[first];
+}
+
+
+/**
+ * Return the next TLV of the same type in an index
+ *
+ * @param idx index built with i2400m_tlv_index_build()
+ *
+ * @param entry entry returned by i2400m_tlv_index_find() or a
+ *     previous call to this function
+ *
+ * @returns entry for the next TLV of the same type as \e entry, NULL
+ *     if there are no more.
+ *
+ * @ingroup i2400m_group
+ */
+const struct i2400m_tlv_entry *i2400m_tlv_index_next(
+	const struct i2400m_tlv_index *idx,
+	const struct i2400m_tlv_entry *entry)
+{
+	return entry->next == -1 ? NULL : &idx->entry[entry->next];
+}
+
+
+/**
+ * Find a TLV by type (and maybe length) in an index
+ *
+ * @param idx index built with i2400m_tlv_index_build()
+ *
+ * @param tlv_type type of the TLV we are looking for
+ *
+ * @param tlv_size expected size of the TLV we are looking for (if -1,
+ *     don't check the size). This includes the header
+ *
+ * @returns NULL if the TLV is not found, otherwise a pointer to
+ *     it. If the sizes don't match, an error is printed and NULL
+ *     returned.
+ *
+ * Same as i2400m_tlv_find(), but without walking the buffer.
+ *
+ * @ingroup i2400m_group
+ */
+const struct i2400m_tlv_hdr *i2400m_tlv_index_get(
+	const struct i2400m_tlv_index *idx,
+	enum i2400m_tlv tlv_type, ssize_t tlv_size)
+{
+	const struct i2400m_tlv_entry *entry;
+
+	for (entry = i2400m_tlv_index_find(idx, tlv_type); entry != NULL;
+	     entry = i2400m_tlv_index_next(idx, entry)) {
+		if (tlv_size == -1
+		    || entry->length + sizeof(*entry->tlv) == tlv_size)
+			return entry->tlv;
+		wimaxll_msg(NULL,
+			    "TLV type 0x%04x found with size "
+			    "mismatch (%zu vs %zu needed)\n",
+			    tlv_type, entry->length + sizeof(*entry->tlv),
+			    tlv_size);
+	}
+	return NULL;
+}
@@ -37,11 +37,23 @@
 #ifndef __lib_internal_h__
 #define __lib_internal_h__
 
+/* WIMAXLL_LEAN changes the layout of some structures */
+#include <config.h>
+#include <pthread.h>
 #include <wimaxll.h>
 
 struct nl_msg;
 struct nlmsgerr;
 struct sockaddr_nl;
+struct nlmsghdr;
+struct timespec;
+struct wimaxll_rx_batch;
+struct wimaxll_rx_shared;
+struct wimaxll_ring;
+struct wimaxll_rx_waiter;
+struct wimaxll_rx_held;
+struct wimaxll_ack_wait;
+struct wimaxll_gnl_family;
 
 enum {
 #define __WIMAXLL_IFNAME_LEN 32
@@ -53,6 +65,119 @@ enum {
 };
 
 
+/*
+ * A pipe a handle has seen (see pipe.c)
+ *
+ * @name: pipe name (NULL for the default pipe)
+ * @hash: hash of @name
+ * @cb: callback for the messages to user on the pipe (NULL for the
+ *     handle's catch-all one)
+ * @priv: private pointer for @cb
+ */
+struct wimaxll_pipe {
+	char *name;
+	unsigned hash;
+	wimaxll_msg_to_user_cb_f cb;
+	void *priv;
+};
+
+
+/*
+ * Pipe names interned by a handle
+ *
+ * @mutex: protects the rest
+ * @pipe: pipes, indexed by ID (0 is the default pipe)
+ * @pipes: number of entries used in @pipe
+ * @pipes_size: number of entries allocated in @pipe
+ * @slot: open addressing hash table of the pipe names; each slot
+ *     holds an ID + 1 (0 if free)
+ * @slots: size of @slot (a power of two)
+ * @subscribed: number of pipes that have a callback
+ */
+struct wimaxll_pipe_table {
+	pthread_mutex_t mutex;
+	struct wimaxll_pipe *pipe;
+	unsigned pipes, pipes_size;
+	unsigned *slot;
+	unsigned slots;
+	unsigned subscribed;
+};
+
+
+/*
+ * Cached state of a device (see op-state-get.c)
+ *
+ * @mutex: protects the rest
+ * @max_age_ms: how long @state can be used (-1 forever); 0 if the
+ *     cache is disabled
+ * @valid: if @state can be used at all
+ * @state: last known state
+ * @ts: when @state was learnt (CLOCK_MONOTONIC)
+ * @generation: bumped every time @state or @valid change, so a
+ *     query to the kernel doesn't overwrite a newer notification
+ */
+struct wimaxll_state_cache {
+	pthread_mutex_t mutex;
+	int max_age_ms;
+	int valid;
+	enum wimax_st state;
+	struct timespec ts;
+	unsigned generation;
+};
+
+
+/*
+ * Socket requests are sent to the kernel over
+ *
+ * \internal
+ *
+ * @nlh: the socket. Its callbacks are set once, by
+ *     wimaxll_tx_cb_set(), to match the acks to the requests waiting
+ *     for them in @acks; don't change them.
+ * @mutex: protects the socket (sending and sequence numbers), @acks,
+ *     @reading and the TX message and batch of the handles using it.
+ * @cond: signalled when an ack arrives or the reader stops reading
+ * @reading: set while a thread is reading acks
+ * @acks: requests waiting for their acks
+ * @users: handles using it (protected by the lock in
+ *     wimaxll_tx_open()); more than one only in lean builds, where
+ *     all the handles share one.
+ */
+struct wimaxll_tx {
+	struct nl_handle *nlh;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int reading;
+	struct wimaxll_ack_wait *acks;
+	unsigned users;
+};
+
+
+/*
+ * Performance counters as kept in a handle
+ *
+ * \internal
+ *
+ * Lean builds don't keep the latency histograms, which are most of
+ * the size of struct wimaxll_stats (and so of a handle); this is the
+ * rest of it, laid out the same (wimaxll_stats_get() copies it and
+ * reports the histograms empty).
+ */
+#ifdef WIMAXLL_LEAN
+struct wimaxll_handle_stats {
+	unsigned long long rx_msgs, rx_bytes, rx_state_changes;
+	unsigned long long rx_other, rx_filtered, rx_parse_errors, rx_nomem;
+	unsigned long long rx_overruns;
+	unsigned long long tx_msgs, tx_bytes, tx_errors;
+	unsigned pipes;
+	unsigned long long pipe_overflow;
+	struct wimaxll_stats_pipe pipe[WIMAXLL_STATS_PIPES];
+};
+#else
+#define wimaxll_handle_stats wimaxll_stats
+#endif
+
+
 /**
  * A WiMax control pipe handle
  *
@@ -66,27 +191,113 @@ enum {
  * wimaxll_msg_write() and \c wimaxll_msg_read() at the same time in a
  * multithreaded environment, for example.
  *
+ * Each side has its own lock. Only one thread reads from each socket
+ * at the same time (the \e reader); the others wait on the side's
+ * condition variable for the reader to hand them what they want
+ * (acks by sequence number on TX, messages and state changes through
+ * \a rx_waiters on RX) or to stop reading so one of them can take
+ * over. See wimaxll_ack_wait() and wimaxll_rx_wait().
+ *
  * \param ifidx Interface Index (of the network interface); if 0, the
  *     interface name will be \c "any" and this means that this handle
  *     works for \e any WiMAX interface.
  * \param gnl_family_id Generic Netlink Family ID assigned to the
- *     device; we maintain it here (for each interface) because we
- *     want to discover it every time we open. This solves the case of
- *     the WiMAX modules being reloaded (and the ID changing) while
- *     this library is running; this way it takes only a new open when
- *     the new device is discovered.
- * \param mcg_id Id of the 'msg' multicast group
+ *     device; we maintain it here (for each interface) as it is
+ *     copied from the process-wide cache every time we open. If the
+ *     WiMAX modules are reloaded (and the ID changes) while this
+ *     library is running, the cache is dropped when the kernel
+ *     rejects the old ID; so it still takes only a new open when the
+ *     new device is discovered.
+ * \param mcg_id Id of the 'msg' multicast group; -1 while the WiMAX
+ *     stack is unregistered (see wimaxll_rx_unbind()).
  * \param name name of the wimax interface
  * \param priv Private pointer set with wimaxll_priv_set() or other
  *     accessors. Use wimaxll_priv_get() to access it.
- * \param nlh_tx handle for writing to the kernel.
- *     Internal note: You \b have \b to set the handlers for
- *     %NL_CB_VALID and nl_cb_err() callbacks, as each callsite will
- *     do it to suit their needs. See wimaxll_rfkill() for an
- *     example. Any other callback you are supposed to restore to what
- *     it was before.
+ * \param tx socket for writing to the kernel, with what is needed to
+ *     wait for the acks (see struct wimaxll_tx); in lean builds, all
+ *     the handles share one.
  * \param nlh_rx handle for reading from the kernel.
+ * \param mock the handle is a mock device's (see wimaxll_mock_create());
+ *     its sockets are socket pairs, so it has no multicast groups to
+ *     join.
+ * \param mock_overrun set by wimaxll_mock_overrun(); the next read
+ *     from \a nlh_rx fails with -ENOBUFS (see wimaxll_rx_mock_overrun()).
  * \param nl_rx_cb Callbacks for the nlh_rx handle
+ * \param rx_msg netlink message being currently dispatched by
+ *     wimaxll_gnl_cb() or, for the batch path, buffer of \a rx_batch
+ *     the event being dispatched was parsed from (only valid while
+ *     the callbacks run).
+ * \param rx_msg_lent if \a rx_msg is a buffer of \a rx_batch, its
+ *     flag to mark it lent by wimaxll_msg_read_borrow(); NULL
+ *     otherwise.
+ * \param rx_held netlink messages whose payload has been lent to
+ *     the user by wimaxll_msg_read_borrow(), one per thread; we hold
+ *     a reference to each until the thread receives again or calls
+ *     wimaxll_msg_release().
+ * \param tx_msg netlink message kept for sending requests (see
+ *     wimaxll_tx_msg_get()); it can hold \a tx_msg_size bytes.
+ * \param tx_msg_busy set while \a tx_msg is being used (protected,
+ *     as \a tx_msg and \a tx_batch, by \a tx->mutex)
+ * \param rx_mutex protects \a rx_waiters, \a rx_held and the
+ *     reader role (\a rx_reading, \a rx_reader).
+ * \param rx_cond signalled when a waiter is done or the RX reader
+ *     stops reading.
+ * \param rx_reading how many times the reader (\a rx_reader) has
+ *     taken the role (callbacks can receive again); 0 if nobody is
+ *     reading.
+ * \param rx_waiters threads waiting for a notification, in arrival
+ *     order (see wimaxll_rx_wait()).
+ * \param tx_batch buffer where wimaxll_msg_write_batch() builds the
+ *     messages it sends (\a tx_batch_size bytes); kept for reuse,
+ *     freed at wimaxll_close() time.
+ * \param rx_batch receive buffers for wimaxll_recv_batch(); allocated
+ *     the first time it is called, freed at wimaxll_close() time.
+ * \param timeout_ms default timeout for blocking calls (-1 for none);
+ *     see wimaxll_set_timeout().
+ * \param rx_shared if the handle was opened with
+ *     %WIMAXLL_OPEN_SHARED_RX, the RX socket it shares with other
+ *     handles (and \a nlh_rx points to it); NULL otherwise.
+ * \param rx_shared_next next handle in the list of handles sharing
+ *     \a rx_shared.
+ * \param rx_refs references taken by wimaxll_rx_handles_get() on
+ *     handles sharing \a rx_shared, so the callbacks can be run on
+ *     them without holding the lock.
+ * \param rx_closed wimaxll_close() was called on a handle sharing
+ *     \a rx_shared; if it still had \a rx_refs, the last
+ *     wimaxll_rx_handles_put() finishes closing it.
+ * \param rx_busy a callback of the handle returned -EBUSY while
+ *     another handle sharing \a rx_shared was receiving; the next
+ *     receive on the handle returns -EALREADY (see
+ *     wimaxll_rx_busy_take()).
+ *     The last three are protected by the shared RX sockets' lock.
+ * \param rx_pipe pipe whose messages to user the handle wants (see
+ *     wimaxll_set_rx_pipe_filter()); WIMAX_PIPE_ANY for all.
+ * \param pipes pipe names the handle has seen, with their callbacks
+ *     (see wimaxll_pipe_set_cb_msg_to_user()).
+ * \param stats performance counters (see wimaxll_stats_get()); in
+ *     lean builds, without the latency histograms.
+ * \param stats_mutex protects the message, byte and latency counters
+ *     in \a stats (and its table of pipes).
+ * \param capture where the handle's traffic is being saved to (see
+ *     wimaxll_capture_start()); NULL if not capturing.
+ * \param stch_coalesced_cb callback for coalesced state changes (see
+ *     wimaxll_set_cb_state_change_coalesced()); when set, it is used
+ *     instead of \a state_change_cb.
+ * \param stch_coalescing set while a receive function (on this
+ *     handle) is draining the socket, so state changes are held in
+ *     \a stch_log until it is empty.
+ * \param stch_ifidx device \a stch_log is for (for "any" handles)
+ * \param stch_old_state state before the first transition held
+ * \param stch_log transitions held for \a stch_coalesced_cb
+ * \param state_cache state of the device, when caching it (see
+ *     wimaxll_set_state_cache()).
+ * \param hotplug_cb callback for the device and the WiMAX stack
+ *     coming and going (see wimaxll_set_cb_hotplug()).
+ * \param nlh_link route netlink socket subscribed to link events,
+ *     while there is a \a hotplug_cb on a handle for a device; NULL
+ *     otherwise.
+ * \param link_buf buffer to read \a nlh_link into (allocated with
+ *     it).
  *
  * FIXME: add doc on callbacks
  */
@@ -96,21 +307,228 @@ struct wimaxll_handle {
 	char name[__WIMAXLL_IFNAME_LEN];
 	void *priv;
 
-	struct nl_handle *nlh_tx;
+	struct wimaxll_tx *tx;
 	struct nl_handle *nlh_rx;
+	int mock, mock_overrun;
 
 	wimaxll_msg_to_user_cb_f msg_to_user_cb;
 	void *msg_to_user_priv;
 
 	wimaxll_state_change_cb_f state_change_cb;
 	void *state_change_priv;
+
+	struct nl_msg *rx_msg;
+	int *rx_msg_lent;
+	struct wimaxll_rx_held *rx_held;
+
+	struct nl_msg *tx_msg;
+	size_t tx_msg_size;
+	int tx_msg_busy;
+
+	pthread_mutex_t rx_mutex;
+	pthread_cond_t rx_cond;
+	unsigned rx_reading;
+	pthread_t rx_reader;
+	struct wimaxll_rx_waiter *rx_waiters;
+
+	void *tx_batch;
+	size_t tx_batch_size;
+
+	struct wimaxll_rx_batch *rx_batch;
+
+	int timeout_ms;
+
+	struct wimaxll_rx_shared *rx_shared;
+	struct wimaxll_handle *rx_shared_next;
+	unsigned rx_refs;
+	int rx_closed;
+	int rx_busy;
+
+	char *rx_pipe;
+	struct wimaxll_pipe_table pipes;
+
+	struct wimaxll_handle_stats stats;
+	pthread_mutex_t stats_mutex;
+
+	struct wimaxll_capture *capture;
+
+	wimaxll_state_change_coalesced_cb_f stch_coalesced_cb;
+	void *stch_coalesced_priv;
+	int stch_coalescing;
+	unsigned stch_ifidx;
+	enum wimax_st stch_old_state;
+	struct wimaxll_state_log stch_log;
+
+	struct wimaxll_state_cache state_cache;
+
+	wimaxll_hotplug_cb_f hotplug_cb;
+	void *hotplug_priv;
+	struct nl_handle *nlh_link;
+	void *link_buf;
+};
+
+
+/*
+ * Request(s) waiting for the kernel to ack them
+ *
+ * @seq: sequence number of the first request
+ * @count: number of requests (with consecutive sequence numbers)
+ * @pending: how many haven't been acked yet
+ * @results: where to store the result of each (-EINPROGRESS until
+ *     acked)
+ * @next: next in the TX socket's list (wmx->tx->acks)
+ */
+struct wimaxll_ack_wait {
+	unsigned seq;
+	size_t count, pending;
+	int *results;
+	struct wimaxll_ack_wait *next;
+};
+
+
+/*
+ * Thread waiting for a notification (see wimaxll_rx_wait())
+ *
+ * @msg_to_user: if not NULL, offered each message to user (with the
+ *     ID of its pipe, -ENOENT if never seen, see
+ *     wimaxll_pipe_intern()); returns -EINPROGRESS if it doesn't
+ *     want it, anything else if it took it (then the message goes to
+ *     no one else).
+ * @state_change: if not NULL, called for each state change (which
+ *     is also delivered to the handle's callbacks).
+ * @done: set once the waiter took something
+ * @next: next in the handle's list (wmx->rx_waiters)
+ *
+ * The calls are done with wmx->rx_mutex held by the thread that is
+ * reading, so they just have to stash what they are given.
+ */
+struct wimaxll_rx_waiter {
+	int (*msg_to_user)(struct wimaxll_handle *,
+			   struct wimaxll_rx_waiter *, int,
+			   const char *, const void *, size_t);
+	void (*state_change)(struct wimaxll_handle *,
+			     struct wimaxll_rx_waiter *,
+			     enum wimax_st, enum wimax_st);
+	int done;
+	struct wimaxll_rx_waiter *next;
+};
+
+
+/*
+ * What a thread is dispatching notifications for
+ *
+ * @wmx: handle
+ * @ifidx: interface the notification is for
+ * @prev: outer dispatch (when a callback receives again)
+ *
+ * Kept in a per-thread stack, so wimaxll_ifidx() on an "any" handle
+ * returns the interface the callback running in that thread is for.
+ */
+struct wimaxll_dispatch {
+	const struct wimaxll_handle *wmx;
+	unsigned ifidx;
+	struct wimaxll_dispatch *prev;
 };
 
 
 /* Utilities */
-int wimaxll_wait_for_ack(struct wimaxll_handle *);
+int wimaxll_handle_init(struct wimaxll_handle *);
+void wimaxll_handle_release(struct wimaxll_handle *);
+struct wimaxll_tx *wimaxll_tx_alloc(void);
+void wimaxll_tx_free(struct wimaxll_tx *);
+int wimaxll_tx_open(struct wimaxll_handle *);
+void wimaxll_tx_close(struct wimaxll_handle *);
+void wimaxll_tx_cb_set(struct wimaxll_tx *);
+int wimaxll_ack_wait(struct wimaxll_handle *, struct wimaxll_ack_wait *,
+		     const struct timespec *, int);
+int wimaxll_send_wait_for_ack(struct wimaxll_handle *, struct nl_msg *, int);
+void wimaxll_deadline_init(struct timespec *, int);
+int wimaxll_deadline_left(const struct timespec *, int);
+int wimaxll_wait_fd(int, int);
+int wimaxll_cond_wait(pthread_cond_t *, pthread_mutex_t *,
+		      const struct timespec *, int);
+void wimaxll_dispatch_push(struct wimaxll_dispatch *,
+			   const struct wimaxll_handle *, unsigned);
+void wimaxll_dispatch_pop(struct wimaxll_dispatch *);
+ssize_t wimaxll_rx_wait(struct wimaxll_handle *, struct wimaxll_rx_waiter *,
+			int);
+int wimaxll_rx_reader_get(struct wimaxll_handle *,
+			  struct wimaxll_rx_waiter *,
+			  const struct timespec *, int);
+void wimaxll_rx_reader_put(struct wimaxll_handle *);
+int wimaxll_rx_waiting(struct wimaxll_handle *);
+int wimaxll_rx_waiters_msg(struct wimaxll_handle *, int, const char *,
+			   const void *, size_t);
+void wimaxll_rx_waiters_state_change(struct wimaxll_handle *,
+				     enum wimax_st, enum wimax_st);
+int wimaxll_rx_hold(struct wimaxll_handle *, struct nl_msg *);
+void wimaxll_rx_held_free(struct wimaxll_handle *);
+struct nl_msg *wimaxll_tx_msg_get(struct wimaxll_handle *, size_t);
+void wimaxll_tx_msg_put(struct wimaxll_handle *, struct nl_msg *);
+void wimaxll_tx_msg_free(struct wimaxll_handle *);
 int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *, struct nl_msg *);
+int wimaxll_msg_to_user_deliver(struct wimaxll_handle *, unsigned,
+				const char *, const void *, size_t);
 int wimaxll_gnl_handle_state_change(struct wimaxll_handle *, struct nl_msg *);
+int wimaxll_state_change_deliver(struct wimaxll_handle *, unsigned,
+				 enum wimax_st, enum wimax_st);
+int wimaxll_state_change_flush(struct wimaxll_handle *);
+void wimaxll_state_cache_update(struct wimaxll_handle *, enum wimax_st);
+void wimaxll_state_cache_seed(struct wimaxll_handle *, int, enum wimax_st,
+			      const struct timespec *);
+void wimaxll_state_cache_invalidate(struct wimaxll_handle *);
+void wimaxll_state_cache_rfkill(struct wimaxll_handle *, int);
+int wimaxll_gnl_parse_msg_to_user(struct wimaxll_handle *, struct nlmsghdr *,
+				  unsigned *, const char **,
+				  const void **, size_t *);
+int wimaxll_gnl_parse_state_change(struct wimaxll_handle *, struct nlmsghdr *,
+				   unsigned *, enum wimax_st *,
+				   enum wimax_st *);
+void wimaxll_rx_batch_free(struct wimaxll_handle *);
+void wimaxll_msg_batch_free(struct wimaxll_handle *);
+ssize_t wimaxll_rx_batch_dispatch(struct wimaxll_handle *);
+int wimaxll_event_dispatch(struct wimaxll_handle *,
+			   const struct wimaxll_event *);
+struct wimaxll_ring *wimaxll_ring_create(unsigned, size_t);
+void wimaxll_ring_destroy(struct wimaxll_ring *);
+int wimaxll_ring_push(struct wimaxll_ring *, const void *, size_t);
+ssize_t wimaxll_ring_pop(struct wimaxll_ring *, void *, size_t);
+int wimaxll_rx_filter_set(struct wimaxll_handle *, int,
+			  const unsigned *, size_t, const char *);
+int wimaxll_rx_filter_refresh(struct wimaxll_handle *);
+void wimaxll_rx_pipe_free(struct wimaxll_handle *);
+int wimaxll_gnl_peek_ifidx(struct nlmsghdr *, unsigned *);
+int wimaxll_pipe_match(const char *, const char *);
+unsigned wimaxll_names_hash(const char *, unsigned, size_t);
+int wimaxll_pipe_intern(struct wimaxll_handle *, const char *);
+int wimaxll_pipe_lookup(struct wimaxll_handle *, const char *,
+			wimaxll_msg_to_user_cb_f *, void **);
+void wimaxll_pipe_table_free(struct wimaxll_handle *);
+struct wimaxll_handle *wimaxll_rx_shared_demux(struct wimaxll_handle *,
+					       struct nlmsghdr *);
+int wimaxll_rx_overrun(struct wimaxll_handle *, struct wimaxll_event *);
+struct wimaxll_handle **wimaxll_rx_handles_get(struct wimaxll_handle **,
+					       size_t *);
+void wimaxll_rx_handles_put(struct wimaxll_handle **,
+			    struct wimaxll_handle **, size_t);
+int wimaxll_rx_handle_closed(struct wimaxll_handle *);
+void wimaxll_rx_busy_set(struct wimaxll_handle *);
+int wimaxll_rx_busy_take(struct wimaxll_handle *);
+void wimaxll_rx_handle_put(struct wimaxll_handle *);
+void wimaxll_rx_unbind(struct wimaxll_handle *);
+int wimaxll_rx_rebind(struct wimaxll_handle *,
+		      const struct wimaxll_gnl_family *);
+void wimaxll_rx_ifidx_set(struct wimaxll_handle *, unsigned);
+void wimaxll_hotplug_ctrl(struct wimaxll_handle *, struct nlmsghdr *);
+ssize_t wimaxll_hotplug_link_process(struct wimaxll_handle *);
+ssize_t wimaxll_hotplug_dispatch(struct wimaxll_handle *);
+void wimaxll_hotplug_release(struct wimaxll_handle *);
+void wimaxll_stats_rx(struct wimaxll_handle *, const char *, size_t);
+void wimaxll_stats_tx(struct wimaxll_handle *, const char *, size_t, int);
+void wimaxll_stats_ack(struct wimaxll_handle *, enum wimaxll_stats_op,
+		       const struct timespec *, int);
+void wimaxll_capture_record(struct wimaxll_handle *,
+			    const struct nlmsghdr *, int);
 int wimaxll_gnl_error_cb(struct sockaddr_nl *, struct nlmsgerr *, void *);
 int wimaxll_gnl_ack_cb(struct nl_msg *msg, void *_mch);
 
@@ -126,14 +544,130 @@ int wimaxll_family_id(struct wimaxll_handle *wmx)
 }
 
 
+/*
+ * wimaxll_rx_mock_overrun - Tell if a read has to fake an overflow
+ *
+ * @wmx: WiMAX handle about to read from its RX socket
+ *
+ * Returns !0 (once) after wimaxll_mock_overrun(); the read is then to
+ * fail with -ENOBUFS, as the kernel reports a receive buffer overflow
+ * before the notifications still queued.
+ */
+static inline
+int wimaxll_rx_mock_overrun(struct wimaxll_handle *wmx)
+{
+	return wmx->mock_overrun
+		&& __sync_bool_compare_and_swap(&wmx->mock_overrun, 1, 0);
+}
+
+
+/*
+ * wimaxll_capture - Record a message if the handle is capturing
+ *
+ * @wmx: WiMAX handle
+ * @nl_hdr: message
+ * @outbound: !0 if it is being sent to the kernel
+ *
+ * Lean builds have no capture support (capture.c is left out).
+ */
+static inline
+void wimaxll_capture(struct wimaxll_handle *wmx,
+		     const struct nlmsghdr *nl_hdr, int outbound)
+{
+#ifndef WIMAXLL_LEAN
+	if (wmx->capture)
+		wimaxll_capture_record(wmx, nl_hdr, outbound);
+#endif
+}
+
+
+/*
+ * pcapng format
+ *
+ * What wimaxll_capture_start() writes and wimaxll_mock_load() reads.
+ */
+enum {
+	PCAPNG_SHB = 0x0a0d0d0a,
+	PCAPNG_IDB = 0x00000001,
+	PCAPNG_EPB = 0x00000006,
+	PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d,
+	PCAPNG_OPT_END = 0,
+	PCAPNG_OPT_IF_NAME = 2,
+	PCAPNG_OPT_EPB_FLAGS = 2,
+	PCAPNG_EPB_FLAGS_INBOUND = 1,
+	PCAPNG_EPB_FLAGS_OUTBOUND = 2,
+
+	LINKTYPE_NETLINK = 253,
+	/* Linux cooked header values (see packet(7)) */
+	WIMAXLL_CAPTURE_PACKET_HOST = 0,
+	WIMAXLL_CAPTURE_PACKET_OUTGOING = 4,
+	WIMAXLL_CAPTURE_ARPHRD_NETLINK = 824,
+};
+
+
+/* pcapng blocks and options are padded to 32 bits */
+#define PCAPNG_ALIGN(size) (((size) + 3) & ~3)
+
+struct pcapng_block_hdr {
+	__u32 type;
+	__u32 len;
+};
+
+struct pcapng_shb {
+	struct pcapng_block_hdr hdr;
+	__u32 magic;
+	__u16 major, minor;
+	__s64 section_len;
+} __attribute__((packed));
+
+struct pcapng_idb {
+	struct pcapng_block_hdr hdr;
+	__u16 link_type, reserved;
+	__u32 snap_len;
+} __attribute__((packed));
+
+struct pcapng_opt {
+	__u16 code, len;
+};
+
+struct pcapng_epb {
+	struct pcapng_block_hdr hdr;
+	__u32 if_id;
+	__u32 ts_high, ts_low;
+	__u32 cap_len, len;
+} __attribute__((packed));
+
+/* Header nlmon captures are prefixed with (all big endian) */
+struct wimaxll_capture_cooked_hdr {
+	__u16 pkt_type;
+	__u16 ha_type;
+	__u16 ha_len;
+	__u8 ha[8];
+	__u16 protocol;
+} __attribute__((packed));
+
+
 void wimaxll_msg(struct wimaxll_handle *, const char *fmt, ...)
 	__attribute__ ((format(printf, 2, 3)));
 
 /* Generic Netlink utilities */
 
-int nl_get_multicast_groups(struct nl_handle *, const char *,
-			    void (*cb)(void *, const char *, int),
-			    void *);
-int genl_ctrl_get_version(struct nl_handle *, const char *);
+/*
+ * Generic netlink information of the WiMAX family
+ *
+ * @id: family ID
+ * @mcg_id: ID of the 'msg' multicast group (-1 if none)
+ * @version: version of the interface (see include/linux/wimax.h)
+ */
+struct wimaxll_gnl_family {
+	int id;
+	int mcg_id;
+	int version;
+};
+
+int wimaxll_gnl_family_get(struct nl_handle *, struct wimaxll_gnl_family *);
+void wimaxll_gnl_family_invalidate(int);
+int wimaxll_gnl_ctrl_mcg_get(struct nl_handle *);
+int wimaxll_gnl_family_notify(struct nlmsghdr *, struct wimaxll_gnl_family *);
 
 #endif /* #ifndef __lib_internal_h__ */
@@ -0,0 +1,545 @@
+/*
+ * Linux WiMax
+ * Asynchronous diagnostics sink
+ *
+ *
+ * Copyright (C) 2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * wimaxll_vlmsg_default() writes to stderr from the thread that
+ * generated the message, so if stderr is slow (eg: a pipe to a log
+ * collector that is backed up) so is that thread--which might be the
+ * one receiving from the kernel.
+ *
+ * wimaxll_vlmsg_async() is a sink that instead formats the message
+ * into a preallocated lock-free queue and returns; the queue is
+ * written out to the destination file descriptor by a background
+ * thread or, when integrated in a poll() loop, by calling
+ * wimaxll_log_async_flush() when wimaxll_log_async_fd() is readable:
+ *
+ * @code
+ * wimaxll_log_async_start(2, 0, 1);
+ * wimaxll_vlmsg_cb = wimaxll_vlmsg_async;
+ * ...
+ * wimaxll_open(BLAH);
+ * @endcode
+ *
+ * Messages that don't fit in the queue are dropped; so are messages
+ * from a single site (identified by their format string) that are
+ * repeated more than a number of times in an interval (see
+ * wimaxll_log_async_ratelimit()); when the interval passes, a note of
+ * how many were suppressed is logged. wimaxll_log_async_stats()
+ * returns the drop counters.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#define W_VERBOSITY W_ERROR
+#include <wimaxll/log.h>
+#include "internal.h"
+
+
+enum {
+	/* Max size of a message, header included */
+	WIMAXLL_LOG_ASYNC_MSG_SIZE = 512,
+	WIMAXLL_LOG_ASYNC_SLOTS = 128,
+	/* Number of message sites to rate limit */
+	WIMAXLL_LOG_ASYNC_SITES = 128,
+};
+
+
+/*
+ * A queued message
+ *
+ * \param level message level (W_PRINT goes to stdout)
+ * \param text formatted message (header included), not NUL
+ *     terminated.
+ */
+struct wimaxll_log_async_msg {
+	unsigned level;
+	char text[WIMAXLL_LOG_ASYNC_MSG_SIZE];
+};
+
+
+/*
+ * Rate limiting information for a message site
+ *
+ * \param fmt format string of the site (NULL if unused)
+ * \param window when the current interval started (in ms)
+ * \param count number of messages in the current interval
+ * \param suppressed number of messages dropped in the current
+ *     interval
+ */
+struct wimaxll_log_async_site {
+	const char *volatile fmt;
+	volatile unsigned long window;
+	volatile unsigned count;
+	volatile unsigned suppressed;
+};
+
+
+/*
+ * Sink state (there is only one, as there is only one
+ * wimaxll_vlmsg_cb)
+ *
+ * \param ring queued messages
+ * \param fd where to write the messages to
+ * \param efd eventfd that is readable when there are messages
+ *     queued
+ * \param pending !0 if efd has been signalled and not flushed yet
+ * \param thread background thread flushing the queue (if
+ *     has_thread)
+ * \param stop tells the background thread to exit
+ * \param flush_mutex serializes the flushers
+ * \param burst max messages per site and interval (0 for no limit)
+ * \param interval_ms rate limit interval
+ */
+static struct wimaxll_log_async {
+	struct wimaxll_ring *ring;
+	int fd, efd;
+	volatile int pending;
+	pthread_t thread;
+	int has_thread;
+	volatile int stop;
+	pthread_mutex_t flush_mutex;
+	unsigned burst, interval_ms;
+	unsigned long dropped, ratelimited;
+	struct wimaxll_log_async_site site[WIMAXLL_LOG_ASYNC_SITES];
+} wimaxll_log_async = {
+	.fd = -1,
+	.efd = -1,
+	.flush_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.burst = 10,
+	.interval_ms = 1000,
+};
+
+
+static
+unsigned long wimaxll_log_async_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+
+static
+void wimaxll_log_async_kick(struct wimaxll_log_async *la)
+{
+	uint64_t one = 1;
+
+	if (__sync_lock_test_and_set(&la->pending, 1) == 0)
+		if (write(la->efd, &one, sizeof(one)) < 0)
+			la->pending = 0;
+}
+
+
+static
+void wimaxll_log_async_push(struct wimaxll_log_async *la,
+			    struct wimaxll_log_async_msg *msg, size_t size)
+{
+	if (wimaxll_ring_push(la->ring, msg,
+			      offsetof(struct wimaxll_log_async_msg, text)
+			      + size) < 0) {
+		__sync_fetch_and_add(&la->dropped, 1);
+		return;
+	}
+	wimaxll_log_async_kick(la);
+}
+
+
+/*
+ * Find (or claim) the rate limiting slot for a site
+ *
+ * Returns NULL if the table is full (then the site is not limited).
+ */
+static
+struct wimaxll_log_async_site *wimaxll_log_async_site(
+	struct wimaxll_log_async *la, const char *fmt)
+{
+	struct wimaxll_log_async_site *site;
+	unsigned cnt, idx;
+
+	idx = ((uintptr_t) fmt >> 3) * 2654435761u;
+	for (cnt = 0; cnt < WIMAXLL_LOG_ASYNC_SITES; cnt++) {
+		site = &la->site[(idx + cnt) % WIMAXLL_LOG_ASYNC_SITES];
+		if (site->fmt == fmt)
+			return site;
+		if (site->fmt == NULL
+		    && __sync_bool_compare_and_swap(&site->fmt, NULL, fmt))
+			return site;
+		if (site->fmt == fmt)
+			return site;
+	}
+	return NULL;
+}
+
+
+/*
+ * Decide if a message has to be suppressed
+ *
+ * Returns !0 if so. When a new interval starts, queues a note of how
+ * many messages from the site were suppressed in the last one.
+ *
+ * The counters are updated without locks, so with many threads
+ * logging from the same site, the limit is approximate.
+ */
+static
+int wimaxll_log_async_limit(struct wimaxll_log_async *la, const char *fmt)
+{
+	struct wimaxll_log_async_site *site;
+	struct wimaxll_log_async_msg msg;
+	unsigned long now, window;
+	unsigned suppressed;
+	int size;
+
+	if (la->burst == 0)
+		return 0;
+	site = wimaxll_log_async_site(la, fmt);
+	if (site == NULL)
+		return 0;
+	now = wimaxll_log_async_now();
+	window = site->window;
+	if (now - window >= la->interval_ms
+	    && __sync_bool_compare_and_swap(&site->window, window, now)) {
+		site->count = 0;
+		suppressed = __sync_lock_test_and_set(&site->suppressed, 0);
+		if (suppressed > 0) {
+			msg.level = W_WARN;
+			size = snprintf(msg.text, sizeof(msg.text),
+					"libwimaxll: W: %u messages "
+					"suppressed: %s", suppressed, fmt);
+			if (size >= sizeof(msg.text))
+				size = sizeof(msg.text) - 1;
+			if (msg.text[size - 1] != '\n')
+				msg.text[size++] = '\n';
+			wimaxll_log_async_push(la, &msg, size);
+		}
+	}
+	if (__sync_fetch_and_add(&site->count, 1) < la->burst)
+		return 0;
+	__sync_fetch_and_add(&site->suppressed, 1);
+	__sync_fetch_and_add(&la->ratelimited, 1);
+	return 1;
+}
+
+
+/**
+ * Deliver \e libwimaxll diagnostics messages to a queue
+ *
+ * \param wmx WiMAX handle this message is related to
+ * \param level Message level
+ * \param header Header for the message
+ * \param fmt printf-like format
+ * \param vargs variable-argument list as created by
+ *     stdargs.h:va_list() that will be formatted according to \e
+ *     fmt.
+ *
+ * Set \ref wimaxll_vlmsg_cb to this function to have messages
+ * formatted into a lock-free queue instead of written; they are
+ * written out by wimaxll_log_async_flush() (or the background thread
+ * started by wimaxll_log_async_start()). Never blocks; messages
+ * that don't fit in the queue or are rate limited are dropped.
+ *
+ * As with wimaxll_vlmsg_default(), W_PRINT messages go to \e stdout
+ * without the header, the rest to the file descriptor given to
+ * wimaxll_log_async_start().
+ *
+ * If wimaxll_log_async_start() hasn't been called, falls back to
+ * wimaxll_vlmsg_default().
+ *
+ * \ingroup helper_log
+ */
+void wimaxll_vlmsg_async(struct wimaxll_handle *wmx, unsigned level,
+			 const char *header,
+			 const char *fmt, va_list vargs)
+{
+	struct wimaxll_log_async *la = &wimaxll_log_async;
+	struct wimaxll_log_async_msg msg;
+	int size = 0, result;
+
+	if (la->ring == NULL) {
+		wimaxll_vlmsg_default(wmx, level, header, fmt, vargs);
+		return;
+	}
+	if (wimaxll_log_async_limit(la, fmt))
+		return;
+	msg.level = level;
+	if (level != W_PRINT) {
+		size = snprintf(msg.text, sizeof(msg.text), "%s", header);
+		if (size >= sizeof(msg.text))
+			size = sizeof(msg.text) - 1;
+	}
+	result = vsnprintf(msg.text + size, sizeof(msg.text) - size,
+			   fmt, vargs);
+	if (result < 0)
+		return;
+	size += result;
+	if (size >= sizeof(msg.text))	/* truncated */
+		size = sizeof(msg.text) - 1;
+	wimaxll_log_async_push(la, &msg, size);
+}
+
+
+static
+void wimaxll_log_async_write(int fd, const char *buf, size_t size)
+{
+	ssize_t result;
+
+	while (size > 0) {
+		result = write(fd, buf, size);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			__sync_fetch_and_add(&wimaxll_log_async.dropped, 1);
+			break;
+		}
+		buf += result;
+		size -= result;
+	}
+}
+
+
+/**
+ * Write out the queued diagnostics messages
+ *
+ * \return number of messages written, -%ENODEV if
+ *     wimaxll_log_async_start() hasn't been called.
+ *
+ * Call when wimaxll_log_async_fd() is readable (if no background
+ * thread was started). Messages that fail to be written (eg: if the
+ * destination file descriptor is non-blocking and full) are counted
+ * as dropped.
+ *
+ * \ingroup helper_log
+ */
+ssize_t wimaxll_log_async_flush(void)
+{
+	struct wimaxll_log_async *la = &wimaxll_log_async;
+	struct wimaxll_log_async_msg msg;
+	ssize_t result, count = 0;
+	uint64_t val;
+
+	if (la->ring == NULL)
+		return -ENODEV;
+	pthread_mutex_lock(&la->flush_mutex);
+	/* Clear before draining, so a push that happens while we do
+	 * signals again */
+	if (read(la->efd, &val, sizeof(val)) < 0)
+		val = 0;
+	__sync_lock_release(&la->pending);
+	while ((result = wimaxll_ring_pop(la->ring, &msg, sizeof(msg))) > 0) {
+		wimaxll_log_async_write(msg.level == W_PRINT ? 1 : la->fd,
+					msg.text, result
+					- offsetof(struct wimaxll_log_async_msg,
+						   text));
+		count++;
+	}
+	pthread_mutex_unlock(&la->flush_mutex);
+	return count;
+}
+
+
+static
+void *wimaxll_log_async_thread(void *priv)
+{
+	struct wimaxll_log_async *la = priv;
+	struct pollfd pfd;
+
+	pfd.fd = la->efd;
+	pfd.events = POLLIN;
+	while (!la->stop) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		wimaxll_log_async_flush();
+	}
+	return NULL;
+}
+
+
+/**
+ * Start queueing diagnostics messages
+ *
+ * \param fd file descriptor where to write the messages (other than
+ *     W_PRINT, that go to \e stdout).
+ * \param slots max number of messages queued (0 for the default,
+ *     128); rounded up to a power of two.
+ * \param thread !0 to start a thread that writes out the messages
+ *     as they are queued; otherwise the caller is responsible for
+ *     calling wimaxll_log_async_flush() when wimaxll_log_async_fd()
+ *     is readable.
+ * \return 0 if ok, -%EBUSY if already started, a negative errno
+ *     code otherwise.
+ *
+ * Then set \ref wimaxll_vlmsg_cb to wimaxll_vlmsg_async().
+ *
+ * \ingroup helper_log
+ */
+int wimaxll_log_async_start(int fd, unsigned slots, int thread)
+{
+	int result;
+	struct wimaxll_log_async *la = &wimaxll_log_async;
+
+	if (la->ring != NULL)
+		return -EBUSY;
+	la->fd = fd;
+	la->efd = eventfd(0, EFD_NONBLOCK);
+	if (la->efd < 0) {
+		result = -errno;
+		goto error_eventfd;
+	}
+	la->ring = wimaxll_ring_create(
+		slots ? slots : WIMAXLL_LOG_ASYNC_SLOTS,
+		sizeof(struct wimaxll_log_async_msg));
+	result = -ENOMEM;
+	if (la->ring == NULL)
+		goto error_ring_create;
+	la->stop = 0;
+	la->has_thread = 0;
+	if (thread) {
+		result = -pthread_create(&la->thread, NULL,
+					 wimaxll_log_async_thread, la);
+		if (result < 0)
+			goto error_pthread_create;
+		la->has_thread = 1;
+	}
+	return 0;
+
+error_pthread_create:
+	wimaxll_ring_destroy(la->ring);
+	la->ring = NULL;
+error_ring_create:
+	close(la->efd);
+	la->efd = -1;
+error_eventfd:
+	return result;
+}
+
+
+/**
+ * Stop queueing diagnostics messages
+ *
+ * Writes out the messages still queued and stops the background
+ * thread, if any. \ref wimaxll_vlmsg_cb should be set back to another
+ * sink before (or wimaxll_vlmsg_async() will fall back to
+ * wimaxll_vlmsg_default()); no other thread can be logging when this
+ * is called.
+ *
+ * \ingroup helper_log
+ */
+void wimaxll_log_async_stop(void)
+{
+	struct wimaxll_log_async *la = &wimaxll_log_async;
+	struct wimaxll_ring *ring;
+	uint64_t one = 1;
+
+	if (la->ring == NULL)
+		return;
+	if (la->has_thread) {
+		la->stop = 1;
+		if (write(la->efd, &one, sizeof(one)) < 0)
+			pthread_cancel(la->thread);
+		pthread_join(la->thread, NULL);
+		la->has_thread = 0;
+	}
+	wimaxll_log_async_flush();
+	ring = la->ring;
+	la->ring = NULL;
+	__sync_synchronize();
+	wimaxll_ring_destroy(ring);
+	close(la->efd);
+	la->efd = -1;
+}
+
+
+/**
+ * Return a file descriptor to poll for queued diagnostics messages
+ *
+ * \return file descriptor that is readable when there are messages
+ *     to write out with wimaxll_log_async_flush(); -1 if
+ *     wimaxll_log_async_start() hasn't been called.
+ *
+ * \ingroup helper_log
+ */
+int wimaxll_log_async_fd(void)
+{
+	return wimaxll_log_async.efd;
+}
+
+
+/**
+ * Set the rate limit for diagnostics messages
+ *
+ * \param burst max number of messages from the same site (same
+ *     format string) to queue in an interval; 0 disables rate
+ *     limiting. Defaults to 10.
+ * \param interval_ms interval length in milliseconds (defaults to
+ *     1000).
+ *
+ * \ingroup helper_log
+ */
+void wimaxll_log_async_ratelimit(unsigned burst, unsigned interval_ms)
+{
+	wimaxll_log_async.burst = burst;
+	wimaxll_log_async.interval_ms = interval_ms;
+}
+
+
+/**
+ * Return the counters of dropped diagnostics messages
+ *
+ * \param dropped where to store the number of messages dropped
+ *     because the queue was full or they failed to be written (or
+ *     NULL).
+ * \param ratelimited where to store the number of messages
+ *     suppressed by rate limiting (or NULL).
+ *
+ * \ingroup helper_log
+ */
+void wimaxll_log_async_stats(unsigned long *dropped,
+			     unsigned long *ratelimited)
+{
+	if (dropped)
+		*dropped = wimaxll_log_async.dropped;
+	if (ratelimited)
+		*ratelimited = wimaxll_log_async.ratelimited;
+}
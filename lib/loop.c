@@ -0,0 +1,812 @@
+/*
+ * Linux WiMax
+ * Event loop for multiple devices
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \defgroup main_loop Event loop
+ *
+ * Applications that handle many WiMAX devices can register all their
+ * handles in a single event loop instead of writing their own
+ * select() / poll() loop around wimaxll_recv_fd():
+ *
+ * @code
+ * struct wimaxll_loop *loop = wimaxll_loop_create();
+ * ...
+ * wimaxll_set_cb_state_change(wmx0, my_state_change_cb, my_priv0);
+ * wimaxll_loop_add(loop, wmx0);
+ * wimaxll_set_cb_state_change(wmx1, my_state_change_cb, my_priv1);
+ * wimaxll_loop_add(loop, wmx1);
+ * ...
+ * timer = wimaxll_loop_timer_add(loop, 1000, 1000, my_timer_cb, priv);
+ * ...
+ * result = wimaxll_loop_run(loop);
+ * @endcode
+ *
+ * When there is activity in a handle, the notifications queued for
+ * it are read in batches (as wimaxll_recv_batch() does) and the \ref
+ * callbacks "callbacks" set in it are executed, the same as
+ * wimaxll_recv() would do. The loop also provides timers (see
+ * wimaxll_loop_timer_add()).
+ *
+ * A callback (notification or timer) returning -%EBUSY makes
+ * wimaxll_loop_run() return -%EBUSY; any notifications left are
+ * processed the next time the loop is ran.
+ *
+ * \section main_loop_threads Threads
+ *
+ * More than one thread can run the same loop
+ * (wimaxll_loop_run_once() or wimaxll_loop_run()) at the same
+ * time. A handle (or timer) is only being serviced by a single thread
+ * at any given time, so the handle's callbacks are never executed in
+ * parallel.
+ *
+ * Handles and timers can be added and removed at any time, also from
+ * callbacks running in the loop. Note a handle removed from a thread
+ * while another thread is executing its callbacks might still be in
+ * use by it when wimaxll_loop_remove() returns; it is only safe to
+ * close it once no threads are running the loop or if it was removed
+ * from one of its own callbacks.
+ *
+ * \internal
+ *
+ * This is a thin layer on top of epoll; each handle and timer (a
+ * timerfd) is a "source" registered with EPOLLONESHOT, so only one
+ * thread gets it when ready; once its callbacks are done, it is
+ * rearmed.
+ *
+ * Sources removed while threads are running the loop might still be
+ * in the event list some thread got from epoll_wait(), so they are
+ * not freed until no threads are running the loop.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/** Max number of epoll events processed per wakeup */
+	WIMAXLL_LOOP_EVENTS = 16,
+};
+
+
+enum wimaxll_loop_src_type {
+	WIMAXLL_LOOP_SRC_HANDLE,
+	WIMAXLL_LOOP_SRC_TIMER,
+	/* link events of a handle (see wimaxll_hotplug_fd()) */
+	WIMAXLL_LOOP_SRC_HOTPLUG,
+};
+
+
+/*
+ * Something the loop waits for activity on
+ *
+ * \param next next in the loop's list of sources
+ * \param type what kind of source this is
+ * \param fd file descriptor registered in the epoll set
+ * \param running a thread is servicing this source
+ * \param deleted removed from the loop; it is in the list of
+ *     zombies (or will be put there by the thread servicing it) and
+ *     has to be ignored.
+ * \param busy a callback returned -EBUSY while processing this
+ *     source; it has not been rearmed and has to be serviced before
+ *     waiting again.
+ */
+struct wimaxll_loop_src {
+	struct wimaxll_loop_src *next;
+	enum wimaxll_loop_src_type type;
+	int fd;
+	unsigned running:1, deleted:1, busy:1;
+};
+
+
+struct wimaxll_loop_handle {
+	struct wimaxll_loop_src src;
+	struct wimaxll_handle *wmx;
+};
+
+
+struct wimaxll_timer {
+	struct wimaxll_loop_src src;
+	wimaxll_timer_cb_f cb;
+	void *priv;
+};
+
+
+/**
+ * Event loop
+ *
+ * \param epoll_fd epoll set where all the sources are registered
+ * \param mutex protects the lists, the counters and the flags in the
+ *     sources
+ * \param srcs list of sources
+ * \param zombies list of sources removed while the loop was running,
+ *     to free when no threads are running it
+ * \param busy_count number of sources in \e srcs with the \e busy
+ *     flag set
+ * \param runners number of threads running the loop
+ *
+ * \ingroup main_loop
+ * \internal
+ */
+struct wimaxll_loop {
+	int epoll_fd;
+	pthread_mutex_t mutex;
+	struct wimaxll_loop_src *srcs, *zombies;
+	unsigned busy_count;
+	unsigned runners;
+};
+
+
+/*
+ * Handle a source is for (NULL if it is a timer)
+ */
+static
+struct wimaxll_handle *wimaxll_loop_src_wmx(struct wimaxll_loop_src *src)
+{
+	if (src->type == WIMAXLL_LOOP_SRC_TIMER)
+		return NULL;
+	return wimaxll_container_of(src, struct wimaxll_loop_handle,
+				    src)->wmx;
+}
+
+
+/*
+ * (Re)arm a source in the epoll set
+ */
+static
+int wimaxll_loop_src_arm(struct wimaxll_loop *loop,
+			 struct wimaxll_loop_src *src, int op)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLONESHOT,
+		.data.ptr = src,
+	};
+
+	if (epoll_ctl(loop->epoll_fd, op, src->fd, &ev) < 0)
+		return -errno;
+	return 0;
+}
+
+
+/*
+ * Free a source; it has to be already unlinked from the loop
+ */
+static
+void wimaxll_loop_src_free(struct wimaxll_loop_src *src)
+{
+	if (src->type == WIMAXLL_LOOP_SRC_TIMER) {
+		close(src->fd);
+		free(wimaxll_container_of(src, struct wimaxll_timer, src));
+	} else	/* handle or its link events */
+		free(wimaxll_container_of(src, struct wimaxll_loop_handle,
+					  src));
+}
+
+
+/*
+ * Free a removed source or, if there are threads running the loop,
+ * leave it for later. Call with loop->mutex held.
+ */
+static
+void __wimaxll_loop_src_put(struct wimaxll_loop *loop,
+			    struct wimaxll_loop_src *src)
+{
+	if (loop->runners > 0) {
+		src->next = loop->zombies;
+		loop->zombies = src;
+	} else
+		wimaxll_loop_src_free(src);
+}
+
+
+/*
+ * Take a source out of the loop
+ *
+ * If a thread is servicing it, we leave it for that thread to
+ * dispose of it. Call with loop->mutex held.
+ */
+static
+void __wimaxll_loop_src_remove(struct wimaxll_loop *loop,
+			       struct wimaxll_loop_src *src)
+{
+	struct wimaxll_loop_src **itr;
+
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, src->fd, NULL);
+	if (src->busy) {
+		src->busy = 0;
+		loop->busy_count--;
+	}
+	for (itr = &loop->srcs; *itr != NULL; itr = &(*itr)->next)
+		if (*itr == src) {
+			*itr = src->next;
+			break;
+		}
+	src->deleted = 1;
+	if (!src->running)
+		__wimaxll_loop_src_put(loop, src);
+}
+
+
+/**
+ * Create an event loop
+ *
+ * \return pointer to the loop descriptor; on error, NULL and \a
+ *     errno is set.
+ *
+ * \ingroup main_loop
+ */
+struct wimaxll_loop *wimaxll_loop_create(void)
+{
+	int result;
+	struct wimaxll_loop *loop;
+
+	d_fnstart(3, NULL, "()\n");
+	result = -ENOMEM;
+	loop = calloc(1, sizeof(*loop));
+	if (loop == NULL) {
+		wimaxll_msg(NULL, "E: cannot allocate event loop: %m\n");
+		goto error_alloc;
+	}
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		result = -errno;
+		wimaxll_msg(NULL, "E: cannot create epoll set: %m\n");
+		goto error_epoll_create;
+	}
+	pthread_mutex_init(&loop->mutex, NULL);
+	d_fnend(3, NULL, "() = %p\n", loop);
+	return loop;
+
+error_epoll_create:
+	free(loop);
+error_alloc:
+	errno = -result;
+	d_fnend(3, NULL, "() = NULL\n");
+	return NULL;
+}
+
+
+/**
+ * Destroy an event loop
+ *
+ * \param loop Event loop descriptor
+ *
+ * Removes all the handles (they are not closed) and deletes all the
+ * timers. No threads can be running the loop.
+ *
+ * \ingroup main_loop
+ */
+void wimaxll_loop_destroy(struct wimaxll_loop *loop)
+{
+	struct wimaxll_loop_src *src;
+
+	d_fnstart(3, NULL, "(loop %p)\n", loop);
+	while ((src = loop->srcs) != NULL) {
+		loop->srcs = src->next;
+		wimaxll_loop_src_free(src);
+	}
+	while ((src = loop->zombies) != NULL) {
+		loop->zombies = src->next;
+		wimaxll_loop_src_free(src);
+	}
+	close(loop->epoll_fd);
+	pthread_mutex_destroy(&loop->mutex);
+	free(loop);
+	d_fnend(3, NULL, "(loop %p) = void\n", loop);
+}
+
+
+/*
+ * Add a source for a handle to the loop; call with loop->mutex held.
+ */
+static
+int wimaxll_loop_handle_add(struct wimaxll_loop *loop,
+			    struct wimaxll_handle *wmx,
+			    enum wimaxll_loop_src_type type, int fd)
+{
+	int result;
+	struct wimaxll_loop_handle *lh;
+
+	lh = calloc(1, sizeof(*lh));
+	if (lh == NULL)
+		return -ENOMEM;
+	lh->src.type = type;
+	lh->src.fd = fd;
+	lh->wmx = wmx;
+	result = wimaxll_loop_src_arm(loop, &lh->src, EPOLL_CTL_ADD);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: %s: cannot add to epoll set: %d\n",
+			    __func__, result);
+		free(lh);
+		return result;
+	}
+	lh->src.next = loop->srcs;
+	loop->srcs = &lh->src;
+	return 0;
+}
+
+
+/**
+ * Add a WiMAX device handle to an event loop
+ *
+ * \param loop Event loop descriptor
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, < 0 errno code on error (-%EEXIST if the handle,
+ *     or another one sharing its RX socket, is already in the loop).
+ *
+ * From now on, when the loop runs, notifications received on the
+ * handle will be processed and the callbacks set in the handle
+ * executed. The handle should not be received on by other means
+ * (wimaxll_recv(), wimaxll_msg_read()...) while in the loop.
+ *
+ * Of the handles opened with %WIMAXLL_OPEN_SHARED_RX, only one needs
+ * to (and can) be added; when it is serviced, the callbacks of all
+ * the handles sharing the socket are executed.
+ *
+ * If the handle has a hotplug callback (see
+ * wimaxll_set_cb_hotplug()), the loop also waits for its link
+ * events.
+ *
+ * \ingroup main_loop
+ */
+int wimaxll_loop_add(struct wimaxll_loop *loop, struct wimaxll_handle *wmx)
+{
+	int result, hotplug_fd;
+	struct wimaxll_loop_src *itr;
+	int fd = wimaxll_recv_fd(wmx);
+
+	d_fnstart(3, wmx, "(loop %p wmx %p)\n", loop, wmx);
+	pthread_mutex_lock(&loop->mutex);
+	result = -EEXIST;
+	for (itr = loop->srcs; itr != NULL; itr = itr->next)
+		if (itr->type == WIMAXLL_LOOP_SRC_HANDLE
+		    && (itr->fd == fd
+			|| wimaxll_container_of(
+				itr, struct wimaxll_loop_handle,
+				src)->wmx == wmx))
+			goto error_exists;
+	result = wimaxll_loop_handle_add(loop, wmx, WIMAXLL_LOOP_SRC_HANDLE,
+					 fd);
+	if (result < 0)
+		goto error_handle_add;
+	hotplug_fd = wimaxll_hotplug_fd(wmx);
+	if (hotplug_fd >= 0) {
+		result = wimaxll_loop_handle_add(
+			loop, wmx, WIMAXLL_LOOP_SRC_HOTPLUG, hotplug_fd);
+		if (result < 0) {
+			__wimaxll_loop_src_remove(loop, loop->srcs);
+			goto error_handle_add;
+		}
+	}
+	pthread_mutex_unlock(&loop->mutex);
+	d_fnend(3, wmx, "(loop %p wmx %p) = 0\n", loop, wmx);
+	return 0;
+
+error_handle_add:
+error_exists:
+	pthread_mutex_unlock(&loop->mutex);
+	d_fnend(3, wmx, "(loop %p wmx %p) = %d\n", loop, wmx, result);
+	return result;
+}
+
+
+/**
+ * Remove a WiMAX device handle from an event loop
+ *
+ * \param loop Event loop descriptor
+ * \param wmx WiMAX device handle
+ * \return 0 if ok, -%ENOENT if the handle is not in the loop.
+ *
+ * Can be called from a callback being executed by the loop (for
+ * example, the handle's own callbacks).
+ *
+ * \ingroup main_loop
+ */
+int wimaxll_loop_remove(struct wimaxll_loop *loop,
+			struct wimaxll_handle *wmx)
+{
+	int result = -ENOENT;
+	struct wimaxll_loop_src *itr;
+
+	d_fnstart(3, wmx, "(loop %p wmx %p)\n", loop, wmx);
+	pthread_mutex_lock(&loop->mutex);
+	do {	/* its RX socket and its link events */
+		for (itr = loop->srcs; itr != NULL; itr = itr->next)
+			if (wimaxll_loop_src_wmx(itr) == wmx) {
+				__wimaxll_loop_src_remove(loop, itr);
+				result = 0;
+				break;
+			}
+	} while (itr != NULL);
+	pthread_mutex_unlock(&loop->mutex);
+	d_fnend(3, wmx, "(loop %p wmx %p) = %d\n", loop, wmx, result);
+	return result;
+}
+
+
+/*
+ * Set up a timerfd for the given initial expiry and period
+ */
+static
+int wimaxll_timer_set(struct wimaxll_timer *timer,
+		      unsigned initial_ms, unsigned period_ms)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = initial_ms / 1000,
+			.tv_nsec = (initial_ms % 1000) * 1000000,
+		},
+		.it_interval = {
+			.tv_sec = period_ms / 1000,
+			.tv_nsec = (period_ms % 1000) * 1000000,
+		},
+	};
+
+	/* a zero it_value would disarm it */
+	if (initial_ms == 0)
+		its.it_value.tv_nsec = 1;
+	if (timerfd_settime(timer->src.fd, 0, &its, NULL) < 0)
+		return -errno;
+	return 0;
+}
+
+
+/**
+ * Add a timer to an event loop
+ *
+ * \param loop Event loop descriptor
+ * \param initial_ms In how many milliseconds the timer expires
+ * \param period_ms After the first expiration, expire again every
+ *     these many milliseconds; 0 to expire only once.
+ * \param cb Function to call when the timer expires
+ * \param priv Private pointer to pass to \a cb
+ * \return Timer descriptor; on error, NULL and \a errno is set.
+ *
+ * When the timer expires, the loop will call \a cb. The timer stays
+ * in the loop (even if it is not periodic) until deleted with
+ * wimaxll_loop_timer_del(); it can be rearmed with
+ * wimaxll_loop_timer_mod().
+ *
+ * \ingroup main_loop
+ */
+struct wimaxll_timer *wimaxll_loop_timer_add(
+	struct wimaxll_loop *loop, unsigned initial_ms, unsigned period_ms,
+	wimaxll_timer_cb_f cb, void *priv)
+{
+	int result;
+	struct wimaxll_timer *timer;
+
+	d_fnstart(3, NULL, "(loop %p initial_ms %u period_ms %u cb %p "
+		  "priv %p)\n", loop, initial_ms, period_ms, cb, priv);
+	result = -ENOMEM;
+	timer = calloc(1, sizeof(*timer));
+	if (timer == NULL)
+		goto error_alloc;
+	timer->src.type = WIMAXLL_LOOP_SRC_TIMER;
+	timer->cb = cb;
+	timer->priv = priv;
+	timer->src.fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer->src.fd < 0) {
+		result = -errno;
+		wimaxll_msg(NULL, "E: %s: cannot create timer: %m\n",
+			    __func__);
+		goto error_timerfd_create;
+	}
+	result = wimaxll_timer_set(timer, initial_ms, period_ms);
+	if (result < 0)
+		goto error_timer_set;
+	pthread_mutex_lock(&loop->mutex);
+	result = wimaxll_loop_src_arm(loop, &timer->src, EPOLL_CTL_ADD);
+	if (result == 0) {
+		timer->src.next = loop->srcs;
+		loop->srcs = &timer->src;
+	}
+	pthread_mutex_unlock(&loop->mutex);
+	if (result < 0)
+		goto error_arm;
+	d_fnend(3, NULL, "(loop %p initial_ms %u period_ms %u cb %p "
+		"priv %p) = %p\n", loop, initial_ms, period_ms, cb, priv,
+		timer);
+	return timer;
+
+error_arm:
+error_timer_set:
+	close(timer->src.fd);
+error_timerfd_create:
+	free(timer);
+error_alloc:
+	errno = -result;
+	d_fnend(3, NULL, "(loop %p initial_ms %u period_ms %u cb %p "
+		"priv %p) = NULL\n", loop, initial_ms, period_ms, cb, priv);
+	return NULL;
+}
+
+
+/**
+ * Rearm a timer
+ *
+ * \param loop Event loop descriptor
+ * \param timer Timer descriptor, as returned by
+ *     wimaxll_loop_timer_add().
+ * \param initial_ms In how many milliseconds the timer expires
+ * \param period_ms After the first expiration, expire again every
+ *     these many milliseconds; 0 to expire only once.
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * \ingroup main_loop
+ */
+int wimaxll_loop_timer_mod(struct wimaxll_loop *loop,
+			   struct wimaxll_timer *timer,
+			   unsigned initial_ms, unsigned period_ms)
+{
+	return wimaxll_timer_set(timer, initial_ms, period_ms);
+}
+
+
+/**
+ * Delete a timer from an event loop
+ *
+ * \param loop Event loop descriptor
+ * \param timer Timer descriptor, as returned by
+ *     wimaxll_loop_timer_add().
+ *
+ * The timer descriptor is not valid after this call. This can be
+ * called from the timer's own callback.
+ *
+ * \ingroup main_loop
+ */
+void wimaxll_loop_timer_del(struct wimaxll_loop *loop,
+			    struct wimaxll_timer *timer)
+{
+	d_fnstart(3, NULL, "(loop %p timer %p)\n", loop, timer);
+	pthread_mutex_lock(&loop->mutex);
+	__wimaxll_loop_src_remove(loop, &timer->src);
+	pthread_mutex_unlock(&loop->mutex);
+	d_fnend(3, NULL, "(loop %p timer %p) = void\n", loop, timer);
+}
+
+
+/*
+ * Run the callbacks for a source that is ready
+ *
+ * The source must be marked as running (so nobody frees it under our
+ * feet).
+ */
+static
+ssize_t wimaxll_loop_src_service(struct wimaxll_loop *loop,
+				 struct wimaxll_loop_src *src)
+{
+	ssize_t result;
+	uint64_t expirations;
+	struct wimaxll_timer *timer;
+	struct wimaxll_loop_handle *lh;
+
+	switch (src->type) {
+	case WIMAXLL_LOOP_SRC_HANDLE:
+		lh = wimaxll_container_of(src, struct wimaxll_loop_handle,
+					  src);
+		result = wimaxll_rx_batch_dispatch(lh->wmx);
+		break;
+	case WIMAXLL_LOOP_SRC_HOTPLUG:
+		lh = wimaxll_container_of(src, struct wimaxll_loop_handle,
+					  src);
+		result = wimaxll_hotplug_dispatch(lh->wmx);
+		break;
+	case WIMAXLL_LOOP_SRC_TIMER:
+		timer = wimaxll_container_of(src, struct wimaxll_timer, src);
+		result = read(src->fd, &expirations, sizeof(expirations));
+		if (result < 0) {	/* -EAGAIN: spurious wakeup */
+			result = errno == EAGAIN ? 0 : -errno;
+			break;
+		}
+		result = timer->cb(loop, timer, timer->priv);
+		break;
+	default:
+		result = -EINVAL;
+	}
+	return result;
+}
+
+
+/*
+ * Service a source and rearm it (or dispose of it if it was deleted
+ * meanwhile)
+ *
+ * If a callback returns -EBUSY, the source is not rearmed but marked
+ * busy, so it is serviced first in the next iteration.
+ */
+static
+ssize_t wimaxll_loop_src_run(struct wimaxll_loop *loop,
+			     struct wimaxll_loop_src *src)
+{
+	ssize_t result;
+
+	pthread_mutex_lock(&loop->mutex);
+	if (src->deleted) {
+		/* removed since we got it from epoll_wait() */
+		pthread_mutex_unlock(&loop->mutex);
+		return 0;
+	}
+	src->running = 1;
+	pthread_mutex_unlock(&loop->mutex);
+
+	result = wimaxll_loop_src_service(loop, src);
+
+	pthread_mutex_lock(&loop->mutex);
+	src->running = 0;
+	if (src->deleted)
+		__wimaxll_loop_src_put(loop, src);
+	else if (result == -EBUSY) {
+		src->busy = 1;
+		loop->busy_count++;
+	} else
+		wimaxll_loop_src_arm(loop, src, EPOLL_CTL_MOD);
+	pthread_mutex_unlock(&loop->mutex);
+	return result;
+}
+
+
+/*
+ * Take a busy source to service it again
+ *
+ * Returns NULL if there are none.
+ */
+static
+struct wimaxll_loop_src *wimaxll_loop_busy_get(struct wimaxll_loop *loop)
+{
+	struct wimaxll_loop_src *itr = NULL;
+
+	pthread_mutex_lock(&loop->mutex);
+	if (loop->busy_count > 0)
+		for (itr = loop->srcs; itr != NULL; itr = itr->next)
+			if (itr->busy) {
+				itr->busy = 0;
+				loop->busy_count--;
+				break;
+			}
+	pthread_mutex_unlock(&loop->mutex);
+	return itr;
+}
+
+
+/**
+ * Wait for activity in an event loop and process it
+ *
+ * \param loop Event loop descriptor
+ * \param timeout_ms How long to wait for activity (milliseconds); -1
+ *     to wait for ever, 0 to just check.
+ * \return Number of handles / timers serviced (0 if the timeout
+ *     expired); -%EBUSY if a callback asked to stop processing;
+ *     other negative errno codes on error.
+ *
+ * Waits once for handles or timers to be ready and runs the
+ * callbacks for all of them.
+ *
+ * \ingroup main_loop
+ */
+ssize_t wimaxll_loop_run_once(struct wimaxll_loop *loop, int timeout_ms)
+{
+	ssize_t result, serviced = 0;
+	int cnt, nevents;
+	struct epoll_event events[WIMAXLL_LOOP_EVENTS];
+	struct wimaxll_loop_src *src;
+
+	d_fnstart(5, NULL, "(loop %p timeout_ms %d)\n", loop, timeout_ms);
+	pthread_mutex_lock(&loop->mutex);
+	loop->runners++;
+	pthread_mutex_unlock(&loop->mutex);
+	/* Finish first whatever we left half way because of -EBUSY */
+	src = wimaxll_loop_busy_get(loop);
+	if (src != NULL) {
+		result = wimaxll_loop_src_run(loop, src);
+		if (result != -EBUSY)
+			result = 1;
+		goto out;
+	}
+	nevents = epoll_wait(loop->epoll_fd, events, WIMAXLL_LOOP_EVENTS,
+			     timeout_ms);
+	if (nevents < 0) {
+		result = -errno;
+		if (result != -EINTR)
+			wimaxll_msg(NULL, "E: %s: epoll_wait() failed: %zd\n",
+				    __func__, result);
+		goto out;
+	}
+	result = 0;
+	for (cnt = 0; cnt < nevents; cnt++) {
+		src = events[cnt].data.ptr;
+		if (result == -EBUSY) {
+			/* Stopping; we got these, so they are disarmed
+			 * and another thread won't touch them. Rearm
+			 * them so they are picked up next time. */
+			pthread_mutex_lock(&loop->mutex);
+			if (!src->deleted)
+				wimaxll_loop_src_arm(loop, src, EPOLL_CTL_MOD);
+			pthread_mutex_unlock(&loop->mutex);
+			continue;
+		}
+		result = wimaxll_loop_src_run(loop, src);
+		if (result != -EBUSY)
+			serviced++;
+	}
+	if (result != -EBUSY)
+		result = serviced;
+out:
+	pthread_mutex_lock(&loop->mutex);
+	if (--loop->runners == 0)
+		while ((src = loop->zombies) != NULL) {
+			loop->zombies = src->next;
+			wimaxll_loop_src_free(src);
+		}
+	pthread_mutex_unlock(&loop->mutex);
+	d_fnend(5, NULL, "(loop %p timeout_ms %d) = %zd\n",
+		loop, timeout_ms, result);
+	return result;
+}
+
+
+/**
+ * Run an event loop
+ *
+ * \param loop Event loop descriptor
+ * \return -%EBUSY when a callback asks to stop processing; other
+ *     negative errno code on error.
+ *
+ * Waits for activity and services handles and timers until a
+ * callback returns -%EBUSY or there is an error. Errors returned by
+ * reading from a single handle don't stop the loop.
+ *
+ * \ingroup main_loop
+ */
+ssize_t wimaxll_loop_run(struct wimaxll_loop *loop)
+{
+	ssize_t result;
+
+	do
+		result = wimaxll_loop_run_once(loop, -1);
+	while (result >= 0 || result == -EINTR);
+	return result;
+}
@@ -54,25 +54,41 @@
 #include "names-vals.h"
 
 
+/*
+ * Hash a name for the tables generated by enum-to-names-vals
+ *
+ * \internal
+ *
+ * Has to match names_hash() in the script.
+ */
+unsigned wimaxll_names_hash(const char *name, unsigned seed, size_t size)
+{
+	unsigned hash = 0;
+
+	while (*name)
+		hash = (hash * seed + (unsigned char) *name++) % 65521;
+	return hash % size;
+}
+
+
 enum wimax_st wimaxll_state_by_name(const char *name)
 {
-	size_t itr, max = wimaxll_array_size(wimax_st_names_vals) - 1;
-	
-	for (itr = 0; itr < max; itr++)
-		if (strcmp(wimax_st_names_vals[itr].name, name) == 0)
-			return wimax_st_names_vals[itr].value;
-	return __WIMAX_ST_INVALID;
+	unsigned idx;
+
+	idx = wimax_st_names_hash[
+		wimaxll_names_hash(name, wimax_st_names_hash_seed,
+				   wimaxll_array_size(wimax_st_names_hash))];
+	if (idx == 0 || strcmp(wimax_st_names_vals[idx - 1].name, name))
+		return __WIMAX_ST_INVALID;
+	return wimax_st_names_vals[idx - 1].value;
 }
 
 
 const char * wimaxll_state_to_name(enum wimax_st st)
 {
-	size_t itr, max = wimaxll_array_size(wimax_st_names_vals) - 1;
-	
-	for (itr = 0; itr < max; itr++)
-		if (wimax_st_names_vals[itr].value == st)
-			return wimax_st_names_vals[itr].name;
-	return NULL;
+	if ((unsigned) st >= wimaxll_array_size(wimax_st_names))
+		return NULL;
+	return wimax_st_names[st];
 }
 
 
@@ -0,0 +1,1021 @@
+/*
+ * Linux WiMax
+ * Mock WiMAX device
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \internal
+ *
+ * The mock's handle is a normal one, but its sockets are not netlink
+ * sockets; we connect() them to netlink as usual (so libnl's handles
+ * are fully set up) and then replace the file descriptors (dup2())
+ * with one end of a SOCK_SEQPACKET socket pair each. The other end is
+ * the "kernel":
+ *
+ * - the TX socket's is read by the mock's thread, that acks the
+ *   requests as the kernel would.
+ *
+ * - the RX socket's is where notifications are written to.
+ *
+ * Sequenced packet sockets keep the datagram boundaries and ignore
+ * the destination address libnl passes to sendmsg(), so the rest of
+ * the library (poll(), recvmmsg(), the BPF filter) works
+ * unchanged. The only thing libnl can't cope with is the source
+ * address of what it reads (it expects a netlink one), so we
+ * override its receive function with wimaxll_mock_nl_recv().
+ *
+ * The generic netlink family ID of the handle is
+ * %WIMAXLL_MOCK_FAMILY_ID; requests for other families are rejected
+ * with -%ENOENT, like the kernel does.
+ *
+ * Traces are kept as a buffer with the netlink messages one after
+ * the other (aligned), each of which is sent as a datagram by
+ * wimaxll_mock_replay().
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <netlink/netlink.h>
+#include <netlink/handlers.h>
+#include <wimaxll.h>
+#include <wimaxll/mock.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	WIMAXLL_MOCK_FAMILY_ID = 0x7ff0,
+	/* Initial allocation of the trace buffer and requests */
+	WIMAXLL_MOCK_TRACE_SIZE = 64 * 1024,
+	WIMAXLL_MOCK_REQ_SIZE = 4096,
+	/* hardware switch on, software switch as set (see wimax.h) */
+	WIMAXLL_MOCK_RFKILL_HW = 0x1,
+	WIMAXLL_MOCK_RFKILL_SW = 0x2,
+};
+
+
+/*
+ * Mock device
+ *
+ * \param wmx handle the user gets
+ * \param fd_tx kernel end of the handle's TX socket
+ * \param fd_rx kernel end of the handle's RX socket
+ * \param thread plays the kernel, answering requests read from \a
+ *     fd_tx (see wimaxll_mock_thread())
+ * \param mutex protects \a state, \a rfkill, \a requests and the
+ *     request callback, which are accessed from \a thread.
+ * \param state what wimaxll_state_get() returns
+ * \param rfkill what wimaxll_rfkill() returns
+ * \param requests number of requests answered
+ * \param trace notifications queued for wimaxll_mock_replay() (\a
+ *     trace_used bytes of \a trace_size); \a trace_count messages,
+ *     \a trace_pos is the offset of the next one to send.
+ */
+struct wimaxll_mock {
+	struct wimaxll_handle *wmx;
+	int fd_tx, fd_rx;
+	pthread_t thread;
+
+	pthread_mutex_t mutex;
+	enum wimax_st state;
+	int rfkill;
+	unsigned long long requests;
+	wimaxll_mock_request_cb_f request_cb;
+	void *request_priv;
+
+	unsigned char *trace;
+	size_t trace_size, trace_used, trace_pos, trace_count;
+};
+
+
+/*
+ * Receive from a mock socket, for libnl
+ *
+ * Same as libnl's nl_recv(), but makes what is read look as coming
+ * from the kernel.
+ */
+static
+int wimaxll_mock_nl_recv(struct nl_handle *nlh, struct sockaddr_nl *nla,
+			 unsigned char **buf, struct ucred **creds)
+{
+	int fd = nl_socket_get_fd(nlh);
+	ssize_t size;
+
+retry:
+	size = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (size < 0) {
+		if (errno == EINTR)
+			goto retry;
+		return errno == EAGAIN ? 0 : -errno;
+	}
+	if (size == 0)
+		return 0;
+	*buf = malloc(size);
+	if (*buf == NULL)
+		return -ENOMEM;
+	size = recv(fd, *buf, size, 0);
+	if (size <= 0) {
+		free(*buf);
+		*buf = NULL;
+		if (size < 0 && errno == EINTR)
+			goto retry;
+		return size < 0 && errno != EAGAIN ? -errno : 0;
+	}
+	memset(nla, 0, sizeof(*nla));
+	nla->nl_family = AF_NETLINK;
+	return size;
+}
+
+
+/*
+ * Replace a handle's netlink socket with one end of a socket pair
+ *
+ * Returns the other end (or < 0 errno code on error).
+ */
+static
+int wimaxll_mock_socket(struct wimaxll_handle *wmx, struct nl_handle *nlh)
+{
+	int result;
+	int sv[2];
+	struct nl_cb *cb;
+
+	result = nl_connect(nlh, NETLINK_GENERIC);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: mock: cannot connect netlink: %d (%s)\n",
+			    result, nl_geterror());
+		goto error_nl_connect;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		result = -errno;
+		wimaxll_msg(wmx, "E: mock: cannot create socket pair: %m\n");
+		goto error_socketpair;
+	}
+	if (dup2(sv[0], nl_socket_get_fd(nlh)) < 0
+	    || fcntl(nl_socket_get_fd(nlh), F_SETFD, FD_CLOEXEC) < 0) {
+		result = -errno;
+		wimaxll_msg(wmx, "E: mock: cannot replace socket: %m\n");
+		goto error_dup;
+	}
+	close(sv[0]);
+	cb = nl_socket_get_cb(nlh);
+	nl_cb_overwrite_recv(cb, wimaxll_mock_nl_recv);
+	nl_cb_put(cb);
+	return sv[1];
+
+error_dup:
+	close(sv[0]);
+	close(sv[1]);
+error_socketpair:
+	nl_close(nlh);
+error_nl_connect:
+	return result;
+}
+
+
+/* Append an attribute to a message being built */
+static
+void *wimaxll_mock_attr_put(void *itr, unsigned type,
+			    const void *data, size_t size)
+{
+	struct nlattr *nla = itr;
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + size;
+	memcpy(itr + NLA_HDRLEN, data, size);
+	memset(itr + NLA_HDRLEN + size, 0,
+	       NLA_ALIGN(nla->nla_len) - nla->nla_len);
+	return itr + NLA_ALIGN(nla->nla_len);
+}
+
+
+/* Find an attribute in a generic netlink message */
+static
+const struct nlattr *wimaxll_mock_attr_find(const struct nlmsghdr *nl_hdr,
+					    unsigned type)
+{
+	const void *itr = NLMSG_DATA(nl_hdr) + GENL_HDRLEN;
+	const void *end = (const void *) nl_hdr + nl_hdr->nlmsg_len;
+	const struct nlattr *nla;
+
+	while (itr + NLA_HDRLEN <= end) {
+		nla = itr;
+		if (nla->nla_len < NLA_HDRLEN || itr + nla->nla_len > end)
+			break;
+		if ((nla->nla_type & NLA_TYPE_MASK) == type)
+			return nla;
+		itr += NLA_ALIGN(nla->nla_len);
+	}
+	return NULL;
+}
+
+
+/*
+ * Get room for a notification of \a size bytes
+ *
+ * At the end of the trace if queuing, so it doesn't need to be
+ * copied; otherwise, just a buffer. wimaxll_mock_msg_commit()
+ * finishes it.
+ */
+static
+struct nlmsghdr *wimaxll_mock_msg_get(struct wimaxll_mock *mock,
+				      size_t size, unsigned flags)
+{
+	size_t new_size;
+	void *buf;
+
+	if (!(flags & WIMAXLL_MOCK_QUEUE))
+		return malloc(size);
+	if (mock->trace_used + NLMSG_ALIGN(size) > mock->trace_size) {
+		new_size = mock->trace_size ? : WIMAXLL_MOCK_TRACE_SIZE;
+		while (mock->trace_used + NLMSG_ALIGN(size) > new_size)
+			new_size *= 2;
+		buf = realloc(mock->trace, new_size);
+		if (buf == NULL)
+			return NULL;
+		mock->trace = buf;
+		mock->trace_size = new_size;
+	}
+	return (void *) mock->trace + mock->trace_used;
+}
+
+
+static
+int wimaxll_mock_msg_commit(struct wimaxll_mock *mock,
+			    struct nlmsghdr *nl_hdr, unsigned flags)
+{
+	ssize_t result = 0;
+
+	if (flags & WIMAXLL_MOCK_QUEUE) {
+		mock->trace_used += NLMSG_ALIGN(nl_hdr->nlmsg_len);
+		mock->trace_count++;
+	} else {
+		result = send(mock->fd_rx, nl_hdr, nl_hdr->nlmsg_len,
+			      MSG_DONTWAIT);
+		free(nl_hdr);
+		if (result < 0)
+			result = -errno;
+	}
+	return result < 0 ? result : 0;
+}
+
+
+/* Fill out the headers of a notification of \a size bytes */
+static
+void *wimaxll_mock_notif_init(struct wimaxll_mock *mock,
+			      struct nlmsghdr *nl_hdr, size_t size,
+			      unsigned cmd)
+{
+	struct genlmsghdr *gnl_hdr = NLMSG_DATA(nl_hdr);
+
+	memset(nl_hdr, 0, NLMSG_HDRLEN + GENL_HDRLEN);
+	nl_hdr->nlmsg_len = size;
+	nl_hdr->nlmsg_type = mock->wmx->gnl_family_id;
+	gnl_hdr->cmd = cmd;
+	gnl_hdr->version = WIMAX_GNL_VERSION;
+	return (void *) gnl_hdr + GENL_HDRLEN;
+}
+
+
+/*
+ * Ack a request
+ *
+ * As the kernel's netlink_ack() does, if \a error is 0 and no ack was
+ * asked for, nothing is sent.
+ */
+static
+void wimaxll_mock_ack(struct wimaxll_mock *mock,
+		      const struct nlmsghdr *req, int error)
+{
+	struct {
+		struct nlmsghdr hdr;
+		struct nlmsgerr err;
+	} ack;
+
+	if (error == 0 && !(req->nlmsg_flags & NLM_F_ACK))
+		return;
+	memset(&ack, 0, sizeof(ack));
+	ack.hdr.nlmsg_len = sizeof(ack);
+	ack.hdr.nlmsg_type = NLMSG_ERROR;
+	ack.hdr.nlmsg_seq = req->nlmsg_seq;
+	ack.hdr.nlmsg_pid = req->nlmsg_pid;
+	ack.err.error = error;
+	ack.err.msg = *req;
+	if (send(mock->fd_tx, &ack, sizeof(ack), 0) < 0)
+		wimaxll_msg(mock->wmx, "E: mock: cannot send ack: %m\n");
+}
+
+
+/*
+ * Execute a request, returning what to ack it with
+ */
+static
+int wimaxll_mock_request(struct wimaxll_mock *mock,
+			 const struct nlmsghdr *nl_hdr)
+{
+	int result;
+	const struct genlmsghdr *gnl_hdr = NLMSG_DATA(nl_hdr);
+	const struct nlattr *nla_pipe, *nla_data, *nla_state;
+	wimaxll_mock_request_cb_f cb;
+	void *priv;
+
+	if (nl_hdr->nlmsg_type != mock->wmx->gnl_family_id)
+		return -ENOENT;
+	if (nl_hdr->nlmsg_len < NLMSG_HDRLEN + GENL_HDRLEN)
+		return -EINVAL;
+	pthread_mutex_lock(&mock->mutex);
+	mock->requests++;
+	switch (gnl_hdr->cmd) {
+	case WIMAX_GNL_OP_MSG_FROM_USER:
+		cb = mock->request_cb;
+		priv = mock->request_priv;
+		pthread_mutex_unlock(&mock->mutex);
+		nla_pipe = wimaxll_mock_attr_find(
+			nl_hdr, WIMAX_GNL_MSG_PIPE_NAME);
+		nla_data = wimaxll_mock_attr_find(
+			nl_hdr, WIMAX_GNL_MSG_DATA);
+		if (nla_data == NULL)
+			return -EINVAL;
+		if (cb == NULL)
+			return 0;
+		return cb(mock, priv,
+			  nla_pipe ? (const void *) nla_pipe + NLA_HDRLEN
+			  : NULL,
+			  (const void *) nla_data + NLA_HDRLEN,
+			  nla_data->nla_len - NLA_HDRLEN);
+	case WIMAX_GNL_OP_RFKILL:
+		result = -EINVAL;
+		nla_state = wimaxll_mock_attr_find(
+			nl_hdr, WIMAX_GNL_RFKILL_STATE);
+		if (nla_state == NULL
+		    || nla_state->nla_len < NLA_HDRLEN + sizeof(__u32))
+			break;
+		switch (*(__u32 *) ((void *) nla_state + NLA_HDRLEN)) {
+		case WIMAX_RF_OFF:
+			mock->rfkill &= ~WIMAXLL_MOCK_RFKILL_SW;
+			break;
+		case WIMAX_RF_ON:
+			mock->rfkill |= WIMAXLL_MOCK_RFKILL_SW;
+			break;
+		case WIMAX_RF_QUERY:
+			break;
+		default:
+			goto out;
+		}
+		result = mock->rfkill;
+		break;
+	case WIMAX_GNL_OP_RESET:
+		result = 0;
+		break;
+	case WIMAX_GNL_OP_STATE_GET:
+		result = mock->state;
+		break;
+	default:
+		result = -EOPNOTSUPP;
+	}
+out:
+	pthread_mutex_unlock(&mock->mutex);
+	return result;
+}
+
+
+/*
+ * Play the kernel: read requests from the TX socket and ack them
+ *
+ * Runs until wimaxll_mock_destroy() shuts down our end of the socket
+ * (or the handle's end is closed).
+ */
+static
+void *wimaxll_mock_thread(void *_mock)
+{
+	struct wimaxll_mock *mock = _mock;
+	ssize_t size;
+	size_t buf_size = WIMAXLL_MOCK_REQ_SIZE;
+	void *buf, *new_buf;
+	struct nlmsghdr *nl_hdr;
+	int len;
+
+	buf = malloc(buf_size);
+	if (buf == NULL) {
+		wimaxll_msg(mock->wmx, "E: mock: cannot allocate buffer\n");
+		return NULL;
+	}
+	while (1) {
+		size = recv(mock->fd_tx, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if ((size_t) size > buf_size) {
+			new_buf = realloc(buf, size);
+			if (new_buf == NULL) {
+				wimaxll_msg(mock->wmx, "E: mock: cannot "
+					    "allocate %zd bytes\n", size);
+				break;
+			}
+			buf = new_buf;
+			buf_size = size;
+		}
+		size = recv(mock->fd_tx, buf, buf_size, 0);
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size <= 0)		/* handle closed */
+			break;
+		len = size;
+		for (nl_hdr = buf; NLMSG_OK(nl_hdr, len);
+		     nl_hdr = NLMSG_NEXT(nl_hdr, len))
+			wimaxll_mock_ack(mock, nl_hdr,
+					 wimaxll_mock_request(mock, nl_hdr));
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/**
+ * Create a mock WiMAX device
+ *
+ * \param name name for the device (for messages and captures); if
+ *     %NULL, "mock"
+ * \param ifidx interface index for the device; it doesn't need to
+ *     exist, but it has to be different than zero.
+ * \return mock device; use wimaxll_mock_handle() to get the handle
+ *     to use it. On error, %NULL is returned and \a errno set.
+ *
+ * \ingroup mock_group
+ */
+struct wimaxll_mock *wimaxll_mock_create(const char *name, unsigned ifidx)
+{
+	int result;
+	struct wimaxll_mock *mock;
+	struct wimaxll_handle *wmx;
+
+	d_fnstart(3, NULL, "(name %s ifidx %u)\n", name, ifidx);
+	result = -EINVAL;
+	if (ifidx == 0)
+		goto error_ifidx;
+	result = -ENOMEM;
+	mock = calloc(1, sizeof(*mock));
+	if (mock == NULL)
+		goto error_mock_alloc;
+	pthread_mutex_init(&mock->mutex, NULL);
+	mock->state = WIMAX_ST_READY;
+	mock->rfkill = WIMAXLL_MOCK_RFKILL_HW | WIMAXLL_MOCK_RFKILL_SW;
+	wmx = calloc(1, sizeof(*wmx));
+	if (wmx == NULL)
+		goto error_wmx_alloc;
+	mock->wmx = wmx;
+	wimaxll_handle_init(wmx);
+	wmx->ifidx = ifidx;
+	strncpy(wmx->name, name ? : "mock", sizeof(wmx->name) - 1);
+	wmx->gnl_family_id = WIMAXLL_MOCK_FAMILY_ID;
+	wmx->mcg_id = -1;
+	wmx->mock = 1;
+
+	/* Its own, even in lean builds: it talks to its own thread */
+	wmx->tx = wimaxll_tx_alloc();
+	if (wmx->tx == NULL)
+		goto error_tx_alloc;
+	result = wimaxll_mock_socket(wmx, wmx->tx->nlh);
+	if (result < 0)
+		goto error_socket_tx;
+	mock->fd_tx = result;
+	wmx->nlh_rx = nl_handle_alloc();
+	if (wmx->nlh_rx == NULL) {
+		result = nl_get_errno();
+		goto error_nl_handle_alloc_rx;
+	}
+	result = wimaxll_mock_socket(wmx, wmx->nlh_rx);
+	if (result < 0)
+		goto error_socket_rx;
+	mock->fd_rx = result;
+	wimaxll_rx_filter_refresh(wmx);
+
+	result = -pthread_create(&mock->thread, NULL,
+				 wimaxll_mock_thread, mock);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: mock: cannot create thread: %d\n",
+			    result);
+		goto error_thread;
+	}
+	d_fnend(3, wmx, "(name %s ifidx %u) = %p\n", name, ifidx, mock);
+	return mock;
+
+error_thread:
+	close(mock->fd_rx);
+	nl_close(wmx->nlh_rx);
+error_socket_rx:
+	nl_handle_destroy(wmx->nlh_rx);
+error_nl_handle_alloc_rx:
+	close(mock->fd_tx);
+error_socket_tx:
+	wimaxll_tx_free(wmx->tx);
+error_tx_alloc:
+	wimaxll_handle_release(wmx);
+	free(wmx);
+error_wmx_alloc:
+	pthread_mutex_destroy(&mock->mutex);
+	free(mock);
+error_mock_alloc:
+error_ifidx:
+	errno = -result;
+	d_fnend(3, NULL, "(name %s ifidx %u) = NULL\n", name, ifidx);
+	return NULL;
+}
+
+
+/**
+ * Destroy a mock WiMAX device
+ *
+ * \param mock mock device
+ *
+ * Closes its handle too.
+ *
+ * \ingroup mock_group
+ */
+void wimaxll_mock_destroy(struct wimaxll_mock *mock)
+{
+	d_fnstart(3, NULL, "(mock %p)\n", mock);
+	/* The thread uses the handle until it sees the end of file;
+	 * stop it first */
+	shutdown(mock->fd_tx, SHUT_RDWR);
+	pthread_join(mock->thread, NULL);
+	wimaxll_close(mock->wmx);
+	close(mock->fd_tx);
+	close(mock->fd_rx);
+	pthread_mutex_destroy(&mock->mutex);
+	free(mock->trace);
+	free(mock);
+	d_fnend(3, NULL, "(mock %p) = void\n", mock);
+}
+
+
+/**
+ * Return the handle of a mock WiMAX device
+ *
+ * \param mock mock device
+ * \return WiMAX handle; it is closed by wimaxll_mock_destroy(), so
+ *     don't call wimaxll_close() on it.
+ *
+ * \ingroup mock_group
+ */
+struct wimaxll_handle *wimaxll_mock_handle(struct wimaxll_mock *mock)
+{
+	return mock->wmx;
+}
+
+
+/**
+ * Set the callback for the messages sent to a mock WiMAX device
+ *
+ * \param mock mock device
+ * \param cb callback (see \ref wimaxll_mock_request_cb_f); %NULL
+ *     to ack them all with success.
+ * \param priv private pointer to pass to the callback
+ *
+ * \ingroup mock_group
+ */
+void wimaxll_mock_set_cb_request(struct wimaxll_mock *mock,
+				 wimaxll_mock_request_cb_f cb, void *priv)
+{
+	pthread_mutex_lock(&mock->mutex);
+	mock->request_cb = cb;
+	mock->request_priv = priv;
+	pthread_mutex_unlock(&mock->mutex);
+}
+
+
+/**
+ * Set the state of a mock WiMAX device
+ *
+ * \param mock mock device
+ * \param state state wimaxll_state_get() will report
+ *
+ * No state change notification is sent; see
+ * wimaxll_mock_state_change() for that.
+ *
+ * \ingroup mock_group
+ */
+void wimaxll_mock_set_state(struct wimaxll_mock *mock, enum wimax_st state)
+{
+	pthread_mutex_lock(&mock->mutex);
+	mock->state = state;
+	pthread_mutex_unlock(&mock->mutex);
+}
+
+
+/**
+ * Make the next read on a mock WiMAX device's handle overflow
+ *
+ * \param mock mock device
+ *
+ * The next time the library reads the handle's socket it gets
+ * -%ENOBUFS, as it would when the kernel had to drop notifications
+ * because the socket was full; the notifications already sent are
+ * still there to be read after it.
+ *
+ * \ingroup mock_group
+ */
+void wimaxll_mock_overrun(struct wimaxll_mock *mock)
+{
+	mock->wmx->mock_overrun = 1;
+	__sync_synchronize();
+}
+
+
+/**
+ * Return how many requests a mock WiMAX device has answered
+ *
+ * \param mock mock device
+ *
+ * \ingroup mock_group
+ */
+unsigned long long wimaxll_mock_requests(struct wimaxll_mock *mock)
+{
+	unsigned long long requests;
+
+	pthread_mutex_lock(&mock->mutex);
+	requests = mock->requests;
+	pthread_mutex_unlock(&mock->mutex);
+	return requests;
+}
+
+
+/**
+ * Send a netlink message to a mock WiMAX device's handle
+ *
+ * \param mock mock device
+ * \param nl_hdr message, as the kernel would send it (the family ID
+ *     and interface index are not modified)
+ * \param flags %WIMAXLL_MOCK_QUEUE to queue it to the trace instead
+ *     of sending it now
+ * \return 0 if ok, < 0 errno code on error; -%EAGAIN if the handle's
+ *     socket is full.
+ *
+ * \ingroup mock_group
+ */
+int wimaxll_mock_inject(struct wimaxll_mock *mock,
+			const struct nlmsghdr *nl_hdr, unsigned flags)
+{
+	struct nlmsghdr *msg;
+
+	msg = wimaxll_mock_msg_get(mock, nl_hdr->nlmsg_len, flags);
+	if (msg == NULL)
+		return -ENOMEM;
+	memcpy(msg, nl_hdr, nl_hdr->nlmsg_len);
+	return wimaxll_mock_msg_commit(mock, msg, flags);
+}
+
+
+/**
+ * Send a message to user from a mock WiMAX device
+ *
+ * \param mock mock device
+ * \param pipe_name pipe to send it over (%NULL for the default one)
+ * \param data payload
+ * \param size size of \a data
+ * \param flags %WIMAXLL_MOCK_QUEUE to queue it to the trace instead
+ *     of sending it now
+ * \return 0 if ok, < 0 errno code on error; -%EAGAIN if the handle's
+ *     socket is full.
+ *
+ * \ingroup mock_group
+ */
+int wimaxll_mock_msg_to_user(struct wimaxll_mock *mock,
+			     const char *pipe_name,
+			     const void *data, size_t size, unsigned flags)
+{
+	struct nlmsghdr *nl_hdr;
+	size_t msg_size;
+	__u32 ifidx = mock->wmx->ifidx;
+	void *itr;
+
+	msg_size = NLMSG_HDRLEN + GENL_HDRLEN + NLA_ALIGN(NLA_HDRLEN + 4)
+		+ NLA_ALIGN(NLA_HDRLEN + size);
+	if (pipe_name)
+		msg_size += NLA_ALIGN(NLA_HDRLEN + strlen(pipe_name) + 1);
+	nl_hdr = wimaxll_mock_msg_get(mock, msg_size, flags);
+	if (nl_hdr == NULL)
+		return -ENOMEM;
+	itr = wimaxll_mock_notif_init(mock, nl_hdr, msg_size,
+				      WIMAX_GNL_OP_MSG_TO_USER);
+	itr = wimaxll_mock_attr_put(itr, WIMAX_GNL_MSG_IFIDX,
+				    &ifidx, sizeof(ifidx));
+	if (pipe_name)
+		itr = wimaxll_mock_attr_put(itr, WIMAX_GNL_MSG_PIPE_NAME,
+					    pipe_name, strlen(pipe_name) + 1);
+	wimaxll_mock_attr_put(itr, WIMAX_GNL_MSG_DATA, data, size);
+	return wimaxll_mock_msg_commit(mock, nl_hdr, flags);
+}
+
+
+/**
+ * Change the state of a mock WiMAX device
+ *
+ * \param mock mock device
+ * \param new_state state to change to
+ * \param flags %WIMAXLL_MOCK_QUEUE to queue the notification to the
+ *     trace instead of sending it now
+ * \return 0 if ok, < 0 errno code on error; -%EAGAIN if the handle's
+ *     socket is full.
+ *
+ * Sends a state change notification from the current state to \a
+ * new_state, which becomes the current one (even if the notification
+ * is queued).
+ *
+ * \ingroup mock_group
+ */
+int wimaxll_mock_state_change(struct wimaxll_mock *mock,
+			      enum wimax_st new_state, unsigned flags)
+{
+	struct nlmsghdr *nl_hdr;
+	size_t msg_size;
+	__u32 ifidx = mock->wmx->ifidx;
+	__u8 old_st, new_st = new_state;
+	void *itr;
+
+	msg_size = NLMSG_HDRLEN + GENL_HDRLEN + NLA_ALIGN(NLA_HDRLEN + 4)
+		+ 2 * NLA_ALIGN(NLA_HDRLEN + 1);
+	nl_hdr = wimaxll_mock_msg_get(mock, msg_size, flags);
+	if (nl_hdr == NULL)
+		return -ENOMEM;
+	pthread_mutex_lock(&mock->mutex);
+	old_st = mock->state;
+	mock->state = new_state;
+	pthread_mutex_unlock(&mock->mutex);
+	itr = wimaxll_mock_notif_init(mock, nl_hdr, msg_size,
+				      WIMAX_GNL_RE_STATE_CHANGE);
+	itr = wimaxll_mock_attr_put(itr, WIMAX_GNL_STCH_IFIDX,
+				    &ifidx, sizeof(ifidx));
+	itr = wimaxll_mock_attr_put(itr, WIMAX_GNL_STCH_STATE_OLD,
+				    &old_st, sizeof(old_st));
+	wimaxll_mock_attr_put(itr, WIMAX_GNL_STCH_STATE_NEW,
+			      &new_st, sizeof(new_st));
+	return wimaxll_mock_msg_commit(mock, nl_hdr, flags);
+}
+
+
+/*
+ * Queue a captured notification to the trace
+ *
+ * Returns 1 if queued, 0 if it is not a notification we can replay.
+ * It is made to look as coming from the mock device.
+ */
+static
+int wimaxll_mock_load_msg(struct wimaxll_mock *mock,
+			  const struct nlmsghdr *nl_hdr)
+{
+	const struct genlmsghdr *gnl_hdr = NLMSG_DATA(nl_hdr);
+	const struct nlattr *nla;
+	struct nlmsghdr *msg;
+
+	if (nl_hdr->nlmsg_type < NLMSG_MIN_TYPE
+	    || nl_hdr->nlmsg_len < NLMSG_HDRLEN + GENL_HDRLEN
+	    || (gnl_hdr->cmd != WIMAX_GNL_OP_MSG_TO_USER
+		&& gnl_hdr->cmd != WIMAX_GNL_RE_STATE_CHANGE))
+		return 0;
+	/* MSG_IFIDX and STCH_IFIDX are the same */
+	nla = wimaxll_mock_attr_find(nl_hdr, WIMAX_GNL_MSG_IFIDX);
+	if (nla == NULL || nla->nla_len != NLA_HDRLEN + sizeof(__u32))
+		return 0;
+	msg = wimaxll_mock_msg_get(mock, nl_hdr->nlmsg_len,
+				   WIMAXLL_MOCK_QUEUE);
+	if (msg == NULL)
+		return -ENOMEM;
+	memcpy(msg, nl_hdr, nl_hdr->nlmsg_len);
+	msg->nlmsg_type = mock->wmx->gnl_family_id;
+	msg->nlmsg_seq = 0;
+	msg->nlmsg_pid = 0;
+	*(__u32 *) ((void *) msg + ((void *) nla - (void *) nl_hdr)
+		    + NLA_HDRLEN) = mock->wmx->ifidx;
+	wimaxll_mock_msg_commit(mock, msg, WIMAXLL_MOCK_QUEUE);
+	return 1;
+}
+
+
+/**
+ * Load the notifications in a capture to a mock WiMAX device's trace
+ *
+ * \param mock mock device
+ * \param file_name capture file (as written by
+ *     wimaxll_capture_start() or a pcapng capture of an \e nlmon
+ *     device)
+ * \return number of notifications queued to the trace, < 0 errno
+ *     code on error (-%EBADMSG if the file is not a capture we can
+ *     read).
+ *
+ * The messages to user and state changes received are appended to
+ * the trace (see wimaxll_mock_replay()), made to look as coming from
+ * \a mock; anything else (messages sent, other netlink traffic) is
+ * ignored.
+ *
+ * \ingroup mock_group
+ */
+ssize_t wimaxll_mock_load(struct wimaxll_mock *mock, const char *file_name)
+{
+	ssize_t result;
+	FILE *file;
+	void *buf = NULL, *new_buf;
+	size_t buf_size = 4096, count = 0, blocks = 0, size, used;
+	struct pcapng_block_hdr *hdr;
+	struct pcapng_epb *epb;
+	struct wimaxll_capture_cooked_hdr *cooked;
+	struct nlmsghdr *nl_hdr;
+	int len;
+	/* bitmap of which interfaces are netlink */
+	unsigned long long netlink_ifs = 0;
+	unsigned if_count = 0;
+
+	d_fnstart(3, mock->wmx, "(mock %p file_name %s)\n", mock, file_name);
+	file = fopen(file_name, "r");
+	if (file == NULL) {
+		result = -errno;
+		goto error_fopen;
+	}
+	buf = malloc(buf_size);
+	if (buf == NULL)
+		goto error_nomem;
+	while (1) {
+		hdr = buf;
+		if (fread(hdr, sizeof(*hdr), 1, file) != 1)
+			break;
+		result = -EBADMSG;
+		if (hdr->len < sizeof(*hdr) + 4 || hdr->len % 4)
+			goto error_bad;
+		if (hdr->len > buf_size) {
+			new_buf = realloc(buf, hdr->len);
+			if (new_buf == NULL)
+				goto error_nomem;
+			buf = hdr = new_buf;
+			buf_size = hdr->len;
+		}
+		size = hdr->len - sizeof(*hdr);
+		if (fread(buf + sizeof(*hdr), size, 1, file) != 1)
+			goto error_bad;
+		if (blocks++ == 0 && hdr->type != PCAPNG_SHB)
+			goto error_bad;
+		switch (hdr->type) {
+		case PCAPNG_SHB:
+			/* Captures made in another byte order are
+			 * not supported */
+			if (hdr->len < sizeof(struct pcapng_shb) + 4
+			    || ((struct pcapng_shb *) hdr)->magic
+			    != PCAPNG_BYTE_ORDER_MAGIC)
+				goto error_bad;
+			/* A new section has its own interfaces */
+			netlink_ifs = 0;
+			if_count = 0;
+			break;
+		case PCAPNG_IDB:
+			if (hdr->len < sizeof(struct pcapng_idb) + 4)
+				goto error_bad;
+			if (((struct pcapng_idb *) hdr)->link_type
+			    == LINKTYPE_NETLINK && if_count < 64)
+				netlink_ifs |= 1ULL << if_count;
+			if_count++;
+			break;
+		case PCAPNG_EPB:
+			epb = buf;
+			if (hdr->len < sizeof(*epb) + 4
+			    || epb->cap_len > hdr->len - sizeof(*epb) - 4)
+				goto error_bad;
+			if (epb->if_id >= 64
+			    || !(netlink_ifs & (1ULL << epb->if_id))
+			    || epb->cap_len < sizeof(*cooked))
+				break;
+			cooked = buf + sizeof(*epb);
+			if (ntohs(cooked->pkt_type)
+			    == WIMAXLL_CAPTURE_PACKET_OUTGOING
+			    || ntohs(cooked->protocol) != NETLINK_GENERIC)
+				break;
+			len = epb->cap_len - sizeof(*cooked);
+			used = 0;
+			for (nl_hdr = (void *) cooked + sizeof(*cooked);
+			     NLMSG_OK(nl_hdr, len);
+			     nl_hdr = NLMSG_NEXT(nl_hdr, len)) {
+				result = wimaxll_mock_load_msg(mock, nl_hdr);
+				if (result < 0)
+					goto error_load;
+				used += result;
+			}
+			count += used;
+			break;
+		default:	/* skip what we don't know about */
+			break;
+		}
+	}
+	result = -EBADMSG;
+	if (ferror(file) || !feof(file))
+		goto error_bad;
+	result = count;
+	goto out;
+
+error_nomem:
+	result = -ENOMEM;
+error_load:
+error_bad:
+out:
+	free(buf);
+	fclose(file);
+error_fopen:
+	d_fnend(3, mock->wmx, "(mock %p file_name %s) = %zd\n",
+		mock, file_name, result);
+	return result;
+}
+
+
+/**
+ * Send the notifications in a mock WiMAX device's trace
+ *
+ * \param mock mock device
+ * \param flags %WIMAXLL_MOCK_LOOP to go back to the beginning of
+ *     the trace after the last notification.
+ * \return number of notifications sent, < 0 errno code on error
+ *     (-%EAGAIN if the handle's socket is full); 0 if the trace is
+ *     empty or was all sent.
+ *
+ * Sends notifications to the handle until its socket can't take any
+ * more; the next call continues where this one left off. To replay
+ * a trace, call this and read from the handle until it returns 0.
+ *
+ * \ingroup mock_group
+ */
+ssize_t wimaxll_mock_replay(struct wimaxll_mock *mock, unsigned flags)
+{
+	ssize_t result;
+	size_t count = 0;
+	struct nlmsghdr *nl_hdr;
+
+	while (1) {
+		if (mock->trace_pos >= mock->trace_used) {
+			if (mock->trace_used == 0
+			    || !(flags & WIMAXLL_MOCK_LOOP))
+				break;
+			mock->trace_pos = 0;
+		}
+		nl_hdr = (void *) mock->trace + mock->trace_pos;
+		result = send(mock->fd_rx, nl_hdr, nl_hdr->nlmsg_len,
+			      MSG_DONTWAIT);
+		if (result < 0) {
+			if (errno == EAGAIN && count > 0)
+				break;
+			return -errno;
+		}
+		mock->trace_pos += NLMSG_ALIGN(nl_hdr->nlmsg_len);
+		count++;
+	}
+	return count;
+}
+
+
+/**
+ * Return how many notifications are in a mock WiMAX device's trace
+ *
+ * \param mock mock device
+ *
+ * \ingroup mock_group
+ */
+size_t wimaxll_mock_trace_count(struct wimaxll_mock *mock)
+{
+	return mock->trace_count;
+}
@@ -51,6 +51,17 @@
  * where \a buf points to where the message is stored. \e PIPE_NAME
  * can be NULL. It is passed verbatim to the receiver.
  *
+ * Many messages can be written with a single system call and wait
+ * for the kernel's acknowledgements with wimaxll_msg_write_batch(),
+ * which gives a result for each:
+ *
+ * @code
+ *  struct iovec msgs[COUNT];
+ *  int results[COUNT];
+ *  ...
+ *  written = wimaxll_msg_write_batch(wmx, PIPE_NAME, msgs, COUNT, results);
+ * @endcode
+ *
  * To wait for a message from the driver:
  *
  * @code
@@ -72,6 +83,22 @@
  *  wimaxll_msg_free(msg);
  * @endcode
  *
+ * Applications that read many messages can avoid the allocation and
+ * copy. wimaxll_msg_read_borrow() returns a pointer straight into the
+ * received netlink message, valid until the calling thread's next
+ * receive on the handle or wimaxll_msg_release():
+ *
+ * @code
+ *  const void *msg;
+ *  ...
+ *  size = wimaxll_msg_read_borrow(wmx, PIPE_NAME, &msg);
+ *  ... <act on the message>
+ *  wimaxll_msg_release(wmx);	// optional
+ * @endcode
+ *
+ * while wimaxll_msg_read_buf() copies the payload into a buffer the
+ * application supplies (and can reuse).
+ *
  * All functions return negative \a errno codes on error.
  *
  * To integrate message reception into a mainloop, \ref callbacks
@@ -94,13 +121,17 @@
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/types.h>
+#include <linux/netlink.h>
 #include <netlink/msg.h>
 #include <netlink/genl/genl.h>
 #include <wimaxll.h>
@@ -134,48 +165,52 @@ struct nla_policy wimaxll_gnl_msg_from_user_policy[WIMAX_GNL_ATTR_MAX + 1] = {
 
 
 /**
- * Callback to process an WIMAX_GNL_OP_MSG_TO_USER from the kernel
+ * Parse a WIMAX_GNL_OP_MSG_TO_USER message from the kernel
  *
  * \internal
  * \ingroup the_messaging_interface
  *
  * \param wmx WiMAX device handle
- * \param mch Pointer to \c struct wimaxll_mc_handle
- * \param msg Pointer to netlink message
- * \return 0 if ok, < 0 errno code on error
- *
- * wimaxll_recv() calls libnl's nl_recvmsgs() to receive messages;
- * when a valid message is received, wimax_gnl__cb() that selects a
- * callback to run for each type of message and it will call this
- * function to actually do it. If no message handling callback is set,
- * this is not called.
+ * \param nl_hdr Pointer to the netlink message header
+ * \param ifidx Where to store the interface index the message is for
+ * \param pipe_name Where to store the pointer to the pipe name (NULL
+ *     if the default pipe)
+ * \param data Where to store the pointer to the message payload
+ * \param size Where to store the size of the message payload
+ * \return 0 if ok, < 0 errno code on error; -ENODEV if the message
+ *     is not for the interface \a wmx represents (or for a pipe it
+ *     has filtered out with wimaxll_set_rx_pipe_filter()).
  *
- * This "netlink" callback will just de-marshall the arguments and
- * call the callback set by the user with wimaxll_set_cb_msg_to_user().
+ * The pointers returned point inside the message, so they are only
+ * valid as long as it is.
  */
-int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *wmx,
-				   struct nl_msg *msg)
+int wimaxll_gnl_parse_msg_to_user(struct wimaxll_handle *wmx,
+				  struct nlmsghdr *nl_hdr, unsigned *ifidx,
+				  const char **pipe_name,
+				  const void **data, size_t *size)
 {
-	size_t size;
-	ssize_t result;
-	struct nlmsghdr *nl_hdr;
+	int result;
 	struct genlmsghdr *gnl_hdr;
 	struct nlattr *tb[WIMAX_GNL_ATTR_MAX+1];
-	const char *pipe_name;
 	unsigned dest_ifidx;
-	void *data;
 
-	d_fnstart(7, wmx, "(wmx %p msg %p)\n", wmx, msg);
-	nl_hdr = nlmsg_hdr(msg);
 	gnl_hdr = nlmsg_data(nl_hdr);
-
 	assert(gnl_hdr->cmd == WIMAX_GNL_OP_MSG_TO_USER);
 
+	/* Quick check before parsing it all, in case the kernel
+	 * couldn't filter it for us */
+	if (wmx->ifidx > 0
+	    && wimaxll_gnl_peek_ifidx(nl_hdr, &dest_ifidx) == 0
+	    && wmx->ifidx != dest_ifidx) {
+		wmx->stats.rx_other++;
+		return -ENODEV;
+	}
+
 	/* Parse the attributes */
 	result = genlmsg_parse(nl_hdr, 0, tb, WIMAX_GNL_ATTR_MAX,
 			       wimaxll_gnl_msg_from_user_policy);
 	if (result < 0) {
-		wimaxll_msg(wmx, "E: %s: genlmsg_parse() failed: %zd\n",
+		wimaxll_msg(wmx, "E: %s: genlmsg_parse() failed: %d\n",
 			  __func__, result);
 		goto error_parse;
 	}
@@ -199,117 +234,310 @@ int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *wmx,
 		goto error_no_attrs;
 
 	}
-	size = nla_len(tb[WIMAX_GNL_MSG_DATA]);
-	data = nla_data(tb[WIMAX_GNL_MSG_DATA]);
+	*ifidx = dest_ifidx;
+	*size = nla_len(tb[WIMAX_GNL_MSG_DATA]);
+	*data = nla_data(tb[WIMAX_GNL_MSG_DATA]);
 
 	if (tb[WIMAX_GNL_MSG_PIPE_NAME])
-		pipe_name = nla_get_string(tb[WIMAX_GNL_MSG_PIPE_NAME]);
+		*pipe_name = nla_get_string(tb[WIMAX_GNL_MSG_PIPE_NAME]);
 	else
-		pipe_name = NULL;
+		*pipe_name = NULL;
+	/* Not a pipe the handle wants (wimaxll_set_rx_pipe_filter())? */
+	if (!wimaxll_pipe_match(wmx->rx_pipe, *pipe_name)) {
+		wmx->stats.rx_filtered++;
+		return -ENODEV;
+	}
 
 	d_printf(1, wmx, "D: CRX genlmsghdr cmd %u version %u\n",
 		 gnl_hdr->cmd, gnl_hdr->version);
 	d_printf(1, wmx, "D: CRX msg from kernel %zu bytes pipe %s\n",
-		 size, pipe_name);
-	d_dump(2, wmx, data, size);
+		 *size, *pipe_name);
+	d_dump(2, wmx, *data, *size);
+	wimaxll_stats_rx(wmx, *pipe_name, *size);
+	wimaxll_capture(wmx, nl_hdr, 0);
+	return result;
 
-	/* If this is an "any" handle, set the wmx->ifidx to the
-	 * received one so the callback can now where did the thing
-	 * come from. Will be restored.
-	 */
-	if (wmx->ifidx == 0) {
-		wmx->ifidx = dest_ifidx;
-		dest_ifidx = 0;
-	}
-	/* Now execute the callback for handling msg-to-user */
-	result = wmx->msg_to_user_cb(wmx, wmx->msg_to_user_priv,
-				     pipe_name, data, size);
-	wmx->ifidx = dest_ifidx;
 error_no_attrs:
+error_parse:
+	if (result == -ENODEV)
+		wmx->stats.rx_other++;
+	else
+		wmx->stats.rx_parse_errors++;
+	return result;
+}
+
+
+/**
+ * Callback to process an WIMAX_GNL_OP_MSG_TO_USER from the kernel
+ *
+ * \internal
+ * \ingroup the_messaging_interface
+ *
+ * \param wmx WiMAX device handle
+ * \param mch Pointer to \c struct wimaxll_mc_handle
+ * \param msg Pointer to netlink message
+ * \return 0 if ok, < 0 errno code on error
+ *
+ * wimaxll_recv() calls libnl's nl_recvmsgs() to receive messages;
+ * when a valid message is received, wimax_gnl__cb() that selects a
+ * callback to run for each type of message and it will call this
+ * function to actually do it. If no message handling callback is set,
+ * this is not called.
+ *
+ * This "netlink" callback will just de-marshall the arguments and
+ * pass them to wimaxll_msg_to_user_deliver().
+ *
+ * \return -%EINPROGRESS if a waiting thread took the message.
+ */
+int wimaxll_gnl_handle_msg_to_user(struct wimaxll_handle *wmx,
+				   struct nl_msg *msg)
+{
+	size_t size;
+	ssize_t result;
+	const char *pipe_name;
+	unsigned dest_ifidx;
+	const void *data;
+
+	d_fnstart(7, wmx, "(wmx %p msg %p)\n", wmx, msg);
+	result = wimaxll_gnl_parse_msg_to_user(wmx, nlmsg_hdr(msg),
+					       &dest_ifidx, &pipe_name,
+					       &data, &size);
+	if (result < 0)
+		goto error_parse;
+	result = wimaxll_msg_to_user_deliver(wmx, dest_ifidx, pipe_name,
+					     data, size);
 error_parse:
 	d_fnend(7, wmx, "(wmx %p msg %p) = %zd\n", wmx, msg, result);
 	return result;
 }
 
 
+/**
+ * Deliver a message to user
+ *
+ * \internal
+ * \ingroup the_messaging_interface
+ *
+ * \param wmx WiMAX device handle
+ * \param ifidx interface the message is for
+ * \param pipe_name pipe it came on (NULL for the default one)
+ * \param data payload
+ * \param size size of \a data
+ * \return what the callback returned, 0 if none was called or
+ *     -%EINPROGRESS if a waiting thread took the message.
+ *
+ * The pipe is looked up once in the handle's table (see pipe.c);
+ * the threads waiting for a message (see wimaxll_rx_waiters_msg())
+ * are offered it first; if none takes it, it goes to the pipe's
+ * callback (wimaxll_pipe_set_cb_msg_to_user()) or to the one set with
+ * wimaxll_set_cb_msg_to_user() if the pipe has none.
+ */
+int wimaxll_msg_to_user_deliver(struct wimaxll_handle *wmx, unsigned ifidx,
+				const char *pipe_name,
+				const void *data, size_t size)
+{
+	int pipe_id;
+	wimaxll_msg_to_user_cb_f cb;
+	void *priv;
+	struct wimaxll_dispatch dispatch;
+	int result;
+
+	pipe_id = wimaxll_pipe_lookup(wmx, pipe_name, &cb, &priv);
+	/* Threads waiting in wimaxll_msg_read*() get first dibs */
+	if (wimaxll_rx_waiters_msg(wmx, pipe_id, pipe_name, data, size))
+		return -EINPROGRESS;
+	if (cb == NULL) {
+		cb = wmx->msg_to_user_cb;
+		priv = wmx->msg_to_user_priv;
+	}
+	if (cb == NULL)
+		return 0;
+	/* If this is an "any" handle, wimaxll_ifidx() returns the
+	 * received one while the callback runs, so it can know where
+	 * did the thing come from. */
+	wimaxll_dispatch_push(&dispatch, wmx, ifidx);
+	/* Now execute the callback for handling msg-to-user */
+	result = cb(wmx, priv, pipe_name, data, size);
+	wimaxll_dispatch_pop(&dispatch);
+	return result;
+}
+
+
+/*
+ * How wimaxll_msg_read_cb() hands the message payload to the reader
+ *
+ * WIMAXLL_MSG_READ_COPY: allocate a buffer and copy the payload to
+ *     it (wimaxll_msg_read()).
+ * WIMAXLL_MSG_READ_BORROW: point into the netlink message and hold a
+ *     reference to it (wimaxll_msg_read_borrow()).
+ * WIMAXLL_MSG_READ_BUF: copy the payload into a buffer supplied by
+ *     the caller (wimaxll_msg_read_buf()).
+ */
+enum wimaxll_msg_read_mode {
+	WIMAXLL_MSG_READ_COPY,
+	WIMAXLL_MSG_READ_BORROW,
+	WIMAXLL_MSG_READ_BUF,
+};
+
+
+/*
+ * Check if a message on a pipe is one that was asked for
+ *
+ * \internal
+ *
+ * \param dst_pipe_name pipe asked for (NULL for the default one,
+ *     WIMAX_PIPE_ANY for any)
+ * \param pipe_name pipe the message came on (NULL for the default)
+ * \return !0 if it matches, 0 otherwise
+ *
+ * This way of checking makes it kind of easier to read...if the user
+ * requests messages from the default pipe (pipe_name == NULL), we
+ * want only those. Sucks strcmp doesn't take NULLs :)
+ */
+int wimaxll_pipe_match(const char *dst_pipe_name, const char *pipe_name)
+{
+	if (dst_pipe_name == WIMAX_PIPE_ANY)
+		return 1;
+	else if (dst_pipe_name == NULL && pipe_name == NULL)
+		return 1;
+	else if (dst_pipe_name == NULL || pipe_name == NULL)
+		return 0;
+	else
+		return strcmp(dst_pipe_name, pipe_name) == 0;
+}
+
+
 struct wimaxll_cb_msg_to_user_context {
-	struct wimaxll_cb_ctx ctx;
+	struct wimaxll_rx_waiter waiter;
+	ssize_t result;
+	const char *pipe_name;
+	int pipe_id;
+	enum wimaxll_msg_read_mode mode;
 	void *data;
+	size_t size;
+	struct nl_msg *held;
 };
 
 
 /*
  * Default handling of messages
  *
- * When someone calls wimaxll_msg_read() those functions set this
- * default callback, which will just copy the data to a buffer and
- * pass that pointer to the caller along with the size.
+ * When someone calls wimaxll_msg_read() (or one of its variants)
+ * those functions register a waiter with this callback, which will
+ * just pass the data to the caller, as requested by the context's
+ * mode, along with the size.
+ *
+ * The pipe name the caller asked for was interned when the waiter
+ * was registered, so comparing IDs is enough.
+ *
+ * Runs in the thread that is reading (maybe not the caller's), with
+ * wmx->rx_mutex held.
  */
 static
 int wimaxll_msg_read_cb(struct wimaxll_handle *wmx,
-			void *_ctx,
+			struct wimaxll_rx_waiter *waiter, int pipe_id,
 			const char *pipe_name,
 			const void *data, size_t data_size)
 {
-	int result;
-	struct wimaxll_cb_ctx *ctx = _ctx;
 	struct wimaxll_cb_msg_to_user_context *mtu_ctx =
 		wimaxll_container_of(
-			ctx, struct wimaxll_cb_msg_to_user_context, ctx);
-	const char *dst_pipe_name = mtu_ctx->data;
-	int pipe_match;
+			waiter, struct wimaxll_cb_msg_to_user_context, waiter);
+	const char *dst_pipe_name = mtu_ctx->pipe_name;
 
 	d_fnstart(3, wmx, "(wmx %p ctx %p pipe_name %s data %p size %zd)\n",
-		  wmx, ctx, pipe_name, data, data_size);
-
-	result = -EBUSY;
-	if (mtu_ctx->ctx.result != -EINPROGRESS)
-		goto out;
-	/*
-	 * Is there a match in requested pipes? (dst_pipe_name ==
-	 * WIMAX_PIPE_ANY), * messages for any pipe work.
-	 *
-	 * This way of checking makes it kind of easier to read...if
-	 * the user requests messages from the default pipe (pipe_name
-	 * == NULL), we want only those. Sucks strcmp doesn't take
-	 * NULLs :)
-	 */
+		  wmx, mtu_ctx, pipe_name, data, data_size);
 	d_printf(3, wmx, "dst_pipe_name %s\n", dst_pipe_name);
+	if (dst_pipe_name != WIMAX_PIPE_ANY
+	    && (pipe_id < 0 || pipe_id != mtu_ctx->pipe_id)) {
+		mtu_ctx->result = -EINPROGRESS;
+		goto out;	/* Not addressed to us */
+	}
 
-	if (dst_pipe_name == WIMAX_PIPE_ANY)
-		pipe_match = 1;
-	else if (dst_pipe_name == NULL && pipe_name == NULL)
-		pipe_match = 1;
-	else if ((dst_pipe_name == NULL && pipe_name != NULL)
-		 || (dst_pipe_name != NULL && pipe_name == NULL))
-		pipe_match = 0;
-	else if (strcmp(dst_pipe_name, pipe_name) == 0)
-		pipe_match = 1;
-	else
-		pipe_match = 0;
-
-	result = -EINPROGRESS;
-	if (pipe_match == 0)	/* Not addressed to us */
-		goto out;
-
-	mtu_ctx->data = malloc(data_size);
-	if (mtu_ctx->data) {
-		memcpy(mtu_ctx->data, data, data_size);
-		ctx->result = data_size;
-	} else
-		ctx->result = -ENOMEM;
-	/* Now tell wimaxll_recv() [the callback dispatcher] to stop
-	 * and return control to the caller */
-	result = -EBUSY;
+	switch (mtu_ctx->mode) {
+	case WIMAXLL_MSG_READ_COPY:
+		mtu_ctx->data = malloc(data_size);
+		if (mtu_ctx->data) {
+			memcpy(mtu_ctx->data, data, data_size);
+			mtu_ctx->result = data_size;
+		} else {
+			wmx->stats.rx_nomem++;
+			mtu_ctx->result = -ENOMEM;
+		}
+		break;
+	case WIMAXLL_MSG_READ_BORROW:
+		/* data points inside wmx->rx_msg; keep it alive (and
+		 * if it is a batch buffer, have it replaced before
+		 * reading into it again) */
+		assert(wmx->rx_msg != NULL);
+		nlmsg_get(wmx->rx_msg);
+		if (wmx->rx_msg_lent)
+			*wmx->rx_msg_lent = 1;
+		mtu_ctx->held = wmx->rx_msg;
+		mtu_ctx->data = (void *) data;
+		mtu_ctx->result = data_size;
+		break;
+	case WIMAXLL_MSG_READ_BUF:
+		if (data_size > mtu_ctx->size)
+			mtu_ctx->result = -EMSGSIZE;
+		else {
+			memcpy(mtu_ctx->data, data, data_size);
+			mtu_ctx->result = data_size;
+		}
+		break;
+	default:
+		assert(0);
+	}
 out:
-	d_fnend(3, wmx, "(wmx %p ctx %p pipe_name %s data %p size %zd) = %d\n",
-		wmx, ctx, pipe_name, data, data_size, result);
+	d_fnend(3, wmx, "(wmx %p ctx %p pipe_name %s data %p size %zd) "
+		"= %zd\n", wmx, mtu_ctx, pipe_name, data, data_size,
+		mtu_ctx->result);
+	return mtu_ctx->result;
+}
+
+
+/*
+ * Common code for the wimaxll_msg_read*() family
+ *
+ * Registers a waiter and receives (or waits for another thread
+ * that is receiving to hand it a message, see wimaxll_rx_wait())
+ * until it gets a message in the desired pipe or the timeout
+ * expires.
+ *
+ * A borrowed message is kept as the calling thread's, until it
+ * receives again or calls wimaxll_msg_release().
+ */
+static
+ssize_t __wimaxll_msg_read(struct wimaxll_handle *wmx,
+			   struct wimaxll_cb_msg_to_user_context *mtu_ctx,
+			   int timeout_ms)
+{
+	ssize_t result;
+
+	if (mtu_ctx->pipe_name != WIMAX_PIPE_ANY) {
+		result = wimaxll_pipe_intern(wmx, mtu_ctx->pipe_name);
+		if (result < 0)
+			return result;
+		mtu_ctx->pipe_id = result;
+	}
+	mtu_ctx->waiter.msg_to_user = wimaxll_msg_read_cb;
+	mtu_ctx->result = -EINPROGRESS;
+	result = wimaxll_rx_wait(wmx, &mtu_ctx->waiter, timeout_ms);
+	d_printf(3, wmx, "I: mtu_ctx.result %zd result %zd\n",
+		 mtu_ctx->result, result);
+	if (!mtu_ctx->waiter.done)
+		return result;
+	result = mtu_ctx->result;
+	if (mtu_ctx->held != NULL) {
+		result = wimaxll_rx_hold(wmx, mtu_ctx->held);
+		if (result == 0)
+			result = mtu_ctx->result;
+	}
 	return result;
 }
 
 
 /**
- * Read a message from any WiMAX kernel-user pipe
+ * Read a message from any WiMAX kernel-user pipe, with a timeout
  *
  * \param wmx WiMAX device handle
  * \param pipe_name Name of the pipe for which we want to read a
@@ -317,58 +545,165 @@ out:
  *     pipe name) will be received. To receive messages from any pipe,
  *     use pipe WIMAX_PIPE_ANY.
  * \param buf Somewhere where to store the pointer to the message data.
+ * \param timeout_ms How long to wait for the message, in
+ *     milliseconds; -1 blocks for ever, 0 doesn't block.
  * \return If successful, a positive (and \c *buf set) or zero size of
  *     the message; on error, a negative \a errno code (\c buf
- *     n/a).
+ *     n/a); -%ETIMEDOUT if no message arrived in time.
  *
  * Returns a message allocated in \c *buf as sent by the kernel via
  * the indicated pipe. The message is allocated by the
  * library and owned by the caller. When done, it has to be freed with
  * wimaxll_msg_free() to release the space allocated to it.
  *
- * \note This is a blocking call.
+ * To avoid the allocation and copy, see wimaxll_msg_read_borrow()
+ * and wimaxll_msg_read_buf().
  *
  * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_read_timeout(struct wimaxll_handle *wmx,
+				 const char *pipe_name, void **buf,
+				 int timeout_ms)
+{
+	ssize_t result;
+	struct wimaxll_cb_msg_to_user_context mtu_ctx = {
+		.pipe_name = pipe_name,
+		.mode = WIMAXLL_MSG_READ_COPY,
+	};
+
+	d_fnstart(3, wmx, "(wmx %p pipe_name %s, buf %p timeout_ms %d)\n",
+		  wmx, pipe_name, buf, timeout_ms);
+	result = __wimaxll_msg_read(wmx, &mtu_ctx, timeout_ms);
+	if (result >= 0)
+		*buf = mtu_ctx.data;
+	d_fnend(3, wmx, "(wmx %p pipe_name %s buf %p timeout_ms %d) = %zd\n",
+		wmx, pipe_name, buf, timeout_ms, result);
+	return result;
+}
+
+
+/**
+ * Read a message from any WiMAX kernel-user pipe
  *
- * \internal
+ * \param wmx WiMAX device handle
+ * \param pipe_name Name of the pipe for which we want to read a
+ *     message. If NULL, only messages from the default pipe (without
+ *     pipe name) will be received. To receive messages from any pipe,
+ *     use pipe WIMAX_PIPE_ANY.
+ * \param buf Somewhere where to store the pointer to the message data.
+ * \return If successful, a positive (and \c *buf set) or zero size of
+ *     the message; on error, a negative \a errno code (\c buf
+ *     n/a).
  *
- * We use the data pointer of the context structure to pass the
- * pipe_name to the callback. This is ok, as we process only one
- * message and then return.
+ * Same as wimaxll_msg_read_timeout() using the handle's default
+ * timeout (see wimaxll_set_timeout()).
+ *
+ * \note This is a blocking call.
+ *
+ * \ingroup the_messaging_interface
  */
 ssize_t wimaxll_msg_read(struct wimaxll_handle *wmx,
 			 const char *pipe_name, void **buf)
+{
+	return wimaxll_msg_read_timeout(wmx, pipe_name, buf,
+					wmx->timeout_ms);
+}
+
+
+/**
+ * Read a message from any WiMAX kernel-user pipe without copying it
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Name of the pipe for which we want to read a
+ *     message (same semantics as in wimaxll_msg_read()).
+ * \param buf Somewhere where to store the pointer to the message data.
+ * \return If successful, a positive (and \c *buf set) or zero size of
+ *     the message; on error, a negative \a errno code (\c buf
+ *     n/a).
+ *
+ * Like wimaxll_msg_read(), but \c *buf is set to point straight into
+ * the netlink message as it was received from the kernel; no memory
+ * is allocated and no data copied. This holds too when the message
+ * was received by another thread with wimaxll_recv_batch() or the
+ * event loop: the buffer it was read into is lent and replaced with
+ * a new one before they read again.
+ *
+ * The data is owned by the library and is only valid until the next
+ * call that receives on this handle from the same thread
+ * (wimaxll_recv(), wimaxll_msg_read*(),
+ * wimaxll_wait_for_state_change()...), until wimaxll_msg_release()
+ * is called from the same thread or the handle is closed. Other
+ * threads reading from the handle don't affect it. Do \b not call
+ * wimaxll_msg_free() on it.
+ *
+ * \note This is a blocking call (limited by the handle's default
+ *     timeout, see wimaxll_set_timeout()).
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_read_borrow(struct wimaxll_handle *wmx,
+				const char *pipe_name, const void **buf)
 {
 	ssize_t result;
 	struct wimaxll_cb_msg_to_user_context mtu_ctx = {
-		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
-		.data = (void *) pipe_name,
+		.pipe_name = pipe_name,
+		.mode = WIMAXLL_MSG_READ_BORROW,
 	};
-	wimaxll_msg_to_user_cb_f prev_cb = NULL;
-	void *prev_priv = NULL;
 
 	d_fnstart(3, wmx, "(wmx %p pipe_name %s, buf %p)\n",
 		  wmx, pipe_name, buf);
-	wimaxll_get_cb_msg_to_user(wmx, &prev_cb, &prev_priv);
-	wimaxll_set_cb_msg_to_user(wmx, wimaxll_msg_read_cb,
-				   &mtu_ctx.ctx);
-	do {
-		/* Loop until we get a message in the desired pipe */
-		result = wimaxll_recv(wmx);
-		d_printf(3, wmx, "I: mtu_ctx.result %zd result %zd\n",
-			 mtu_ctx.ctx.result, result);
-	} while (result >= 0 && mtu_ctx.ctx.result == -EINPROGRESS);
-	if (result >= 0) {
+	result = __wimaxll_msg_read(wmx, &mtu_ctx, wmx->timeout_ms);
+	if (result >= 0)
 		*buf = mtu_ctx.data;
-		result = mtu_ctx.ctx.result;
-	}
-	wimaxll_set_cb_msg_to_user(wmx, prev_cb, prev_priv);
 	d_fnend(3, wmx, "(wmx %p pipe_name %s buf %p) = %zd\n",
 		wmx, pipe_name, buf, result);
 	return result;
 }
 
 
+/**
+ * Read a message from any WiMAX kernel-user pipe into a buffer
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Name of the pipe for which we want to read a
+ *     message (same semantics as in wimaxll_msg_read()).
+ * \param buf Buffer where to copy the message data.
+ * \param size Size of \a buf.
+ * \return If successful, a positive or zero size of the message
+ *     written to \a buf; on error, a negative \a errno code:
+ *
+ *     -%EMSGSIZE: the message didn't fit in \a buf; it has been
+ *      consumed and discarded.
+ *
+ * Like wimaxll_msg_read(), but the message is copied into a buffer
+ * owned by the caller, which can be reused from call to call, so no
+ * allocation is done.
+ *
+ * \note This is a blocking call (limited by the handle's default
+ *     timeout, see wimaxll_set_timeout()).
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_read_buf(struct wimaxll_handle *wmx,
+			     const char *pipe_name, void *buf, size_t size)
+{
+	ssize_t result;
+	struct wimaxll_cb_msg_to_user_context mtu_ctx = {
+		.pipe_name = pipe_name,
+		.mode = WIMAXLL_MSG_READ_BUF,
+		.data = buf,
+		.size = size,
+	};
+
+	d_fnstart(3, wmx, "(wmx %p pipe_name %s, buf %p size %zu)\n",
+		  wmx, pipe_name, buf, size);
+	result = __wimaxll_msg_read(wmx, &mtu_ctx, wmx->timeout_ms);
+	d_fnend(3, wmx, "(wmx %p pipe_name %s buf %p size %zu) = %zd\n",
+		wmx, pipe_name, buf, size, result);
+	return result;
+}
+
+
 /**
  * Free a message received with wimaxll_msg_read()
  *
@@ -384,6 +719,29 @@ void wimaxll_msg_free(void *msg)
 }
 
 
+/**
+ * Release a message lent with wimaxll_msg_read_borrow()
+ *
+ * \param wmx WiMAX device handle
+ *
+ * Releases the reference the library holds on the last message lent
+ * by wimaxll_msg_read_borrow() to the calling thread; the pointer
+ * returned by it is no longer valid. Calling this when no message is
+ * lent does nothing. Messages lent to other threads are not
+ * affected.
+ *
+ * This is done automatically by the next receive operation on the
+ * handle in the same thread; calling it explicitly allows returning
+ * the memory earlier.
+ *
+ * \ingroup the_messaging_interface
+ */
+void wimaxll_msg_release(struct wimaxll_handle *wmx)
+{
+	wimaxll_rx_hold(wmx, NULL);
+}
+
+
 /**
  * Send a driver-specific message to a WiMAX device
  *
@@ -409,14 +767,22 @@ ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
 	ssize_t result;
 	struct nl_msg *nl_msg;
 	void *msg;
+	size_t payload;
+	struct timespec start;
+	unsigned ifidx;
 
 	d_fnstart(3, wmx, "(wmx %p buf %p size %zu)\n", wmx, buf, size);
 	result = -EBADF;
-	if (wmx->ifidx == 0)
+	ifidx = wimaxll_ifidx(wmx);
+	if (ifidx == 0)
 		goto error_not_any;
-	nl_msg = nlmsg_new();
+	payload = GENL_HDRLEN + nla_total_size(sizeof(__u32))
+		+ nla_total_size(size);
+	if (pipe_name != NULL)
+		payload += nla_total_size(strlen(pipe_name) + 1);
+	nl_msg = wimaxll_tx_msg_get(wmx, payload);
 	if (nl_msg == NULL) {
-		result = nl_get_errno();
+		result = -ENOMEM;
 		wimaxll_msg(wmx, "E: cannot allocate generic netlink "
 			  "message: %m\n");
 		goto error_msg_alloc;
@@ -431,7 +797,7 @@ ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
 		goto error_msg_prep;
 	}
 
-	nla_put_u32(nl_msg, WIMAX_GNL_MSG_IFIDX, (__u32) wmx->ifidx);
+	nla_put_u32(nl_msg, WIMAX_GNL_MSG_IFIDX, (__u32) ifidx);
 	if (pipe_name != NULL)
 		nla_put_string(nl_msg, WIMAX_GNL_MSG_PIPE_NAME, pipe_name);
 	nla_put(nl_msg, WIMAX_GNL_MSG_DATA, size, buf);
@@ -442,20 +808,17 @@ ssize_t wimaxll_msg_write(struct wimaxll_handle *wmx,
 	d_printf(5, wmx, "D: CTX wimax message:\n");
 	d_dump(5, wmx, buf, size);
 
-	result = nl_send_auto_complete(wmx->nlh_tx, nl_msg);
-	if (result < 0) {
-		wimaxll_msg(wmx, "E: error sending message: %zd\n", result);
-		goto error_msg_send;
-	}
-
-	result = wimaxll_wait_for_ack(wmx);	/* Get the ACK from netlink */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Send it and get the ACK from netlink */
+	result = wimaxll_send_wait_for_ack(wmx, nl_msg, 1);
 	if (result < 0)
 		wimaxll_msg(wmx, "E: %s: generic netlink ack failed: %zd\n",
 			  __func__, result);
-error_msg_send:
+	wimaxll_stats_ack(wmx, WIMAXLL_STATS_OP_MSG_WRITE, &start, result);
 error_msg_prep:
-	nlmsg_free(nl_msg);
+	wimaxll_tx_msg_put(wmx, nl_msg);
 error_msg_alloc:
+	wimaxll_stats_tx(wmx, pipe_name, size, result);
 error_not_any:
 	d_fnend(3, wmx, "(wmx %p buf %p size %zu) = %zd\n",
 		wmx, buf, size, result);
@@ -463,6 +826,254 @@ error_not_any:
 }
 
 
+enum {
+	/*
+	 * Max bytes and messages sent in one go by
+	 * wimaxll_msg_write_batch(); the kernel acks each message
+	 * with a datagram of its own (that carries a copy of it if it
+	 * failed), so this also bounds how much we need to have room
+	 * for in the TX socket's receive buffer--if it fills up, the
+	 * kernel drops the acks that don't fit.
+	 */
+	WIMAXLL_MSG_BATCH_BYTES = 32 * 1024,
+	WIMAXLL_MSG_BATCH_MSGS = 64,
+	/* Biggest payload a netlink attribute (16 bit nla_len) holds */
+	WIMAXLL_MSG_BATCH_DATA_MAX = 0xffff - NLA_HDRLEN,
+};
+
+
+/*
+ * Free the buffer used by wimaxll_msg_write_batch()
+ *
+ * \internal
+ *
+ * Called from wimaxll_close().
+ */
+void wimaxll_msg_batch_free(struct wimaxll_handle *wmx)
+{
+	free(wmx->tx_batch);
+	wmx->tx_batch = NULL;
+	wmx->tx_batch_size = 0;
+}
+
+
+/*
+ * Append a netlink attribute to a message being built by hand
+ */
+static
+void *wimaxll_msg_batch_put(void *itr, unsigned type,
+			    const void *data, size_t size)
+{
+	struct nlattr *nla = itr;
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + size;
+	memcpy(itr + NLA_HDRLEN, data, size);
+	memset(itr + NLA_HDRLEN + size, 0, NLA_ALIGN(size) - size);
+	return itr + NLA_HDRLEN + NLA_ALIGN(size);
+}
+
+
+/*
+ * Send a chunk of a batch and collect its acks
+ *
+ * Called with wmx->tx->mutex held (the chunk was built in
+ * wmx->tx_batch with sequence numbers allocated under it).
+ *
+ * \return 0 if all were sent and acked (with whatever result), < 0
+ *     errno code if the chunk couldn't be sent or we stopped getting
+ *     acks; the messages not acked are left with that as result.
+ */
+static
+int wimaxll_msg_batch_flush(struct wimaxll_handle *wmx,
+			    struct wimaxll_ack_wait *wait, size_t size,
+			    const struct timespec *deadline)
+{
+	int result, left;
+	size_t cnt;
+	struct nlmsghdr *nl_hdr;
+
+	result = nl_sendto(wmx->tx->nlh, wmx->tx_batch, size);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: %s: error sending messages: %d\n",
+			    __func__, result);
+		goto error_send;
+	}
+	left = size;
+	if (wmx->capture)
+		for (nl_hdr = wmx->tx_batch; NLMSG_OK(nl_hdr, left);
+		     nl_hdr = NLMSG_NEXT(nl_hdr, left))
+			wimaxll_capture(wmx, nl_hdr, 1);
+	return wimaxll_ack_wait(wmx, wait, deadline, wmx->timeout_ms);
+
+error_send:
+	for (cnt = 0; cnt < wait->count; cnt++)
+		wait->results[cnt] = result;
+	return result;
+}
+
+
+/**
+ * Send many driver-specific messages to a WiMAX device
+ *
+ * \param wmx wimax device descriptor
+ * \param pipe_name Name of the pipe for which to send the messages;
+ *     NULL means adding no destination pipe.
+ * \param msgs Array of \a count messages (pointer and size of each).
+ * \param count Number of messages in \a msgs.
+ * \param results Where to store the result of each message (0 if
+ *     ok, < 0 errno code as wimaxll_msg_write() would return); can be
+ *     NULL.
+ * \return Number of messages written (and acked) succesfully before
+ *     the first one that failed (so \a count if they all went
+ *     through); if the first one failed, its (negative errno code)
+ *     result. -%EMSGSIZE if any message is too big to fit in a
+ *     netlink attribute (about 64K); none is sent then and \a
+ *     results is not touched.
+ *
+ * Same as calling wimaxll_msg_write() for each message, but many
+ * messages are built in the same buffer and sent with a single
+ * system call, then all their acknowledgements are collected (by
+ * sequence number). This way, writing a burst of small messages
+ * takes about one round trip to the kernel instead of one for each.
+ *
+ * The kernel processes all the messages, even if some fail. The
+ * handle's timeout (see wimaxll_set_timeout()) applies to the whole
+ * batch.
+ *
+ * \note This is a blocking call
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_msg_write_batch(struct wimaxll_handle *wmx,
+				const char *pipe_name,
+				const struct iovec *msgs, size_t count,
+				int *results)
+{
+	ssize_t result;
+	size_t cnt, first, size, msg_size, pipe_size, written;
+	void *itr;
+	struct nlmsghdr *nl_hdr;
+	struct genlmsghdr *gnl_hdr;
+	struct wimaxll_ack_wait wait;
+	struct timespec deadline;
+	unsigned pid;
+	int *results_alloc = NULL, family_gone = 0;
+	__u32 ifidx = wimaxll_ifidx(wmx);
+
+	d_fnstart(3, wmx, "(wmx %p msgs %p count %zu)\n", wmx, msgs, count);
+	result = -EBADF;
+	if (ifidx == 0)
+		goto error_not_any;
+	result = 0;
+	if (count == 0)
+		goto out_empty;
+	result = -EMSGSIZE;
+	for (cnt = 0; cnt < count; cnt++)
+		if (msgs[cnt].iov_len > WIMAXLL_MSG_BATCH_DATA_MAX) {
+			wimaxll_msg(wmx, "E: %s: message %zu too big (%zu "
+				    "bytes)\n", __func__, cnt,
+				    msgs[cnt].iov_len);
+			goto error_msg_size;
+		}
+	result = -ENOMEM;
+	if (results == NULL) {
+		results = results_alloc = malloc(count * sizeof(results[0]));
+		if (results == NULL)
+			goto error_results_alloc;
+	}
+	for (cnt = 0; cnt < count; cnt++)
+		results[cnt] = -EINPROGRESS;
+	pid = nl_socket_get_local_port(wmx->tx->nlh);
+	pipe_size = pipe_name ? strlen(pipe_name) + 1 : 0;
+	wimaxll_deadline_init(&deadline, wmx->timeout_ms);
+	result = 0;
+	pthread_mutex_lock(&wmx->tx->mutex);
+	for (first = 0; first < count; first = cnt) {
+		/* Pack as many as fit in a chunk (at least one) */
+		size = 0;
+		for (cnt = first; cnt < count; cnt++) {
+			msg_size = GENL_HDRLEN + nla_total_size(sizeof(ifidx))
+				+ nla_total_size(msgs[cnt].iov_len);
+			if (pipe_name != NULL)
+				msg_size += nla_total_size(pipe_size);
+			msg_size = NLMSG_SPACE(msg_size);
+			if (cnt > first
+			    && (size + msg_size > WIMAXLL_MSG_BATCH_BYTES
+				|| cnt - first >= WIMAXLL_MSG_BATCH_MSGS))
+				break;
+			if (size + msg_size > wmx->tx_batch_size) {
+				itr = realloc(wmx->tx_batch, size + msg_size);
+				if (itr == NULL) {
+					wimaxll_msg(wmx, "E: %s: cannot "
+						    "allocate buffer\n",
+						    __func__);
+					result = -ENOMEM;
+					goto error_buf_alloc;
+				}
+				wmx->tx_batch = itr;
+				wmx->tx_batch_size = size + msg_size;
+			}
+			nl_hdr = wmx->tx_batch + size;
+			nl_hdr->nlmsg_len = msg_size;
+			nl_hdr->nlmsg_type = wimaxll_family_id(wmx);
+			nl_hdr->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+			nl_hdr->nlmsg_seq = nl_socket_use_seq(wmx->tx->nlh);
+			nl_hdr->nlmsg_pid = pid;
+			if (cnt == first)
+				wait.seq = nl_hdr->nlmsg_seq;
+			gnl_hdr = NLMSG_DATA(nl_hdr);
+			memset(gnl_hdr, 0, GENL_HDRLEN);
+			gnl_hdr->cmd = WIMAX_GNL_OP_MSG_FROM_USER;
+			gnl_hdr->version = WIMAX_GNL_VERSION;
+			itr = (void *) gnl_hdr + GENL_HDRLEN;
+			itr = wimaxll_msg_batch_put(itr, WIMAX_GNL_MSG_IFIDX,
+						    &ifidx, sizeof(ifidx));
+			if (pipe_name != NULL)
+				itr = wimaxll_msg_batch_put(
+					itr, WIMAX_GNL_MSG_PIPE_NAME,
+					pipe_name, pipe_size);
+			wimaxll_msg_batch_put(itr, WIMAX_GNL_MSG_DATA,
+					      msgs[cnt].iov_base,
+					      msgs[cnt].iov_len);
+			size += msg_size;
+		}
+		wait.count = wait.pending = cnt - first;
+		wait.results = results + first;
+		d_printf(3, wmx, "D: CTX %zu messages (%zu bytes) seq 0x%x\n",
+			 wait.count, size, wait.seq);
+		result = wimaxll_msg_batch_flush(wmx, &wait, size, &deadline);
+		if (result < 0)
+			break;
+	}
+error_buf_alloc:
+	pthread_mutex_unlock(&wmx->tx->mutex);
+	written = 0;
+	for (cnt = 0; cnt < count; cnt++) {
+		if (results[cnt] == -EINPROGRESS)	/* never sent */
+			results[cnt] = result;
+		if (results[cnt] == -ENOENT)
+			family_gone = 1;
+		wimaxll_stats_tx(wmx, pipe_name, msgs[cnt].iov_len,
+				 results[cnt]);
+		if (results[cnt] == 0 && written == cnt)
+			written++;
+	}
+	/* The WiMAX modules were reloaded? (see wimaxll_send_wait_for_ack()) */
+	if (family_gone)
+		wimaxll_gnl_family_invalidate(wmx->gnl_family_id);
+	result = results[0] < 0 ? results[0] : written;
+	free(results_alloc);
+error_results_alloc:
+error_msg_size:
+out_empty:
+error_not_any:
+	d_fnend(3, wmx, "(wmx %p msgs %p count %zu) = %zd\n",
+		wmx, msgs, count, result);
+	return result;
+}
+
+
 /**
  * Get the callback and priv pointer for a MSG_TO_USER message
  *
@@ -35,8 +35,9 @@
 /**
  * @defgroup device_management WiMAX device management
  *
- * The main device management operations are wimaxll_open(),
- * wimaxll_close() and wimax_reset().
+ * The main device management operations are wimaxll_open() (or
+ * wimaxll_open_ex() for more options), wimaxll_close() and
+ * wimax_reset().
  *
  * It is allowed to have more than one handle opened at the same
  * time.
@@ -49,11 +50,16 @@
  *
  * \code
  * wimaxll_open()
- *   wimaxll_gnl_resolve()
- *   wimaxll_mc_rx_open()
+ *   wimaxll_open_ex()
+ *     wimaxll_gnl_resolve()
+ *       wimaxll_gnl_family_get()
+ *     wimaxll_gnl_probe()
+ *     wimaxll_rx_open()
+ *       wimaxll_rx_shared_get()
  *
  * wimaxll_close()
- *   wimaxll_mc_rx_close()
+ *   wimaxll_rx_close()
+ *     wimaxll_rx_shared_put()
  *   wimaxll_free()
  *
  * wimaxll_ifname()
@@ -61,12 +67,15 @@
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include <linux/types.h>
 #include <net/if.h>
 #include <netlink/msg.h>
@@ -120,16 +129,27 @@ static
  * - any other < 0 error code to indicate an error and that the
  *   message should be skipped.
  *
+ * If the handle shares its RX socket with others, messages for the
+ * other handles' devices are processed with their callbacks (see
+ * wimaxll_rx_shared_demux()) and are considered for another device
+ * (-ENODEV) as far as this handle is concerned.
+ *
+ * Notifications from the generic netlink controller go to
+ * wimaxll_hotplug_ctrl().
+ *
  * \fn int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
  */
 int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
 {
 	ssize_t result;
+	int stop;
 	enum nl_cb_action result_nl;
 	struct wimaxll_cb_ctx *ctx = _ctx;
-	struct wimaxll_handle *wmx = ctx->wmx;
+	struct wimaxll_handle *wmx = ctx->wmx, *dst_wmx;
 	struct nlmsghdr *nl_hdr;
 	struct genlmsghdr *gnl_hdr;
+	struct nl_msg *prev_msg;
+	int *prev_lent;
 
 	d_fnstart(3, wmx, "(msg %p wmx %p)\n", msg, wmx);
 	nl_hdr = nlmsg_hdr(msg);
@@ -137,15 +157,45 @@ int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
 
 	d_printf(3, wmx, "E: %s: received gnl message %d\n",
 		 __func__, gnl_hdr->cmd);
+	if (nl_hdr->nlmsg_type == GENL_ID_CTRL) {
+		/* The WiMAX stack coming or going? */
+		wimaxll_hotplug_ctrl(wmx, nl_hdr);
+		result = 0;
+		goto out_other;
+	}
+	dst_wmx = wimaxll_rx_shared_demux(wmx, nl_hdr);
+	if (dst_wmx != wmx) {
+		if (dst_wmx != NULL) {
+			struct wimaxll_cb_ctx dst_ctx =
+				WIMAXLL_CB_CTX_INIT(dst_wmx);
+			if (wimaxll_gnl_cb(msg, &dst_ctx) == NL_STOP)
+				wimaxll_rx_busy_set(dst_wmx);
+			wimaxll_rx_handle_put(dst_wmx);
+		}
+		result = -ENODEV;
+		goto out_other;
+	}
+	/* A callback receiving again? restore what it was dispatching */
+	prev_msg = wmx->rx_msg;
+	prev_lent = wmx->rx_msg_lent;
+	wmx->rx_msg = msg;
+	wmx->rx_msg_lent = NULL;
 	switch (gnl_hdr->cmd) {
 	case WIMAX_GNL_OP_MSG_TO_USER:
-		if (wmx->msg_to_user_cb)
+		/* State changes held for coalescing came before this */
+		stop = wimaxll_state_change_flush(wmx) == -EBUSY;
+		if (wmx->msg_to_user_cb || wmx->pipes.subscribed
+		    || wimaxll_rx_waiting(wmx))
 			result = wimaxll_gnl_handle_msg_to_user(wmx, msg);
 		else
 			result = 0;
+		if (stop && result >= 0)
+			result = -EBUSY;
 		break;
 	case WIMAX_GNL_RE_STATE_CHANGE:
-		if (wmx->state_change_cb)
+		if (wmx->state_change_cb || wmx->stch_coalesced_cb
+		    || wmx->state_cache.max_age_ms
+		    || wimaxll_rx_waiting(wmx))
 			result = wimaxll_gnl_handle_state_change(wmx, msg);
 		else
 			result = 0;
@@ -155,6 +205,9 @@ int wimaxll_gnl_cb(struct nl_msg *msg, void *_ctx)
 			 __func__, gnl_hdr->cmd);
 		result = 0;
 	}
+	wmx->rx_msg = prev_msg;
+	wmx->rx_msg_lent = prev_lent;
+out_other:
 	if (result == -EBUSY) {		/* stop signal from the user's callback */
 		result_nl = NL_STOP;
 		result = 0;
@@ -189,43 +242,43 @@ int wimaxll_recv_fd(struct wimaxll_handle *wmx)
 }
 
 
-/**
- * Read notifications from the WiMAX multicast group
- *
- * \param wmx WiMAX device handle
- * \return Value returned by the callback functions (depending on the
- *     implementation of the callback). On error, a negative errno
- *     code:
- *
- *     -%EBUSY: callback instructed to stop processing messages
- *
- * Read one or more messages from a multicast group and for each valid
- * one, execute the callbacks set in the multi cast handle.
- *
- * The callbacks are expected to handle the messages and set
- * information in the context specific to the mc handle
- * (mch->cb_ctx). In case of any type of errors (cb_ctx.result < 0),
- * it is expected that no resources will be tied to the context.
- *
- * \remarks This is a blocking call.
- *
- * \ingroup mc_rx
+/*
+ * Receive and dispatch notifications (with the reader role taken)
  *
  * \internal
  *
+ * \param waiter if not NULL, stop once it is done
+ *
  * This calls nl_recvmsgs() on the handle specific to a multi-cast
  * group; wimaxll_gnl_cb() will be called for succesfully received
  * generic netlink messages from the kernel and execute the callbacks
  * for each.
+ *
+ * When there is a timeout, we poll() on the socket before each call
+ * to nl_recvmsgs(), so it never blocks past the deadline.
+ *
+ * If the socket overflowed (-ENOBUFS), wimaxll_rx_overrun() reports
+ * the loss and we keep on reading; the socket is still good.
+ *
+ * With a coalesced state change callback, state changes are held
+ * (wimaxll_state_change_deliver() returns -EINPROGRESS, so the
+ * context's result is not set) and we keep reading until the socket
+ * has nothing else queued; then they are all delivered at once.
+ *
+ * Whichever way a callback returns -EBUSY (from wimaxll_gnl_cb(),
+ * the overrun notice or a coalesced flush), we stop and return 0.
  */
-ssize_t wimaxll_recv(struct wimaxll_handle *wmx)
+static
+ssize_t __wimaxll_recv_timeout(struct wimaxll_handle *wmx,
+			       struct wimaxll_rx_waiter *waiter,
+			       const struct timespec *deadline,
+			       int timeout_ms)
 {
 	ssize_t result;
+	int flush_result;
 	struct wimaxll_cb_ctx ctx = WIMAXLL_CB_CTX_INIT(wmx);
 	struct nl_cb *cb;
 
-	d_fnstart(3, wmx, "(wmx %p)\n", wmx);
-
 	/*
 	 * The reading and processing happens here
 	 *
@@ -234,66 +287,465 @@ ssize_t wimaxll_recv(struct wimaxll_handle *wmx)
 	 * the processing of the message content is done.
 	 */
 	cb = nl_socket_get_cb(wmx->nlh_rx);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wimaxll_gnl_ack_cb, &ctx);
-	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
-		  wimaxll_seq_check_cb, NULL);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, wimaxll_gnl_cb, &ctx);
-	nl_cb_err(cb, NL_CB_CUSTOM, wimaxll_gnl_error_cb, &ctx);
 	d_printf(2, wmx, "I: Calling nl_recvmsgs()\n");
+	wmx->stch_coalescing = 1;
 	do {
+		/* Set every time: a callback that receives again on
+		 * the handle points them to its own context */
+		nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM,
+			  wimaxll_gnl_ack_cb, &ctx);
+		nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
+			  wimaxll_seq_check_cb, NULL);
+		nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, wimaxll_gnl_cb, &ctx);
+		nl_cb_err(cb, NL_CB_CUSTOM, wimaxll_gnl_error_cb, &ctx);
 		ctx.result = -EINPROGRESS;
-		result = nl_recvmsgs(wmx->nlh_rx, cb);
+		/* Left for a plain receive; waiters keep waiting */
+		if (waiter == NULL && wimaxll_rx_busy_take(wmx) < 0) {
+			ctx.result = -EALREADY;
+			result = 0;
+			break;
+		}
+		if (timeout_ms >= 0) {
+			result = wimaxll_wait_fd(
+				nl_socket_get_fd(wmx->nlh_rx),
+				wimaxll_deadline_left(deadline, timeout_ms));
+			if (result < 0)
+				break;
+		}
+		if (wimaxll_rx_mock_overrun(wmx))
+			result = -ENOBUFS;
+		else
+			result = nl_recvmsgs(wmx->nlh_rx, cb);
 		d_printf(3, wmx, "I: ctx.result %zd result %zd\n",
 			 ctx.result, result);
+		if (result == -ENOBUFS) {
+			/* Notifications were lost; report it and go on
+			 * (unless the callback asked us to stop) */
+			if (wimaxll_rx_overrun(wmx, NULL) == -EBUSY)
+				ctx.result = 0;
+			result = 1;
+			continue;
+		}
 		/* if this was a message for another device, we skip it */
 		if (ctx.result == -ENODEV)
 			ctx.result = -EINPROGRESS;
+		/* nothing else queued? deliver what was coalesced */
+		if (wmx->stch_log.count > 0 && result > 0
+		    && wimaxll_wait_fd(nl_socket_get_fd(wmx->nlh_rx), 0)
+		    == -ETIMEDOUT) {
+			flush_result = wimaxll_state_change_flush(wmx);
+			if (flush_result == -EBUSY)
+				flush_result = 0;
+			wimaxll_cb_maybe_set_result(&ctx, flush_result);
+		}
 	} while ((ctx.result == -EINPROGRESS)
-		 && result > 0);
-	if (result < 0)
+		 && result > 0 && (waiter == NULL || !waiter->done));
+	nl_cb_put(cb);
+	wmx->stch_coalescing = 0;
+	/* Deliver what is left coalesced; its callback can also ask
+	 * us to stop, which we were doing anyway. */
+	if (wimaxll_state_change_flush(wmx) == -EBUSY && result >= 0)
+		ctx.result = 0;
+	if (result == -ETIMEDOUT)
+		d_printf(2, wmx, "I: timed out after %d ms\n", timeout_ms);
+	else if (result < 0) {
+		if (result == -ENOMEM)
+			wmx->stats.rx_nomem++;
 		wimaxll_msg(wmx, "E: %s: nl_recvmgsgs failed: %zd\n",
 			    __func__, result);
-	else if (ctx.result != -EINPROGRESS)
+	} else if (ctx.result != -EINPROGRESS)
 		result = ctx.result;
 	else
 		result = 0;
 	/* No complains on error; the kernel might just be sending an
 	 * error out; pass it through. */
-	d_fnend(3, wmx, "(wmx %p) = %zd\n", wmx, result);
 	return result;
 }
 
 
-static
-void wimaxll_mc_group_cb(void *_wmx, const char *name, int id)
+/**
+ * Read notifications from the WiMAX multicast group, with a timeout
+ *
+ * \param wmx WiMAX device handle
+ * \param timeout_ms How long to wait for notifications, in
+ *     milliseconds; -1 blocks for ever, 0 doesn't block.
+ * \return Value returned by the callback functions (depending on the
+ *     implementation of the callback); 0 if one instructed to stop
+ *     processing messages (returning -%EBUSY). On error, a negative
+ *     errno code:
+ *
+ *     -%EALREADY: a callback of this handle instructed to stop
+ *      while another handle sharing its RX socket was receiving
+ *      (see %WIMAXLL_OPEN_SHARED_RX); nothing was read.
+ *
+ *     -%ETIMEDOUT: the timeout expired before the callbacks
+ *      finished processing
+ *
+ * Read one or more messages from a multicast group and for each valid
+ * one, execute the callbacks set in the multi cast handle.
+ *
+ * The callbacks are expected to handle the messages and set
+ * information in the context specific to the mc handle
+ * (mch->cb_ctx). In case of any type of errors (cb_ctx.result < 0),
+ * it is expected that no resources will be tied to the context.
+ *
+ * Any message payload lent with wimaxll_msg_read_borrow() to the
+ * calling thread is released before reading.
+ *
+ * Link events pending for the hotplug callback (see
+ * wimaxll_set_cb_hotplug()) are processed first.
+ *
+ * Only one thread receives from a handle at the same time; if another
+ * one is, this waits (up to \a timeout_ms) for it to be done. The
+ * callbacks are executed by whichever thread is receiving; messages
+ * and state changes that threads blocked in wimaxll_msg_read*() or
+ * wimaxll_wait_for_state_change() are waiting for are handed to them
+ * (and messages to user taken by them don't go to the callback).
+ *
+ * \ingroup mc_rx
+ */
+ssize_t wimaxll_recv_timeout(struct wimaxll_handle *wmx, int timeout_ms)
 {
-	struct wimaxll_handle *wmx = _wmx;
+	ssize_t result;
+	struct timespec deadline;
 
-	if (strcmp(name, "msg"))
-		return;
-	wmx->mcg_id = id;
+	d_fnstart(3, wmx, "(wmx %p timeout_ms %d)\n", wmx, timeout_ms);
+	wimaxll_msg_release(wmx);
+	wimaxll_deadline_init(&deadline, timeout_ms);
+	result = wimaxll_rx_reader_get(wmx, NULL, &deadline, timeout_ms);
+	if (result < 0)
+		goto error_reader_get;
+	if (wmx->nlh_link)
+		wimaxll_hotplug_link_process(wmx);
+	result = __wimaxll_recv_timeout(wmx, NULL, &deadline, timeout_ms);
+	wimaxll_rx_reader_put(wmx);
+error_reader_get:
+	d_fnend(3, wmx, "(wmx %p timeout_ms %d) = %zd\n",
+		wmx, timeout_ms, result);
+	return result;
+}
+
+
+/**
+ * Read notifications from the WiMAX multicast group
+ *
+ * \param wmx WiMAX device handle
+ * \return Value returned by the callback functions (depending on the
+ *     implementation of the callback); 0 if one instructed to stop
+ *     processing messages. On error, a negative errno code:
+ *
+ *     -%EALREADY: see wimaxll_recv_timeout().
+ *
+ *     -%ETIMEDOUT: the handle's default timeout (see
+ *      wimaxll_set_timeout()) expired.
+ *
+ * Same as wimaxll_recv_timeout(), using the handle's default
+ * timeout (by default, there is none).
+ *
+ * \remarks This is a blocking call.
+ *
+ * \ingroup mc_rx
+ */
+ssize_t wimaxll_recv(struct wimaxll_handle *wmx)
+{
+	return wimaxll_recv_timeout(wmx, wmx->timeout_ms);
+}
+
+
+/*
+ * Become the thread that reads from a handle's RX socket
+ *
+ * \internal
+ *
+ * \param waiter if not NULL, stop trying once it is done
+ * \param deadline when to give up (as set by wimaxll_deadline_init())
+ * \param timeout_ms timeout \a deadline was initialized with
+ * \return 0 if this thread is the reader now (and has to call
+ *     wimaxll_rx_reader_put() when done reading), 1 if \a waiter
+ *     was handed what it wanted by the reader, -%ETIMEDOUT if the
+ *     deadline passed while somebody else was reading.
+ *
+ * The reader can take the role again (a callback receiving on the
+ * handle).
+ */
+int wimaxll_rx_reader_get(struct wimaxll_handle *wmx,
+			  struct wimaxll_rx_waiter *waiter,
+			  const struct timespec *deadline, int timeout_ms)
+{
+	int result = 0;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&wmx->rx_mutex);
+	while (1) {
+		if (waiter != NULL && waiter->done) {
+			result = 1;
+			break;
+		}
+		if (wmx->rx_reading == 0
+		    || pthread_equal(wmx->rx_reader, self)) {
+			wmx->rx_reader = self;
+			wmx->rx_reading++;
+			break;
+		}
+		result = wimaxll_cond_wait(&wmx->rx_cond, &wmx->rx_mutex,
+					   deadline, timeout_ms);
+		if (result < 0)
+			break;
+	}
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	return result;
+}
+
+
+/*
+ * Stop being the thread that reads from a handle's RX socket
+ *
+ * \internal
+ *
+ * Wakes up the threads waiting, so one can take over.
+ */
+void wimaxll_rx_reader_put(struct wimaxll_handle *wmx)
+{
+	pthread_mutex_lock(&wmx->rx_mutex);
+	if (--wmx->rx_reading == 0)
+		pthread_cond_broadcast(&wmx->rx_cond);
+	pthread_mutex_unlock(&wmx->rx_mutex);
+}
+
+
+/*
+ * Wait for a notification
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param waiter what we are waiting for (the functions in it stash
+ *     the notification)
+ * \param timeout_ms how long to wait; -1 for ever, 0 doesn't block
+ * \return 0 if \a waiter got what it wanted; a negative errno code
+ *     otherwise (-%ETIMEDOUT if it didn't arrive in time).
+ *
+ * Registers \a waiter in the handle, so whichever thread is
+ * receiving hands it the notification, and takes the reader role
+ * whenever nobody else has it. Waiters are offered messages in the
+ * order they started to wait.
+ */
+ssize_t wimaxll_rx_wait(struct wimaxll_handle *wmx,
+			struct wimaxll_rx_waiter *waiter, int timeout_ms)
+{
+	ssize_t result;
+	int done;
+	struct timespec deadline;
+	struct wimaxll_rx_waiter **itr;
+
+	wimaxll_msg_release(wmx);
+	wimaxll_deadline_init(&deadline, timeout_ms);
+	waiter->done = 0;
+	waiter->next = NULL;
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = &wmx->rx_waiters; *itr != NULL; itr = &(*itr)->next)
+		;
+	*itr = waiter;
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	do {
+		result = wimaxll_rx_reader_get(wmx, waiter,
+					       &deadline, timeout_ms);
+		if (result != 0)
+			break;
+		result = __wimaxll_recv_timeout(wmx, waiter,
+						&deadline, timeout_ms);
+		wimaxll_rx_reader_put(wmx);
+	} while (result >= 0);
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = &wmx->rx_waiters; *itr != NULL; itr = &(*itr)->next)
+		if (*itr == waiter) {
+			*itr = waiter->next;
+			break;
+		}
+	done = waiter->done;
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	return done ? 0 : result;
+}
+
+
+/*
+ * Return !0 if any thread is waiting for notifications on a handle
+ *
+ * \internal
+ */
+int wimaxll_rx_waiting(struct wimaxll_handle *wmx)
+{
+	int result;
+
+	pthread_mutex_lock(&wmx->rx_mutex);
+	result = wmx->rx_waiters != NULL;
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	return result;
+}
+
+
+/*
+ * Offer a message to user to the threads waiting for one
+ *
+ * \internal
+ *
+ * \param pipe_id ID of the pipe the message came on (see
+ *     wimaxll_pipe_lookup()); -ENOENT if the handle never saw it.
+ * \return !0 if one took it (the first one waiting that wanted
+ *     it), 0 otherwise.
+ */
+int wimaxll_rx_waiters_msg(struct wimaxll_handle *wmx, int pipe_id,
+			   const char *pipe_name, const void *data, size_t size)
+{
+	int result = 0;
+	struct wimaxll_rx_waiter *itr;
+
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = wmx->rx_waiters; itr != NULL; itr = itr->next) {
+		if (itr->done || itr->msg_to_user == NULL)
+			continue;
+		if (itr->msg_to_user(wmx, itr, pipe_id, pipe_name,
+				     data, size)
+		    == -EINPROGRESS)
+			continue;
+		itr->done = 1;
+		pthread_cond_broadcast(&wmx->rx_cond);
+		result = 1;
+		break;
+	}
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	return result;
+}
+
+
+/*
+ * Pass a state change to all the threads waiting for one
+ *
+ * \internal
+ */
+void wimaxll_rx_waiters_state_change(struct wimaxll_handle *wmx,
+				     enum wimax_st old_state,
+				     enum wimax_st new_state)
+{
+	int woken = 0;
+	struct wimaxll_rx_waiter *itr;
+
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = wmx->rx_waiters; itr != NULL; itr = itr->next) {
+		if (itr->done || itr->state_change == NULL)
+			continue;
+		itr->state_change(wmx, itr, old_state, new_state);
+		itr->done = 1;
+		woken = 1;
+	}
+	if (woken)
+		pthread_cond_broadcast(&wmx->rx_cond);
+	pthread_mutex_unlock(&wmx->rx_mutex);
+}
+
+
+/*
+ * Message lent to a thread by wimaxll_msg_read_borrow()
+ *
+ * @thread: thread it was lent to
+ * @msg: netlink message we hold a reference to (NULL if none)
+ * @next: next in the handle's list (wmx->rx_held)
+ *
+ * Entries are kept (for reuse) until the handle is closed.
+ */
+struct wimaxll_rx_held {
+	pthread_t thread;
+	struct nl_msg *msg;
+	struct wimaxll_rx_held *next;
+};
+
+
+/*
+ * Set the message lent to the calling thread
+ *
+ * \internal
+ *
+ * \param msg message (whose reference is passed to the handle); NULL
+ *     just to release the one lent before.
+ * \return 0 if ok, -%ENOMEM if the entry for the thread can't be
+ *     allocated (and the message is released).
+ */
+int wimaxll_rx_hold(struct wimaxll_handle *wmx, struct nl_msg *msg)
+{
+	int result = 0;
+	struct wimaxll_rx_held *itr;
+	struct nl_msg *old_msg = NULL;
+	pthread_t self = pthread_self();
+
+	pthread_mutex_lock(&wmx->rx_mutex);
+	for (itr = wmx->rx_held; itr != NULL; itr = itr->next)
+		if (pthread_equal(itr->thread, self))
+			break;
+	if (itr == NULL && msg != NULL) {
+		itr = malloc(sizeof(*itr));
+		if (itr == NULL) {
+			wmx->stats.rx_nomem++;
+			old_msg = msg;
+			result = -ENOMEM;
+			goto out;
+		}
+		itr->thread = self;
+		itr->msg = NULL;
+		itr->next = wmx->rx_held;
+		wmx->rx_held = itr;
+	}
+	if (itr != NULL) {
+		old_msg = itr->msg;
+		itr->msg = msg;
+	}
+out:
+	pthread_mutex_unlock(&wmx->rx_mutex);
+	if (old_msg)
+		nlmsg_free(old_msg);	/* drops our reference */
+	return result;
+}
+
+
+/*
+ * Release all the messages lent and the entries to track them
+ *
+ * \internal
+ *
+ * Called from wimaxll_close().
+ */
+void wimaxll_rx_held_free(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_rx_held *itr, *next;
+
+	for (itr = wmx->rx_held; itr != NULL; itr = next) {
+		next = itr->next;
+		if (itr->msg)
+			nlmsg_free(itr->msg);
+		free(itr);
+	}
+	wmx->rx_held = NULL;
 }
 
 
 static
 int wimaxll_gnl_resolve(struct wimaxll_handle *wmx)
 {
-	int result, version;
+	int result;
 	unsigned major, minor;
+	struct wimaxll_gnl_family family;
 
 	d_fnstart(5, wmx, "(wmx %p)\n", wmx);
-	/* Lookup the generic netlink family */
-	result = genl_ctrl_resolve(wmx->nlh_tx, "WiMAX");
+	/* Lookup the generic netlink family (usually cached) */
+	result = wimaxll_gnl_family_get(wmx->tx->nlh, &family);
 	if (result < 0) {
 		wimaxll_msg(wmx, "E: can't find kernel's WiMAX API "
 			    "over genetic netlink: %d\n", result);
 		goto error_ctrl_resolve;
 	}
-	wmx->gnl_family_id = result;
+	wmx->gnl_family_id = family.id;
 	d_printf(1, wmx, "D: WiMAX device %s, genl family ID %d\n",
 		 wmx->name, wmx->gnl_family_id);
-	wmx->mcg_id = -1;
-	nl_get_multicast_groups(wmx->nlh_tx, "WiMAX", wimaxll_mc_group_cb, wmx);
+	wmx->mcg_id = family.mcg_id;
 	if (wmx->mcg_id == -1) {
 		wimaxll_msg(wmx, "E: %s: cannot resolve multicast group ID; "
 			  "your kernel might be too old (< 2.6.23).\n",
@@ -302,12 +754,11 @@ int wimaxll_gnl_resolve(struct wimaxll_handle *wmx)
 		goto error_mcg_resolve;
 	}
 
-	version = genl_ctrl_get_version(wmx->nlh_tx, "WiMAX");
 	/* Check version compatibility -- check include/linux/wimax.h
 	 * for a complete description. The idea is to allow for good
 	 * expandability of the interface without causing breakage. */
-	major = version / 10;
-	minor = version % 10;
+	major = family.version / 10;
+	minor = family.version % 10;
 	if (major != WIMAX_GNL_VERSION / 10) {
 		result = -EBADR;
 		wimaxll_msg(wmx, "E: kernel's major WiMAX GNL interface "
@@ -327,99 +778,870 @@ error_ctrl_resolve:
 }
 
 
+/*
+ * Check if the device is a WiMAX supported device
+ *
+ * By just querying for the RFKILL status. If this is not a WiMAX
+ * device, it will fail with -ENODEV.
+ *
+ * If the family ID we got from the cache is stale (the WiMAX
+ * modules were reloaded), the kernel fails with -ENOENT and
+ * wimaxll_send_wait_for_ack() drops the cache entry; so we look it up
+ * again and retry.
+ */
 static
-void wimaxll_free(struct wimaxll_handle *wmx)
+int wimaxll_gnl_probe(struct wimaxll_handle *wmx)
 {
-	free(wmx);
+	int result;
+
+	result = wimaxll_rfkill(wmx, WIMAX_RF_QUERY);
+	if (result == -ENOENT) {
+		d_printf(1, wmx, "D: stale genl family ID %d, retrying\n",
+			 wmx->gnl_family_id);
+		result = wimaxll_gnl_resolve(wmx);
+		if (result < 0)
+			return result;
+		result = wimaxll_rfkill(wmx, WIMAX_RF_QUERY);
+	}
+	if (result == -ENODEV) {
+		wimaxll_msg(wmx, "E: device %s is not a WiMAX device; "
+			    "or supports an interface unknown to "
+			    "libwimaxll: %d\n", wmx->name, result);
+		return result;
+	}
+	return 0;
 }
 
 
-/**
- * Open a handle to the WiMAX control interface in the kernel
- *
- * \param device device name of the WiMAX network interface; to
- *     specify an interface by index, use the name "#IFNAME". To open
- *     a handle that will receive data for any device (but not allow
- *     sending commands to devices), set %NULL.
- * 
- * \return WiMAX device handle on success; on error, %NULL is returned
- *     and the \a errno variable is updated with a corresponding
- *     negative value.
- *
- * When opening the handle to the device, a basic check of API
- * versioning will be done. If the kernel interface has a different
- * major version, the \c wimaxll_open() call will fail (existing
- * interfaces modified or removed). A higher kernel minor version is
- * allowed (new interfaces added); a lower kernel minor version is
- * allowed with a warning (the library might need interfaces that are
- * not in the kernel).
+/*
+ * Allocate a TX socket (not connected yet)
  *
- * \ingroup device_management
  * \internal
  *
- * Allocates the netlink handles needed to talk to the kernel. With
- * that, looks up the Generic Netlink Family ID associated (if none,
- * it's not a WiMAX device). This is done by querying generic netlink
- * for a family called "WiMAX <DEVNAME>".
+ * Returns NULL if out of memory; free with wimaxll_tx_free().
  *
- * Then the Generic Netlink Controller is used to lookup versioning
- * and the multicast group list that conform the different pipes
- * supported by an interface.
+ * Condition variables wait on deadlines kept in CLOCK_MONOTONIC (see
+ * wimaxll_cond_wait()).
  */
-struct wimaxll_handle *wimaxll_open(const char *device)
+struct wimaxll_tx *wimaxll_tx_alloc(void)
+{
+	struct wimaxll_tx *tx;
+	pthread_condattr_t cond_attr;
+
+	tx = calloc(1, sizeof(*tx));
+	if (tx == NULL)
+		goto error_alloc;
+	tx->nlh = nl_handle_alloc();
+	if (tx->nlh == NULL)
+		goto error_nl_handle_alloc;
+	nl_socket_enable_msg_peek(tx->nlh);
+	wimaxll_tx_cb_set(tx);
+	pthread_mutex_init(&tx->mutex, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&tx->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	tx->users = 1;
+	return tx;
+
+error_nl_handle_alloc:
+	free(tx);
+error_alloc:
+	return NULL;
+}
+
+
+/*
+ * Release a TX socket allocated with wimaxll_tx_alloc()
+ *
+ * \internal
+ */
+void wimaxll_tx_free(struct wimaxll_tx *tx)
+{
+	nl_close(tx->nlh);
+	nl_handle_destroy(tx->nlh);
+	pthread_cond_destroy(&tx->cond);
+	pthread_mutex_destroy(&tx->mutex);
+	free(tx);
+}
+
+
+/*
+ * Lean builds use one TX socket for all the handles (acks are matched
+ * to the requests by sequence number, so it makes no difference to
+ * them); this protects it and the users counts of all of them.
+ */
+static pthread_mutex_t wimaxll_tx_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct wimaxll_tx *wimaxll_tx_shared;
+
+
+static
+int wimaxll_tx_connect(struct wimaxll_handle *wmx, struct wimaxll_tx **_tx)
 {
 	int result;
-	struct wimaxll_handle *wmx;
+	struct wimaxll_tx *tx;
 
-	d_fnstart(3, NULL, "(device %s)\n", device);
-	result = ENOMEM;
-	wmx = malloc(sizeof(*wmx));
-	if (wmx == NULL) {
-		wimaxll_msg(NULL, "E: cannot allocate WiMax handle: %m\n");
-		goto error_gnl_handle_alloc;
+	tx = wimaxll_tx_alloc();
+	if (tx == NULL) {
+		result = -ENOMEM;
+		wimaxll_msg(wmx, "E: TX: cannot allocate handle\n");
+		goto error_alloc;
 	}
-	memset(wmx, 0, sizeof(*wmx));
-	if (device != NULL && sscanf(device, "#%u", &wmx->ifidx) == 1) {
-		/* Open by interface index "#IFINDEX" */
-		if (if_indextoname(wmx->ifidx, wmx->name) == NULL) {
-			wimaxll_msg(wmx, "E: device index #%u does not exist\n",
-				    wmx->ifidx);
-			result = -ENODEV;
-			goto error_no_dev;
+	result = nl_connect(tx->nlh, NETLINK_GENERIC);
+	if (result < 0) {
+		wimaxll_msg(wmx, "E: TX: cannot connect netlink: %d (%s)\n",
+			    result, nl_geterror());
+		goto error_nl_connect;
+	}
+	*_tx = tx;
+	return 0;
+
+error_nl_connect:
+	wimaxll_tx_free(tx);
+error_alloc:
+	return result;
+}
+
+
+/*
+ * Set up the TX side of a handle
+ *
+ * \internal
+ *
+ * Connects the socket requests are sent (and acked) over (or, in
+ * lean builds, takes a reference to the one all the handles use) and
+ * looks up the generic netlink family (fills wmx->gnl_family_id and
+ * wmx->mcg_id); undo with wimaxll_tx_close().
+ */
+int wimaxll_tx_open(struct wimaxll_handle *wmx)
+{
+	int result = 0;
+
+#ifdef WIMAXLL_LEAN
+	pthread_mutex_lock(&wimaxll_tx_shared_mutex);
+	if (wimaxll_tx_shared == NULL)
+		result = wimaxll_tx_connect(wmx, &wimaxll_tx_shared);
+	else
+		wimaxll_tx_shared->users++;
+	wmx->tx = wimaxll_tx_shared;
+	pthread_mutex_unlock(&wimaxll_tx_shared_mutex);
+#else
+	result = wimaxll_tx_connect(wmx, &wmx->tx);
+#endif
+	if (result < 0)
+		goto error_connect;
+
+	result = wimaxll_gnl_resolve(wmx);	/* Get genl information */
+	if (result < 0)				/* fills wmx->mcg_id */
+		goto error_gnl_resolve;
+	return 0;
+
+error_gnl_resolve:
+	wimaxll_tx_close(wmx);
+error_connect:
+	return result;
+}
+
+
+/*
+ * Release what wimaxll_tx_open() set up
+ *
+ * \internal
+ */
+void wimaxll_tx_close(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_tx *tx = wmx->tx;
+	unsigned users;
+
+	if (tx == NULL)
+		return;
+	pthread_mutex_lock(&wimaxll_tx_shared_mutex);
+	users = --tx->users;
+	if (users == 0 && tx == wimaxll_tx_shared)
+		wimaxll_tx_shared = NULL;
+	pthread_mutex_unlock(&wimaxll_tx_shared_mutex);
+	if (users == 0)
+		wimaxll_tx_free(tx);
+	wmx->tx = NULL;
+}
+
+
+/*
+ * Subscribe a RX socket to the generic netlink controller's
+ * notifications
+ *
+ * So we hear about the WiMAX family being unregistered and
+ * registered again (see wimaxll_hotplug_ctrl()). Not fatal if it
+ * fails; the handle just won't survive a reload of the WiMAX stack.
+ */
+static
+void wimaxll_rx_ctrl_join(struct wimaxll_handle *wmx, struct nl_handle *nlh)
+{
+	int result;
+
+	result = wimaxll_gnl_ctrl_mcg_get(wmx->tx->nlh);
+	if (result >= 0)
+		result = nl_socket_add_membership(nlh, result);
+	if (result < 0)
+		wimaxll_msg(wmx, "W: RX: cannot subscribe to generic "
+			    "netlink controller notifications: %d\n", result);
+}
+
+
+/*
+ * Set the size of the kernel receive buffer of a netlink socket
+ *
+ * SO_RCVBUFFORCE can go over /proc/sys/net/core/rmem_max, but needs
+ * CAP_NET_ADMIN; if we don't have it, we settle for what SO_RCVBUF
+ * gives us (which the kernel caps to rmem_max). Not fatal either
+ * way, so we just complain.
+ */
+static
+void wimaxll_rx_rcvbuf_set(struct wimaxll_handle *wmx, struct nl_handle *nlh,
+			   int rcvbuf)
+{
+	int fd = nl_socket_get_fd(nlh);
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &rcvbuf, sizeof(rcvbuf)) == 0)
+		return;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+		       &rcvbuf, sizeof(rcvbuf)) < 0)
+		wimaxll_msg(wmx, "W: RX: cannot set receive buffer size "
+			    "to %d: %m\n", rcvbuf);
+	else
+		d_printf(1, wmx, "D: RX: receive buffer size capped by "
+			 "rmem_max (asked for %d)\n", rcvbuf);
+}
+
+
+/*
+ * RX socket shared by the handles opened with WIMAXLL_OPEN_SHARED_RX
+ *
+ * \param refcount number of handles using it
+ * \param nlh netlink handle
+ * \param mcg_id multicast group it is subscribed to
+ * \param rcvbuf receive buffer size set (0 if the default)
+ * \param handles list of the handles using it (linked by
+ *     wimaxll_handle->rx_shared_next)
+ *
+ * There is only one per process; wimaxll_rx_shared_mutex protects
+ * it and the list of handles.
+ */
+struct wimaxll_rx_shared {
+	unsigned refcount;
+	struct nl_handle *nlh;
+	int mcg_id;
+	int rcvbuf;
+	struct wimaxll_handle *handles;
+};
+
+static pthread_mutex_t wimaxll_rx_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct wimaxll_rx_shared *wimaxll_rx_shared;
+
+
+/*
+ * Update the kernel side filter of the shared RX socket
+ *
+ * Called with wimaxll_rx_shared_mutex held when the handle list
+ * changes, so the kernel passes only the messages for the devices
+ * that have handles; \a wmx is just for messages. Pipes are filtered
+ * per handle in user space.
+ */
+static
+void wimaxll_rx_shared_filter(struct wimaxll_rx_shared *rxs,
+			      struct wimaxll_handle *wmx)
+{
+	unsigned *ifidx;
+	size_t cnt = 0;
+	struct wimaxll_handle *itr;
+
+	ifidx = malloc(rxs->refcount * sizeof(ifidx[0]));
+	if (ifidx == NULL)	/* just pass'em all */
+		goto out;
+	for (itr = rxs->handles; itr != NULL; itr = itr->rx_shared_next)
+		ifidx[cnt++] = itr->ifidx;
+out:
+	wimaxll_rx_filter_set(wmx, nl_socket_get_fd(rxs->nlh),
+			      ifidx, cnt, WIMAX_PIPE_ANY);
+	free(ifidx);
+}
+
+
+static
+void wimaxll_rx_shared_destroy(struct wimaxll_rx_shared *rxs)
+{
+	nl_close(rxs->nlh);
+	nl_handle_destroy(rxs->nlh);
+	free(rxs);
+}
+
+
+/*
+ * Attach a handle to the shared RX socket, creating it if needed
+ *
+ * Only one handle per device can share the socket, as messages are
+ * demultiplexed to handles by interface index (see
+ * wimaxll_rx_shared_demux()).
+ */
+static
+int wimaxll_rx_shared_get(struct wimaxll_handle *wmx, int rcvbuf)
+{
+	int result;
+	struct wimaxll_rx_shared *rxs;
+	struct wimaxll_handle *itr;
+
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	rxs = wimaxll_rx_shared;
+	if (rxs == NULL) {
+		result = -ENOMEM;
+		rxs = calloc(1, sizeof(*rxs));
+		if (rxs == NULL) {
+			wimaxll_msg(wmx, "E: RX: cannot allocate shared "
+				    "socket\n");
+			goto error_alloc;
 		}
-	} else if (device != NULL) {
-		/* Open by interface name */
-		strncpy(wmx->name, device, sizeof(wmx->name));
-		wmx->ifidx = if_nametoindex(wmx->name);
-		if (wmx->ifidx == 0) {
-			wimaxll_msg(wmx, "E: device %s does not exist\n", wmx->name);
-			result = -ENODEV;
-			goto error_no_dev;
+		rxs->mcg_id = -1;
+		rxs->nlh = nl_handle_alloc();
+		if (rxs->nlh == NULL) {
+			result = nl_get_errno();
+			wimaxll_msg(wmx, "E: RX: cannot allocate handle: "
+				    "%d (%s)\n", result, nl_geterror());
+			goto error_nl_handle_alloc;
 		}
-	} else {
-		/* "Any" device (just for receiving callbacks) */
-		wmx->name[0] = 0;
-		wmx->ifidx = 0;
+		result = nl_connect(rxs->nlh, NETLINK_GENERIC);
+		if (result < 0) {
+			wimaxll_msg(wmx, "E: RX: cannot connect netlink: "
+				    "%d (%s)\n", result, nl_geterror());
+			goto error_nl_connect;
+		}
+		nl_socket_enable_msg_peek(rxs->nlh);
+		wimaxll_rx_ctrl_join(wmx, rxs->nlh);
+		wimaxll_rx_shared = rxs;
 	}
+	result = -EEXIST;
+	for (itr = rxs->handles; itr != NULL; itr = itr->rx_shared_next)
+		if (itr->ifidx == wmx->ifidx) {
+			wimaxll_msg(wmx, "E: RX: device %s already has a "
+				    "handle sharing the RX socket\n",
+				    wmx->name);
+			goto error_exists;
+		}
+	if (rxs->mcg_id != wmx->mcg_id) {
+		/* First user or the WiMAX modules were reloaded */
+		result = nl_socket_add_membership(rxs->nlh, wmx->mcg_id);
+		if (result < 0) {
+			wimaxll_msg(wmx, "E: RX: cannot join multicast group "
+				    "%u: %d (%s)\n", wmx->mcg_id, result,
+				    nl_geterror());
+			goto error_nl_add_membership;
+		}
+		rxs->mcg_id = wmx->mcg_id;
+	}
+	if (rcvbuf > rxs->rcvbuf) {
+		wimaxll_rx_rcvbuf_set(wmx, rxs->nlh, rcvbuf);
+		rxs->rcvbuf = rcvbuf;
+	}
+	rxs->refcount++;
+	wmx->rx_shared_next = rxs->handles;
+	rxs->handles = wmx;
+	wmx->rx_shared = rxs;
+	wmx->nlh_rx = rxs->nlh;
+	wimaxll_rx_shared_filter(rxs, wmx);
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return 0;
 
-	/* Setup the TX side */
-	wmx->nlh_tx = nl_handle_alloc();
-	if (wmx->nlh_tx == NULL) {
-		result = nl_get_errno();
-		wimaxll_msg(wmx, "E: TX: cannot allocate handle: %d (%s)\n",
-			    result, nl_geterror());
-		goto error_nl_handle_alloc_tx;
+error_nl_add_membership:
+error_exists:
+	if (rxs->refcount == 0) {
+		wimaxll_rx_shared = NULL;
+		wimaxll_rx_shared_destroy(rxs);
 	}
-	nl_socket_enable_msg_peek(wmx->nlh_tx);
+	goto error_alloc;
+error_nl_connect:
+	nl_handle_destroy(rxs->nlh);
+error_nl_handle_alloc:
+	free(rxs);
+error_alloc:
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return result;
+}
+
+
+/*
+ * Detach a handle from the shared RX socket, releasing it if this
+ * was the last user.
+ */
+static
+void wimaxll_rx_shared_put(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_rx_shared *rxs = wmx->rx_shared;
+	struct wimaxll_handle **itr;
+
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	for (itr = &rxs->handles; *itr != NULL; itr = &(*itr)->rx_shared_next)
+		if (*itr == wmx) {
+			*itr = wmx->rx_shared_next;
+			break;
+		}
+	if (--rxs->refcount == 0) {
+		wimaxll_rx_shared = NULL;
+		wimaxll_rx_shared_destroy(rxs);
+	} else
+		wimaxll_rx_shared_filter(rxs, wmx);
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	wmx->rx_shared = NULL;
+	wmx->rx_shared_next = NULL;
+	wmx->nlh_rx = NULL;
+}
+
+
+/*
+ * Find which handle a message received on a shared RX socket is for
+ *
+ * \internal
+ *
+ * \param wmx handle which read the message
+ * \param nl_hdr message
+ * \return the handle the message is for (\a wmx if it is not
+ *     sharing the RX socket, if it is for its device or if it is not
+ *     a message we know how to route); NULL if it is for a device
+ *     that has no handle on the socket, so it has to be dropped.
+ *     A handle other than \a wmx is returned with a reference; drop
+ *     it with wimaxll_rx_handle_put() once done with it.
+ *
+ * Both WIMAX_GNL_OP_MSG_TO_USER and WIMAX_GNL_RE_STATE_CHANGE carry
+ * the destination interface index; anything else is left for \a
+ * wmx's parsers to deal with.
+ */
+struct wimaxll_handle *wimaxll_rx_shared_demux(struct wimaxll_handle *wmx,
+					       struct nlmsghdr *nl_hdr)
+{
+	struct genlmsghdr *gnl_hdr;
+	struct nlattr *tb[WIMAX_GNL_ATTR_MAX+1];
+	struct wimaxll_handle *itr;
+	unsigned ifidx;
+	int attr;
+	/* WIMAX_GNL_MSG_IFIDX and WIMAX_GNL_STCH_IFIDX are the same
+	 * attribute number and type, so one entry serves both */
+	static struct nla_policy policy[WIMAX_GNL_ATTR_MAX + 1] = {
+		[WIMAX_GNL_MSG_IFIDX] = { .type = NLA_U32 },
+	};
+
+	if (wmx->rx_shared == NULL)
+		return wmx;
+	if (wimaxll_gnl_peek_ifidx(nl_hdr, &ifidx) == 0)
+		goto found;
+	gnl_hdr = nlmsg_data(nl_hdr);
+	switch (gnl_hdr->cmd) {
+	case WIMAX_GNL_OP_MSG_TO_USER:
+		attr = WIMAX_GNL_MSG_IFIDX;
+		break;
+	case WIMAX_GNL_RE_STATE_CHANGE:
+		attr = WIMAX_GNL_STCH_IFIDX;
+		break;
+	default:
+		return wmx;
+	}
+	if (genlmsg_parse(nl_hdr, 0, tb, WIMAX_GNL_ATTR_MAX, policy) < 0
+	    || tb[attr] == NULL)
+		return wmx;
+	ifidx = nla_get_u32(tb[attr]);
+found:
+	if (ifidx == wmx->ifidx)
+		return wmx;
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	for (itr = wmx->rx_shared->handles; itr != NULL;
+	     itr = itr->rx_shared_next)
+		if (itr->ifidx == ifidx && !itr->rx_closed)
+			break;
+	if (itr != NULL)
+		itr->rx_refs++;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	d_printf(3, wmx, "D: shared RX: message for ifidx %u goes to %p\n",
+		 ifidx, itr);
+	return itr;
+}
+
+
+/*
+ * List the handles that read from a handle's RX socket
+ *
+ * \internal
+ *
+ * \param wmx pointer to the handle that read from the socket
+ * \param count where to store the number of handles
+ * \return array of \a *count handles; release with
+ *     wimaxll_rx_handles_put().
+ *
+ * Just \a *wmx, unless it shares the socket; then all the handles
+ * sharing it (but those being closed), collected with the lock held,
+ * so the caller can run their callbacks with it released. Each gets a
+ * reference, so another thread's wimaxll_close() doesn't free it
+ * until wimaxll_rx_handles_put(); skip the ones for which
+ * wimaxll_rx_handle_closed() is true. If there is no memory for the
+ * list, we make do with \a *wmx.
+ */
+struct wimaxll_handle **wimaxll_rx_handles_get(struct wimaxll_handle **wmx,
+					       size_t *count)
+{
+	struct wimaxll_handle **handles = wmx, *itr;
+
+	*count = 1;
+	if ((*wmx)->rx_shared == NULL)
+		return handles;
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	handles = malloc((*wmx)->rx_shared->refcount * sizeof(handles[0]));
+	if (handles != NULL) {
+		*count = 0;
+		for (itr = (*wmx)->rx_shared->handles; itr != NULL;
+		     itr = itr->rx_shared_next) {
+			if (itr->rx_closed)
+				continue;
+			itr->rx_refs++;
+			handles[(*count)++] = itr;
+		}
+	} else
+		handles = wmx;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return handles;
+}
+
+
+static void __wimaxll_close(struct wimaxll_handle *);
+
+/*
+ * Release a list from wimaxll_rx_handles_get()
+ *
+ * \internal
+ *
+ * Drops the references; handles closed meanwhile are closed for
+ * good by whoever drops the last one.
+ */
+void wimaxll_rx_handles_put(struct wimaxll_handle **handles,
+			    struct wimaxll_handle **wmx, size_t count)
+{
+	size_t cnt, closed = 0;
+
+	if (handles == wmx)
+		return;
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	for (cnt = 0; cnt < count; cnt++)
+		if (--handles[cnt]->rx_refs == 0 && handles[cnt]->rx_closed)
+			handles[closed++] = handles[cnt];
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	for (cnt = 0; cnt < closed; cnt++)
+		__wimaxll_close(handles[cnt]);
+	free(handles);
+}
 
-	result = nl_connect(wmx->nlh_tx, NETLINK_GENERIC);
+
+/*
+ * Drop the reference wimaxll_rx_shared_demux() took on a handle
+ *
+ * \internal
+ */
+void wimaxll_rx_handle_put(struct wimaxll_handle *wmx)
+{
+	int close;
+
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	close = --wmx->rx_refs == 0 && wmx->rx_closed;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	if (close)
+		__wimaxll_close(wmx);
+}
+
+
+/*
+ * Tell if a handle from wimaxll_rx_handles_get() was closed since
+ *
+ * \internal
+ */
+int wimaxll_rx_handle_closed(struct wimaxll_handle *wmx)
+{
+	int closed;
+
+	if (wmx->rx_shared == NULL)
+		return 0;
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	closed = wmx->rx_closed;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return closed;
+}
+
+
+/*
+ * Note a callback asked to stop on another handle's receive
+ *
+ * \internal
+ *
+ * \param wmx handle sharing an RX socket whose callback returned
+ *     -EBUSY while another handle sharing it was receiving.
+ *
+ * On its own socket, that would have made the receive executing the
+ * callback stop and return; the receive running now is somebody
+ * else's, so it is left for \a wmx's next one.
+ */
+void wimaxll_rx_busy_set(struct wimaxll_handle *wmx)
+{
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	wmx->rx_busy = 1;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+}
+
+
+/*
+ * Consume a stop request left by wimaxll_rx_busy_set()
+ *
+ * \internal
+ *
+ * \return -EALREADY if there was one (the caller has to stop as if
+ *     the callback had just asked to), 0 otherwise.
+ */
+int wimaxll_rx_busy_take(struct wimaxll_handle *wmx)
+{
+	int busy;
+
+	if (wmx->rx_shared == NULL)
+		return 0;
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	busy = wmx->rx_busy;
+	wmx->rx_busy = 0;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return busy ? -EALREADY : 0;
+}
+
+
+/*
+ * Mark a handle sharing an RX socket as closed
+ *
+ * \return non-zero if wimaxll_rx_handles_get() holds references to
+ *     it, so it is not to be closed yet (see
+ *     wimaxll_rx_handles_put()).
+ *
+ * After this, wimaxll_rx_handles_get() won't return it.
+ */
+static
+int wimaxll_rx_close_deferred(struct wimaxll_handle *wmx)
+{
+	int deferred;
+
+	if (wmx->rx_shared == NULL)
+		return 0;
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	wmx->rx_closed = 1;
+	deferred = wmx->rx_refs > 0;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return deferred;
+}
+
+
+/*
+ * Mark a handle's RX socket as not subscribed to the WiMAX group
+ *
+ * \internal
+ *
+ * \param wmx handle that read the notification
+ *
+ * When the WiMAX family unregisters, the kernel drops all the
+ * subscriptions to its multicast group; with \a mcg_id -1,
+ * wimaxll_rx_rebind() knows it has to join again, even if the family
+ * comes back with the same group ID (as it usually does).
+ */
+void wimaxll_rx_unbind(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_rx_shared *rxs = wmx->rx_shared;
+	struct wimaxll_handle *itr;
+
+	if (rxs == NULL) {
+		wmx->mcg_id = -1;
+		return;
+	}
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	rxs->mcg_id = -1;
+	for (itr = rxs->handles; itr != NULL; itr = itr->rx_shared_next)
+		itr->mcg_id = -1;
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+}
+
+
+/*
+ * Move a handle's RX socket to new generic netlink IDs
+ *
+ * \internal
+ *
+ * \param wmx handle that read the notification
+ * \param family the WiMAX family's information after it registered
+ *     again
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * After the WiMAX stack was reloaded: updates the IDs of \a wmx (and
+ * of whoever shares its RX socket), joins the multicast group and
+ * rebuilds the kernel side filter, that matches on the family ID.
+ *
+ * The group is always joined, as the kernel dropped the subscription
+ * with the family, and the new group ID is usually the old one;
+ * joining a group the socket is already in is harmless.
+ */
+int wimaxll_rx_rebind(struct wimaxll_handle *wmx,
+		      const struct wimaxll_gnl_family *family)
+{
+	int result = 0;
+	struct wimaxll_rx_shared *rxs = wmx->rx_shared;
+	struct wimaxll_handle *itr;
+
+	if (rxs == NULL) {
+		/* A mock device's socket has no groups to join */
+		if (wmx->mock == 0) {
+			if (wmx->mcg_id != -1
+			    && wmx->mcg_id != family->mcg_id)
+				nl_socket_drop_membership(wmx->nlh_rx,
+							  wmx->mcg_id);
+			result = nl_socket_add_membership(wmx->nlh_rx,
+							  family->mcg_id);
+			if (result < 0)
+				goto error_add_membership;
+		}
+		wmx->gnl_family_id = family->id;
+		wmx->mcg_id = family->mcg_id;
+		wimaxll_rx_filter_refresh(wmx);
+		return 0;
+	}
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	if (rxs->mcg_id != -1 && rxs->mcg_id != family->mcg_id)
+		nl_socket_drop_membership(rxs->nlh, rxs->mcg_id);
+	result = nl_socket_add_membership(rxs->nlh, family->mcg_id);
 	if (result < 0) {
-		wimaxll_msg(wmx, "E: TX: cannot connect netlink: %d (%s)\n",
-			    result, nl_geterror());
-		goto error_nl_connect_tx;
+		pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+		goto error_add_membership;
 	}
+	rxs->mcg_id = family->mcg_id;
+	for (itr = rxs->handles; itr != NULL; itr = itr->rx_shared_next) {
+		itr->gnl_family_id = family->id;
+		itr->mcg_id = family->mcg_id;
+	}
+	wimaxll_rx_shared_filter(rxs, wmx);
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+	return 0;
+
+error_add_membership:
+	wimaxll_msg(wmx, "E: RX: cannot join multicast group %u: %d (%s)\n",
+		    family->mcg_id, result, nl_geterror());
+	return result;
+}
+
+
+/*
+ * Point a handle to a new interface index
+ *
+ * \internal
+ *
+ * The device was unplugged and plugged back (see
+ * wimaxll_hotplug_link_process()); the filter of the RX socket has
+ * to let through what is for the new index.
+ */
+void wimaxll_rx_ifidx_set(struct wimaxll_handle *wmx, unsigned ifidx)
+{
+	if (wmx->rx_shared == NULL) {
+		wmx->ifidx = ifidx;
+		wimaxll_rx_filter_refresh(wmx);
+		return;
+	}
+	pthread_mutex_lock(&wimaxll_rx_shared_mutex);
+	wmx->ifidx = ifidx;
+	wimaxll_rx_shared_filter(wmx->rx_shared, wmx);
+	pthread_mutex_unlock(&wimaxll_rx_shared_mutex);
+}
+
+
+/*
+ * Fill out the event telling a handle that notifications were lost
+ *
+ * The old state is WIMAXLL_STATE_LOST; the new one is unknown. We
+ * don't ask the device: this runs in the receive path (and maybe in
+ * another handle's callbacks), where a round trip could block for a
+ * whole timeout; the application resyncs if it cares.
+ */
+static
+void wimaxll_rx_lost_event(struct wimaxll_handle *wmx,
+			   struct wimaxll_event *event)
+{
+	/* Whatever we had cached might have changed meanwhile */
+	wimaxll_state_cache_invalidate(wmx);
+	memset(event, 0, sizeof(*event));
+	event->type = WIMAXLL_EVENT_STATE_CHANGE;
+	event->ifidx = wmx->ifidx;
+	event->state_change.old_state = WIMAXLL_STATE_LOST;
+	event->state_change.new_state = __WIMAX_ST_INVALID;
+}
+
+
+/*
+ * Recover from an overflow of a handle's RX socket
+ *
+ * \internal
+ *
+ * \param wmx handle that got -ENOBUFS reading from its RX socket
+ * \param event if not NULL, where to store the event for \a wmx
+ *     instead of calling its state change callback.
+ * \return -EBUSY if the state change callback of \a wmx asked to
+ *     stop processing messages, 0 otherwise.
+ *
+ * The kernel dropped notifications because the socket's receive
+ * buffer was full and we can't know which, so every handle reading
+ * from the socket (only \a wmx, unless it is the shared one) gets
+ * a synthetic state change from WIMAXLL_STATE_LOST to
+ * __WIMAX_ST_INVALID (unknown). The socket itself is still usable.
+ *
+ * The callbacks are called without holding any locks, as they
+ * might open or close handles (see wimaxll_rx_handles_get()).
+ */
+int wimaxll_rx_overrun(struct wimaxll_handle *wmx,
+		       struct wimaxll_event *event)
+{
+	int result = 0;
+	struct wimaxll_handle **handles, *itr;
+	struct wimaxll_event lost;
+	size_t cnt, count;
+
+	wmx->stats.rx_overruns++;
+	wimaxll_msg(wmx, "W: RX: receive buffer overflowed, notifications "
+		    "lost; resyncing state\n");
+	handles = wimaxll_rx_handles_get(&wmx, &count);
+	for (cnt = 0; cnt < count; cnt++) {
+		itr = handles[cnt];
+		if (wimaxll_rx_handle_closed(itr))
+			continue;
+		wimaxll_rx_lost_event(itr, &lost);
+		if (itr == wmx && event != NULL)
+			*event = lost;
+		else if (wimaxll_event_dispatch(itr, &lost) == -EBUSY) {
+			if (itr == wmx)
+				result = -EBUSY;
+			else
+				wimaxll_rx_busy_set(itr);
+		}
+	}
+	wimaxll_rx_handles_put(handles, &wmx, count);
+	return result;
+}
+
+
+/*
+ * Set up the RX side of a handle
+ *
+ * Either its own socket subscribed to the multicast group or the
+ * shared one.
+ */
+static
+int wimaxll_rx_open(struct wimaxll_handle *wmx, unsigned flags, int rcvbuf)
+{
+	int result;
+
+	if (flags & WIMAXLL_OPEN_SHARED_RX)
+		return wimaxll_rx_shared_get(wmx, rcvbuf);
 
-	/* Set up the RX side */
 	wmx->nlh_rx = nl_handle_alloc();
 	if (wmx->nlh_rx == NULL) {
 		result = nl_get_errno();
@@ -434,10 +1656,8 @@ struct wimaxll_handle *wimaxll_open(const char *device)
 		goto error_nl_connect_rx;
 	}
 	nl_socket_enable_msg_peek(wmx->nlh_rx);
-
-	result = wimaxll_gnl_resolve(wmx);	/* Get genl information */
-	if (result < 0)				/* fills wmx->mcg_id */
-		goto error_gnl_resolve;
+	if (rcvbuf > 0)
+		wimaxll_rx_rcvbuf_set(wmx, wmx->nlh_rx, rcvbuf);
 
 	result = nl_socket_add_membership(wmx->nlh_rx, wmx->mcg_id);
 	if (result < 0) {
@@ -445,37 +1665,246 @@ struct wimaxll_handle *wimaxll_open(const char *device)
 			    wmx->mcg_id, result, nl_geterror());
 		goto error_nl_add_membership;
 	}
-	/* Now we check if the device is a WiMAX supported device, by
-	 * just querying for the RFKILL status. If this is not a WiMAX
-	 * device, it will fail with -ENODEV. */
-	if (wmx->ifidx > 0) {		/* if this handle is for any, don't check */
-		result = wimaxll_rfkill(wmx, WIMAX_RF_QUERY);
-		if (result == -ENODEV) {
-			wimaxll_msg(wmx, "E: device %s is not a WiMAX device; "
-				    "or supports an interface unknown to "
-				    "libwimaxll: %d\n", wmx->name, result);
-			goto error_rfkill;
-		}
-	}
-	d_fnend(3, wmx, "(device %s) = %p\n", device, wmx);
-	return wmx;
+	wimaxll_rx_ctrl_join(wmx, wmx->nlh_rx);
+	/* Have the kernel drop what is for other devices; if it
+	 * can't, we'll do it ourselves */
+	wimaxll_rx_filter_refresh(wmx);
+	return 0;
 
-error_rfkill:
 error_nl_add_membership:
-error_gnl_resolve:
 	nl_close(wmx->nlh_rx);
 error_nl_connect_rx:
 	nl_handle_destroy(wmx->nlh_rx);
+	wmx->nlh_rx = NULL;
 error_nl_handle_alloc_rx:
-	nl_close(wmx->nlh_tx);
-error_nl_connect_tx:
-	nl_handle_destroy(wmx->nlh_tx);
-error_nl_handle_alloc_tx:
+	return result;
+}
+
+
+static
+void wimaxll_rx_close(struct wimaxll_handle *wmx)
+{
+	if (wmx->rx_shared) {
+		wimaxll_rx_shared_put(wmx);
+		return;
+	}
+	nl_close(wmx->nlh_rx);
+	nl_handle_destroy(wmx->nlh_rx);
+	wmx->nlh_rx = NULL;
+}
+
+
+/*
+ * Initialize a freshly allocated (and zeroed) handle
+ *
+ * \internal
+ *
+ * Sets the defaults and the locks; undo with wimaxll_handle_release().
+ *
+ * Condition variables wait on deadlines kept in CLOCK_MONOTONIC (see
+ * wimaxll_cond_wait()).
+ */
+int wimaxll_handle_init(struct wimaxll_handle *wmx)
+{
+	pthread_condattr_t cond_attr;
+
+	wmx->timeout_ms = -1;
+	wmx->rx_pipe = WIMAX_PIPE_ANY;
+	pthread_mutex_init(&wmx->rx_mutex, NULL);
+	pthread_mutex_init(&wmx->stats_mutex, NULL);
+	pthread_mutex_init(&wmx->pipes.mutex, NULL);
+	pthread_mutex_init(&wmx->state_cache.mutex, NULL);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wmx->rx_cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	return 0;
+}
+
+
+/*
+ * Release what wimaxll_handle_init() set up
+ *
+ * \internal
+ */
+void wimaxll_handle_release(struct wimaxll_handle *wmx)
+{
+	wimaxll_rx_held_free(wmx);
+	wimaxll_pipe_table_free(wmx);
+	pthread_cond_destroy(&wmx->rx_cond);
+	pthread_mutex_destroy(&wmx->state_cache.mutex);
+	pthread_mutex_destroy(&wmx->pipes.mutex);
+	pthread_mutex_destroy(&wmx->stats_mutex);
+	pthread_mutex_destroy(&wmx->rx_mutex);
+}
+
+
+static
+void wimaxll_free(struct wimaxll_handle *wmx)
+{
+	wimaxll_handle_release(wmx);
+	free(wmx);
+}
+
+
+/**
+ * Open a handle to the WiMAX control interface in the kernel
+ *
+ * \param device device name of the WiMAX network interface; to
+ *     specify an interface by index, use the name "#IFNAME". To open
+ *     a handle that will receive data for any device (but not allow
+ *     sending commands to devices), set %NULL.
+ * 
+ * \return WiMAX device handle on success; on error, %NULL is returned
+ *     and the \a errno variable is updated with a corresponding
+ *     negative value.
+ *
+ * When opening the handle to the device, a basic check of API
+ * versioning will be done. If the kernel interface has a different
+ * major version, the \c wimaxll_open() call will fail (existing
+ * interfaces modified or removed). A higher kernel minor version is
+ * allowed (new interfaces added); a lower kernel minor version is
+ * allowed with a warning (the library might need interfaces that are
+ * not in the kernel).
+ *
+ * Same as calling wimaxll_open_ex() with no attributes.
+ *
+ * \ingroup device_management
+ */
+struct wimaxll_handle *wimaxll_open(const char *device)
+{
+	return wimaxll_open_ex(device, NULL);
+}
+
+
+/**
+ * Open a handle to the WiMAX control interface in the kernel, with
+ * options
+ *
+ * \param device device name of the WiMAX network interface (see
+ *     wimaxll_open()).
+ * \param attr options (see \ref wimaxll_open_attr "struct
+ *     wimaxll_open_attr"); %NULL for the defaults.
+ *
+ * \return WiMAX device handle on success; on error, %NULL is returned
+ *     and the \a errno variable is updated with a corresponding
+ *     negative value.
+ *
+ * Like wimaxll_open(), but allows tuning how the handle is set up:
+ *
+ * - %WIMAXLL_OPEN_SHARED_RX: instead of opening its own socket for
+ *   receiving notifications from the kernel, the handle uses a
+ *   socket shared with all the other handles opened with this
+ *   flag. This saves a file descriptor and a multicast subscription
+ *   per handle. Notifications are routed to the handle of the device
+ *   they are for (and dropped if there is none), so receiving on any
+ *   of the handles executes the callbacks of all of them. This means
+ *   all the handles sharing the socket have to be received on from
+ *   the same thread; the easiest way is to add just one of them to
+ *   an \ref main_loop "event loop". If a handle's callback returns
+ *   -%EBUSY while another handle is receiving, the next receive on
+ *   that handle returns -%EALREADY right away (the event loop
+ *   returns -%EBUSY, as for any stop). Only one handle per
+ *   device can share the socket and it can't be used with handles
+ *   for \e any device (-%EINVAL).
+ *
+ * - %WIMAXLL_OPEN_NO_PROBE: don't check if the device is a WiMAX
+ *   device by querying its RF kill state; saves a round trip to the
+ *   kernel when the caller already knows it is.
+ *
+ * To open handles for all the WiMAX devices in the system, see
+ * wimaxll_discover().
+ *
+ * \ingroup device_management
+ * \internal
+ *
+ * Allocates the netlink handles needed to talk to the kernel. With
+ * that, looks up the Generic Netlink Family ID associated (if none,
+ * it's not a WiMAX device), its multicast group and version. This
+ * information is the same for all the handles, so it is cached (see
+ * wimaxll_gnl_family_get()) and the Generic Netlink Controller is
+ * only queried by the first wimaxll_open() call (or the first after
+ * the WiMAX modules are reloaded).
+ */
+struct wimaxll_handle *wimaxll_open_ex(const char *device,
+				       const struct wimaxll_open_attr *attr)
+{
+	int result;
+	struct wimaxll_handle *wmx;
+	unsigned flags = attr ? attr->flags : 0;
+
+	d_fnstart(3, NULL, "(device %s attr %p)\n", device, attr);
+	result = -EINVAL;
+	if (device == NULL && (flags & WIMAXLL_OPEN_SHARED_RX)) {
+		wimaxll_msg(NULL, "E: handles for any device can't share "
+			    "the RX socket\n");
+		goto error_gnl_handle_alloc;
+	}
+	result = -ENOMEM;
+	wmx = malloc(sizeof(*wmx));
+	if (wmx == NULL) {
+		wimaxll_msg(NULL, "E: cannot allocate WiMax handle: %m\n");
+		goto error_gnl_handle_alloc;
+	}
+	memset(wmx, 0, sizeof(*wmx));
+	wimaxll_handle_init(wmx);
+	if (device != NULL && sscanf(device, "#%u", &wmx->ifidx) == 1) {
+		/* Open by interface index "#IFINDEX" */
+		if (if_indextoname(wmx->ifidx, wmx->name) == NULL) {
+			wimaxll_msg(wmx, "E: device index #%u does not exist\n",
+				    wmx->ifidx);
+			result = -ENODEV;
+			goto error_no_dev;
+		}
+	} else if (device != NULL) {
+		/* Open by interface name */
+		strncpy(wmx->name, device, sizeof(wmx->name));
+		wmx->ifidx = if_nametoindex(wmx->name);
+		if (wmx->ifidx == 0) {
+			wimaxll_msg(wmx, "E: device %s does not exist\n", wmx->name);
+			result = -ENODEV;
+			goto error_no_dev;
+		}
+	} else {
+		/* "Any" device (just for receiving callbacks) */
+		wmx->name[0] = 0;
+		wmx->ifidx = 0;
+	}
+
+	result = wimaxll_tx_open(wmx);
+	if (result < 0)
+		goto error_tx_open;
+
+	/* if this handle is for any, don't check */
+	if (wmx->ifidx > 0 && !(flags & WIMAXLL_OPEN_NO_PROBE)) {
+		result = wimaxll_gnl_probe(wmx);
+		if (result < 0)
+			goto error_probe;
+	}
+
+	/* Set up the RX side */
+	result = wimaxll_rx_open(wmx, flags, attr ? attr->rcvbuf : 0);
+	if (result < 0)
+		goto error_rx_open;
+	if (attr && attr->state_cache_ms != 0) {
+		result = wimaxll_set_state_cache(wmx, attr->state_cache_ms);
+		if (result < 0)
+			goto error_state_cache;
+	}
+	d_fnend(3, wmx, "(device %s attr %p) = %p\n", device, attr, wmx);
+	return wmx;
+
+error_state_cache:
+	wimaxll_rx_close(wmx);
+error_rx_open:
+error_probe:
+	wimaxll_tx_close(wmx);
+error_tx_open:
 error_no_dev:
 	wimaxll_free(wmx);
 error_gnl_handle_alloc:
 	errno = -result;
-	d_fnend(3, NULL, "(device %s) = NULL\n", device);
+	d_fnend(3, NULL, "(device %s attr %p) = NULL\n", device, attr);
 	return NULL;
 }
 
@@ -487,15 +1916,40 @@ error_gnl_handle_alloc:
  * \ingroup device_management
  * \internal
  *
- * Performs the natural oposite actions done in wimaxll_open().
+ * Performs the natural oposite actions done in wimaxll_open(). \a
+ * wmx can be %NULL.
+ *
+ * No other thread can be using the handle (or start to) when this is
+ * called. The library itself might still be (eg: a receive on a
+ * shared RX socket resyncing all the handles that share it); then,
+ * the handle won't get more callbacks and it is freed once the
+ * library is done with it.
  */
 void wimaxll_close(struct wimaxll_handle *wmx)
+{
+	if (wmx == NULL)
+		return;
+	if (wimaxll_rx_close_deferred(wmx))
+		return;
+	__wimaxll_close(wmx);
+}
+
+
+static
+void __wimaxll_close(struct wimaxll_handle *wmx)
 {
 	d_fnstart(3, NULL, "(wmx %p)\n", wmx);
-	nl_close(wmx->nlh_rx);
-	nl_handle_destroy(wmx->nlh_rx);
-	nl_close(wmx->nlh_tx);
-	nl_handle_destroy(wmx->nlh_tx);
+	wimaxll_msg_release(wmx);
+	wimaxll_hotplug_release(wmx);
+#ifndef WIMAXLL_LEAN
+	wimaxll_capture_stop(wmx);
+#endif
+	wimaxll_rx_batch_free(wmx);
+	wimaxll_msg_batch_free(wmx);
+	wimaxll_tx_msg_free(wmx);
+	wimaxll_rx_pipe_free(wmx);
+	wimaxll_rx_close(wmx);
+	wimaxll_tx_close(wmx);
 	wimaxll_free(wmx);
 	d_fnend(3, NULL, "(wmx %p) = void\n", wmx);
 }
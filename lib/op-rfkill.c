@@ -40,6 +40,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
 #include <netlink/netlink.h>
@@ -93,14 +94,18 @@ int wimaxll_rfkill(struct wimaxll_handle *wmx, enum wimax_rf_state state)
 {
 	ssize_t result;
 	struct nl_msg *msg;
+	struct timespec start;
+	unsigned ifidx;
 
 	d_fnstart(3, wmx, "(wmx %p state %u)\n", wmx, state);
 	result = -EBADF;
-	if (wmx->ifidx == 0)
+	ifidx = wimaxll_ifidx(wmx);
+	if (ifidx == 0)
 		goto error_not_any;
-	msg = nlmsg_new();
+	msg = wimaxll_tx_msg_get(wmx, GENL_HDRLEN
+				 + 2 * nla_total_size(sizeof(__u32)));
 	if (msg == NULL) {
-		result = errno;
+		result = -ENOMEM;
 		wimaxll_msg(wmx, "E: RFKILL: cannot allocate generic netlink "
 			  "message: %m\n");
 		goto error_msg_alloc;
@@ -113,21 +118,18 @@ int wimaxll_rfkill(struct wimaxll_handle *wmx, enum wimax_rf_state state)
 			  "%zd 0x%08x\n", result, (unsigned int) result);
 		goto error_msg_prep;
 	}
-	nla_put_u32(msg, WIMAX_GNL_RFKILL_IFIDX, (__u32) wmx->ifidx);
+	nla_put_u32(msg, WIMAX_GNL_RFKILL_IFIDX, (__u32) ifidx);
 	nla_put_u32(msg, WIMAX_GNL_RFKILL_STATE, (__u32) state);
-	result = nl_send_auto_complete(wmx->nlh_tx, msg);
-	if (result < 0) {
-		wimaxll_msg(wmx, "E: RFKILL: error sending message: %zd\n",
-			  result);
-		goto error_msg_send;
-	}
-	/* Read the message ACK from netlink */
-	result = wimaxll_wait_for_ack(wmx);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Send it and read the message ACK from netlink */
+	result = wimaxll_send_wait_for_ack(wmx, msg, 0);
 	if (result < 0 && result != -ENODEV)
 		wimaxll_msg(wmx, "E: RFKILL: operation failed: %zd\n", result);
+	else if (result >= 0 && ifidx == wmx->ifidx)
+		wimaxll_state_cache_rfkill(wmx, result);
+	wimaxll_stats_ack(wmx, WIMAXLL_STATS_OP_RFKILL, &start, result);
 error_msg_prep:
-error_msg_send:
-	nlmsg_free(msg);
+	wimaxll_tx_msg_put(wmx, msg);
 error_msg_alloc:
 error_not_any:
 	d_fnend(3, wmx, "(wmx %p state %u) = %zd\n", wmx, state, result);
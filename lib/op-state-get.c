@@ -44,6 +44,8 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
 #include <netlink/netlink.h>
@@ -54,31 +56,221 @@
 #include "debug.h"
 
 
-/**
- * Get Wimax device status from kernel and return it to user space
+/*
+ * State cache
  *
- * \param wmx WiMAX device handle
+ * When enabled with wimaxll_set_state_cache(), wimaxll_state_get()
+ * answers from memory what it learnt from the kernel the last time
+ * it asked, kept current with the state change notifications the
+ * handle receives (they are tracked as they are parsed, so it works
+ * with all the receive functions) and with what wimaxll_rfkill()
+ * returns.
  *
- * \return Negative errno code on error. Otherwise, one from Wimax device
- *     status value, defined in enum wimax_st.
+ * It is only as current as the last notification received, so
+ * applications using it should keep receiving on the handle (as
+ * they'd do anyway for the callbacks). The cached state is dropped
+ * if the handle's RX socket overflows (and notifications might have
+ * been lost) or when it is older than the configured maximum age;
+ * the next query asks the kernel again.
  *
- * Allows the caller to get the state of the Wimax device.
+ * Only handles for a given interface can cache (not "any" handles).
+ */
+
+/*
+ * Is the cached state usable?
+ *
+ * Called with the cache's mutex held.
+ */
+static
+int wimaxll_state_cache_fresh(const struct wimaxll_state_cache *cache)
+{
+	struct timespec now;
+	long long age_ms;
+
+	if (cache->max_age_ms == 0 || !cache->valid)
+		return 0;
+	if (cache->max_age_ms < 0)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	age_ms = (now.tv_sec - cache->ts.tv_sec) * 1000LL
+		+ (now.tv_nsec - cache->ts.tv_nsec) / 1000000;
+	return age_ms <= cache->max_age_ms;
+}
+
+
+/*
+ * Update the cached state from a state change notification
  *
- * \ingroup device_management
  * \internal
  *
+ * Called as the notifications are parsed
+ * (wimaxll_gnl_parse_state_change()).
  */
-int wimaxll_state_get(struct wimaxll_handle *wmx)
+void wimaxll_state_cache_update(struct wimaxll_handle *wmx,
+				enum wimax_st new_state)
 {
-	ssize_t result;
-	struct nl_msg *msg;
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	if (wmx->ifidx == 0)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->max_age_ms != 0) {
+		cache->state = new_state;
+		cache->valid = 1;
+		cache->generation++;
+		clock_gettime(CLOCK_MONOTONIC, &cache->ts);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Enable the cache with a state already known
+ *
+ * \internal
+ *
+ * Like wimaxll_set_state_cache(), but instead of asking the kernel,
+ * takes the state it answered with at time \a ts (eg: when probing
+ * many devices at the same time, see wimaxll_discover()).
+ */
+void wimaxll_state_cache_seed(struct wimaxll_handle *wmx, int max_age_ms,
+			      enum wimax_st state, const struct timespec *ts)
+{
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	if (wmx->ifidx == 0 || max_age_ms == 0)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_age_ms = max_age_ms;
+	cache->state = state;
+	cache->valid = 1;
+	cache->generation++;
+	cache->ts = *ts;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Drop the cached state (eg: notifications might have been lost)
+ *
+ * \internal
+ */
+void wimaxll_state_cache_invalidate(struct wimaxll_handle *wmx)
+{
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->valid = 0;
+	cache->generation++;
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/*
+ * Update the cached state with the result of wimaxll_rfkill()
+ *
+ * \internal
+ *
+ * \param rfkill status of the switches (bit 0 hw, bit 1 sw, set if
+ *     radio on)
+ *
+ * If the radio is off, a device that was up is now in
+ * %WIMAX_ST_RADIO_OFF. If it is on and was off, the device will move
+ * on by itself (and tell us with a notification); we don't know to
+ * which state, so the cache is dropped until then.
+ */
+void wimaxll_state_cache_rfkill(struct wimaxll_handle *wmx, int rfkill)
+{
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	/* Same condition the kernel uses to change the state */
+	if (!cache->valid || cache->state <= __WIMAX_ST_QUIESCING)
+		goto out;
+	if ((rfkill & 0x3) != 0x3) {		/* hw or sw switch off */
+		if (cache->state != WIMAX_ST_RADIO_OFF) {
+			cache->state = WIMAX_ST_RADIO_OFF;
+			cache->generation++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &cache->ts);
+	} else if (cache->state == WIMAX_ST_RADIO_OFF) {
+		cache->valid = 0;
+		cache->generation++;
+	}
+out:
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+
+/**
+ * Cache the state of a WiMAX device
+ *
+ * \param wmx WiMAX device handle
+ * \param max_age_ms How long (in milliseconds) the cached state can
+ *     be used without asking the kernel again; -1 for as long as the
+ *     handle receives notifications without losing any, 0 to disable
+ *     the cache (the default).
+ * \return 0 if ok, < 0 errno code on error (the cache is left
+ *     disabled): -%EBADF if \a wmx is an "any" handle or whatever
+ *     the initial wimaxll_state_get() returned.
+ *
+ * When enabled, wimaxll_state_get() and wimaxll_state_get_cached()
+ * answer from memory; the cache is seeded here with a
+ * wimaxll_state_get() and kept current with the state change
+ * notifications the handle receives and the results of
+ * wimaxll_rfkill(). See the notes in op-state-get.c.
+ *
+ * \ingroup device_management
+ */
+int wimaxll_set_state_cache(struct wimaxll_handle *wmx, int max_age_ms)
+{
+	int result;
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
 
+	d_fnstart(3, wmx, "(wmx %p max_age_ms %d)\n", wmx, max_age_ms);
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_age_ms = 0;
+	cache->valid = 0;
+	cache->generation++;
+	pthread_mutex_unlock(&cache->mutex);
+	result = 0;
+	if (max_age_ms == 0)
+		goto out;
 	result = -EBADF;
 	if (wmx->ifidx == 0)
-		goto error_not_any;
-	msg = nlmsg_new();
+		goto out;
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_age_ms = max_age_ms;
+	pthread_mutex_unlock(&cache->mutex);
+	result = wimaxll_state_get(wmx);
+	if (result < 0) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->max_age_ms = 0;
+		pthread_mutex_unlock(&cache->mutex);
+		goto out;
+	}
+	result = 0;
+out:
+	d_fnend(3, wmx, "(wmx %p max_age_ms %d) = %d\n",
+		wmx, max_age_ms, result);
+	return result;
+}
+
+
+/*
+ * Ask the kernel for the state of the device
+ */
+static
+int wimaxll_state_get_kernel(struct wimaxll_handle *wmx, unsigned ifidx)
+{
+	ssize_t result;
+	struct nl_msg *msg;
+	struct timespec start;
+
+	msg = wimaxll_tx_msg_get(wmx, GENL_HDRLEN
+				 + nla_total_size(sizeof(__u32)));
 	if (msg == NULL) {
-		result = errno;
+		result = -ENOMEM;
 		wimaxll_msg(wmx, "E: STATE_GET: cannot allocate generic"
 			"netlink message: %m\n");
 		goto error_msg_alloc;
@@ -91,22 +283,101 @@ int wimaxll_state_get(struct wimaxll_handle *wmx)
 			  "%zd 0x%08x\n", result, (unsigned int) result);
 		goto error_msg_prep;
 	}
-	nla_put_u32(msg, WIMAX_GNL_STGET_IFIDX, (__u32) wmx->ifidx);
-	result = nl_send_auto_complete(wmx->nlh_tx, msg);
-	if (result < 0) {
-		wimaxll_msg(wmx, "E: STATE_GET: error sending message: %zd\n",
-			  result);
-		goto error_msg_send;
-	}
-	/* Read the message ACK from netlink */
-	result = wimaxll_wait_for_ack(wmx);
+	nla_put_u32(msg, WIMAX_GNL_STGET_IFIDX, (__u32) ifidx);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Send it and read the message ACK from netlink */
+	result = wimaxll_send_wait_for_ack(wmx, msg, 0);
 	if (result < 0 && result != -ENODEV)
 		wimaxll_msg(wmx, "E: STATE_GET: operation failed: %zd\n", result);
+	wimaxll_stats_ack(wmx, WIMAXLL_STATS_OP_STATE_GET, &start, result);
 error_msg_prep:
-error_msg_send:
-	nlmsg_free(msg);
+	wimaxll_tx_msg_put(wmx, msg);
 error_msg_alloc:
+	return result;
+}
+
+
+/**
+ * Get the state of a WiMAX device, and since when it is known
+ *
+ * \param wmx WiMAX device handle
+ * \param ts If not NULL, where to store the time (CLOCK_MONOTONIC)
+ *     at which the state was last learnt from the kernel (the time of
+ *     the call if it had to ask now).
+ *
+ * \return Negative errno code on error. Otherwise, one from Wimax
+ *     device status value, defined in enum wimax_st.
+ *
+ * Same as wimaxll_state_get(); if the state cache is enabled (see
+ * wimaxll_set_state_cache()) and what it holds is usable, it is
+ * answered from memory, otherwise the kernel is asked (and the
+ * cache refreshed).
+ *
+ * \ingroup device_management
+ */
+int wimaxll_state_get_cached(struct wimaxll_handle *wmx, struct timespec *ts)
+{
+	int result;
+	unsigned ifidx, generation;
+	struct wimaxll_state_cache *cache = &wmx->state_cache;
+
+	d_fnstart(3, wmx, "(wmx %p ts %p)\n", wmx, ts);
+	result = -EBADF;
+	ifidx = wimaxll_ifidx(wmx);
+	if (ifidx == 0)
+		goto error_not_any;
+	pthread_mutex_lock(&cache->mutex);
+	/* In a callback of an "any" handle: not what we cache */
+	if (ifidx == wmx->ifidx && wimaxll_state_cache_fresh(cache)) {
+		result = cache->state;
+		if (ts)
+			*ts = cache->ts;
+		pthread_mutex_unlock(&cache->mutex);
+		goto out;
+	}
+	generation = cache->generation;
+	pthread_mutex_unlock(&cache->mutex);
+
+	result = wimaxll_state_get_kernel(wmx, ifidx);
+	if (ts)
+		clock_gettime(CLOCK_MONOTONIC, ts);
+	if (result < 0 || ifidx != wmx->ifidx)
+		goto out;
+	pthread_mutex_lock(&cache->mutex);
+	/* Unless a notification updated it meanwhile (that is newer) */
+	if (cache->max_age_ms != 0 && cache->generation == generation) {
+		cache->state = result;
+		cache->valid = 1;
+		cache->generation++;
+		clock_gettime(CLOCK_MONOTONIC, &cache->ts);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+out:
 error_not_any:
-	d_fnend(3, wmx, "(wmx %p) = %zd\n", wmx, result);
+	d_fnend(3, wmx, "(wmx %p ts %p) = %d\n", wmx, ts, result);
 	return result;
 }
+
+
+/**
+ * Get Wimax device status from kernel and return it to user space
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \return Negative errno code on error. Otherwise, one from Wimax device
+ *     status value, defined in enum wimax_st.
+ *
+ * Allows the caller to get the state of the Wimax device.
+ *
+ * If the handle has the state cache enabled (see
+ * wimaxll_set_state_cache()), the kernel is asked only when what is
+ * cached is not usable.
+ *
+ * \ingroup device_management
+ * \internal
+ *
+ */
+int wimaxll_state_get(struct wimaxll_handle *wmx)
+{
+	return wimaxll_state_get_cached(wmx, NULL);
+}
@@ -0,0 +1,369 @@
+/*
+ * Linux WiMax
+ * Per-pipe subscriptions
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * \defgroup pipe_group Per-pipe callbacks
+ *
+ * Besides the callback set with wimaxll_set_cb_msg_to_user(), that
+ * gets the messages to user from all the pipes, a handle can have a
+ * callback for each pipe it is interested in:
+ *
+ * @code
+ * wimaxll_pipe_set_cb_msg_to_user(wmx, NULL, l3l4_cb, l3l4_ctx);
+ * wimaxll_pipe_set_cb_msg_to_user(wmx, "trace", trace_cb, trace_ctx);
+ * wimaxll_pipe_set_cb_msg_to_user(wmx, "diag", diag_cb, diag_ctx);
+ * ...
+ * while (1)
+ *         wimaxll_recv(wmx);
+ * @endcode
+ *
+ * so a single receive loop fans the messages out to all the pipe
+ * consumers. A message on a pipe that has a callback of its own is
+ * not passed to the catch-all one; as always, threads waiting in
+ * wimaxll_msg_read*() get the messages they ask for first.
+ *
+ * Pipe names are interned the first time the handle sees them
+ * (setting a callback, wimaxll_msg_read() on a pipe), into small
+ * integer IDs (0 is the default pipe) kept in a hash table. Finding
+ * who a message goes to costs a hash of the pipe name and a table
+ * lookup, regardless of how many pipes are being listened to. IDs
+ * are never reused during the lifetime of the handle.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/* Initial sizes; both grow by doubling */
+	WIMAXLL_PIPE_TABLE_PIPES = 8,
+	WIMAXLL_PIPE_TABLE_SLOTS = 16,
+};
+
+
+/*
+ * Hash a pipe name (FNV-1a)
+ */
+static
+unsigned wimaxll_pipe_hash(const char *name)
+{
+	unsigned hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+/*
+ * Find the ID of a pipe name in the table
+ *
+ * Called with the table's mutex held; \a name can't be NULL.
+ *
+ * Returns the ID or -ENOENT if not interned.
+ */
+static
+int __wimaxll_pipe_find(const struct wimaxll_pipe_table *table,
+			const char *name, unsigned hash)
+{
+	unsigned idx;
+	const struct wimaxll_pipe *pipe;
+
+	if (table->slots == 0)
+		return -ENOENT;
+	for (idx = hash & (table->slots - 1); table->slot[idx] != 0;
+	     idx = (idx + 1) & (table->slots - 1)) {
+		pipe = &table->pipe[table->slot[idx] - 1];
+		if (pipe->hash == hash && !strcmp(pipe->name, name))
+			return table->slot[idx] - 1;
+	}
+	return -ENOENT;
+}
+
+
+/*
+ * Rebuild the hash table with \a slots slots
+ *
+ * Called with the table's mutex held.
+ */
+static
+int wimaxll_pipe_rehash(struct wimaxll_pipe_table *table, unsigned slots)
+{
+	unsigned *slot, id, idx;
+
+	slot = calloc(slots, sizeof(slot[0]));
+	if (slot == NULL)
+		return -ENOMEM;
+	/* The default pipe (ID 0) has no name and is not hashed */
+	for (id = 1; id < table->pipes; id++) {
+		idx = table->pipe[id].hash & (slots - 1);
+		while (slot[idx] != 0)
+			idx = (idx + 1) & (slots - 1);
+		slot[idx] = id + 1;
+	}
+	free(table->slot);
+	table->slot = slot;
+	table->slots = slots;
+	return 0;
+}
+
+
+/*
+ * Intern a pipe name
+ *
+ * Called with the table's mutex held.
+ */
+static
+int __wimaxll_pipe_intern(struct wimaxll_pipe_table *table,
+			  const char *name)
+{
+	int result;
+	unsigned hash, idx;
+	struct wimaxll_pipe *pipe;
+
+	if (table->pipes == 0) {	/* first use, add the default pipe */
+		result = wimaxll_pipe_rehash(table, WIMAXLL_PIPE_TABLE_SLOTS);
+		if (result < 0)
+			goto error;
+		result = -ENOMEM;
+		table->pipe = calloc(WIMAXLL_PIPE_TABLE_PIPES,
+				     sizeof(table->pipe[0]));
+		if (table->pipe == NULL)
+			goto error;
+		table->pipes_size = WIMAXLL_PIPE_TABLE_PIPES;
+		table->pipes = 1;
+	}
+	if (name == NULL)
+		return 0;
+	hash = wimaxll_pipe_hash(name);
+	result = __wimaxll_pipe_find(table, name, hash);
+	if (result >= 0)
+		return result;
+	/* Keep the hash table at most half full */
+	if (2 * table->pipes >= table->slots) {
+		result = wimaxll_pipe_rehash(table, 2 * table->slots);
+		if (result < 0)
+			goto error;
+	}
+	if (table->pipes >= table->pipes_size) {
+		result = -ENOMEM;
+		pipe = realloc(table->pipe,
+			       2 * table->pipes_size * sizeof(*pipe));
+		if (pipe == NULL)
+			goto error;
+		table->pipe = pipe;
+		table->pipes_size *= 2;
+	}
+	pipe = &table->pipe[table->pipes];
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->name = strdup(name);
+	if (pipe->name == NULL) {
+		result = -ENOMEM;
+		goto error;
+	}
+	pipe->hash = hash;
+	idx = hash & (table->slots - 1);
+	while (table->slot[idx] != 0)
+		idx = (idx + 1) & (table->slots - 1);
+	table->slot[idx] = table->pipes + 1;
+	return table->pipes++;
+
+error:
+	return result;
+}
+
+
+/**
+ * Intern a pipe name
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name name of the pipe (NULL for the default one)
+ * \return the pipe's ID (>= 0) or a negative errno code on error.
+ *
+ * Adds the pipe to the handle's table if it is not there yet.
+ */
+int wimaxll_pipe_intern(struct wimaxll_handle *wmx, const char *pipe_name)
+{
+	int result;
+
+	pthread_mutex_lock(&wmx->pipes.mutex);
+	result = __wimaxll_pipe_intern(&wmx->pipes, pipe_name);
+	pthread_mutex_unlock(&wmx->pipes.mutex);
+	d_printf(3, wmx, "D: pipe %s interned as %d\n", pipe_name, result);
+	return result;
+}
+
+
+/**
+ * Find the ID and callback of a pipe
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name name of the pipe (NULL for the default one)
+ * \param cb where to store the pipe's callback (NULL if none)
+ * \param priv where to store the pipe's callback private pointer
+ * \return the pipe's ID (>= 0) or -%ENOENT if the handle has never
+ *     seen the pipe (then \a cb is set to NULL).
+ *
+ * This is what is done for each message to user received, so it
+ * doesn't intern anything.
+ */
+int wimaxll_pipe_lookup(struct wimaxll_handle *wmx, const char *pipe_name,
+			wimaxll_msg_to_user_cb_f *cb, void **priv)
+{
+	int result;
+	struct wimaxll_pipe_table *table = &wmx->pipes;
+
+	*cb = NULL;
+	*priv = NULL;
+	pthread_mutex_lock(&table->mutex);
+	if (table->pipes == 0)
+		result = -ENOENT;
+	else if (pipe_name == NULL)
+		result = 0;
+	else
+		result = __wimaxll_pipe_find(
+			table, pipe_name, wimaxll_pipe_hash(pipe_name));
+	if (result >= 0) {
+		*cb = table->pipe[result].cb;
+		*priv = table->pipe[result].priv;
+	}
+	pthread_mutex_unlock(&table->mutex);
+	return result;
+}
+
+
+/*
+ * Release the pipe table of a handle
+ *
+ * \internal
+ */
+void wimaxll_pipe_table_free(struct wimaxll_handle *wmx)
+{
+	unsigned id;
+	struct wimaxll_pipe_table *table = &wmx->pipes;
+
+	for (id = 0; id < table->pipes; id++)
+		free(table->pipe[id].name);
+	free(table->pipe);
+	free(table->slot);
+	table->pipe = NULL;
+	table->slot = NULL;
+	table->pipes = table->pipes_size = table->slots = 0;
+	table->subscribed = 0;
+}
+
+
+/**
+ * Get the callback and priv pointer for messages to user on a pipe
+ *
+ * \param wmx WiMAX handle.
+ * \param pipe_name Name of the pipe (NULL for the default one).
+ * \param cb Where to store the current callback function (NULL if
+ *     none is set for the pipe).
+ * \param priv Where to store the private data pointer passed to the
+ *     callback.
+ *
+ * \ingroup pipe_group
+ */
+void wimaxll_pipe_get_cb_msg_to_user(
+	struct wimaxll_handle *wmx, const char *pipe_name,
+	wimaxll_msg_to_user_cb_f *cb, void **priv)
+{
+	wimaxll_pipe_lookup(wmx, pipe_name, cb, priv);
+}
+
+
+/**
+ * Set the callback and priv pointer for messages to user on a pipe
+ *
+ * \param wmx WiMAX handle.
+ * \param pipe_name Name of the pipe (NULL for the default one).
+ * \param cb Callback function to set; NULL to stop getting the
+ *     pipe's messages with their own callback (they go back to the
+ *     one set with wimaxll_set_cb_msg_to_user()).
+ * \param priv Private data pointer to pass to the callback
+ *     function.
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * \a cb will be called by wimaxll_recv() (and friends) for each
+ * message to user received on \a pipe_name, instead of the handle's
+ * catch-all callback. It is passed \a pipe_name as the handle sees
+ * it (not the pointer given here).
+ *
+ * Can be called while other threads are receiving from the handle
+ * (and from callbacks); it takes effect with the next message.
+ *
+ * \ingroup pipe_group
+ */
+int wimaxll_pipe_set_cb_msg_to_user(
+	struct wimaxll_handle *wmx, const char *pipe_name,
+	wimaxll_msg_to_user_cb_f cb, void *priv)
+{
+	int result;
+	struct wimaxll_pipe_table *table = &wmx->pipes;
+	struct wimaxll_pipe *pipe;
+
+	d_fnstart(3, wmx, "(wmx %p pipe_name %s cb %p priv %p)\n",
+		  wmx, pipe_name, cb, priv);
+	pthread_mutex_lock(&table->mutex);
+	result = __wimaxll_pipe_intern(table, pipe_name);
+	if (result < 0)
+		goto error_intern;
+	pipe = &table->pipe[result];
+	if (pipe->cb == NULL && cb != NULL)
+		table->subscribed++;
+	else if (pipe->cb != NULL && cb == NULL)
+		table->subscribed--;
+	pipe->cb = cb;
+	pipe->priv = priv;
+	result = 0;
+error_intern:
+	pthread_mutex_unlock(&table->mutex);
+	d_fnend(3, wmx, "(wmx %p pipe_name %s cb %p priv %p) = %d\n",
+		wmx, pipe_name, cb, priv, result);
+	return result;
+}
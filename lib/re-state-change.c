@@ -63,6 +63,28 @@
  *
  * Applications can query the current callback set for the state
  * change notifications with wimaxll_get_cb_state_change().
+ *
+ * \section state_change_coalesced Coalescing state changes
+ *
+ * When a device flaps (eg: connecting and disconnecting), a burst of
+ * state changes can be queued. Applications that only care about
+ * where the device ended up (and the path it took) can set a
+ * coalesced callback instead:
+ *
+ * @code
+ * wimaxll_set_cb_state_change_coalesced(wmx, my_coalesced_callback,
+ *                                       context_pointer);
+ * @endcode
+ *
+ * Then, when wimaxll_recv() (or the event loop) finds state changes
+ * queued, it collapses all of them into a single call, with the
+ * state before the first one, the state after the last one and a
+ * log of the states visited (\ref wimaxll_state_log). The callback
+ * is called once there are no more notifications queued, before any
+ * message to user received after them or when a state change doesn't
+ * follow from the previous one (eg: after %WIMAXLL_STATE_LOST).
+ *
+ * wimaxll_recv_batch() always returns state changes one by one.
  */
 #define _GNU_SOURCE
 #include <sys/types.h>
@@ -99,53 +121,57 @@ struct nla_policy wimaxll_gnl_re_state_change_policy[WIMAX_GNL_ATTR_MAX + 1] = {
 
 
 /**
- * Callback to process an WIMAX_GNL_RE_STATE_CHANGE from the kernel
+ * Parse a WIMAX_GNL_RE_STATE_CHANGE message from the kernel
  *
  * \internal
  *
  * \param wmx WiMAX device handle
- * \param mch WiMAX multicast group handle
- * \param msg Pointer to netlink message
- * \return \c enum nl_cb_action
- *
- * wimaxll_mc_rx_read() calls libnl's nl_recvmsgs() to receive messages;
- * when a valid message is received, it goes into a loop that selects
- * a callback to run for each type of message and it will call this
- * function.
- *
- * This just expects a _RE_STATE_CHANGE message, whose payload is what
- * has to be passed to the caller. We just extract the data and call
- * the callback defined in the handle.
+ * \param nl_hdr Pointer to the netlink message header
+ * \param ifidx Where to store the interface index the message is for
+ * \param old_state Where to store the state the device left
+ * \param new_state Where to store the state the device entered
+ * \return 0 if ok, < 0 errno code on error; -ENODEV if the message
+ *     is not for the interface \a wmx represents.
  */
-int wimaxll_gnl_handle_state_change(struct wimaxll_handle *wmx,
-				    struct nl_msg *msg)
+int wimaxll_gnl_parse_state_change(struct wimaxll_handle *wmx,
+				   struct nlmsghdr *nl_hdr, unsigned *ifidx,
+				   enum wimax_st *old_state,
+				   enum wimax_st *new_state)
 {
-	ssize_t result;
-	struct nlmsghdr *nl_hdr;
+	int result;
 	struct genlmsghdr *gnl_hdr;
 	struct nlattr *tb[WIMAX_GNL_ATTR_MAX+1];
-	enum wimax_st old_state, new_state;
 	unsigned dest_ifidx;
-	
-	d_fnstart(7, wmx, "(wmx %p msg %p)\n", wmx, msg);
-	nl_hdr = nlmsg_hdr(msg);
-	gnl_hdr = nlmsg_data(nl_hdr);
 
+	gnl_hdr = nlmsg_data(nl_hdr);
 	assert(gnl_hdr->cmd == WIMAX_GNL_RE_STATE_CHANGE);
 
+	/* Quick check before parsing it all, in case the kernel
+	 * couldn't filter it for us */
+	if (wmx->ifidx > 0
+	    && wimaxll_gnl_peek_ifidx(nl_hdr, &dest_ifidx) == 0
+	    && wmx->ifidx != dest_ifidx) {
+		wmx->stats.rx_other++;
+		return -ENODEV;
+	}
+
 	/* Parse the attributes */
 	result = genlmsg_parse(nl_hdr, 0, tb, WIMAX_GNL_ATTR_MAX,
 			       wimaxll_gnl_re_state_change_policy);
 	if (result < 0) {
-		wimaxll_msg(wmx, "E: %s: genlmsg_parse() failed: %zd\n",
+		wimaxll_msg(wmx, "E: %s: genlmsg_parse() failed: %d\n",
 			  __func__, result);
 		goto error_parse;
 	}
 	/* Find if the message is for the interface wmx represents */
-	dest_ifidx = nla_get_u32(tb[WIMAX_GNL_STCH_IFIDX]);
-	if (wmx->ifidx > 0 && wmx->ifidx != dest_ifidx) {
+	if (tb[WIMAX_GNL_STCH_IFIDX] == NULL) {
 		wimaxll_msg(wmx, "E: %s: cannot find IFIDX attribute\n",
 			    __func__);
+		result = -EINVAL;
+		goto error_no_attrs;
+	}
+	dest_ifidx = nla_get_u32(tb[WIMAX_GNL_STCH_IFIDX]);
+	if (wmx->ifidx > 0 && wmx->ifidx != dest_ifidx) {
 		result = -ENODEV;
 		goto error_no_attrs;
 	}
@@ -157,8 +183,6 @@ int wimaxll_gnl_handle_state_change(struct wimaxll_handle *wmx,
 		goto error_no_attrs;
 
 	}
-	old_state = nla_get_u8(tb[WIMAX_GNL_STCH_STATE_OLD]);
-
 	if (tb[WIMAX_GNL_STCH_STATE_NEW] == NULL) {
 		wimaxll_msg(wmx, "E: %s: cannot find STCH_STATE_NEW "
 			    "attribute\n", __func__);
@@ -166,39 +190,170 @@ int wimaxll_gnl_handle_state_change(struct wimaxll_handle *wmx,
 		goto error_no_attrs;
 
 	}
-	new_state = nla_get_u8(tb[WIMAX_GNL_STCH_STATE_NEW]);
+	*ifidx = dest_ifidx;
+	*old_state = nla_get_u8(tb[WIMAX_GNL_STCH_STATE_OLD]);
+	*new_state = nla_get_u8(tb[WIMAX_GNL_STCH_STATE_NEW]);
 
 	d_printf(1, wmx, "D: CRX re_state_change old %u new %u\n",
-		 old_state, new_state);
-
-	/* If this is an "any" handle, set the wmx->ifidx to the
-	 * received one so the callback can now where did the thing
-	 * come from. Will be restored.
-	 */
-	if (wmx->ifidx == 0) {
-		wmx->ifidx = dest_ifidx;
-		dest_ifidx = 0;
-	}
-	/* Now execute the callback for handling re-state-change; if
-	 * it doesn't update the context's result code, we'll do. */
-	result = wmx->state_change_cb(wmx, wmx->state_change_priv,
-				      old_state, new_state);
-	wmx->ifidx = dest_ifidx;
+		 *old_state, *new_state);
+	wmx->stats.rx_state_changes++;
+	wimaxll_state_cache_update(wmx, *new_state);
+	return result;
+
 error_no_attrs:
+error_parse:
+	if (result == -ENODEV)
+		wmx->stats.rx_other++;
+	else
+		wmx->stats.rx_parse_errors++;
+	return result;
+}
+
+
+/**
+ * Callback to process an WIMAX_GNL_RE_STATE_CHANGE from the kernel
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle
+ * \param mch WiMAX multicast group handle
+ * \param msg Pointer to netlink message
+ * \return \c enum nl_cb_action
+ *
+ * wimaxll_mc_rx_read() calls libnl's nl_recvmsgs() to receive messages;
+ * when a valid message is received, it goes into a loop that selects
+ * a callback to run for each type of message and it will call this
+ * function.
+ *
+ * This just expects a _RE_STATE_CHANGE message, whose payload is what
+ * has to be passed to the caller. We just extract the data and call
+ * the callback defined in the handle.
+ */
+int wimaxll_gnl_handle_state_change(struct wimaxll_handle *wmx,
+				    struct nl_msg *msg)
+{
+	ssize_t result;
+	enum wimax_st old_state, new_state;
+	unsigned dest_ifidx;
+
+	d_fnstart(7, wmx, "(wmx %p msg %p)\n", wmx, msg);
+	result = wimaxll_gnl_parse_state_change(wmx, nlmsg_hdr(msg),
+						&dest_ifidx,
+						&old_state, &new_state);
+	if (result < 0)
+		goto error_parse;
+	result = wimaxll_state_change_deliver(wmx, dest_ifidx,
+					      old_state, new_state);
 error_parse:
 	d_fnend(7, wmx, "(wmx %p msg %p) = %zd\n", wmx, msg, result);
 	return result;
 }
 
 
+/*
+ * Pass a state change to the handle's callbacks
+ *
+ * \internal
+ *
+ * \param ifidx interface the state change is for
+ * \return what the callback returned; -%EINPROGRESS if the state
+ *     change is being held to be coalesced with the next ones (and
+ *     wimaxll_state_change_flush() has to be called when there are no
+ *     more queued).
+ *
+ * Threads waiting in wimaxll_wait_for_state_change() get it first
+ * (all of them). Then, without a coalesced callback, the state change
+ * callback is called right away (if set). With it, unless a receive
+ * function is draining the socket (wmx->stch_coalescing), the state
+ * change is delivered on its own.
+ *
+ * If this is an "any" handle, wimaxll_ifidx() returns the received
+ * one while the callbacks run so they can know where did the thing
+ * come from.
+ */
+int wimaxll_state_change_deliver(struct wimaxll_handle *wmx, unsigned ifidx,
+				 enum wimax_st old_state,
+				 enum wimax_st new_state)
+{
+	int result = 0, flushed;
+	struct wimaxll_state_log *log = &wmx->stch_log;
+	struct wimaxll_dispatch dispatch;
+
+	wimaxll_rx_waiters_state_change(wmx, old_state, new_state);
+	if (wmx->stch_coalesced_cb == NULL) {
+		if (wmx->state_change_cb == NULL)
+			return 0;
+		wimaxll_dispatch_push(&dispatch, wmx, ifidx);
+		result = wmx->state_change_cb(wmx, wmx->state_change_priv,
+					      old_state, new_state);
+		wimaxll_dispatch_pop(&dispatch);
+		return result;
+	}
+	/* Not a continuation of what we hold? deliver that first */
+	if (log->count > 0
+	    && (ifidx != wmx->stch_ifidx
+		|| old_state != log->state[log->count - 1]))
+		result = wimaxll_state_change_flush(wmx);
+	if (log->count == 0) {
+		wmx->stch_ifidx = ifidx;
+		wmx->stch_old_state = old_state;
+		log->transitions = 0;
+		log->state[log->count++] = old_state;
+	}
+	if (log->count >= WIMAXLL_STATE_LOG_SIZE) {
+		memmove(log->state, log->state + 1, log->count - 1);
+		log->count--;
+	}
+	log->state[log->count++] = new_state;
+	log->transitions++;
+	if (!wmx->stch_coalescing) {
+		/* Don't lose a stop asked for by the first flush */
+		flushed = wimaxll_state_change_flush(wmx);
+		return result < 0 ? result : flushed;
+	}
+	d_printf(2, wmx, "D: holding state change %u -> %u (%u so far)\n",
+		 old_state, new_state, log->transitions);
+	return result == -EBUSY ? result : -EINPROGRESS;
+}
+
+
+/*
+ * Deliver the state changes held for coalescing
+ *
+ * \internal
+ *
+ * \return what the coalesced callback returned; 0 if there was
+ *     nothing held.
+ */
+int wimaxll_state_change_flush(struct wimaxll_handle *wmx)
+{
+	int result = 0;
+	struct wimaxll_state_log log = wmx->stch_log;
+	struct wimaxll_dispatch dispatch;
+
+	if (log.count == 0)
+		return 0;
+	/* Clear it first, the callback might receive again */
+	wmx->stch_log.count = 0;
+	wmx->stch_log.transitions = 0;
+	if (wmx->stch_coalesced_cb == NULL)
+		return 0;
+	wimaxll_dispatch_push(&dispatch, wmx, wmx->stch_ifidx);
+	result = wmx->stch_coalesced_cb(wmx, wmx->stch_coalesced_priv,
+					wmx->stch_old_state,
+					log.state[log.count - 1], &log);
+	wimaxll_dispatch_pop(&dispatch);
+	return result;
+}
+
+
 /*
  * Context for the default callback we use in
  * wimaxll_wait_for_state_change()
  */
 struct wimaxll_state_change_context {
-	struct wimaxll_cb_ctx ctx;
+	struct wimaxll_rx_waiter waiter;
 	enum wimax_st *old_state, *new_state;
-	int set:1;
 };
 
 
@@ -237,74 +392,147 @@ void wimaxll_set_cb_state_change(struct wimaxll_handle *wmx,
 }
 
 
+/**
+ * Get the callback and priv pointer for coalesced state changes
+ *
+ * \param wmx WiMAX handle.
+ * \param cb Where to store the current callback function.
+ * \param priv Where to store the private data pointer passed to the
+ *     callback.
+ *
+ * \ingroup state_change_group
+ */
+void wimaxll_get_cb_state_change_coalesced(
+	struct wimaxll_handle *wmx,
+	wimaxll_state_change_coalesced_cb_f *cb, void **priv)
+{
+	*cb = wmx->stch_coalesced_cb;
+	*priv = wmx->stch_coalesced_priv;
+}
+
+
+/**
+ * Set the callback and priv pointer for coalesced state changes
+ *
+ * \param wmx WiMAX handle.
+ * \param cb Callback function to set; NULL to go back to the
+ *     (one by one) state change callback.
+ * \param priv Private data pointer to pass to the callback function.
+ *
+ * While set, it is used instead of the callback set with
+ * wimaxll_set_cb_state_change(). State changes held for
+ * the previous callback are delivered to it first.
+ *
+ * \ingroup state_change_group
+ */
+void wimaxll_set_cb_state_change_coalesced(
+	struct wimaxll_handle *wmx,
+	wimaxll_state_change_coalesced_cb_f cb, void *priv)
+{
+	wimaxll_state_change_flush(wmx);
+	wmx->stch_coalesced_cb = cb;
+	wmx->stch_coalesced_priv = priv;
+}
+
+
 /*
  * Default callback we use in wimaxll_wait_for_state_change()
+ *
+ * Runs in the thread that is reading (maybe not the waiter's), with
+ * wmx->rx_mutex held.
  */
 static
-int wimaxll_cb_state_change(struct wimaxll_handle *wmx, void *_ctx,
-			    enum wimax_st old_state, enum wimax_st new_state)
+void wimaxll_cb_state_change(struct wimaxll_handle *wmx,
+			     struct wimaxll_rx_waiter *waiter,
+			     enum wimax_st old_state, enum wimax_st new_state)
 {
-	struct wimaxll_cb_ctx *ctx = _ctx;
 	struct wimaxll_state_change_context *stch_ctx =
-		wimaxll_container_of(ctx, struct wimaxll_state_change_context,
-				     ctx);
+		wimaxll_container_of(waiter,
+				     struct wimaxll_state_change_context,
+				     waiter);
 
-	if (stch_ctx->set)
-		return -EBUSY;
 	*stch_ctx->old_state = old_state;
 	*stch_ctx->new_state = new_state;
-	stch_ctx->set = 1;
-	return -EBUSY;
 }
 
 
 /**
- * Wait for an state change notification from the kernel
+ * Wait for an state change notification from the kernel, with a
+ * timeout
  *
  * \param wmx WiMAX device handle
  * \param old_state Pointer to where to store the previous state
  * \param new_state Pointer to where to store the new state
+ * \param timeout_ms How long to wait for the state change, in
+ *     milliseconds; -1 blocks for ever, 0 doesn't block.
  * \return If successful, 0 and the values pointed to by the \a
  *     old_state and \a new_state arguments are valid; on error, a
  *     negative \a errno code and the state pointers contain no valid
- *     information.
+ *     information; -%ETIMEDOUT if no state change was notified in
+ *     time.
  *
  * Waits for the WiMAX device to change state and reports said state
  * change.
  *
- * Internally, this function uses wimax_recv() , which means that on
- * reception (from the kernel) of notifications other than state
- * change, any callbacks that are set for them will be executed.
- *
- * \note This is a blocking call.
+ * Internally, this function receives like wimax_recv_timeout(),
+ * which means that on reception (from the kernel) of notifications
+ * other than state change, any callbacks that are set for them will
+ * be executed. The state change is also delivered to the state change
+ * callbacks set in the handle.
  *
- * \note This function cannot be run in parallel with other code that
- *     modifies the \e state \e change callbacks for this same handle.
+ * Many threads can wait at the same time on the same handle; all of
+ * them get the state change. If another thread is receiving on the
+ * handle, this waits for it to pass it the state change.
  *
  * \ingroup state_change_group
  */
-ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
-				      enum wimax_st *old_state,
-				      enum wimax_st *new_state)
+ssize_t wimaxll_wait_for_state_change_timeout(struct wimaxll_handle *wmx,
+					      enum wimax_st *old_state,
+					      enum wimax_st *new_state,
+					      int timeout_ms)
 {
 	ssize_t result;
-	wimaxll_state_change_cb_f prev_cb = NULL;
-	void *prev_priv = NULL;
 	struct wimaxll_state_change_context ctx = {
-		.ctx = WIMAXLL_CB_CTX_INIT(wmx),
+		.waiter = {
+			.state_change = wimaxll_cb_state_change,
+		},
 		.old_state = old_state,
 		.new_state = new_state,
-		.set = 0,
 	};
 
-	d_fnstart(3, wmx, "(wmx %p old_state %p new_state %p)\n",
-		  wmx, old_state, new_state);
-	wimaxll_get_cb_state_change(wmx, &prev_cb, &prev_priv);
-	wimaxll_set_cb_state_change(wmx, wimaxll_cb_state_change, &ctx.ctx);
-	result = wimaxll_recv(wmx);
+	d_fnstart(3, wmx, "(wmx %p old_state %p new_state %p timeout_ms %d)\n",
+		  wmx, old_state, new_state, timeout_ms);
+	result = wimaxll_rx_wait(wmx, &ctx.waiter, timeout_ms);
 	/* the callback filled out *old_state and *new_state if ok */
-	wimaxll_set_cb_state_change(wmx, prev_cb, prev_priv);
 	d_fnend(3, wmx, "(wmx %p old_state %p [%u] new_state %p [%u])\n",
 		wmx, old_state, *old_state, new_state, *new_state);
 	return result;
 }
+
+
+/**
+ * Wait for an state change notification from the kernel
+ *
+ * \param wmx WiMAX device handle
+ * \param old_state Pointer to where to store the previous state
+ * \param new_state Pointer to where to store the new state
+ * \return If successful, 0 and the values pointed to by the \a
+ *     old_state and \a new_state arguments are valid; on error, a
+ *     negative \a errno code and the state pointers contain no valid
+ *     information.
+ *
+ * Same as wimaxll_wait_for_state_change_timeout() using the handle's
+ * default timeout (see wimaxll_set_timeout()).
+ *
+ * \note This is a blocking call.
+ *
+ * \ingroup state_change_group
+ */
+ssize_t wimaxll_wait_for_state_change(struct wimaxll_handle *wmx,
+				      enum wimax_st *old_state,
+				      enum wimax_st *new_state)
+{
+	return wimaxll_wait_for_state_change_timeout(wmx, old_state,
+						     new_state,
+						     wmx->timeout_ms);
+}
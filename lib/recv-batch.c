@@ -0,0 +1,750 @@
+/*
+ * Linux WiMax
+ * Batched reception of notifications from the kernel
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * wimaxll_recv() goes through libnl's nl_recvmsgs(), which reads a
+ * single datagram per system call and runs a callback per
+ * message. When the device is sending bursts of reports that ends up
+ * being a wakeup and a full callback setup per event.
+ *
+ * wimaxll_recv_batch() reads straight from the RX socket, pulling as
+ * many datagrams as are queued with a single recvmmsg() call (where
+ * available, a recvmsg() loop otherwise) into a set of per-handle
+ * buffers. The generic netlink messages in them are then parsed with
+ * the same code the callback path uses and returned to the caller as
+ * an array of events.
+ *
+ * Each buffer is a netlink message (struct nl_msg), so a payload in
+ * it can be lent with wimaxll_msg_read_borrow() like one received by
+ * wimaxll_recv(): the borrower takes a reference and the buffer is
+ * marked as lent. Lent buffers are replaced with new ones before the
+ * next read; the borrower's reference frees the old one when done.
+ *
+ * If the caller's array fills up before all the datagrams read are
+ * parsed, we keep a cursor to where we left off so the next call
+ * returns the rest before reading from the socket again.
+ */
+#define _GNU_SOURCE
+#include <config.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <netlink/msg.h>
+#include <netlink/netlink.h>
+#include <netlink/genl/genl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+#ifdef WIMAXLL_LEAN
+enum {
+	/** Max number of datagrams read in one go (16K of buffers) */
+	WIMAXLL_RX_BATCH_MSGS = 2,
+	/** Size of each datagram buffer */
+	WIMAXLL_RX_BATCH_SIZE = 8192,
+};
+#else
+enum {
+	/** Max number of datagrams read in one go (128K of buffers) */
+	WIMAXLL_RX_BATCH_MSGS = 16,
+	/** Size of each datagram buffer */
+	WIMAXLL_RX_BATCH_SIZE = 8192,
+};
+#endif
+
+
+/*
+ * Receive buffers for wimaxll_recv_batch()
+ *
+ * \param count number of datagrams currently held in \a buf
+ * \param idx datagram we are parsing
+ * \param offset offset into datagram \a idx of the next netlink
+ *     message to parse
+ * \param len size of each datagram in \a buf
+ * \param lost_pending \a lost has to be returned once the datagrams
+ *     in \a buf are parsed
+ * \param lost event telling that notifications were lost (see
+ *     wimaxll_rx_overrun())
+ * \param lent set when a payload in the matching \a buf has been lent
+ *     with wimaxll_msg_read_borrow(); it has to be replaced before
+ *     reading into it again.
+ * \param buf datagram buffers, WIMAXLL_RX_BATCH_SIZE bytes each
+ */
+struct wimaxll_rx_batch {
+	unsigned count, idx;
+	size_t offset;
+	int lost_pending;
+	struct wimaxll_event lost;
+	size_t len[WIMAXLL_RX_BATCH_MSGS];
+	int lent[WIMAXLL_RX_BATCH_MSGS];
+	struct nl_msg *buf[WIMAXLL_RX_BATCH_MSGS];
+};
+
+
+/* Where datagram buffer @idx starts */
+static inline
+void *wimaxll_rx_batch_buf(struct wimaxll_rx_batch *rxb, unsigned idx)
+{
+	return nlmsg_hdr(rxb->buf[idx]);
+}
+
+
+/*
+ * Free the batch receive buffers of a handle
+ *
+ * \internal
+ *
+ * Called from wimaxll_close().
+ */
+void wimaxll_rx_batch_free(struct wimaxll_handle *wmx)
+{
+	unsigned cnt;
+
+	if (wmx->rx_batch == NULL)
+		return;
+	/* Lent buffers are freed when their borrowers are done */
+	for (cnt = 0; cnt < WIMAXLL_RX_BATCH_MSGS; cnt++)
+		if (wmx->rx_batch->buf[cnt])
+			nlmsg_free(wmx->rx_batch->buf[cnt]);
+	free(wmx->rx_batch);
+	wmx->rx_batch = NULL;
+}
+
+
+/*
+ * Return the batch receive buffers of a handle, allocating them if
+ * needed
+ *
+ * The receive buffers take 128K (16K in lean builds), so we only
+ * allocate them when they are first needed in a handle.
+ */
+static
+struct wimaxll_rx_batch *wimaxll_rx_batch_get(struct wimaxll_handle *wmx)
+{
+	unsigned cnt;
+
+	if (wmx->rx_batch != NULL)
+		return wmx->rx_batch;
+	wmx->rx_batch = calloc(1, sizeof(*wmx->rx_batch));
+	if (wmx->rx_batch == NULL)
+		goto error_alloc;
+	for (cnt = 0; cnt < WIMAXLL_RX_BATCH_MSGS; cnt++) {
+		wmx->rx_batch->buf[cnt] =
+			nlmsg_alloc_size(WIMAXLL_RX_BATCH_SIZE);
+		if (wmx->rx_batch->buf[cnt] == NULL)
+			goto error_alloc_buf;
+	}
+	return wmx->rx_batch;
+
+error_alloc_buf:
+	wimaxll_rx_batch_free(wmx);
+error_alloc:
+	wimaxll_msg(wmx, "E: %s: cannot allocate receive buffers\n",
+		    __func__);
+	return NULL;
+}
+
+
+/*
+ * Replace the buffers lent with wimaxll_msg_read_borrow()
+ *
+ * \return 0 if ok, -ENOMEM if a new buffer can't be allocated (the
+ *     ones not replaced stay lent).
+ *
+ * Done before reading into them again; dropping our reference leaves
+ * the old ones to the borrowers, which free them when done.
+ */
+static
+int wimaxll_rx_batch_unlend(struct wimaxll_handle *wmx,
+			    struct wimaxll_rx_batch *rxb)
+{
+	unsigned cnt;
+	struct nl_msg *msg;
+
+	for (cnt = 0; cnt < WIMAXLL_RX_BATCH_MSGS; cnt++) {
+		if (!rxb->lent[cnt])
+			continue;
+		msg = nlmsg_alloc_size(WIMAXLL_RX_BATCH_SIZE);
+		if (msg == NULL) {
+			wmx->stats.rx_nomem++;
+			return -ENOMEM;
+		}
+		nlmsg_free(rxb->buf[cnt]);
+		rxb->buf[cnt] = msg;
+		rxb->lent[cnt] = 0;
+	}
+	return 0;
+}
+
+
+/*
+ * Run the callbacks for an event parsed from datagram buffer @idx
+ *
+ * While they run, the buffer is the message being dispatched (see
+ * wimaxll_handle.rx_msg), so wimaxll_msg_read_borrow() can lend it.
+ * The notice of lost notifications comes after the last datagram
+ * (@idx is past them); it has no buffer.
+ */
+static
+int wimaxll_rx_batch_deliver(struct wimaxll_handle *wmx,
+			     struct wimaxll_rx_batch *rxb, unsigned idx,
+			     const struct wimaxll_event *event)
+{
+	int result;
+	struct nl_msg *prev_msg = wmx->rx_msg;
+	int *prev_lent = wmx->rx_msg_lent;
+
+	if (idx < rxb->count) {
+		wmx->rx_msg = rxb->buf[idx];
+		wmx->rx_msg_lent = &rxb->lent[idx];
+	}
+	result = wimaxll_event_dispatch(wmx, event);
+	wmx->rx_msg = prev_msg;
+	wmx->rx_msg_lent = prev_lent;
+	return result;
+}
+
+
+/*
+ * The RX socket overflowed; queue the notice for the handle
+ *
+ * It is returned after the datagrams already read, as they came
+ * before the ones that were lost.
+ */
+static
+void wimaxll_rx_batch_overrun(struct wimaxll_handle *wmx,
+			      struct wimaxll_rx_batch *rxb)
+{
+	wimaxll_rx_overrun(wmx, &rxb->lost);
+	rxb->lost_pending = 1;
+}
+
+
+/*
+ * Read as many datagrams as there are queued in the RX socket
+ *
+ * \return number of datagrams read (0 if none were queued) or < 0
+ *     errno code on error.
+ *
+ * Doesn't block.  Datagrams that don't come from the kernel or were
+ * truncated are left with zero length, so they are skipped when
+ * parsing. If the socket overflowed, the notice that notifications
+ * were lost is queued (and 0 returned if nothing else was read).
+ */
+static
+ssize_t wimaxll_rx_batch_fill(struct wimaxll_handle *wmx,
+			      struct wimaxll_rx_batch *rxb)
+{
+	ssize_t result;
+	int fd = nl_socket_get_fd(wmx->nlh_rx);
+	unsigned cnt;
+	struct sockaddr_nl addr[WIMAXLL_RX_BATCH_MSGS];
+	struct iovec iov[WIMAXLL_RX_BATCH_MSGS];
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr mmsg[WIMAXLL_RX_BATCH_MSGS];
+
+	result = wimaxll_rx_batch_unlend(wmx, rxb);
+	if (result < 0)
+		goto error_unlend;
+	/* What doesn't come with an address (eg: mock devices) is
+	 * taken as coming from the kernel */
+	memset(addr, 0, sizeof(addr));
+	memset(mmsg, 0, sizeof(mmsg));
+	for (cnt = 0; cnt < WIMAXLL_RX_BATCH_MSGS; cnt++) {
+		iov[cnt].iov_base = wimaxll_rx_batch_buf(rxb, cnt);
+		iov[cnt].iov_len = WIMAXLL_RX_BATCH_SIZE;
+		mmsg[cnt].msg_hdr.msg_name = &addr[cnt];
+		mmsg[cnt].msg_hdr.msg_namelen = sizeof(addr[cnt]);
+		mmsg[cnt].msg_hdr.msg_iov = &iov[cnt];
+		mmsg[cnt].msg_hdr.msg_iovlen = 1;
+	}
+	if (wimaxll_rx_mock_overrun(wmx)) {
+		result = -ENOBUFS;
+		goto error_recv;
+	}
+	result = recvmmsg(fd, mmsg, WIMAXLL_RX_BATCH_MSGS, MSG_DONTWAIT, NULL);
+	if (result < 0) {
+		result = -errno;
+		goto error_recv;
+	}
+	for (cnt = 0; cnt < result; cnt++) {
+		rxb->len[cnt] = mmsg[cnt].msg_len;
+		if (mmsg[cnt].msg_hdr.msg_flags & MSG_TRUNC) {
+			wimaxll_msg(wmx, "W: %s: datagram truncated, "
+				    "dropped\n", __func__);
+			rxb->len[cnt] = 0;
+		}
+		if (addr[cnt].nl_pid != 0)	/* not from the kernel */
+			rxb->len[cnt] = 0;
+	}
+#else
+	struct msghdr msg;
+
+	result = wimaxll_rx_batch_unlend(wmx, rxb);
+	if (result < 0)
+		goto error_unlend;
+	if (wimaxll_rx_mock_overrun(wmx)) {
+		result = -ENOBUFS;
+		goto error_recv;
+	}
+	memset(addr, 0, sizeof(addr));
+	for (cnt = 0; cnt < WIMAXLL_RX_BATCH_MSGS; cnt++) {
+		memset(&msg, 0, sizeof(msg));
+		iov[cnt].iov_base = wimaxll_rx_batch_buf(rxb, cnt);
+		iov[cnt].iov_len = WIMAXLL_RX_BATCH_SIZE;
+		msg.msg_name = &addr[cnt];
+		msg.msg_namelen = sizeof(addr[cnt]);
+		msg.msg_iov = &iov[cnt];
+		msg.msg_iovlen = 1;
+		result = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if (result < 0) {
+			result = -errno;
+			if (cnt > 0) {
+				if (result == -ENOBUFS)
+					wimaxll_rx_batch_overrun(wmx, rxb);
+				break;
+			}
+			goto error_recv;
+		}
+		rxb->len[cnt] = result;
+		if (msg.msg_flags & MSG_TRUNC) {
+			wimaxll_msg(wmx, "W: %s: datagram truncated, "
+				    "dropped\n", __func__);
+			rxb->len[cnt] = 0;
+		}
+		if (addr[cnt].nl_pid != 0)	/* not from the kernel */
+			rxb->len[cnt] = 0;
+	}
+	result = cnt;
+#endif
+	rxb->count = result;
+	rxb->idx = 0;
+	rxb->offset = 0;
+	d_printf(2, wmx, "D: %s: read %zd datagrams\n", __func__, result);
+	return result;
+
+error_unlend:
+error_recv:
+	rxb->count = 0;
+	rxb->idx = 0;
+	rxb->offset = 0;
+	if (result == -EAGAIN || result == -EWOULDBLOCK)
+		return 0;
+	if (result == -ENOBUFS) {
+		wimaxll_rx_batch_overrun(wmx, rxb);
+		return 0;
+	}
+	wimaxll_msg(wmx, "E: %s: cannot read from RX socket: %zd\n",
+		    __func__, result);
+	return result;
+}
+
+
+/*
+ * Convert a netlink message into an event
+ *
+ * \return 0 if the event was filled out, < 0 errno code if the
+ *     message has to be skipped (not ours, for another device,
+ *     malformed...).
+ *
+ * If the handle shares its RX socket, messages for other handles
+ * are handed to their callbacks right away (\a event is used as
+ * scratch space); \a nl_hdr is in datagram buffer \a rxb->idx.
+ */
+static
+int wimaxll_rx_batch_parse_one(struct wimaxll_handle *wmx,
+			       struct wimaxll_rx_batch *rxb,
+			       struct nlmsghdr *nl_hdr,
+			       struct wimaxll_event *event)
+{
+	int result;
+	struct genlmsghdr *gnl_hdr;
+	struct wimaxll_handle *dst_wmx;
+
+	switch (nl_hdr->nlmsg_type) {
+	case NLMSG_ERROR:
+	case NLMSG_DONE:
+	case NLMSG_NOOP:
+	case NLMSG_OVERRUN:
+		return -ENOMSG;
+	case GENL_ID_CTRL:
+		/* The WiMAX stack coming or going? */
+		wimaxll_hotplug_ctrl(wmx, nl_hdr);
+		return -ENOMSG;
+	}
+	if (nl_hdr->nlmsg_type != wmx->gnl_family_id
+	    || nlmsg_len(nl_hdr) < GENL_HDRLEN)
+		return -ENOMSG;
+	dst_wmx = wimaxll_rx_shared_demux(wmx, nl_hdr);
+	if (dst_wmx != wmx) {
+		/* For another handle sharing the RX socket; run its
+		 * callbacks */
+		if (dst_wmx == NULL)
+			return -ENODEV;
+		if (wimaxll_rx_batch_parse_one(dst_wmx, rxb, nl_hdr,
+					       event) >= 0
+		    && wimaxll_rx_batch_deliver(dst_wmx, rxb, rxb->idx,
+						event) == -EBUSY)
+			wimaxll_rx_busy_set(dst_wmx);
+		wimaxll_rx_handle_put(dst_wmx);
+		return -ENODEV;
+	}
+	gnl_hdr = nlmsg_data(nl_hdr);
+	switch (gnl_hdr->cmd) {
+	case WIMAX_GNL_OP_MSG_TO_USER:
+		event->type = WIMAXLL_EVENT_MSG_TO_USER;
+		result = wimaxll_gnl_parse_msg_to_user(
+			wmx, nl_hdr, &event->ifidx, &event->msg.pipe_name,
+			&event->msg.data, &event->msg.size);
+		break;
+	case WIMAX_GNL_RE_STATE_CHANGE:
+		event->type = WIMAXLL_EVENT_STATE_CHANGE;
+		result = wimaxll_gnl_parse_state_change(
+			wmx, nl_hdr, &event->ifidx,
+			&event->state_change.old_state,
+			&event->state_change.new_state);
+		break;
+	default:
+		d_printf(3, wmx, "E: %s: received unknown gnl message %d\n",
+			 __func__, gnl_hdr->cmd);
+		result = -ENOMSG;
+	}
+	return result;
+}
+
+
+/*
+ * Parse the datagrams held in the buffers into events
+ *
+ * \return number of events filled out in \a events
+ *
+ * Stops when \a count events have been filled out or when all the
+ * datagrams have been parsed; the cursor in \a rxb is updated to
+ * point to the next message to parse. A pending notice of lost
+ * notifications is returned after the last datagram.
+ */
+static
+size_t wimaxll_rx_batch_parse(struct wimaxll_handle *wmx,
+			      struct wimaxll_rx_batch *rxb,
+			      struct wimaxll_event *events, size_t count)
+{
+	size_t filled = 0;
+	int remaining;
+	struct nlmsghdr *nl_hdr;
+
+	while (rxb->idx < rxb->count && filled < count) {
+		nl_hdr = wimaxll_rx_batch_buf(rxb, rxb->idx) + rxb->offset;
+		remaining = rxb->len[rxb->idx] - rxb->offset;
+		if (!nlmsg_ok(nl_hdr, remaining)) {
+			/* done with this datagram */
+			rxb->idx++;
+			rxb->offset = 0;
+			continue;
+		}
+		if (wimaxll_rx_batch_parse_one(wmx, rxb, nl_hdr,
+					       &events[filled]) >= 0)
+			filled++;
+		rxb->offset += NLMSG_ALIGN(nl_hdr->nlmsg_len);
+	}
+	if (rxb->lost_pending && rxb->idx >= rxb->count && filled < count) {
+		events[filled++] = rxb->lost;
+		rxb->lost_pending = 0;
+	}
+	return filled;
+}
+
+
+/**
+ * Read a batch of notifications from the kernel
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \param events Array where to store the events received
+ *
+ * \param count Number of entries in \a events
+ *
+ * \param timeout_ms How long to wait for the first event to
+ *     arrive, in milliseconds; -1 waits forever, 0 doesn't wait at
+ *     all.
+ *
+ * \return Number of events stored in \a events; 0 if the timeout
+ *     expired before any arrived.  On error, a negative errno code.
+ *
+ * Waits until at least one notification is available and then
+ * returns (up to \a count of) the ones a single read of the socket
+ * brings in, without blocking again; call again for the rest. Both
+ * \e message \e to \e user and \e state \e change notifications are
+ * returned, in the order they were received, as a \ref
+ * wimaxll_event "struct wimaxll_event".
+ *
+ * Pointers in the events returned (pipe names and message payloads)
+ * point into buffers that belong to the handle; they are valid only
+ * until the next call to this function or wimaxll_close().
+ *
+ * Unlike wimaxll_recv(), this does not execute the callbacks set in
+ * the handle (nor hands notifications to threads waiting in
+ * wimaxll_msg_read*() or wimaxll_wait_for_state_change()).
+ * Notifications that don't fit in \a events are kept and returned by
+ * the next call; they will be lost if wimaxll_recv() (or any of the
+ * functions that use it) is called in between.
+ *
+ * While this receives, other threads that want to receive on the
+ * handle wait. As the buffers are the handle's, only one thread
+ * should use this function on a handle.
+ *
+ * If the handle shares its RX socket with others (see
+ * wimaxll_open_ex()), notifications for them are not returned; their
+ * callbacks are executed instead.
+ *
+ * If the kernel dropped notifications because the receive buffer was
+ * full, a state change event from %WIMAXLL_STATE_LOST to
+ * %__WIMAX_ST_INVALID (the state now is unknown) is returned after
+ * the ones received before the overflow.
+ *
+ * Any message payload lent with wimaxll_msg_read_borrow() is
+ * released before reading.
+ *
+ * \ingroup the_messaging_interface
+ */
+ssize_t wimaxll_recv_batch(struct wimaxll_handle *wmx,
+			   struct wimaxll_event *events, size_t count,
+			   int timeout_ms)
+{
+	ssize_t result;
+	size_t filled = 0;
+	struct wimaxll_rx_batch *rxb;
+	struct timespec deadline;
+
+	d_fnstart(3, wmx, "(wmx %p events %p count %zu timeout_ms %d)\n",
+		  wmx, events, count, timeout_ms);
+	wimaxll_msg_release(wmx);
+	wimaxll_deadline_init(&deadline, timeout_ms);
+	result = wimaxll_rx_reader_get(wmx, NULL, &deadline, timeout_ms);
+	if (result == -ETIMEDOUT) {
+		result = 0;
+		goto error_reader_get;
+	}
+	if (wmx->nlh_link)
+		wimaxll_hotplug_link_process(wmx);
+	result = -ENOMEM;
+	rxb = wimaxll_rx_batch_get(wmx);
+	if (rxb == NULL)
+		goto error_alloc;
+	while (filled < count) {
+		if (rxb->idx >= rxb->count) {
+			/* Buffers consumed; refilling them would
+			 * overwrite what the events returned so far
+			 * point to */
+			if (filled > 0)
+				break;
+			if (timeout_ms != 0) {
+				result = wimaxll_wait_fd(
+					nl_socket_get_fd(wmx->nlh_rx),
+					wimaxll_deadline_left(&deadline,
+							      timeout_ms));
+				if (result == -ETIMEDOUT)
+					break;
+				if (result < 0)
+					goto error_poll;
+			}
+			result = wimaxll_rx_batch_fill(wmx, rxb);
+			if (result < 0)
+				goto error_fill;
+			if (result == 0 && !rxb->lost_pending) {
+				/* Queue drained (or a spurious wakeup) */
+				if (timeout_ms == 0)
+					break;
+				continue;
+			}
+		}
+		filled += wimaxll_rx_batch_parse(wmx, rxb, events + filled,
+						 count - filled);
+	}
+	result = filled;
+	wimaxll_rx_reader_put(wmx);
+	d_fnend(3, wmx, "(wmx %p events %p count %zu timeout_ms %d) = %zd\n",
+		wmx, events, count, timeout_ms, result);
+	return result;
+
+error_fill:
+error_poll:
+error_alloc:
+	wimaxll_rx_reader_put(wmx);
+error_reader_get:
+	d_fnend(3, wmx, "(wmx %p events %p count %zu timeout_ms %d) = %zd\n",
+		wmx, events, count, timeout_ms, result);
+	return result;
+}
+
+
+/*
+ * Execute the callback set in a handle for an event
+ *
+ * \internal
+ *
+ * \return what the callback returned (0 if there is no callback set
+ *     for this type of event); -%EINPROGRESS if a state change is
+ *     being held for coalescing (see wimaxll_state_change_deliver()).
+ *
+ * Same as what wimaxll_gnl_cb() does for messages received with
+ * wimaxll_recv(): messages are offered first to the threads waiting
+ * for them, then go to their pipe's callback (see
+ * wimaxll_msg_to_user_deliver()) and if this is an "any" handle,
+ * wimaxll_ifidx() returns the one the event is for while the
+ * callback runs.
+ */
+int wimaxll_event_dispatch(struct wimaxll_handle *wmx,
+			   const struct wimaxll_event *event)
+{
+	int result = 0, stop;
+
+	switch (event->type) {
+	case WIMAXLL_EVENT_MSG_TO_USER:
+		/* State changes held for coalescing came before this */
+		stop = wimaxll_state_change_flush(wmx) == -EBUSY;
+		result = wimaxll_msg_to_user_deliver(
+			wmx, event->ifidx, event->msg.pipe_name,
+			event->msg.data, event->msg.size);
+		if (result == -EINPROGRESS)	/* a waiting thread took it */
+			result = 0;
+		if (stop && result >= 0)
+			result = -EBUSY;
+		break;
+	case WIMAXLL_EVENT_STATE_CHANGE:
+		result = wimaxll_state_change_deliver(
+			wmx, event->ifidx, event->state_change.old_state,
+			event->state_change.new_state);
+		break;
+	}
+	return result;
+}
+
+
+/*
+ * Execute the callbacks for the notifications queued in a handle
+ *
+ * \internal
+ *
+ * \return number of notifications processed, -%EBUSY if a callback
+ *     asked to stop processing or a negative errno code on error.
+ *
+ * Doesn't block. Processes first whatever is left in the receive
+ * buffers, then reads once from the RX socket and processes that. If
+ * there are more datagrams queued, they are left for the next call,
+ * so a flooding device doesn't starve others when this is used from
+ * a main loop (the socket will still be readable).
+ *
+ * When a callback returns -%EBUSY, the rest of the notifications
+ * stay in the buffers for the next call.
+ *
+ * State changes for a coalesced state change callback are held
+ * across calls until the socket has nothing else queued.
+ *
+ * If another thread is receiving on the handle, this does nothing
+ * (that thread executes the callbacks).
+ */
+ssize_t wimaxll_rx_batch_dispatch(struct wimaxll_handle *wmx)
+{
+	ssize_t result;
+	size_t dispatched = 0;
+	int filled = 0;
+	struct wimaxll_rx_batch *rxb;
+	struct wimaxll_event event;
+
+	d_fnstart(5, wmx, "(wmx %p)\n", wmx);
+	wimaxll_msg_release(wmx);
+	/* A callback asked to stop while another handle received?
+	 * For the loop, that's a stop like any other */
+	result = wimaxll_rx_busy_take(wmx);
+	if (result < 0) {
+		result = -EBUSY;
+		goto error_reader_get;
+	}
+	/* Somebody else receiving? they'll execute the callbacks */
+	result = wimaxll_rx_reader_get(wmx, NULL, NULL, 0);
+	if (result < 0) {
+		result = 0;
+		goto error_reader_get;
+	}
+	if (wmx->nlh_link)
+		wimaxll_hotplug_link_process(wmx);
+	result = -ENOMEM;
+	rxb = wimaxll_rx_batch_get(wmx);
+	if (rxb == NULL)
+		goto error_alloc;
+	wmx->stch_coalescing = 1;
+	while (1) {
+		if (wimaxll_rx_batch_parse(wmx, rxb, &event, 1) == 0) {
+			/* buffers consumed */
+			if (filled)
+				break;
+			result = wimaxll_rx_batch_fill(wmx, rxb);
+			if (result < 0)
+				goto error_fill;
+			if (result == 0 && !rxb->lost_pending)
+				break;
+			filled = 1;
+			continue;
+		}
+		/* parsing leaves rxb->idx at the event's datagram */
+		result = wimaxll_rx_batch_deliver(wmx, rxb, rxb->idx, &event);
+		if (result == -EBUSY)
+			goto error_busy;
+		dispatched++;
+	}
+	result = dispatched;
+	/* Deliver the state changes coalesced once there are no more
+	 * queued; else, we'll be called again as the socket is still
+	 * readable. */
+	if (wmx->stch_log.count > 0
+	    && wimaxll_wait_fd(nl_socket_get_fd(wmx->nlh_rx), 0) == -ETIMEDOUT
+	    && wimaxll_state_change_flush(wmx) == -EBUSY)
+		result = -EBUSY;
+error_busy:
+error_fill:
+	wmx->stch_coalescing = 0;
+error_alloc:
+	wimaxll_rx_reader_put(wmx);
+error_reader_get:
+	d_fnend(5, wmx, "(wmx %p) = %zd\n", wmx, result);
+	return result;
+}
@@ -0,0 +1,232 @@
+/*
+ * Linux WiMax
+ * Lock-free bounded ring of messages
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * A fixed size array of preallocated, fixed size slots that any
+ * number of threads can push messages into and pop them out of
+ * without taking locks, so a producer (eg: a netlink receive path)
+ * never blocks on a slow consumer; when the ring is full, the push
+ * just fails.
+ *
+ * Each slot carries a sequence number that tells whose turn it is:
+ *
+ * - seq == pos: free, a producer at position pos can fill it
+ * - seq == pos + 1: filled, a consumer at position pos can empty it
+ *
+ * Producers and consumers claim positions by advancing the tail and
+ * head counters with a compare-and-swap, then copy the data in or
+ * out and pass the slot on by updating its sequence number (D.
+ * Vyukov's bounded MPMC queue).
+ */
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <wimaxll.h>
+#include "internal.h"
+
+
+struct wimaxll_ring_slot {
+	volatile unsigned long seq;
+	size_t size;
+	unsigned char data[];
+};
+
+
+/*
+ * Ring descriptor
+ *
+ * \param head next position to pop from
+ * \param tail next position to push to
+ * \param mask number of slots - 1 (it is a power of two)
+ * \param slot_size size of each slot, including the header
+ * \param data_size max size of a message
+ * \param slots the slots themselves
+ *
+ * head and tail are apart so producers and consumers don't fight
+ * for the same cache line.
+ */
+struct wimaxll_ring {
+	volatile unsigned long head __attribute__((aligned(64)));
+	volatile unsigned long tail __attribute__((aligned(64)));
+	unsigned long mask __attribute__((aligned(64)));
+	size_t slot_size, data_size;
+	unsigned char *slots;
+};
+
+
+static inline
+struct wimaxll_ring_slot *wimaxll_ring_slot(struct wimaxll_ring *ring,
+					    unsigned long pos)
+{
+	return (void *) ring->slots + (pos & ring->mask) * ring->slot_size;
+}
+
+
+/**
+ * Create a ring
+ *
+ * \internal
+ *
+ * \param slots number of slots (rounded up to a power of two)
+ * \param data_size max size of the messages
+ * \return pointer to the ring or NULL if out of memory.
+ */
+struct wimaxll_ring *wimaxll_ring_create(unsigned slots, size_t data_size)
+{
+	struct wimaxll_ring *ring;
+	unsigned long cnt, count = 1;
+
+	while (count < slots)
+		count <<= 1;
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		goto error_alloc;
+	ring->mask = count - 1;
+	ring->data_size = data_size;
+	ring->slot_size = (sizeof(struct wimaxll_ring_slot) + data_size
+			   + sizeof(long) - 1) & ~(sizeof(long) - 1);
+	ring->slots = malloc(count * ring->slot_size);
+	if (ring->slots == NULL)
+		goto error_slots_alloc;
+	for (cnt = 0; cnt < count; cnt++)
+		wimaxll_ring_slot(ring, cnt)->seq = cnt;
+	return ring;
+
+error_slots_alloc:
+	free(ring);
+error_alloc:
+	return NULL;
+}
+
+
+/**
+ * Destroy a ring
+ *
+ * \internal
+ *
+ * Nobody can be using it any more.
+ */
+void wimaxll_ring_destroy(struct wimaxll_ring *ring)
+{
+	if (ring == NULL)
+		return;
+	free(ring->slots);
+	free(ring);
+}
+
+
+/**
+ * Copy a message into the ring
+ *
+ * \internal
+ *
+ * \return 0 if ok, -%ENOSPC if the ring is full, -%EMSGSIZE if the
+ *     message doesn't fit in a slot.
+ *
+ * Never blocks.
+ */
+int wimaxll_ring_push(struct wimaxll_ring *ring,
+		      const void *data, size_t size)
+{
+	struct wimaxll_ring_slot *slot;
+	unsigned long pos, seq;
+	long dif;
+
+	if (size > ring->data_size)
+		return -EMSGSIZE;
+	pos = ring->tail;
+	while (1) {
+		slot = wimaxll_ring_slot(ring, pos);
+		seq = slot->seq;
+		__sync_synchronize();
+		dif = (long) seq - (long) pos;
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&ring->tail,
+							 pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return -ENOSPC;
+		pos = ring->tail;
+	}
+	memcpy(slot->data, data, size);
+	slot->size = size;
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	return 0;
+}
+
+
+/**
+ * Copy the oldest message out of the ring
+ *
+ * \internal
+ *
+ * \param buf where to copy it to
+ * \param size size of \a buf; has to be at least the max message
+ *     size the ring was created for.
+ * \return size of the message, -%EAGAIN if the ring is empty,
+ *     -%EMSGSIZE if \a buf is too small.
+ *
+ * Never blocks.
+ */
+ssize_t wimaxll_ring_pop(struct wimaxll_ring *ring, void *buf, size_t size)
+{
+	struct wimaxll_ring_slot *slot;
+	unsigned long pos, seq;
+	long dif;
+	ssize_t result;
+
+	if (size < ring->data_size)
+		return -EMSGSIZE;
+	pos = ring->head;
+	while (1) {
+		slot = wimaxll_ring_slot(ring, pos);
+		seq = slot->seq;
+		__sync_synchronize();
+		dif = (long) seq - (long) (pos + 1);
+		if (dif == 0) {
+			if (__sync_bool_compare_and_swap(&ring->head,
+							 pos, pos + 1))
+				break;
+		} else if (dif < 0)
+			return -EAGAIN;
+		pos = ring->head;
+	}
+	result = slot->size;
+	memcpy(buf, slot->data, result);
+	__sync_synchronize();
+	slot->seq = pos + ring->mask + 1;
+	return result;
+}
@@ -0,0 +1,468 @@
+/*
+ * Linux WiMax
+ * Kernel side filtering of notifications
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * The kernel multicasts the notifications of all the WiMAX devices
+ * to everybody subscribed to the 'msg' group; each handle used to
+ * get all of them copied to user space, parse them (genlmsg_parse())
+ * and then throw away the ones for other devices.
+ *
+ * Instead, we attach a classic BPF socket filter to the RX socket
+ * that drops in the kernel the WIMAX_GNL_OP_MSG_TO_USER and
+ * WIMAX_GNL_RE_STATE_CHANGE messages that are not for the
+ * interface(s) the socket serves and, optionally, the messages to
+ * user on pipes the handle doesn't care about (see
+ * wimaxll_set_rx_pipe_filter()).
+ *
+ * The filter relies on the layout the kernel uses for these
+ * messages: the interface index is always the first attribute and,
+ * in messages to user, the pipe name (if any) is the second. Anything
+ * that doesn't look like that is let through for the userspace
+ * parsers to handle.
+ *
+ * If the kernel doesn't take the filter, we fall back to filtering in
+ * user space; wimaxll_gnl_peek_ifidx() allows to check the interface
+ * index of a message without parsing it fully.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+#include <netlink/genl/genl.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+enum {
+	/** Max number of interfaces a filter can match on */
+	WIMAXLL_RX_FILTER_IFIDX_MAX = 64,
+	/** Max length of a pipe name a filter can match on */
+	WIMAXLL_RX_FILTER_PIPE_MAX = 64,
+	/** Max size of a filter program (generous) */
+	WIMAXLL_RX_FILTER_SIZE = 32 + 2 * WIMAXLL_RX_FILTER_IFIDX_MAX
+		+ 2 * WIMAXLL_RX_FILTER_PIPE_MAX,
+	WIMAXLL_RX_FILTER_ACCEPT = 0xffffffff,
+	WIMAXLL_RX_FILTER_DROP = 0,
+	/* Offsets of the fields the filter looks at */
+	WIMAXLL_RX_FILTER_OFF_TYPE = offsetof(struct nlmsghdr, nlmsg_type),
+	WIMAXLL_RX_FILTER_OFF_CMD = NLMSG_HDRLEN,
+	WIMAXLL_RX_FILTER_OFF_ATTR0 = NLMSG_HDRLEN + GENL_HDRLEN,
+	WIMAXLL_RX_FILTER_OFF_IFIDX = WIMAXLL_RX_FILTER_OFF_ATTR0 + NLA_HDRLEN,
+	WIMAXLL_RX_FILTER_OFF_ATTR1 = WIMAXLL_RX_FILTER_OFF_IFIDX
+		+ NLA_ALIGN(sizeof(__u32)),
+};
+
+
+/*
+ * Program being built
+ */
+struct wimaxll_rx_filter {
+	unsigned size;
+	struct sock_filter insn[WIMAXLL_RX_FILTER_SIZE];
+};
+
+
+static
+void wimaxll_rx_filter_emit(struct wimaxll_rx_filter *filter,
+			    __u16 code, __u8 jt, __u8 jf, __u32 k)
+{
+	struct sock_filter *insn = &filter->insn[filter->size++];
+
+	insn->code = code;
+	insn->jt = jt;
+	insn->jf = jf;
+	insn->k = k;
+}
+
+
+/*
+ * BPF loads convert from network byte order, but netlink messages
+ * are in host byte order; these give the value a load from \a ptr
+ * will yield.
+ */
+static
+__u32 wimaxll_rx_filter_k32(const void *ptr)
+{
+	__u32 val;
+	memcpy(&val, ptr, sizeof(val));
+	return ntohl(val);
+}
+
+static
+__u32 wimaxll_rx_filter_k16(const void *ptr)
+{
+	__u16 val;
+	memcpy(&val, ptr, sizeof(val));
+	return ntohs(val);
+}
+
+
+/*
+ * Emit A != K -> return accept
+ */
+static
+void wimaxll_rx_filter_emit_accept_ne(struct wimaxll_rx_filter *filter,
+				      __u32 k)
+{
+	wimaxll_rx_filter_emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, k);
+	wimaxll_rx_filter_emit(filter, BPF_RET | BPF_K, 0, 0,
+			       WIMAXLL_RX_FILTER_ACCEPT);
+}
+
+
+/*
+ * Emit A != K -> return drop
+ */
+static
+void wimaxll_rx_filter_emit_drop_ne(struct wimaxll_rx_filter *filter,
+				    __u32 k)
+{
+	wimaxll_rx_filter_emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 1, 0, k);
+	wimaxll_rx_filter_emit(filter, BPF_RET | BPF_K, 0, 0,
+			       WIMAXLL_RX_FILTER_DROP);
+}
+
+
+/*
+ * Emit the check for the interface index (first attribute)
+ *
+ * If the first attribute is not an u32 of type \a attr, accept (let
+ * user space sort it out); if it doesn't match any of \a ifidx, drop.
+ */
+static
+void wimaxll_rx_filter_emit_ifidx(struct wimaxll_rx_filter *filter,
+				  int attr, const unsigned *ifidx,
+				  size_t ifidx_count)
+{
+	size_t cnt;
+	struct nlattr nla = {
+		.nla_len = NLA_HDRLEN + sizeof(__u32),
+		.nla_type = attr,
+	};
+	__u32 val;
+
+	wimaxll_rx_filter_emit(filter, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			       WIMAXLL_RX_FILTER_OFF_ATTR0);
+	wimaxll_rx_filter_emit_accept_ne(filter,
+					 wimaxll_rx_filter_k32(&nla));
+	wimaxll_rx_filter_emit(filter, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			       WIMAXLL_RX_FILTER_OFF_IFIDX);
+	for (cnt = 0; cnt < ifidx_count; cnt++) {
+		val = ifidx[cnt];
+		/* on match, skip the rest of the checks and the drop */
+		wimaxll_rx_filter_emit(filter, BPF_JMP | BPF_JEQ | BPF_K,
+				       ifidx_count - cnt, 0,
+				       wimaxll_rx_filter_k32(&val));
+	}
+	wimaxll_rx_filter_emit(filter, BPF_RET | BPF_K, 0, 0,
+			       WIMAXLL_RX_FILTER_DROP);
+}
+
+
+/*
+ * Emit the check for the pipe name (second attribute of a message
+ * to user)
+ *
+ * If \a pipe_name is NULL, we want only messages to the default
+ * pipe, which carry no WIMAX_GNL_MSG_PIPE_NAME attribute.
+ */
+static
+void wimaxll_rx_filter_emit_pipe(struct wimaxll_rx_filter *filter,
+				 const char *pipe_name)
+{
+	__u16 type = WIMAX_GNL_MSG_PIPE_NAME, len;
+	size_t size, offset;
+	unsigned char buf[WIMAXLL_RX_FILTER_PIPE_MAX + 4];
+
+	wimaxll_rx_filter_emit(filter, BPF_LD | BPF_H | BPF_ABS, 0, 0,
+			       WIMAXLL_RX_FILTER_OFF_ATTR1
+			       + offsetof(struct nlattr, nla_type));
+	if (pipe_name == NULL) {
+		wimaxll_rx_filter_emit(filter, BPF_JMP | BPF_JEQ | BPF_K,
+				       0, 1, wimaxll_rx_filter_k16(&type));
+		wimaxll_rx_filter_emit(filter, BPF_RET | BPF_K, 0, 0,
+				       WIMAXLL_RX_FILTER_DROP);
+		goto out;
+	}
+	wimaxll_rx_filter_emit_drop_ne(filter, wimaxll_rx_filter_k16(&type));
+	size = strlen(pipe_name) + 1;
+	len = NLA_HDRLEN + size;
+	wimaxll_rx_filter_emit(filter, BPF_LD | BPF_H | BPF_ABS, 0, 0,
+			       WIMAXLL_RX_FILTER_OFF_ATTR1
+			       + offsetof(struct nlattr, nla_len));
+	wimaxll_rx_filter_emit_drop_ne(filter, wimaxll_rx_filter_k16(&len));
+	/* Compare the name (and its terminating NUL) a word at a time,
+	 * then the tail a half word and a byte at a time */
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, pipe_name, size);
+	for (offset = 0; offset + 4 <= size; offset += 4) {
+		wimaxll_rx_filter_emit(
+			filter, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+			WIMAXLL_RX_FILTER_OFF_ATTR1 + NLA_HDRLEN + offset);
+		wimaxll_rx_filter_emit_drop_ne(
+			filter, wimaxll_rx_filter_k32(buf + offset));
+	}
+	if (offset + 2 <= size) {
+		wimaxll_rx_filter_emit(
+			filter, BPF_LD | BPF_H | BPF_ABS, 0, 0,
+			WIMAXLL_RX_FILTER_OFF_ATTR1 + NLA_HDRLEN + offset);
+		wimaxll_rx_filter_emit_drop_ne(
+			filter, wimaxll_rx_filter_k16(buf + offset));
+		offset += 2;
+	}
+	if (offset < size) {
+		wimaxll_rx_filter_emit(
+			filter, BPF_LD | BPF_B | BPF_ABS, 0, 0,
+			WIMAXLL_RX_FILTER_OFF_ATTR1 + NLA_HDRLEN + offset);
+		wimaxll_rx_filter_emit_drop_ne(filter, buf[offset]);
+	}
+out:
+	wimaxll_rx_filter_emit(filter, BPF_RET | BPF_K, 0, 0,
+			       WIMAXLL_RX_FILTER_ACCEPT);
+}
+
+
+/**
+ * Set (or update) the kernel side filter of a RX socket
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle (for messages and the family ID)
+ * \param fd RX socket
+ * \param ifidx Array of interface indexes to let through
+ * \param ifidx_count Number of entries in \a ifidx; if zero,
+ *     messages for any interface are let through.
+ * \param pipe_name Only let through messages to user on this pipe
+ *     (NULL for the default one); WIMAX_PIPE_ANY to let them all
+ *     through.
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * If there is nothing to filter, or the filter can't be built (too
+ * many interfaces, pipe name too long) the current filter is
+ * removed, so everything goes to user space. Errors are not fatal;
+ * the callers still filter in user space.
+ */
+int wimaxll_rx_filter_set(struct wimaxll_handle *wmx, int fd,
+			  const unsigned *ifidx, size_t ifidx_count,
+			  const char *pipe_name)
+{
+	int result;
+	struct wimaxll_rx_filter *filter, *msg_block;
+	struct sock_fprog prog;
+	__u16 family_id = wmx->gnl_family_id;
+
+	d_fnstart(5, wmx, "(wmx %p fd %d ifidx %p ifidx_count %zu "
+		  "pipe_name %s)\n", wmx, fd, ifidx, ifidx_count,
+		  pipe_name == WIMAX_PIPE_ANY ? "<any>" : pipe_name);
+	if ((ifidx_count == 0 && pipe_name == WIMAX_PIPE_ANY)
+	    || ifidx_count > WIMAXLL_RX_FILTER_IFIDX_MAX
+	    || (pipe_name != WIMAX_PIPE_ANY && pipe_name != NULL
+		&& strlen(pipe_name) >= WIMAXLL_RX_FILTER_PIPE_MAX)) {
+		result = setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER,
+				    NULL, 0);
+		/* -ENOENT: there was no filter attached */
+		if (result < 0 && errno != ENOENT)
+			result = -errno;
+		else
+			result = 0;
+		goto out;
+	}
+	result = -ENOMEM;
+	filter = calloc(2, sizeof(*filter));
+	if (filter == NULL)
+		goto out;
+	msg_block = filter + 1;
+	/* Other families (shouldn't be any): let them through */
+	wimaxll_rx_filter_emit(filter, BPF_LD | BPF_H | BPF_ABS, 0, 0,
+			       WIMAXLL_RX_FILTER_OFF_TYPE);
+	wimaxll_rx_filter_emit_accept_ne(filter,
+					 wimaxll_rx_filter_k16(&family_id));
+	wimaxll_rx_filter_emit(filter, BPF_LD | BPF_B | BPF_ABS, 0, 0,
+			       WIMAXLL_RX_FILTER_OFF_CMD);
+	/* Messages to user; the block is built separately, as we need
+	 * to know its size to jump over it */
+	if (ifidx_count)
+		wimaxll_rx_filter_emit_ifidx(msg_block, WIMAX_GNL_MSG_IFIDX,
+					     ifidx, ifidx_count);
+	if (pipe_name != WIMAX_PIPE_ANY)
+		wimaxll_rx_filter_emit_pipe(msg_block, pipe_name);
+	else
+		wimaxll_rx_filter_emit(msg_block, BPF_RET | BPF_K, 0, 0,
+				       WIMAXLL_RX_FILTER_ACCEPT);
+	wimaxll_rx_filter_emit(filter, BPF_JMP | BPF_JEQ | BPF_K, 1, 0,
+			       WIMAX_GNL_OP_MSG_TO_USER);
+	wimaxll_rx_filter_emit(filter, BPF_JMP | BPF_JA, 0, 0,
+			       msg_block->size);
+	memcpy(&filter->insn[filter->size], msg_block->insn,
+	       msg_block->size * sizeof(msg_block->insn[0]));
+	filter->size += msg_block->size;
+	/* State changes */
+	if (ifidx_count) {
+		wimaxll_rx_filter_emit_accept_ne(filter,
+						 WIMAX_GNL_RE_STATE_CHANGE);
+		wimaxll_rx_filter_emit_ifidx(filter, WIMAX_GNL_STCH_IFIDX,
+					     ifidx, ifidx_count);
+	}
+	wimaxll_rx_filter_emit(filter, BPF_RET | BPF_K, 0, 0,
+			       WIMAXLL_RX_FILTER_ACCEPT);
+
+	prog.len = filter->size;
+	prog.filter = filter->insn;
+	result = setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+			    &prog, sizeof(prog));
+	if (result < 0) {
+		result = -errno;
+		d_printf(1, wmx, "D: %s: kernel doesn't take socket "
+			 "filter (%d); filtering in user space\n",
+			 __func__, result);
+	}
+	free(filter);
+out:
+	d_fnend(5, wmx, "(wmx %p fd %d ifidx %p ifidx_count %zu) = %d\n",
+		wmx, fd, ifidx, ifidx_count, result);
+	return result;
+}
+
+
+/**
+ * Get the interface index of a notification without parsing it
+ *
+ * \internal
+ *
+ * \param nl_hdr message (WIMAX_GNL_OP_MSG_TO_USER or
+ *     WIMAX_GNL_RE_STATE_CHANGE)
+ * \param ifidx where to store the interface index
+ * \return 0 if ok, -%ENOMSG if the message is not laid out as the
+ *     kernel usually does (and thus a full parse is needed).
+ *
+ * This is the user space equivalent of what the socket filter does,
+ * for when the kernel doesn't take it: checks the first attribute is
+ * the interface index and reads it.
+ */
+int wimaxll_gnl_peek_ifidx(struct nlmsghdr *nl_hdr, unsigned *ifidx)
+{
+	struct genlmsghdr *gnl_hdr = nlmsg_data(nl_hdr);
+	struct nlattr *nla;
+	int attr;
+
+	if (nl_hdr->nlmsg_len < WIMAXLL_RX_FILTER_OFF_IFIDX + sizeof(__u32))
+		return -ENOMSG;
+	switch (gnl_hdr->cmd) {
+	case WIMAX_GNL_OP_MSG_TO_USER:
+		attr = WIMAX_GNL_MSG_IFIDX;
+		break;
+	case WIMAX_GNL_RE_STATE_CHANGE:
+		attr = WIMAX_GNL_STCH_IFIDX;
+		break;
+	default:
+		return -ENOMSG;
+	}
+	nla = genlmsg_attrdata(gnl_hdr, 0);
+	if (nla->nla_type != attr || nla->nla_len != nla_attr_size(sizeof(__u32)))
+		return -ENOMSG;
+	*ifidx = nla_get_u32(nla);
+	return 0;
+}
+
+
+/*
+ * Refresh the kernel side filter of a handle with its own RX socket
+ */
+int wimaxll_rx_filter_refresh(struct wimaxll_handle *wmx)
+{
+	if (wmx->rx_shared)
+		return 0;	/* filtered per socket, see op-open.c */
+	return wimaxll_rx_filter_set(wmx, nl_socket_get_fd(wmx->nlh_rx),
+				     &wmx->ifidx, wmx->ifidx > 0 ? 1 : 0,
+				     wmx->rx_pipe);
+}
+
+
+/**
+ * Only receive messages to user from a given pipe
+ *
+ * \param wmx WiMAX device handle
+ * \param pipe_name Name of the pipe whose messages are to be
+ *     received (NULL is the default pipe); WIMAX_PIPE_ANY to
+ *     receive from all the pipes again (the default).
+ * \return 0 if ok, < 0 errno code on error.
+ *
+ * Messages to user from other pipes will not be seen by the handle
+ * (callbacks, wimaxll_msg_read(), wimaxll_recv_batch()...); where
+ * possible, they are dropped by the kernel and never copied to user
+ * space. State change notifications are not affected.
+ *
+ * \ingroup the_messaging_interface
+ */
+int wimaxll_set_rx_pipe_filter(struct wimaxll_handle *wmx,
+			       const char *pipe_name)
+{
+	char *rx_pipe;
+
+	if (pipe_name == WIMAX_PIPE_ANY || pipe_name == NULL)
+		rx_pipe = (char *) pipe_name;
+	else {
+		rx_pipe = strdup(pipe_name);
+		if (rx_pipe == NULL)
+			return -ENOMEM;
+	}
+	wimaxll_rx_pipe_free(wmx);
+	wmx->rx_pipe = rx_pipe;
+	wimaxll_rx_filter_refresh(wmx);
+	return 0;
+}
+
+
+/*
+ * Release the pipe name set with wimaxll_set_rx_pipe_filter()
+ *
+ * \internal
+ */
+void wimaxll_rx_pipe_free(struct wimaxll_handle *wmx)
+{
+	if (wmx->rx_pipe != WIMAX_PIPE_ANY && wmx->rx_pipe != NULL)
+		free(wmx->rx_pipe);
+	wmx->rx_pipe = WIMAX_PIPE_ANY;
+}
@@ -0,0 +1,319 @@
+/*
+ * Linux WiMax
+ * Performance counters
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \defgroup stats_group Performance counters
+ *
+ * Each handle counts the messages (and bytes) it receives and sends
+ * (in total and per pipe), the notifications it skips (because they
+ * are for other devices or pipes, or they can't be parsed) and the
+ * time it takes for each control operation (wimaxll_rfkill(),
+ * wimaxll_reset(), wimaxll_state_get(), wimaxll_msg_write()) to be
+ * acknowledged by the kernel:
+ *
+ * @code
+ * struct wimaxll_stats stats;
+ * ...
+ * wimaxll_stats_get(wmx, &stats);
+ * p99 = wimaxll_stats_hist_percentile(
+ *         &stats.ack[WIMAXLL_STATS_OP_STATE_GET], 99.0);
+ * @endcode
+ *
+ * The latencies are kept in log-linear histograms (as HdrHistogram
+ * does): values under 8us have buckets of their own, then each power
+ * of two range is split in 8 buckets, so any value is recorded with
+ * a precision of 12.5% in a fixed amount of space, from 1us to over
+ * 60s.
+ *
+ * The message, byte and latency counters are updated under a lock,
+ * so they are consistent when several threads send and receive with
+ * the same handle; the rest (skipped notifications, etc) are not, so
+ * they might be off slightly.
+ */
+#include <sys/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+
+
+#ifdef WIMAXLL_LEAN
+/* wimaxll_stats_get() copies the handle's counters as a prefix */
+typedef char wimaxll_handle_stats_check[
+	sizeof(struct wimaxll_handle_stats)
+	== offsetof(struct wimaxll_stats, ack) ? 1 : -1];
+#else
+static
+unsigned wimaxll_stats_hist_index(unsigned long long value)
+{
+	unsigned exp;
+
+	if (value < 8)
+		return value;
+	exp = 63 - __builtin_clzll(value);
+	if (exp > WIMAXLL_STATS_HIST_BUCKETS / 8 + 1)
+		return WIMAXLL_STATS_HIST_BUCKETS - 1;
+	return (exp - 2) * 8 + ((value >> (exp - 3)) & 7);
+}
+#endif
+
+
+/**
+ * Return the lowest value that goes into a histogram bucket
+ *
+ * \param idx bucket index (0 to %WIMAXLL_STATS_HIST_BUCKETS - 1)
+ * \return value in microseconds
+ *
+ * \ingroup stats_group
+ */
+unsigned long long wimaxll_stats_hist_value(unsigned idx)
+{
+	if (idx < 8)
+		return idx;
+	return (8ULL + idx % 8) << (idx / 8 - 1);
+}
+
+
+/**
+ * Return a percentile of a latency histogram
+ *
+ * \param hist histogram
+ * \param percentile (0 to 100)
+ * \return latency in microseconds under which \a percentile of the
+ *     samples are (rounded up to the limit of the bucket); 0 if
+ *     there are no samples.
+ *
+ * \ingroup stats_group
+ */
+unsigned long long wimaxll_stats_hist_percentile(
+	const struct wimaxll_stats_hist *hist, double percentile)
+{
+	unsigned idx;
+	unsigned long long target, acc = 0;
+
+	if (hist->count == 0)
+		return 0;
+	target = hist->count * percentile / 100.0 + 0.5;
+	if (target == 0)
+		target = 1;
+	for (idx = 0; idx < WIMAXLL_STATS_HIST_BUCKETS; idx++) {
+		acc += hist->bucket[idx];
+		if (acc >= target)
+			break;
+	}
+	if (idx >= WIMAXLL_STATS_HIST_BUCKETS - 1)
+		return hist->max_us;
+	target = wimaxll_stats_hist_value(idx + 1) - 1;
+	return target < hist->max_us ? target : hist->max_us;
+}
+
+
+/**
+ * Return the name of a stats operation
+ *
+ * \ingroup stats_group
+ */
+const char *wimaxll_stats_op_name(enum wimaxll_stats_op op)
+{
+	static const char *names[] = {
+		[WIMAXLL_STATS_OP_RFKILL] = "rfkill",
+		[WIMAXLL_STATS_OP_RESET] = "reset",
+		[WIMAXLL_STATS_OP_STATE_GET] = "state-get",
+		[WIMAXLL_STATS_OP_MSG_WRITE] = "msg-write",
+	};
+	if ((unsigned) op >= WIMAXLL_STATS_OP_MAX)
+		return "unknown";
+	return names[op];
+}
+
+
+/*
+ * Find (or add) the counters of a pipe
+ *
+ * Returns NULL if there is no space for a new one.
+ */
+static
+struct wimaxll_stats_pipe *wimaxll_stats_pipe(
+	struct wimaxll_handle_stats *stats, const char *pipe_name)
+{
+	unsigned cnt;
+	struct wimaxll_stats_pipe *pipe;
+
+	if (pipe_name == NULL)
+		pipe_name = "";
+	for (cnt = 0; cnt < stats->pipes; cnt++) {
+		pipe = &stats->pipe[cnt];
+		if (!strncmp(pipe->name, pipe_name, sizeof(pipe->name)))
+			return pipe;
+	}
+	if (stats->pipes >= WIMAXLL_STATS_PIPES) {
+		stats->pipe_overflow++;
+		return NULL;
+	}
+	pipe = &stats->pipe[stats->pipes++];
+	strncpy(pipe->name, pipe_name, sizeof(pipe->name) - 1);
+	return pipe;
+}
+
+
+/*
+ * Account a message to user received
+ *
+ * \internal
+ */
+void wimaxll_stats_rx(struct wimaxll_handle *wmx, const char *pipe_name,
+		      size_t size)
+{
+	struct wimaxll_stats_pipe *pipe;
+
+	pthread_mutex_lock(&wmx->stats_mutex);
+	wmx->stats.rx_msgs++;
+	wmx->stats.rx_bytes += size;
+	pipe = wimaxll_stats_pipe(&wmx->stats, pipe_name);
+	if (pipe) {
+		pipe->rx_msgs++;
+		pipe->rx_bytes += size;
+	}
+	pthread_mutex_unlock(&wmx->stats_mutex);
+}
+
+
+/*
+ * Account a message written (or that failed to be)
+ *
+ * \internal
+ */
+void wimaxll_stats_tx(struct wimaxll_handle *wmx, const char *pipe_name,
+		      size_t size, int result)
+{
+	struct wimaxll_stats_pipe *pipe;
+
+	pthread_mutex_lock(&wmx->stats_mutex);
+	if (result < 0) {
+		wmx->stats.tx_errors++;
+		goto out;
+	}
+	wmx->stats.tx_msgs++;
+	wmx->stats.tx_bytes += size;
+	pipe = wimaxll_stats_pipe(&wmx->stats, pipe_name);
+	if (pipe) {
+		pipe->tx_msgs++;
+		pipe->tx_bytes += size;
+	}
+out:
+	pthread_mutex_unlock(&wmx->stats_mutex);
+}
+
+
+/*
+ * Record the round trip time of an operation
+ *
+ * \internal
+ *
+ * \param start when the request was sent (CLOCK_MONOTONIC)
+ * \param result what the operation returned
+ *
+ * Lean builds don't keep these.
+ */
+void wimaxll_stats_ack(struct wimaxll_handle *wmx, enum wimaxll_stats_op op,
+		       const struct timespec *start, int result)
+{
+#ifndef WIMAXLL_LEAN
+	struct timespec now;
+	struct wimaxll_stats_hist *hist = &wmx->stats.ack[op];
+	long long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000LL
+		+ (now.tv_nsec - start->tv_nsec) / 1000;
+	if (us < 0)
+		us = 0;
+	pthread_mutex_lock(&wmx->stats_mutex);
+	if (hist->count == 0 || us < hist->min_us)
+		hist->min_us = us;
+	if (us > hist->max_us)
+		hist->max_us = us;
+	hist->count++;
+	hist->sum_us += us;
+	hist->bucket[wimaxll_stats_hist_index(us)]++;
+	if (result < 0)
+		hist->errors++;
+	pthread_mutex_unlock(&wmx->stats_mutex);
+#endif
+}
+
+
+/**
+ * Get a handle's performance counters
+ *
+ * \param wmx WiMAX handle
+ * \param stats where to copy them
+ * \return 0
+ *
+ * In lean builds (configure --enable-lean), the round trip
+ * histograms (\a stats->ack) are not kept and come back empty.
+ *
+ * \ingroup stats_group
+ */
+int wimaxll_stats_get(const struct wimaxll_handle *wmx,
+		      struct wimaxll_stats *stats)
+{
+	pthread_mutex_t *mutex = (pthread_mutex_t *) &wmx->stats_mutex;
+
+	pthread_mutex_lock(mutex);
+#ifdef WIMAXLL_LEAN
+	memcpy(stats, &wmx->stats, sizeof(wmx->stats));
+	memset(stats->ack, 0, sizeof(stats->ack));
+#else
+	*stats = wmx->stats;
+#endif
+	pthread_mutex_unlock(mutex);
+	return 0;
+}
+
+
+/**
+ * Reset a handle's performance counters
+ *
+ * \ingroup stats_group
+ */
+void wimaxll_stats_reset(struct wimaxll_handle *wmx)
+{
+	pthread_mutex_lock(&wmx->stats_mutex);
+	memset(&wmx->stats, 0, sizeof(wmx->stats));
+	pthread_mutex_unlock(&wmx->stats_mutex);
+}
@@ -0,0 +1,1071 @@
+/*
+ * Linux WiMax
+ * Debug tracing into per-thread ring buffers
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * \defgroup trace_group Debug tracing
+ *
+ * The debug messages in the library (the ones that are printed to
+ * stderr when compiling a file with D_LOCAL) are also tracepoints;
+ * when tracing is enabled with wimaxll_trace_enable(), each thread
+ * records the messages it generates in a ring buffer of its own
+ * (instead of printing them), keeping the last ones, and
+ * wimaxll_trace_dump() prints them:
+ *
+ * @code
+ * wimaxll_trace_enable(5, 0);
+ * wimaxll_trace_dump_on_signal(SIGUSR1, 2);
+ * ...
+ * wimaxll_trace_dump(2);
+ * @endcode
+ *
+ * While tracing is disabled, a tracepoint costs a single (predicted
+ * not taken) branch. Configuring with --disable-trace compiles them
+ * out completely (and these functions return -%ENOSYS).
+ *
+ * The messages are not formatted when recorded: a record keeps the
+ * format string, the arguments (strings are copied) and a timestamp;
+ * they are formatted by wimaxll_trace_dump(). Hex dumps record the
+ * raw bytes (up to %WIMAXLL_TRACE_ARGS).
+ *
+ * \internal
+ *
+ * A ring is only written by its thread, so recording takes no locks
+ * nor atomic operations; a dump (that might be running in another
+ * thread) uses each record's sequence number to skip records that
+ * were being overwritten while it was reading them.
+ *
+ * Rings are allocated the first time a thread records something and
+ * never freed; when the thread exits, the ring is given to the next
+ * thread that needs one (so the records of a thread that is gone are
+ * kept until then).
+ */
+#include <config.h>
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <wimaxll.h>
+#include "internal.h"
+#define D_LOCAL 0
+#include "debug.h"
+
+
+/* Records tracepoints with level <= this; 0 disables */
+int __wimaxll_trace_level;
+
+
+#ifdef WIMAXLL_TRACE
+
+enum {
+	/* Space for arguments (or dumped bytes) in a trace record */
+	WIMAXLL_TRACE_ARGS = 128,
+	WIMAXLL_TRACE_RECORDS = 256,
+	/* Not all the arguments fit in the record */
+	WIMAXLL_TRACE_F_TRUNCATED = 0x1,
+};
+
+
+/*
+ * A traced message
+ *
+ * \param seq position in the ring + 1; 0 while being written
+ * \param ts when it was recorded (CLOCK_MONOTONIC)
+ * \param tid thread that recorded it
+ * \param fmt format string or NULL if a hex dump
+ * \param size bytes used in args
+ * \param dev name of the device (if any)
+ * \param args arguments, packed as described in
+ *     __wimaxll_trace_pack() or bytes dumped.
+ */
+struct wimaxll_trace_rec {
+	volatile unsigned long seq;
+	struct timespec ts;
+	pid_t tid;
+	const char *func;
+	const char *tag;
+	const char *fmt;
+	unsigned char level;
+	unsigned char flags;
+	unsigned short size;
+	char dev[__WIMAXLL_IFNAME_LEN];
+	unsigned char args[WIMAXLL_TRACE_ARGS];
+};
+
+
+/*
+ * A thread's trace ring
+ *
+ * \param next next in the list of all the rings
+ * \param owned !0 if some thread is using it
+ * \param tid thread using it
+ * \param head number of records written so far
+ * \param mask number of records - 1 (it is a power of two)
+ */
+struct wimaxll_trace_ring {
+	struct wimaxll_trace_ring *next;
+	volatile int owned;
+	pid_t tid;
+	volatile unsigned long head;
+	unsigned long mask;
+	struct wimaxll_trace_rec rec[];
+};
+
+
+static struct wimaxll_trace_ring *wimaxll_trace_rings;
+static pthread_mutex_t wimaxll_trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t wimaxll_trace_key;
+static pthread_once_t wimaxll_trace_once = PTHREAD_ONCE_INIT;
+static unsigned wimaxll_trace_records = WIMAXLL_TRACE_RECORDS;
+static __thread struct wimaxll_trace_ring *wimaxll_trace_ring;
+
+
+/* Thread exit: let other threads reuse the ring */
+static
+void wimaxll_trace_ring_release(void *_ring)
+{
+	struct wimaxll_trace_ring *ring = _ring;
+
+	__sync_synchronize();
+	ring->owned = 0;
+}
+
+
+static
+void wimaxll_trace_key_create(void)
+{
+	pthread_key_create(&wimaxll_trace_key, wimaxll_trace_ring_release);
+}
+
+
+/*
+ * Get the current thread's ring, allocating (or reusing) one if
+ * needed.
+ *
+ * Might return NULL if out of memory; then the record is just lost.
+ */
+static
+struct wimaxll_trace_ring *wimaxll_trace_ring_get(void)
+{
+	struct wimaxll_trace_ring *ring;
+	unsigned long cnt, count = 1;
+
+	if (wimaxll_trace_ring != NULL)
+		return wimaxll_trace_ring;
+	pthread_once(&wimaxll_trace_once, wimaxll_trace_key_create);
+	pthread_mutex_lock(&wimaxll_trace_mutex);
+	for (ring = wimaxll_trace_rings; ring; ring = ring->next)
+		if (__sync_bool_compare_and_swap(&ring->owned, 0, 1))
+			goto found;
+	while (count < wimaxll_trace_records)
+		count <<= 1;
+	ring = calloc(1, sizeof(*ring) + count * sizeof(ring->rec[0]));
+	if (ring == NULL)
+		goto error_alloc;
+	ring->owned = 1;
+	ring->mask = count - 1;
+	for (cnt = 0; cnt < count; cnt++)
+		ring->rec[cnt].seq = 0;
+	ring->next = wimaxll_trace_rings;
+	__sync_synchronize();
+	wimaxll_trace_rings = ring;
+found:
+	ring->tid = syscall(SYS_gettid);
+	pthread_setspecific(wimaxll_trace_key, ring);
+	wimaxll_trace_ring = ring;
+error_alloc:
+	pthread_mutex_unlock(&wimaxll_trace_mutex);
+	return ring;
+}
+
+
+static
+struct wimaxll_trace_rec *__wimaxll_trace_start(
+	struct wimaxll_trace_ring *ring, int level, const char *func,
+	const char *tag, const struct wimaxll_handle *dev)
+{
+	struct wimaxll_trace_rec *rec;
+
+	rec = &ring->rec[ring->head & ring->mask];
+	rec->seq = 0;
+	__sync_synchronize();
+	clock_gettime(CLOCK_MONOTONIC, &rec->ts);
+	rec->tid = ring->tid;
+	rec->func = func;
+	rec->tag = tag;
+	rec->level = level;
+	rec->flags = 0;
+	if (dev == NULL)
+		rec->dev[0] = 0;
+	else
+		memcpy(rec->dev, dev->name, sizeof(rec->dev));
+	return rec;
+}
+
+
+static
+void __wimaxll_trace_commit(struct wimaxll_trace_ring *ring,
+			    struct wimaxll_trace_rec *rec)
+{
+	__sync_synchronize();
+	rec->seq = ring->head + 1;
+	ring->head++;
+}
+
+
+static
+int __wimaxll_trace_put(struct wimaxll_trace_rec *rec, size_t *itr,
+			const void *data, size_t size)
+{
+	if (*itr + size > sizeof(rec->args))
+		return -ENOSPC;
+	memcpy(rec->args + *itr, data, size);
+	*itr += size;
+	return 0;
+}
+
+
+/*
+ * Parse a printf() conversion specification
+ *
+ * \param fmt points to the character after the '%'
+ * \param star number of '*' (width and/or precision) found
+ * \param length length modifier: 'H' (hh), 'h', 'l', 'q' (ll),
+ *     'j', 'z', 't', 'L' or 0.
+ * \return pointer to the conversion character
+ */
+static
+const char *__wimaxll_trace_spec(const char *fmt, int *star, int *length)
+{
+	*star = 0;
+	*length = 0;
+	fmt += strspn(fmt, "-+ #0'");
+	if (*fmt == '*') {
+		(*star)++;
+		fmt++;
+	} else
+		fmt += strspn(fmt, "0123456789");
+	if (*fmt == '.') {
+		fmt++;
+		if (*fmt == '*') {
+			(*star)++;
+			fmt++;
+		} else
+			fmt += strspn(fmt, "0123456789");
+	}
+	switch (*fmt) {
+	case 'h':
+		*length = fmt[1] == 'h' ? 'H' : 'h';
+		break;
+	case 'l':
+		*length = fmt[1] == 'l' ? 'q' : 'l';
+		break;
+	case 'q': case 'j': case 'z': case 't': case 'L':
+		*length = *fmt;
+		break;
+	}
+	if (*length)
+		fmt += *length == 'H' || (*length == 'q' && *fmt == 'l') ?
+			2 : 1;
+	return fmt;
+}
+
+
+/*
+ * Pack the arguments of a message
+ *
+ * Walks the format string and, for each conversion, appends its
+ * argument to the record: integers as long long (signed or unsigned
+ * depending on the conversion, already truncated to the length
+ * modifier), floating point as double, pointers as void * and
+ * strings as a copy, NUL terminated. Widths and precisions given as
+ * '*' are appended as int, before the argument; %m appends \a
+ * errno_val as int.
+ *
+ * If they don't fit, the record is flagged as truncated.
+ */
+static
+size_t __wimaxll_trace_pack(struct wimaxll_trace_rec *rec, int errno_val,
+			    const char *fmt, va_list ap)
+{
+	size_t itr = 0, len;
+	int star, length, val;
+	long long ll;
+	unsigned long long ull;
+	double dbl;
+	void *ptr;
+	const char *str;
+
+	while ((fmt = strchr(fmt, '%')) != NULL) {
+		fmt++;
+		if (*fmt == '%') {
+			fmt++;
+			continue;
+		}
+		fmt = __wimaxll_trace_spec(fmt, &star, &length);
+		while (star--) {
+			val = va_arg(ap, int);
+			if (__wimaxll_trace_put(rec, &itr, &val, sizeof(val)))
+				goto error_truncated;
+		}
+		switch (*fmt) {
+		case 'd': case 'i':
+			switch (length) {
+			case 'H': ll = (signed char) va_arg(ap, int); break;
+			case 'h': ll = (short) va_arg(ap, int); break;
+			case 'l': ll = va_arg(ap, long); break;
+			case 'q': ll = va_arg(ap, long long); break;
+			case 'j': ll = va_arg(ap, intmax_t); break;
+			case 'z': ll = va_arg(ap, ssize_t); break;
+			case 't': ll = va_arg(ap, ptrdiff_t); break;
+			default:  ll = va_arg(ap, int);
+			}
+			if (__wimaxll_trace_put(rec, &itr, &ll, sizeof(ll)))
+				goto error_truncated;
+			break;
+		case 'u': case 'x': case 'X': case 'o': case 'c':
+			switch (length) {
+			case 'H': ull = (unsigned char) va_arg(ap, int); break;
+			case 'h': ull = (unsigned short) va_arg(ap, int); break;
+			case 'l': ull = va_arg(ap, unsigned long); break;
+			case 'q': ull = va_arg(ap, unsigned long long); break;
+			case 'j': ull = va_arg(ap, uintmax_t); break;
+			case 'z': ull = va_arg(ap, size_t); break;
+			case 't': ull = va_arg(ap, ptrdiff_t); break;
+			default:  ull = va_arg(ap, unsigned);
+			}
+			if (__wimaxll_trace_put(rec, &itr, &ull, sizeof(ull)))
+				goto error_truncated;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (length == 'L')
+				dbl = va_arg(ap, long double);
+			else
+				dbl = va_arg(ap, double);
+			if (__wimaxll_trace_put(rec, &itr, &dbl, sizeof(dbl)))
+				goto error_truncated;
+			break;
+		case 'p':
+			ptr = va_arg(ap, void *);
+			if (__wimaxll_trace_put(rec, &itr, &ptr, sizeof(ptr)))
+				goto error_truncated;
+			break;
+		case 's':
+			str = va_arg(ap, const char *);
+			if (str == NULL)
+				str = "(null)";
+			len = strlen(str) + 1;
+			if (itr >= sizeof(rec->args))
+				goto error_truncated;
+			if (itr + len > sizeof(rec->args)) {
+				/* copy as much as fits */
+				len = sizeof(rec->args) - itr;
+				memcpy(rec->args + itr, str, len - 1);
+				rec->args[itr + len - 1] = 0;
+				itr += len;
+				goto error_truncated;
+			}
+			memcpy(rec->args + itr, str, len);
+			itr += len;
+			break;
+		case 'm':
+			if (__wimaxll_trace_put(rec, &itr, &errno_val,
+						sizeof(errno_val)))
+				goto error_truncated;
+			break;
+		case 'n':
+			va_arg(ap, void *);
+			break;
+		default:	/* we don't know what it is, give up */
+			goto error_truncated;
+		}
+		fmt++;
+	}
+	return itr;
+
+error_truncated:
+	rec->flags |= WIMAXLL_TRACE_F_TRUNCATED;
+	return itr;
+}
+
+
+/**
+ * Record a debug message
+ *
+ * \internal
+ *
+ * Called by the d_printf() family of macros when tracing is enabled
+ * for the message's level.
+ */
+void __wimaxll_trace(int level, const char *func, const char *tag,
+		     const struct wimaxll_handle *dev, const char *fmt, ...)
+{
+	struct wimaxll_trace_ring *ring;
+	struct wimaxll_trace_rec *rec;
+	va_list ap;
+	int errno_val = errno;
+
+	ring = wimaxll_trace_ring_get();
+	if (ring == NULL)
+		goto out;
+	rec = __wimaxll_trace_start(ring, level, func, tag, dev);
+	rec->fmt = fmt;
+	va_start(ap, fmt);
+	rec->size = __wimaxll_trace_pack(rec, errno_val, fmt, ap);
+	va_end(ap);
+	__wimaxll_trace_commit(ring, rec);
+out:
+	errno = errno_val;
+}
+
+
+/**
+ * Record a hex dump
+ *
+ * \internal
+ *
+ * Called by d_dump() when tracing is enabled for the level.
+ */
+void __wimaxll_trace_dump(int level, const char *func,
+			  const struct wimaxll_handle *dev,
+			  const void *ptr, size_t size)
+{
+	struct wimaxll_trace_ring *ring;
+	struct wimaxll_trace_rec *rec;
+
+	ring = wimaxll_trace_ring_get();
+	if (ring == NULL)
+		return;
+	rec = __wimaxll_trace_start(ring, level, func, "", dev);
+	rec->fmt = NULL;
+	if (size > sizeof(rec->args)) {
+		size = sizeof(rec->args);
+		rec->flags |= WIMAXLL_TRACE_F_TRUNCATED;
+	}
+	memcpy(rec->args, ptr, size);
+	rec->size = size;
+	__wimaxll_trace_commit(ring, rec);
+}
+
+
+/* Output buffer for a dump; written with write(2) when full */
+struct wimaxll_trace_out {
+	int fd;
+	int result;
+	size_t used;
+	char buf[1024];
+};
+
+
+static
+void wimaxll_trace_flush(struct wimaxll_trace_out *out)
+{
+	size_t itr = 0;
+	ssize_t result;
+
+	while (itr < out->used) {
+		result = write(out->fd, out->buf + itr, out->used - itr);
+		if (result < 0) {
+			if (errno == EINTR)
+				continue;
+			out->result = -errno;
+			break;
+		}
+		itr += result;
+	}
+	out->used = 0;
+}
+
+
+static
+void wimaxll_trace_putn(struct wimaxll_trace_out *out,
+			const char *data, size_t size)
+{
+	size_t chunk;
+
+	while (size > 0) {
+		if (out->used == sizeof(out->buf))
+			wimaxll_trace_flush(out);
+		chunk = sizeof(out->buf) - out->used;
+		if (chunk > size)
+			chunk = size;
+		memcpy(out->buf + out->used, data, chunk);
+		out->used += chunk;
+		data += chunk;
+		size -= chunk;
+	}
+}
+
+
+static
+void wimaxll_trace_puts(struct wimaxll_trace_out *out, const char *str)
+{
+	wimaxll_trace_putn(out, str, strlen(str));
+}
+
+
+static
+void wimaxll_trace_pad(struct wimaxll_trace_out *out, char c, int count)
+{
+	while (count-- > 0)
+		wimaxll_trace_putn(out, &c, 1);
+}
+
+
+/*
+ * A conversion specification, as far as we honour it
+ *
+ * \param left '-' flag
+ * \param zero '0' flag
+ * \param alt '#' flag
+ * \param sign "+", " " (for the '+' and ' ' flags) or ""
+ * \param width minimum field width
+ * \param precision -1 if not given
+ */
+struct wimaxll_trace_conv {
+	int left, zero, alt;
+	const char *sign;
+	int width, precision;
+};
+
+
+/*
+ * Write a field, padded to the conversion's width
+ *
+ * \a prefix (sign, 0x...) goes before the padding when it is done
+ * with zeros, \a zeros are leading zeros required by the precision.
+ */
+static
+void wimaxll_trace_field(struct wimaxll_trace_out *out,
+			 const struct wimaxll_trace_conv *conv,
+			 const char *prefix, int zeros,
+			 const char *body, size_t len)
+{
+	size_t prefix_len = strlen(prefix);
+	int pad = conv->width - (int) (prefix_len + zeros + len);
+
+	if (conv->zero && !conv->left && pad > 0) {
+		zeros += pad;
+		pad = 0;
+	}
+	if (!conv->left)
+		wimaxll_trace_pad(out, ' ', pad);
+	wimaxll_trace_putn(out, prefix, prefix_len);
+	wimaxll_trace_pad(out, '0', zeros);
+	wimaxll_trace_putn(out, body, len);
+	if (conv->left)
+		wimaxll_trace_pad(out, ' ', pad);
+}
+
+
+/*
+ * Write the digits of a number backwards, ending at \a end
+ *
+ * \return number of digits written (at least one)
+ */
+static
+size_t wimaxll_trace_utoa(char *end, unsigned long long val,
+			  unsigned base, int upper)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	size_t len = 0;
+
+	do {
+		*--end = digits[val % base];
+		val /= base;
+		len++;
+	} while (val > 0);
+	return len;
+}
+
+
+static
+void wimaxll_trace_num(struct wimaxll_trace_out *out,
+		       const struct wimaxll_trace_conv *_conv,
+		       const char *prefix, unsigned long long val,
+		       unsigned base, int upper)
+{
+	struct wimaxll_trace_conv conv = *_conv;
+	char buf[24];
+	size_t len;
+	int zeros = 0;
+
+	if (conv.precision >= 0)
+		conv.zero = 0;
+	if (val == 0 && conv.precision == 0)
+		len = 0;
+	else
+		len = wimaxll_trace_utoa(buf + sizeof(buf), val, base, upper);
+	if (conv.precision > (int) len)
+		zeros = conv.precision - len;
+	wimaxll_trace_field(out, &conv, prefix, zeros,
+			    buf + sizeof(buf) - len, len);
+}
+
+
+/*
+ * Floating point, always as with %f (up to 9 decimals)
+ *
+ * Debug messages hardly print them, so this is only meant to be
+ * readable.
+ */
+static
+void wimaxll_trace_dbl(struct wimaxll_trace_out *out,
+		       const struct wimaxll_trace_conv *conv, double dbl)
+{
+	char buf[48], *itr = buf + sizeof(buf);
+	const char *prefix = conv->sign;
+	unsigned long long ip, fp, scale = 1;
+	int cnt, precision = conv->precision < 0 ? 6 : conv->precision;
+
+	if (dbl < 0) {
+		prefix = "-";
+		dbl = -dbl;
+	}
+	if (dbl != dbl) {
+		wimaxll_trace_field(out, conv, "", 0, "nan", 3);
+		return;
+	}
+	if (dbl >= 1e19) {
+		wimaxll_trace_field(out, conv, prefix, 0, "inf", 3);
+		return;
+	}
+	if (precision > 9)
+		precision = 9;
+	for (cnt = 0; cnt < precision; cnt++)
+		scale *= 10;
+	ip = dbl;
+	fp = (dbl - ip) * scale + 0.5;
+	if (fp >= scale) {
+		ip++;
+		fp -= scale;
+	}
+	if (precision > 0) {
+		cnt = wimaxll_trace_utoa(itr, fp, 10, 0);
+		itr -= cnt;
+		while (cnt++ < precision)
+			*--itr = '0';
+		*--itr = '.';
+	}
+	itr -= wimaxll_trace_utoa(itr, ip, 10, 0);
+	wimaxll_trace_field(out, conv, prefix, 0, itr,
+			    buf + sizeof(buf) - itr);
+}
+
+
+static
+int __wimaxll_trace_get(const struct wimaxll_trace_rec *rec, size_t *itr,
+			void *data, size_t size)
+{
+	if (*itr + size > rec->size)
+		return -ENOSPC;
+	memcpy(data, rec->args + *itr, size);
+	*itr += size;
+	return 0;
+}
+
+
+/*
+ * Parse flags, width and precision of a conversion specification
+ *
+ * \param fmt points to the character after the '%'
+ * \return 0 if ok, -%ENOSPC if the record has no more arguments
+ *     (for a '*').
+ */
+static
+int wimaxll_trace_conv_parse(struct wimaxll_trace_conv *conv,
+			     const struct wimaxll_trace_rec *rec,
+			     size_t *itr, const char *fmt)
+{
+	int val;
+
+	conv->left = conv->zero = conv->alt = 0;
+	conv->sign = "";
+	conv->width = 0;
+	conv->precision = -1;
+	for (;; fmt++) {
+		if (*fmt == '-')
+			conv->left = 1;
+		else if (*fmt == '0')
+			conv->zero = 1;
+		else if (*fmt == '#')
+			conv->alt = 1;
+		else if (*fmt == '+')
+			conv->sign = "+";
+		else if (*fmt == ' ') {
+			if (conv->sign[0] != '+')
+				conv->sign = " ";
+		} else if (*fmt != '\'')
+			break;
+	}
+	if (*fmt == '*') {
+		if (__wimaxll_trace_get(rec, itr, &val, sizeof(val)))
+			return -ENOSPC;
+		if (val < 0) {
+			conv->left = 1;
+			val = -val;
+		}
+		conv->width = val;
+		fmt++;
+	} else
+		for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+			conv->width = conv->width * 10 + *fmt - '0';
+	if (*fmt == '.') {
+		fmt++;
+		if (*fmt == '*') {
+			if (__wimaxll_trace_get(rec, itr, &val, sizeof(val)))
+				return -ENOSPC;
+			conv->precision = val < 0 ? -1 : val;
+		} else
+			for (conv->precision = 0; *fmt >= '0' && *fmt <= '9';
+			     fmt++)
+				conv->precision = conv->precision * 10
+					+ *fmt - '0';
+	}
+	return 0;
+}
+
+
+/*
+ * Format a message from the format string and the packed arguments
+ *
+ * Done by hand, with no stdio, so it is safe in a signal
+ * handler. The flags, width and precision are honoured; floating
+ * point is always printed as with %f and %m as the errno number
+ * (strerror() is not safe either).
+ */
+static
+void wimaxll_trace_format(struct wimaxll_trace_out *out,
+			  const struct wimaxll_trace_rec *rec)
+{
+	const char *fmt = rec->fmt, *start, *end, *prefix;
+	struct wimaxll_trace_conv conv;
+	size_t itr = 0, len;
+	int star, length, val;
+	long long ll;
+	unsigned long long ull;
+	double dbl;
+	void *ptr;
+	const char *str;
+	char c;
+
+	while ((start = strchr(fmt, '%')) != NULL) {
+		wimaxll_trace_putn(out, fmt, start - fmt);
+		if (start[1] == '%') {
+			wimaxll_trace_putn(out, "%", 1);
+			fmt = start + 2;
+			continue;
+		}
+		end = __wimaxll_trace_spec(start + 1, &star, &length);
+		if (wimaxll_trace_conv_parse(&conv, rec, &itr, start + 1))
+			goto out_of_args;
+		fmt = end + 1;
+		switch (*end) {
+		case 'd': case 'i':
+			if (__wimaxll_trace_get(rec, &itr, &ll, sizeof(ll)))
+				goto out_of_args;
+			ull = ll;
+			if (ll < 0)
+				ull = -ull;
+			wimaxll_trace_num(out, &conv, ll < 0 ? "-" : conv.sign,
+					  ull, 10, 0);
+			break;
+		case 'u': case 'x': case 'X': case 'o':
+			if (__wimaxll_trace_get(rec, &itr, &ull, sizeof(ull)))
+				goto out_of_args;
+			prefix = "";
+			if (conv.alt && ull != 0)
+				prefix = *end == 'x' ? "0x"
+					: *end == 'X' ? "0X"
+					: *end == 'o' ? "0" : "";
+			wimaxll_trace_num(out, &conv, prefix, ull,
+					  *end == 'o' ? 8 : *end == 'u' ? 10 : 16,
+					  *end == 'X');
+			break;
+		case 'c':
+			if (__wimaxll_trace_get(rec, &itr, &ull, sizeof(ull)))
+				goto out_of_args;
+			c = ull;
+			conv.zero = 0;
+			wimaxll_trace_field(out, &conv, "", 0, &c, 1);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (__wimaxll_trace_get(rec, &itr, &dbl, sizeof(dbl)))
+				goto out_of_args;
+			wimaxll_trace_dbl(out, &conv, dbl);
+			break;
+		case 'p':
+			if (__wimaxll_trace_get(rec, &itr, &ptr, sizeof(ptr)))
+				goto out_of_args;
+			if (ptr == NULL) {
+				conv.zero = 0;
+				wimaxll_trace_field(out, &conv, "", 0,
+						    "(nil)", 5);
+			} else
+				wimaxll_trace_num(out, &conv, "0x",
+						  (uintptr_t) ptr, 16, 0);
+			break;
+		case 's':
+			str = (const char *) rec->args + itr;
+			if (itr >= rec->size)
+				goto out_of_args;
+			len = strnlen(str, rec->size - itr);
+			itr += len + 1;
+			if (conv.precision >= 0 && (size_t) conv.precision < len)
+				len = conv.precision;
+			conv.zero = 0;
+			wimaxll_trace_field(out, &conv, "", 0, str, len);
+			break;
+		case 'm':
+			if (__wimaxll_trace_get(rec, &itr, &val, sizeof(val)))
+				goto out_of_args;
+			wimaxll_trace_puts(out, "errno ");
+			conv.width = 0;
+			conv.precision = -1;
+			wimaxll_trace_num(out, &conv, "", val, 10, 0);
+			break;
+		case 'n':
+			break;
+		default:
+			goto out_of_args;
+		}
+	}
+	wimaxll_trace_puts(out, fmt);
+	return;
+
+out_of_args:
+	wimaxll_trace_puts(out, " [truncated]\n");
+}
+
+
+static
+void wimaxll_trace_hex(struct wimaxll_trace_out *out,
+		       const struct wimaxll_trace_rec *rec)
+{
+	static const char digits[] = "0123456789abcdef";
+	char byte[3];
+	size_t cnt;
+
+	byte[2] = ' ';
+	for (cnt = 0; cnt < rec->size; cnt++) {
+		byte[0] = digits[rec->args[cnt] >> 4];
+		byte[1] = digits[rec->args[cnt] & 0xf];
+		wimaxll_trace_putn(out, byte, sizeof(byte));
+	}
+	if (rec->flags & WIMAXLL_TRACE_F_TRUNCATED)
+		wimaxll_trace_puts(out, "[truncated]");
+	wimaxll_trace_putn(out, "\n", 1);
+}
+
+
+static
+void wimaxll_trace_ring_dump(struct wimaxll_trace_out *out,
+			     struct wimaxll_trace_ring *ring)
+{
+	static const struct wimaxll_trace_conv plain = {
+		.sign = "", .precision = -1,
+	}, nsec = {
+		.zero = 1, .sign = "", .width = 9, .precision = -1,
+	};
+	struct wimaxll_trace_rec rec;
+	unsigned long pos, head, seq;
+
+	head = ring->head;
+	pos = head > ring->mask ? head - ring->mask - 1 : 0;
+	for (; pos < head; pos++) {
+		seq = ring->rec[pos & ring->mask].seq;
+		__sync_synchronize();
+		rec = ring->rec[pos & ring->mask];
+		__sync_synchronize();
+		if (seq != pos + 1 || ring->rec[pos & ring->mask].seq != seq)
+			continue;	/* overwritten while copying */
+		wimaxll_trace_num(out, &plain, "", rec.ts.tv_sec, 10, 0);
+		wimaxll_trace_putn(out, ".", 1);
+		wimaxll_trace_num(out, &nsec, "", rec.ts.tv_nsec, 10, 0);
+		wimaxll_trace_num(out, &plain, " ", rec.tid, 10, 0);
+		wimaxll_trace_puts(out, " libwimax");
+		if (rec.dev[0]) {
+			wimaxll_trace_putn(out, "[", 1);
+			wimaxll_trace_putn(out, rec.dev,
+					   strnlen(rec.dev, sizeof(rec.dev)));
+			wimaxll_trace_putn(out, "]", 1);
+		}
+		wimaxll_trace_puts(out, ": ");
+		wimaxll_trace_puts(out, rec.func);
+		wimaxll_trace_puts(out, rec.tag);
+		wimaxll_trace_puts(out, ": ");
+		if (rec.fmt == NULL)
+			wimaxll_trace_hex(out, &rec);
+		else
+			wimaxll_trace_format(out, &rec);
+	}
+}
+
+
+/**
+ * Enable debug tracing
+ *
+ * \param level record debug messages of this level or lower (see
+ *     d_printf()); 0 disables tracing.
+ * \param records number of records to keep per thread (rounded up
+ *     to a power of two); 0 for the default (256). Only affects the
+ *     rings allocated after this call.
+ * \return 0 if ok, -%ENOSYS if the library was configured with
+ *     --disable-trace.
+ *
+ * \ingroup trace_group
+ */
+int wimaxll_trace_enable(int level, unsigned records)
+{
+	if (records > 0)
+		wimaxll_trace_records = records;
+	__sync_synchronize();
+	__wimaxll_trace_level = level;
+	return 0;
+}
+
+
+/**
+ * Dump the debug trace
+ *
+ * \param fd file descriptor where to write to
+ * \return 0 if ok, -%ENOSYS if the library was configured with
+ *     --disable-trace; a negative errno code if write(2) failed.
+ *
+ * The records of each thread are printed oldest first, one thread
+ * after another; each line starts with the timestamp and the
+ * thread ID. Recording is not stopped while dumping.
+ *
+ * Doesn't allocate memory, take locks nor use stdio (the messages are
+ * formatted by hand and written with write(2)), so it can be called
+ * from a signal handler (see wimaxll_trace_dump_on_signal()). In
+ * exchange, floating point arguments are always printed as with %f
+ * and %m prints the errno number instead of its description.
+ *
+ * \ingroup trace_group
+ */
+int wimaxll_trace_dump(int fd)
+{
+	struct wimaxll_trace_out out;
+	struct wimaxll_trace_ring *ring;
+
+	out.fd = fd;
+	out.result = 0;
+	out.used = 0;
+	for (ring = wimaxll_trace_rings; ring; ring = ring->next)
+		wimaxll_trace_ring_dump(&out, ring);
+	wimaxll_trace_flush(&out);
+	return out.result;
+}
+
+
+static int wimaxll_trace_signal_fd = -1;
+
+static
+void wimaxll_trace_signal(int signo)
+{
+	int old_errno = errno;
+	wimaxll_trace_dump(wimaxll_trace_signal_fd);
+	errno = old_errno;
+}
+
+
+/**
+ * Dump the debug trace when a signal is received
+ *
+ * \param signo signal number (eg: SIGUSR1)
+ * \param fd file descriptor where to write to
+ * \return 0 if ok, -%ENOSYS if the library was configured with
+ *     --disable-trace; a negative errno code if the handler can't
+ *     be installed.
+ *
+ * Installs a handler for \a signo that calls wimaxll_trace_dump().
+ *
+ * \ingroup trace_group
+ */
+int wimaxll_trace_dump_on_signal(int signo, int fd)
+{
+	struct sigaction sa;
+
+	wimaxll_trace_signal_fd = fd;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wimaxll_trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signo, &sa, NULL) < 0)
+		return -errno;
+	return 0;
+}
+
+#else /* #ifdef WIMAXLL_TRACE */
+
+/* The tracepoints are compiled out; just in case something links */
+void __wimaxll_trace(int level, const char *func, const char *tag,
+		     const struct wimaxll_handle *dev, const char *fmt, ...)
+{
+}
+
+void __wimaxll_trace_dump(int level, const char *func,
+			  const struct wimaxll_handle *dev,
+			  const void *ptr, size_t size)
+{
+}
+
+int wimaxll_trace_enable(int level, unsigned records)
+{
+	return -ENOSYS;
+}
+
+int wimaxll_trace_dump(int fd)
+{
+	return -ENOSYS;
+}
+
+int wimaxll_trace_dump_on_signal(int signo, int fd)
+{
+	return -ENOSYS;
+}
+
+#endif /* #ifdef WIMAXLL_TRACE */
@@ -44,6 +44,9 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/types.h>
 #include <netlink/msg.h>
 #include <netlink/genl/genl.h>
@@ -100,7 +103,9 @@ int wimaxll_gnl_error_cb(struct sockaddr_nl *nla, struct nlmsgerr *nlerr,
  *
  * Complementary to wimaxll_gnl_error_cb().
  *
- * Frontend to this is wimaxll_wait_for_ack()
+ * Used on the RX socket by wimaxll_recv_timeout(); acks on the TX
+ * socket are matched to their requests by wimaxll_tx_cb_set()'s
+ * callbacks.
  */
 int wimaxll_gnl_ack_cb(struct nl_msg *msg, void *_ctx)
 {
@@ -149,45 +154,465 @@ error_bad_type:
 }
 
 
+/*
+ * Record the result of a request in whoever is waiting for it
+ *
+ * \internal
+ *
+ * Acks for requests nobody waits for any more (they timed out) are
+ * dropped. The waiter is woken up once all its requests are acked.
+ */
+static
+void wimaxll_ack_result(struct wimaxll_tx *tx, unsigned seq, int result)
+{
+	struct wimaxll_ack_wait *itr;
+	unsigned idx;
+
+	pthread_mutex_lock(&tx->mutex);
+	for (itr = tx->acks; itr != NULL; itr = itr->next) {
+		idx = seq - itr->seq;
+		if (idx >= itr->count || itr->results[idx] != -EINPROGRESS)
+			continue;	/* not this one's, or repeated */
+		itr->results[idx] = result;
+		if (--itr->pending == 0)
+			pthread_cond_broadcast(&tx->cond);
+		break;
+	}
+	if (itr == NULL)
+		d_printf(2, NULL, "D: netlink ack: skipping stale ack "
+			 "seq 0x%x (%d)\n", seq, result);
+	pthread_mutex_unlock(&tx->mutex);
+}
+
+
+static
+int wimaxll_tx_seq_check_cb(struct nl_msg *msg, void *arg)
+{
+	return NL_OK;	/* we match them by hand */
+}
+
+
+static
+int wimaxll_tx_ack_cb(struct nl_msg *msg, void *tx)
+{
+	wimaxll_ack_result(tx, nlmsg_hdr(msg)->nlmsg_seq, 0);
+	return NL_OK;
+}
+
+
+static
+int wimaxll_tx_error_cb(struct sockaddr_nl *nla, struct nlmsgerr *nlerr,
+			void *tx)
+{
+	d_printf(2, NULL, "D: netlink ack: received netlink error %d\n",
+		 nlerr->error);
+	wimaxll_ack_result(tx, nlerr->msg.nlmsg_seq, nlerr->error);
+	return NL_SKIP;
+}
+
+
+/*
+ * Set up the callbacks of a TX socket
+ *
+ * \internal
+ *
+ * Done once when the socket is created; whichever thread reads from
+ * it passes the results to the requests waiting for them (see
+ * wimaxll_ack_wait()), matching them by sequence number. That way
+ * acks for requests that timed out, or that were sent by other
+ * threads (or, in lean builds, for other handles), don't confuse
+ * anybody.
+ */
+void wimaxll_tx_cb_set(struct wimaxll_tx *tx)
+{
+	struct nl_cb *cb;
+
+	cb = nl_socket_get_cb(tx->nlh);
+	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wimaxll_tx_ack_cb, tx);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
+	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM,
+		  wimaxll_tx_seq_check_cb, NULL);
+	nl_cb_err(cb, NL_CB_CUSTOM, wimaxll_tx_error_cb, tx);
+	nl_cb_put(cb);
+}
+
+
 /**
- * Wait for a netlink ACK and pass on the result code it passed
+ * Wait for the kernel to ack one or more requests
+ *
+ * \internal
+ *
+ * \param wmx WiMAX device handle; \a wmx->tx->mutex has to be held
+ *     (it is released while waiting and held again on return).
+ * \param wait requests being waited for (sent with \a tx->mutex held,
+ *     so their acks can't be read before we are registered).
+ * \param deadline when to give up waiting (as set by
+ *     wimaxll_deadline_init())
+ * \param timeout_ms timeout \a deadline was initialized with (-1 for
+ *     none).
+ * \return 0 if all the requests were acked (their results are in
+ *     \a wait->results); on error (-%ETIMEDOUT if it took too long)
+ *     a negative errno code, also stored as the result of the
+ *     requests not acked.
+ *
+ * If no other thread is reading from the TX socket, this one does
+ * (and passes on the acks for the requests the others are waiting
+ * for); otherwise it waits for the reader to get its acks or to stop
+ * reading, in which case it takes over.
+ */
+int wimaxll_ack_wait(struct wimaxll_handle *wmx, struct wimaxll_ack_wait *wait,
+		     const struct timespec *deadline, int timeout_ms)
+{
+	int result = 0;
+	size_t cnt;
+	struct nl_cb *cb;
+	struct wimaxll_tx *tx = wmx->tx;
+	struct wimaxll_ack_wait **itr;
+
+	wait->next = tx->acks;
+	tx->acks = wait;
+	while (wait->pending > 0) {
+		if (tx->reading) {
+			result = wimaxll_cond_wait(&tx->cond, &tx->mutex,
+						   deadline, timeout_ms);
+			if (result < 0)
+				break;
+			continue;
+		}
+		tx->reading = 1;
+		pthread_mutex_unlock(&tx->mutex);
+		if (timeout_ms >= 0)
+			result = wimaxll_wait_fd(
+				nl_socket_get_fd(tx->nlh),
+				wimaxll_deadline_left(deadline, timeout_ms));
+		if (result == 0) {
+			cb = nl_socket_get_cb(tx->nlh);
+			result = nl_recvmsgs(tx->nlh, cb);
+			nl_cb_put(cb);
+		}
+		pthread_mutex_lock(&tx->mutex);
+		tx->reading = 0;
+		pthread_cond_broadcast(&tx->cond);
+		if (result < 0)
+			break;
+		result = 0;
+	}
+	for (itr = &tx->acks; *itr != NULL; itr = &(*itr)->next)
+		if (*itr == wait) {
+			*itr = wait->next;
+			break;
+		}
+	if (wait->pending == 0)
+		return 0;
+	for (cnt = 0; cnt < wait->count; cnt++)
+		if (wait->results[cnt] == -EINPROGRESS)
+			wait->results[cnt] = result;
+	return result;
+}
+
+
+/**
+ * Send a request to the kernel and pass on the result code it acks
+ * with
  *
  * \internal
  *
  * \param wmx WiMAX device handle
+ * \param msg Message to send (with NL_AUTO_SEQ, it gets its sequence
+ *     number when sent).
+ * \param capture !0 to record the message if the handle is capturing
  * \return error code passed by the kernel in the nlmsgerr structure
- *     that contained the ACK.
+ *     that contained the ACK or a negative errno code if the message
+ *     couldn't be sent; -%ETIMEDOUT if the ack doesn't arrive before
+ *     the handle's timeout (see wimaxll_set_timeout()). -%ENOENT means
+ *     the generic netlink family is gone and drops it from the cache
+ *     (see wimaxll_gnl_family_invalidate()).
  *
  * Similar to nl_wait_for_ack(), but returns the value in
  * nlmsgerr->error, so it can be used by the kernel to return simple
  * error codes.
+ *
+ * Can be called from many threads at the same time; each gets its
+ * own ack (see wimaxll_ack_wait()).
  */
-int wimaxll_wait_for_ack(struct wimaxll_handle *wmx)
+int wimaxll_send_wait_for_ack(struct wimaxll_handle *wmx, struct nl_msg *msg,
+			      int capture)
 {
-	int result;
-	struct nl_cb *cb;
-	struct wimaxll_cb_ctx ctx;
+	int result, ack_result = -EINPROGRESS;
+	struct timespec deadline;
+	struct wimaxll_ack_wait wait = {
+		.count = 1,
+		.pending = 1,
+		.results = &ack_result,
+	};
+
+	wimaxll_deadline_init(&deadline, wmx->timeout_ms);
+	pthread_mutex_lock(&wmx->tx->mutex);
+	result = nl_send_auto_complete(wmx->tx->nlh, msg);
+	if (result < 0) {
+		pthread_mutex_unlock(&wmx->tx->mutex);
+		wimaxll_msg(wmx, "E: error sending message: %d\n", result);
+		return result;
+	}
+	wait.seq = nlmsg_hdr(msg)->nlmsg_seq;
+	if (capture)
+		wimaxll_capture(wmx, nlmsg_hdr(msg), 1);
+	result = wimaxll_ack_wait(wmx, &wait, &deadline, wmx->timeout_ms);
+	pthread_mutex_unlock(&wmx->tx->mutex);
+	if (result < 0)
+		return result;
+	/* The kernel doesn't know our family ID; the WiMAX modules
+	 * were reloaded, so the cached one is no good any more */
+	if (ack_result == -ENOENT)
+		wimaxll_gnl_family_invalidate(wmx->gnl_family_id);
+	return ack_result;
+}
 
-	ctx.wmx = wmx;
-	ctx.result = -EINPROGRESS;
-	ctx.msg_done = 0;
 
-	cb = nl_socket_get_cb(wmx->nlh_tx);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, wimaxll_gnl_ack_cb, &ctx);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_err(cb, NL_CB_CUSTOM, wimaxll_gnl_error_cb, &ctx);
+/*
+ * Compute the point in time when a timeout expires
+ *
+ * \internal
+ *
+ * \param deadline where to store the deadline (CLOCK_MONOTONIC)
+ * \param timeout_ms how many milliseconds from now; if negative
+ *     (no timeout), \a deadline is left untouched.
+ */
+void wimaxll_deadline_init(struct timespec *deadline, int timeout_ms)
+{
+	if (timeout_ms < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+
+/*
+ * Return how many milliseconds are left until a deadline
+ *
+ * \internal
+ *
+ * \param deadline as set by wimaxll_deadline_init()
+ * \param timeout_ms timeout \a deadline was initialized with
+ * \return -1 if there is no timeout (\a timeout_ms < 0), otherwise
+ *     the milliseconds left (rounded up), zero if already expired.
+ */
+int wimaxll_deadline_left(const struct timespec *deadline, int timeout_ms)
+{
+	struct timespec now;
+	long long left_ns;
+
+	if (timeout_ms < 0)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left_ns = (deadline->tv_sec - now.tv_sec) * 1000000000LL
+		+ deadline->tv_nsec - now.tv_nsec;
+	if (left_ns <= 0)
+		return 0;
+	return (left_ns + 999999) / 1000000;
+}
+
+
+/*
+ * Wait for a file descriptor to have data to read
+ *
+ * \internal
+ *
+ * \param fd file descriptor
+ * \param timeout_ms how long to wait; -1 for ever, 0 to just check
+ * \return 0 if there is data to read, -%ETIMEDOUT if the timeout
+ *     expired or a negative errno code on error.
+ */
+int wimaxll_wait_fd(int fd, int timeout_ms)
+{
+	int result;
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
 	do
-		result = nl_recvmsgs(wmx->nlh_tx, cb);
-	while (ctx.msg_done == 0 && result >= 0);
-	result = ctx.result;
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_err(cb, NL_CB_CUSTOM, NL_CB_DEFAULT, NULL);
-	nl_cb_put(cb);
+		result = poll(&pfd, 1, timeout_ms);
+	while (result < 0 && errno == EINTR);
 	if (result < 0)
-		return result;
-	else
-		return ctx.result;
+		return -errno;
+	if (result == 0)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+
+/*
+ * Wait on a condition variable until a deadline
+ *
+ * \internal
+ *
+ * \param cond condition variable (initialized with CLOCK_MONOTONIC,
+ *     see wimaxll_handle_init())
+ * \param mutex mutex protecting it, held
+ * \param deadline as set by wimaxll_deadline_init()
+ * \param timeout_ms timeout \a deadline was initialized with; -1
+ *     waits for ever.
+ * \return 0 if signalled (or woken up spuriously), -%ETIMEDOUT if
+ *     the deadline passed.
+ */
+int wimaxll_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+		      const struct timespec *deadline, int timeout_ms)
+{
+	if (timeout_ms < 0)
+		return -pthread_cond_wait(cond, mutex);
+	if (timeout_ms == 0)
+		return -ETIMEDOUT;
+	return -pthread_cond_timedwait(cond, mutex, deadline);
+}
+
+
+/* What this thread is dispatching notifications for (innermost) */
+static __thread struct wimaxll_dispatch *wimaxll_dispatch_top;
+
+
+/*
+ * Note this thread is running callbacks for an interface
+ *
+ * \internal
+ *
+ * \param dispatch where to keep the context (on the caller's stack)
+ * \param wmx handle the callbacks are for
+ * \param ifidx interface the notification is for
+ *
+ * While set (until wimaxll_dispatch_pop()), wimaxll_ifidx() on an
+ * "any" handle returns \a ifidx in this thread; other threads using
+ * the same handle are not affected.
+ */
+void wimaxll_dispatch_push(struct wimaxll_dispatch *dispatch,
+			   const struct wimaxll_handle *wmx, unsigned ifidx)
+{
+	dispatch->wmx = wmx;
+	dispatch->ifidx = ifidx;
+	dispatch->prev = wimaxll_dispatch_top;
+	wimaxll_dispatch_top = dispatch;
+}
+
+
+/*
+ * Undo wimaxll_dispatch_push()
+ *
+ * \internal
+ */
+void wimaxll_dispatch_pop(struct wimaxll_dispatch *dispatch)
+{
+	wimaxll_dispatch_top = dispatch->prev;
+}
+
+
+#ifdef WIMAXLL_LEAN
+enum {
+	/* Enough for all the control requests */
+	WIMAXLL_TX_MSG_MIN = 256,
+	/* Messages written to pipes are usually bigger; don't keep
+	 * those */
+	WIMAXLL_TX_MSG_MAX = 256,
+};
+#else
+enum {
+	/* Smallest TX message to allocate (what nlmsg_new() does) */
+	WIMAXLL_TX_MSG_MIN = 4096,
+	/* Bigger TX messages are not kept for reuse */
+	WIMAXLL_TX_MSG_MAX = 64 * 1024,
+};
+#endif
+
+
+/*
+ * Get a netlink message to send a request to the kernel
+ *
+ * \internal
+ *
+ * \param wmx WiMAX handle
+ * \param payload how many bytes of generic netlink header and
+ *     attributes are going to be put in it
+ * \return empty message (ready for genlmsg_put()) or NULL if out of
+ *     memory; return it with wimaxll_tx_msg_put() once done.
+ *
+ * Each handle keeps one message around for this, so the control ops
+ * don't allocate in the common case. Sizes are rounded up to a power
+ * of two, and if the one the handle has is too small, it is replaced
+ * by a bigger one (unless it is too big to keep).
+ *
+ * If the handle's message is in use (eg: another thread is sending a
+ * request), a fresh one is allocated.
+ */
+struct nl_msg *wimaxll_tx_msg_get(struct wimaxll_handle *wmx, size_t payload)
+{
+	struct nl_msg *msg;
+	struct nlmsghdr *nl_hdr;
+	size_t size = WIMAXLL_TX_MSG_MIN;
+
+	payload = NLMSG_SPACE(payload);
+	pthread_mutex_lock(&wmx->tx->mutex);
+	if (!wmx->tx_msg_busy && payload <= wmx->tx_msg_size) {
+		msg = wmx->tx_msg;
+		nl_hdr = nlmsg_hdr(msg);
+		memset(nl_hdr, 0, NLMSG_HDRLEN);
+		nl_hdr->nlmsg_len = NLMSG_HDRLEN;
+		wmx->tx_msg_busy = 1;
+		goto out;
+	}
+	while (size < payload)
+		size <<= 1;
+	msg = nlmsg_alloc_size(size);
+	if (msg == NULL)
+		goto out;
+	if (!wmx->tx_msg_busy && size <= WIMAXLL_TX_MSG_MAX) {
+		if (wmx->tx_msg)
+			nlmsg_free(wmx->tx_msg);
+		wmx->tx_msg = msg;
+		wmx->tx_msg_size = size;
+		wmx->tx_msg_busy = 1;
+	}
+out:
+	pthread_mutex_unlock(&wmx->tx->mutex);
+	return msg;
+}
+
+
+/*
+ * Return a message obtained with wimaxll_tx_msg_get()
+ *
+ * \internal
+ */
+void wimaxll_tx_msg_put(struct wimaxll_handle *wmx, struct nl_msg *msg)
+{
+	pthread_mutex_lock(&wmx->tx->mutex);
+	if (msg == wmx->tx_msg) {
+		wmx->tx_msg_busy = 0;
+		msg = NULL;
+	}
+	pthread_mutex_unlock(&wmx->tx->mutex);
+	if (msg)
+		nlmsg_free(msg);
+}
+
+
+/*
+ * Free the handle's TX message
+ *
+ * \internal
+ *
+ * Called from wimaxll_close().
+ */
+void wimaxll_tx_msg_free(struct wimaxll_handle *wmx)
+{
+	if (wmx->tx_msg == NULL)
+		return;
+	nlmsg_free(wmx->tx_msg);
+	wmx->tx_msg = NULL;
+	wmx->tx_msg_size = 0;
 }
 
 
@@ -239,13 +664,22 @@ const char *wimaxll_ifname(const struct wimaxll_handle *wmx)
  * Note that if this is an \e any interface (open for all devices),
  * this will vary. When not processing a callback, it will be
  * zero. When processing a callback, this call will return the
- * interface for which the callback was executed.
+ * interface for which the callback was executed (in the thread
+ * executing it; other threads using the handle at the same time
+ * still see zero or the interface of their own callbacks).
  *
  * \ingroup device_management
  */
 unsigned wimaxll_ifidx(const struct wimaxll_handle *wmx)
 {
-	return wmx->ifidx;
+	struct wimaxll_dispatch *itr;
+
+	if (wmx->ifidx > 0)
+		return wmx->ifidx;
+	for (itr = wimaxll_dispatch_top; itr != NULL; itr = itr->prev)
+		if (itr->wmx == wmx)
+			return itr->ifidx;
+	return 0;
 }
 
 
@@ -278,3 +712,43 @@ void * wimaxll_priv_get(struct wimaxll_handle *wmx)
 {
 	return wmx->priv;
 }
+
+
+/**
+ * Set the default timeout for blocking calls on a WiMAX device handle
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \param timeout_ms Timeout in milliseconds; -1 to block for ever
+ *     (default), 0 not to block at all.
+ *
+ * Blocking calls (such as wimaxll_recv(), wimaxll_msg_read*(),
+ * wimaxll_wait_for_state_change(), or waiting for the kernel to ack
+ * commands like wimaxll_rfkill()) return -%ETIMEDOUT if what they
+ * are waiting for doesn't happen before this timeout passes.
+ *
+ * Calls with a \e _timeout variant take it for that call only.
+ *
+ * \ingroup device_management
+ */
+void wimaxll_set_timeout(struct wimaxll_handle *wmx, int timeout_ms)
+{
+	wmx->timeout_ms = timeout_ms < 0 ? -1 : timeout_ms;
+}
+
+
+/**
+ * Return the default timeout for blocking calls on a WiMAX device
+ * handle
+ *
+ * \param wmx WiMAX device handle
+ *
+ * \returns timeout in milliseconds as set by wimaxll_set_timeout()
+ *     (-1 if blocking calls wait for ever).
+ *
+ * \ingroup device_management
+ */
+int wimaxll_get_timeout(const struct wimaxll_handle *wmx)
+{
+	return wmx->timeout_ms;
+}
@@ -0,0 +1,407 @@
+/*
+ * Linux WiMax
+ * Latency benchmark of the control operations
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Usage: bench-control [-j] [-i IFNAME] [-n COUNT] [-w WARMUP] [-o OPS]
+ *
+ * Times, one call at a time, COUNT synchronous control operations of
+ * each kind in OPS (a comma separated list; all by default):
+ *
+ * - rfkill: wimaxll_rfkill(WIMAX_RF_QUERY)
+ * - reset: wimaxll_reset()
+ * - state_get: wimaxll_state_get()
+ * - msg_write: wimaxll_msg_write() of an i2400m GET_STATE command
+ *   (waits for the ack only)
+ * - i2400m_msg_to_dev: i2400m_msg_to_dev() of the same command
+ *   (waits for the ack and the reply)
+ *
+ * and prints the median, 99th and 99.9th percentile and maximum
+ * latency and the calls per second; with -j, as one JSON object per
+ * line (with the library's version) so runs of different versions can
+ * be compared.
+ *
+ * The operations run against a mock device (which echoes the i2400m
+ * commands back as their replies) or, with -i, the WiMAX device
+ * IFNAME. As resetting real hardware is disruptive, reset is then only
+ * done if listed in OPS.
+ *
+ * WARMUP calls (100 by default) of each operation are done first and
+ * not counted. A thread keeps receiving notifications, as the ones
+ * carrying the i2400m replies have to be dispatched for
+ * i2400m_msg_to_dev() to return.
+ */
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wimaxll.h>
+#include <wimaxll/version.h>
+#include <wimaxll/mock.h>
+#include <wimaxll/i2400m.h>
+
+enum {
+	BENCH_COUNT = 10000,
+	BENCH_WARMUP = 100,
+	/* Don't wait for ever for an i2400m reply that won't come */
+	BENCH_TIMEOUT_MS = 5000,
+	/* How often the receive thread checks if it has to stop */
+	BENCH_RX_POLL_MS = 100,
+};
+
+enum bench_op {
+	BENCH_RFKILL,
+	BENCH_RESET,
+	BENCH_STATE_GET,
+	BENCH_MSG_WRITE,
+	BENCH_I2400M_MSG_TO_DEV,
+	BENCH_OPS
+};
+
+static const char *bench_op_name[BENCH_OPS] = {
+	[BENCH_RFKILL] = "rfkill",
+	[BENCH_RESET] = "reset",
+	[BENCH_STATE_GET] = "state_get",
+	[BENCH_MSG_WRITE] = "msg_write",
+	[BENCH_I2400M_MSG_TO_DEV] = "i2400m_msg_to_dev",
+};
+
+struct bench {
+	struct wimaxll_handle *wmx;
+	struct i2400m *i2400m;
+	const char *device;
+	int json;
+	/* Latency of each call, in ns */
+	unsigned long long *lat;
+	volatile int rx_stop;
+};
+
+/* What msg_write and i2400m_msg_to_dev send: it has no payload */
+static struct i2400m_l3l4_hdr bench_cmd;
+
+
+static
+unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static
+int bench_lat_cmp(const void *_a, const void *_b)
+{
+	const unsigned long long *a = _a, *b = _b;
+
+	return *a < *b ? -1 : *a > *b;
+}
+
+
+/* Nearest rank percentile (in per mille) of sorted latencies */
+static
+unsigned long long bench_pct(const unsigned long long *lat,
+			     unsigned long count, unsigned permille)
+{
+	unsigned long rank = (count * permille + 999) / 1000;
+
+	return lat[rank ? rank - 1 : 0];
+}
+
+
+static
+void bench_print(struct bench *bench, enum bench_op op,
+		 unsigned long count, unsigned long long ns)
+{
+	unsigned long long *lat = bench->lat, p50, p99, p999, max;
+	double calls_per_s = count * 1e9 / (ns ? ns : 1);
+
+	qsort(lat, count, sizeof(lat[0]), bench_lat_cmp);
+	p50 = bench_pct(lat, count, 500);
+	p99 = bench_pct(lat, count, 990);
+	p999 = bench_pct(lat, count, 999);
+	max = lat[count - 1];
+	if (bench->json)
+		printf("{\"version\":\"%s\",\"device\":\"%s\",\"op\":\"%s\","
+		       "\"calls\":%lu,\"calls_per_s\":%.0f,"
+		       "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+		       "\"max_ns\":%llu}\n",
+		       WIMAXLL_VERSION, bench->device, bench_op_name[op],
+		       count, calls_per_s, p50, p99, p999, max);
+	else
+		printf("%-18s %8lu calls %10.0f calls/s  p50 %9.1f us  "
+		       "p99 %9.1f us  p999 %9.1f us  max %9.1f us\n",
+		       bench_op_name[op], count, calls_per_s, p50 / 1e3,
+		       p99 / 1e3, p999 / 1e3, max / 1e3);
+	fflush(stdout);
+}
+
+
+static
+int bench_call(struct bench *bench, enum bench_op op)
+{
+	switch (op) {
+	case BENCH_RFKILL:
+		return wimaxll_rfkill(bench->wmx, WIMAX_RF_QUERY);
+	case BENCH_RESET:
+		return wimaxll_reset(bench->wmx);
+	case BENCH_STATE_GET:
+		return wimaxll_state_get(bench->wmx);
+	case BENCH_MSG_WRITE:
+		return wimaxll_msg_write(bench->wmx, NULL,
+					 &bench_cmd, sizeof(bench_cmd));
+	case BENCH_I2400M_MSG_TO_DEV:
+		return i2400m_msg_to_dev_timeout(
+			bench->i2400m, &bench_cmd, sizeof(bench_cmd),
+			NULL, NULL, BENCH_TIMEOUT_MS);
+	default:
+		return -EINVAL;
+	}
+}
+
+
+static
+int bench_op(struct bench *bench, enum bench_op op,
+	     unsigned long count, unsigned long warmup)
+{
+	int result = 0;
+	unsigned long itr;
+	unsigned long long start, before, after;
+
+	for (itr = 0; itr < warmup; itr++) {
+		result = bench_call(bench, op);
+		if (result < 0)
+			goto error;
+	}
+	start = bench_now_ns();
+	after = start;
+	for (itr = 0; itr < count; itr++) {
+		before = after;
+		result = bench_call(bench, op);
+		after = bench_now_ns();
+		if (result < 0)
+			goto error;
+		bench->lat[itr] = after - before;
+	}
+	bench_print(bench, op, count, after - start);
+	return 0;
+
+error:
+	fprintf(stderr, "E: %s: %d (%s)\n", bench_op_name[op], result,
+		strerror(-result));
+	return result;
+}
+
+
+/*
+ * Dispatch notifications (and with them, the i2400m replies) until
+ * told to stop
+ */
+static
+void *bench_rx_thread(void *_bench)
+{
+	ssize_t result;
+	struct bench *bench = _bench;
+
+	while (!bench->rx_stop) {
+		result = wimaxll_recv_timeout(bench->wmx, BENCH_RX_POLL_MS);
+		if (result < 0 && result != -ETIMEDOUT && result != -EINTR) {
+			fprintf(stderr, "E: receive: %zd (%s)\n", result,
+				strerror(-result));
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+/* Mock device side: reply to each i2400m command with its header */
+static
+int bench_mock_request_cb(struct wimaxll_mock *mock, void *priv,
+			  const char *pipe_name,
+			  const void *data, size_t size)
+{
+	struct i2400m_l3l4_hdr reply;
+
+	if (pipe_name != NULL || size < sizeof(reply))
+		return 0;
+	memcpy(&reply, data, sizeof(reply));
+	reply.length = 0;
+	reply.status = 0;
+	wimaxll_mock_msg_to_user(mock, NULL, &reply, sizeof(reply), 0);
+	return 0;
+}
+
+
+/* Parse a comma separated list of operation names into a bitmap */
+static
+int bench_ops_parse(const char *str, unsigned *ops)
+{
+	const char *end;
+	size_t len;
+	unsigned op;
+
+	*ops = 0;
+	while (*str) {
+		end = strchr(str, ',');
+		if (end == NULL)
+			end = str + strlen(str);
+		len = end - str;
+		for (op = 0; op < BENCH_OPS; op++)
+			if (strlen(bench_op_name[op]) == len
+			    && !strncmp(str, bench_op_name[op], len))
+				break;
+		if (op == BENCH_OPS) {
+			fprintf(stderr, "E: unknown operation '%.*s'\n",
+				(int) len, str);
+			return -EINVAL;
+		}
+		*ops |= 1 << op;
+		str = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	int result;
+	int opt;
+	unsigned long count = BENCH_COUNT, warmup = BENCH_WARMUP;
+	unsigned ops = 0, op;
+	const char *ifname = NULL;
+	struct wimaxll_mock *mock = NULL;
+	struct bench bench;
+	pthread_t rx_thread;
+
+	memset(&bench, 0, sizeof(bench));
+	while ((opt = getopt(argc, argv, "ji:n:w:o:")) != -1) {
+		switch (opt) {
+		case 'j':
+			bench.json = 1;
+			break;
+		case 'i':
+			ifname = optarg;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			warmup = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			if (bench_ops_parse(optarg, &ops) < 0)
+				return 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-j] [-i IFNAME] "
+				"[-n COUNT] [-w WARMUP] [-o OPS]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (count == 0)
+		count = 1;
+	if (ops == 0)
+		ops = ((1 << BENCH_OPS) - 1)
+			& ~(ifname ? 1 << BENCH_RESET : 0);
+
+	bench_cmd.type = htole16(I2400M_MT_GET_STATE);
+	bench_cmd.version = htole16(I2400M_L3L4_VERSION);
+
+	result = -ENOMEM;
+	bench.lat = calloc(count, sizeof(bench.lat[0]));
+	if (bench.lat == NULL) {
+		fprintf(stderr, "E: cannot allocate %lu latencies\n", count);
+		goto error_lat_alloc;
+	}
+	if (ifname) {
+		result = i2400m_create(&bench.i2400m, ifname, NULL, NULL);
+		if (result < 0) {
+			fprintf(stderr, "E: %s: cannot open: %d (%s)\n",
+				ifname, result, strerror(-result));
+			goto error_open;
+		}
+		bench.wmx = i2400m_wmx(bench.i2400m);
+		bench.device = ifname;
+	} else {
+		mock = wimaxll_mock_create("wmx-bench", 1);
+		if (mock == NULL) {
+			fprintf(stderr, "E: cannot create mock device: %m\n");
+			result = -errno;
+			goto error_open;
+		}
+		wimaxll_mock_set_cb_request(mock, bench_mock_request_cb, NULL);
+		bench.wmx = wimaxll_mock_handle(mock);
+		bench.device = "mock";
+		result = i2400m_create_from_handle(&bench.i2400m, bench.wmx,
+						   NULL, NULL);
+		if (result < 0) {
+			fprintf(stderr, "E: cannot create i2400m: %d (%s)\n",
+				result, strerror(-result));
+			goto error_i2400m;
+		}
+	}
+	result = -pthread_create(&rx_thread, NULL, bench_rx_thread, &bench);
+	if (result < 0) {
+		fprintf(stderr, "E: cannot create receive thread: %d (%s)\n",
+			result, strerror(-result));
+		goto error_thread;
+	}
+
+	for (op = 0; op < BENCH_OPS && result == 0; op++)
+		if (ops & 1 << op)
+			result = bench_op(&bench, op, count, warmup);
+
+	bench.rx_stop = 1;
+	pthread_join(rx_thread, NULL);
+error_thread:
+	/* i2400m_destroy() closes the handle, which for a mock device
+	 * wimaxll_mock_destroy() does; so that one just goes away with
+	 * the process. */
+	if (mock == NULL)
+		i2400m_destroy(bench.i2400m);
+error_i2400m:
+	if (mock)
+		wimaxll_mock_destroy(mock);
+error_open:
+	free(bench.lat);
+error_lat_alloc:
+	return result < 0 ? 1 : 0;
+}
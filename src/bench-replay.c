@@ -0,0 +1,418 @@
+/*
+ * Linux WiMax
+ * Benchmark of the receive paths using a mock device
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Usage: bench-replay [-n COUNT] [-s SIZE] [TRACE]
+ *
+ * Replays TRACE (a capture done with "wimaxll capture" or
+ * wimaxll_capture_start()) or, if none is given, a synthetic one of
+ * messages of SIZE bytes against a mock device, as fast as it can be
+ * received and prints how long it takes to:
+ *
+ * - dispatch COUNT messages with wimaxll_recv() and with
+ *   wimaxll_recv_batch()
+ *
+ * - read COUNT messages with wimaxll_msg_read() (allocation and
+ *   copy), wimaxll_msg_read_buf() (copy) and
+ *   wimaxll_msg_read_borrow() (none)
+ *
+ * - look up a TLV in an L3L4 payload with i2400m_tlv_find() and with
+ *   an i2400m_tlv_index
+ *
+ * - complete a wimaxll_state_get(), wimaxll_rfkill() and
+ *   wimaxll_msg_write() round trip with the mock's thread.
+ *
+ * The mock device needs no hardware or kernel support, so the
+ * numbers measure only the library (and the socket layer).
+ */
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wimaxll.h>
+#include <wimaxll/mock.h>
+#include <wimaxll/i2400m.h>
+
+enum {
+	BENCH_COUNT = 1000000,
+	BENCH_SIZE = 256,
+	/* Messages in the synthetic trace */
+	BENCH_TRACE_MSGS = 1024,
+	/* TLVs in the L3L4 payload for the lookup benchmarks */
+	BENCH_TLVS = 32,
+	BENCH_EVENTS = 64,
+};
+
+static unsigned long bench_msgs;
+
+
+static
+double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static
+void bench_print(const char *name, unsigned long count, double secs)
+{
+	printf("%-20s %10lu ops %8.3f s %12.0f ops/s %10.1f ns/op\n",
+	       name, count, secs, count / secs, secs * 1e9 / count);
+}
+
+
+static
+int bench_msg_to_user_cb(struct wimaxll_handle *wmx, void *priv,
+			 const char *pipe_name,
+			 const void *data, size_t size)
+{
+	bench_msgs++;
+	return 0;
+}
+
+
+/* Dispatch with wimaxll_recv(), draining the socket each time */
+static
+int bench_recv(struct wimaxll_mock *mock, unsigned long count)
+{
+	ssize_t result;
+	struct wimaxll_handle *wmx = wimaxll_mock_handle(mock);
+	double start;
+
+	bench_msgs = 0;
+	wimaxll_set_cb_msg_to_user(wmx, bench_msg_to_user_cb, NULL);
+	start = bench_now();
+	while (bench_msgs < count) {
+		result = wimaxll_mock_replay(mock, WIMAXLL_MOCK_LOOP);
+		if (result < 0 && result != -EAGAIN)
+			goto error;
+		do
+			result = wimaxll_recv_timeout(wmx, 0);
+		while (result >= 0);
+		if (result != -ETIMEDOUT)
+			goto error;
+	}
+	bench_print("recv", bench_msgs, bench_now() - start);
+	wimaxll_set_cb_msg_to_user(wmx, NULL, NULL);
+	return 0;
+
+error:
+	fprintf(stderr, "E: recv: %zd (%s)\n", result, strerror(-result));
+	return result;
+}
+
+
+static
+int bench_recv_batch(struct wimaxll_mock *mock, unsigned long count)
+{
+	ssize_t result;
+	struct wimaxll_handle *wmx = wimaxll_mock_handle(mock);
+	struct wimaxll_event events[BENCH_EVENTS];
+	unsigned long msgs = 0;
+	double start;
+
+	start = bench_now();
+	while (msgs < count) {
+		result = wimaxll_mock_replay(mock, WIMAXLL_MOCK_LOOP);
+		if (result < 0 && result != -EAGAIN)
+			goto error;
+		do {
+			result = wimaxll_recv_batch(wmx, events,
+						    BENCH_EVENTS, 0);
+			msgs += result > 0 ? result : 0;
+		} while (result > 0);
+		if (result < 0)
+			goto error;
+	}
+	bench_print("recv_batch", msgs, bench_now() - start);
+	return 0;
+
+error:
+	fprintf(stderr, "E: recv_batch: %zd (%s)\n", result, strerror(-result));
+	return result;
+}
+
+
+enum bench_read_mode {
+	BENCH_READ_COPY,
+	BENCH_READ_BUF,
+	BENCH_READ_BORROW,
+};
+
+/* Read from any pipe one message at a time */
+static
+int bench_msg_read(struct wimaxll_mock *mock, unsigned long count,
+		   enum bench_read_mode mode)
+{
+	static const char *names[] = {
+		[BENCH_READ_COPY] = "msg_read",
+		[BENCH_READ_BUF] = "msg_read_buf",
+		[BENCH_READ_BORROW] = "msg_read_borrow",
+	};
+	ssize_t result;
+	struct wimaxll_handle *wmx = wimaxll_mock_handle(mock);
+	unsigned long msgs = 0;
+	void *data;
+	const void *borrowed;
+	static char buf[65536];
+	double start;
+
+	wimaxll_set_timeout(wmx, 0);
+	start = bench_now();
+	while (msgs < count) {
+		switch (mode) {
+		case BENCH_READ_COPY:
+			result = wimaxll_msg_read(wmx, WIMAX_PIPE_ANY, &data);
+			if (result >= 0)
+				wimaxll_msg_free(data);
+			break;
+		case BENCH_READ_BUF:
+			result = wimaxll_msg_read_buf(
+				wmx, WIMAX_PIPE_ANY, buf, sizeof(buf));
+			break;
+		case BENCH_READ_BORROW:
+		default:
+			result = wimaxll_msg_read_borrow(
+				wmx, WIMAX_PIPE_ANY, &borrowed);
+			break;
+		}
+		if (result == -ETIMEDOUT) {
+			result = wimaxll_mock_replay(mock, WIMAXLL_MOCK_LOOP);
+			if (result < 0 && result != -EAGAIN)
+				goto error;
+			continue;
+		}
+		if (result < 0)
+			goto error;
+		msgs++;
+	}
+	bench_print(names[mode], msgs, bench_now() - start);
+	wimaxll_msg_release(wmx);
+	wimaxll_set_timeout(wmx, -1);
+	return 0;
+
+error:
+	fprintf(stderr, "E: %s: %zd (%s)\n", names[mode], result,
+		strerror(-result));
+	wimaxll_set_timeout(wmx, -1);
+	return result;
+}
+
+
+/*
+ * Look up the last TLV of a buffer of BENCH_TLVS, with
+ * i2400m_tlv_find() (which walks them all) and with an index built
+ * for each lookup.
+ */
+static
+int bench_tlv(unsigned long count)
+{
+	int result;
+	unsigned char buf[BENCH_TLVS * (sizeof(struct i2400m_tlv_hdr) + 8)];
+	struct i2400m_tlv_hdr *tlv;
+	const struct i2400m_tlv_hdr *found;
+	struct i2400m_tlv_index idx;
+	unsigned cnt;
+	unsigned long itr;
+	double start;
+
+	for (cnt = 0; cnt < BENCH_TLVS; cnt++) {
+		tlv = (void *) buf + cnt * (sizeof(*tlv) + 8);
+		tlv->type = htole16(0x1000 + cnt);
+		tlv->length = htole16(8);
+		memset(tlv->pl, cnt, 8);
+	}
+	start = bench_now();
+	for (itr = 0; itr < count; itr++) {
+		found = i2400m_tlv_find((void *) buf, sizeof(buf),
+					0x1000 + BENCH_TLVS - 1,
+					sizeof(*tlv) + 8);
+		if (found == NULL)
+			goto error;
+	}
+	bench_print("tlv_find", count, bench_now() - start);
+	start = bench_now();
+	for (itr = 0; itr < count; itr++) {
+		result = i2400m_tlv_index_build(&idx, buf, sizeof(buf));
+		if (result < 0)
+			goto error;
+		found = i2400m_tlv_index_get(&idx, 0x1000 + BENCH_TLVS - 1,
+					     sizeof(*tlv) + 8);
+		if (found == NULL)
+			goto error;
+	}
+	bench_print("tlv_index", count, bench_now() - start);
+	return 0;
+
+error:
+	fprintf(stderr, "E: tlv: lookup failed\n");
+	return -EINVAL;
+}
+
+
+/* Round trips with the mock's thread */
+static
+int bench_rtt(struct wimaxll_mock *mock, unsigned long count, size_t size)
+{
+	int result;
+	struct wimaxll_handle *wmx = wimaxll_mock_handle(mock);
+	void *data;
+	unsigned long itr;
+	double start;
+
+	data = calloc(1, size);
+	if (data == NULL)
+		return -ENOMEM;
+	start = bench_now();
+	for (itr = 0; itr < count; itr++) {
+		result = wimaxll_state_get(wmx);
+		if (result < 0)
+			goto error;
+	}
+	bench_print("state_get", count, bench_now() - start);
+	start = bench_now();
+	for (itr = 0; itr < count; itr++) {
+		result = wimaxll_rfkill(wmx, WIMAX_RF_QUERY);
+		if (result < 0)
+			goto error;
+	}
+	bench_print("rfkill", count, bench_now() - start);
+	start = bench_now();
+	for (itr = 0; itr < count; itr++) {
+		result = wimaxll_msg_write(wmx, NULL, data, size);
+		if (result < 0)
+			goto error;
+	}
+	bench_print("msg_write", count, bench_now() - start);
+	free(data);
+	return 0;
+
+error:
+	fprintf(stderr, "E: round trip: %d (%s)\n", result, strerror(-result));
+	free(data);
+	return result;
+}
+
+
+int main(int argc, char **argv)
+{
+	ssize_t result;
+	int opt;
+	unsigned long count = BENCH_COUNT;
+	size_t size = BENCH_SIZE, cnt;
+	struct wimaxll_mock *mock;
+	void *data;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n COUNT] [-s SIZE] "
+				"[TRACE]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (count == 0)
+		count = 1;
+
+	mock = wimaxll_mock_create("wmx-bench", 1);
+	if (mock == NULL) {
+		fprintf(stderr, "E: cannot create mock device: %m\n");
+		result = -errno;
+		goto error_mock_create;
+	}
+	if (optind < argc) {
+		result = wimaxll_mock_load(mock, argv[optind]);
+		if (result < 0) {
+			fprintf(stderr, "E: %s: cannot load: %zd (%s)\n",
+				argv[optind], result, strerror(-result));
+			goto error_load;
+		}
+		if (result == 0) {
+			fprintf(stderr, "E: %s: no messages to replay\n",
+				argv[optind]);
+			result = -ENODATA;
+			goto error_load;
+		}
+		printf("trace: %zd messages from %s\n", result, argv[optind]);
+	} else {
+		result = -ENOMEM;
+		data = calloc(1, size);
+		if (data == NULL)
+			goto error_load;
+		for (cnt = 0; cnt < BENCH_TRACE_MSGS; cnt++) {
+			result = wimaxll_mock_msg_to_user(
+				mock, NULL, data, size, WIMAXLL_MOCK_QUEUE);
+			if (result < 0)
+				break;
+		}
+		free(data);
+		if (result < 0)
+			goto error_load;
+		printf("trace: %u messages of %zu bytes\n",
+		       BENCH_TRACE_MSGS, size);
+	}
+
+	result = bench_recv(mock, count);
+	if (result == 0)
+		result = bench_recv_batch(mock, count);
+	if (result == 0)
+		result = bench_msg_read(mock, count, BENCH_READ_COPY);
+	if (result == 0)
+		result = bench_msg_read(mock, count, BENCH_READ_BUF);
+	if (result == 0)
+		result = bench_msg_read(mock, count, BENCH_READ_BORROW);
+	if (result == 0)
+		result = bench_tlv(count);
+	/* Round trips are much slower; don't take for ever */
+	if (result == 0)
+		result = bench_rtt(mock, count / 10 ? : 1, size);
+error_load:
+	wimaxll_mock_destroy(mock);
+error_mock_create:
+	return result < 0 ? 1 : 0;
+}
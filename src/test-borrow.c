@@ -0,0 +1,236 @@
+/*
+ * Linux WiMax
+ * Test of wimaxll_msg_read_borrow() against concurrent receivers
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * Usage: test-borrow [-n COUNT]
+ *
+ * Reads COUNT messages from a mock device with
+ * wimaxll_msg_read_borrow() while another thread runs an event loop
+ * on the same handle, so the messages are handed over sometimes from
+ * wimaxll_recv() (borrowing the netlink message) and sometimes from
+ * the loop's batched receive (borrowing the batch buffer it was read
+ * into), and checks each message lent holds what was sent. Messages
+ * the loop gets while nobody is reading go to the handle's callback
+ * and are counted apart.
+ *
+ * Once a message is consumed, the next one is sent while the message
+ * lent is still held, so the loop reads it (and refills its batch
+ * buffers) meanwhile; the message lent must not change until it is
+ * released.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wimaxll.h>
+#include <wimaxll/mock.h>
+
+enum {
+	TEST_COUNT = 100000,
+	TEST_TIMEOUT_MS = 100,
+	/* how long to let the loop run while holding a message lent */
+	TEST_HOLD_YIELDS = 100,
+};
+
+struct test_borrow {
+	struct wimaxll_mock *mock;
+	struct wimaxll_loop *loop;
+	unsigned long count;
+	/* messages read or taken by the loop's callback */
+	volatile unsigned long consumed;
+	unsigned long dispatched;
+	volatile int stop;
+};
+
+
+/* The loop got a message nobody was waiting for */
+static
+int test_msg_to_user_cb(struct wimaxll_handle *wmx, void *priv,
+			const char *pipe_name,
+			const void *data, size_t size)
+{
+	struct test_borrow *test = priv;
+
+	test->dispatched++;
+	__sync_fetch_and_add(&test->consumed, 1);
+	return 0;
+}
+
+
+/* Drain the handle with the event loop until told to stop */
+static
+void *test_loop_thread(void *_test)
+{
+	struct test_borrow *test = _test;
+	ssize_t result;
+
+	while (!test->stop) {
+		result = wimaxll_loop_run_once(test->loop, 10);
+		if (result < 0 && result != -EBUSY) {
+			fprintf(stderr, "E: loop: %zd (%s)\n",
+				result, strerror(-result));
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+/* Send message #N once #N - 1 has been consumed */
+static
+void *test_send_thread(void *_test)
+{
+	struct test_borrow *test = _test;
+	unsigned long cnt;
+	int result;
+
+	for (cnt = 0; cnt < test->count && !test->stop; cnt++) {
+		while (test->consumed < cnt && !test->stop)
+			sched_yield();
+		result = wimaxll_mock_msg_to_user(test->mock, NULL, &cnt,
+						  sizeof(cnt), 0);
+		if (result < 0) {
+			fprintf(stderr, "E: send #%lu: %d (%s)\n",
+				cnt, result, strerror(-result));
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+int main(int argc, char **argv)
+{
+	ssize_t result = 0;
+	int opt, cnt;
+	unsigned long borrowed = 0, got, last = 0;
+	struct wimaxll_handle *wmx;
+	struct test_borrow test = { .count = TEST_COUNT };
+	pthread_t loop_thread, send_thread;
+	const void *data;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			test.count = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n COUNT]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	test.mock = wimaxll_mock_create("wmx-test", 1);
+	if (test.mock == NULL) {
+		fprintf(stderr, "E: cannot create mock device: %m\n");
+		result = -errno;
+		goto error_mock_create;
+	}
+	wmx = wimaxll_mock_handle(test.mock);
+	wimaxll_set_timeout(wmx, TEST_TIMEOUT_MS);
+	wimaxll_set_cb_msg_to_user(wmx, test_msg_to_user_cb, &test);
+	result = -ENOMEM;
+	test.loop = wimaxll_loop_create();
+	if (test.loop == NULL)
+		goto error_loop_create;
+	result = wimaxll_loop_add(test.loop, wmx);
+	if (result < 0)
+		goto error_loop_add;
+	result = -pthread_create(&loop_thread, NULL, test_loop_thread, &test);
+	if (result < 0)
+		goto error_loop_thread;
+	result = -pthread_create(&send_thread, NULL, test_send_thread, &test);
+	if (result < 0)
+		goto error_send_thread;
+
+	while (test.consumed < test.count) {
+		result = wimaxll_msg_read_borrow(wmx, NULL, &data);
+		if (result == -ETIMEDOUT)
+			continue;	/* the loop took it */
+		if (result < 0) {
+			fprintf(stderr, "E: read: %zd (%s)\n",
+				result, strerror(-result));
+			break;
+		}
+		if (result != sizeof(got)) {
+			fprintf(stderr, "E: read: got %zd bytes, "
+				"expected %zu\n", result, sizeof(got));
+			result = -EBADMSG;
+			break;
+		}
+		memcpy(&got, data, sizeof(got));
+		if (borrowed > 0 && got <= last) {
+			fprintf(stderr, "E: read: got message #%lu "
+				"after #%lu\n", got, last);
+			result = -EBADMSG;
+			break;
+		}
+		last = got;
+		borrowed++;
+		__sync_fetch_and_add(&test.consumed, 1);
+		for (cnt = 0; cnt < TEST_HOLD_YIELDS; cnt++)
+			sched_yield();
+		if (memcmp(data, &got, sizeof(got))) {
+			fprintf(stderr, "E: read: message #%lu lent "
+				"changed while held\n", got);
+			result = -EBADMSG;
+			break;
+		}
+		result = 0;
+	}
+	wimaxll_msg_release(wmx);
+
+	test.stop = 1;
+	pthread_join(send_thread, NULL);
+error_send_thread:
+	test.stop = 1;
+	pthread_join(loop_thread, NULL);
+	if (result == 0)
+		printf("I: %lu messages borrowed, %lu taken by the loop\n",
+		       borrowed, test.dispatched);
+error_loop_thread:
+	wimaxll_loop_remove(test.loop, wmx);
+error_loop_add:
+	wimaxll_loop_destroy(test.loop);
+error_loop_create:
+	wimaxll_mock_destroy(test.mock);
+error_mock_create:
+	return result < 0 ? 1 : 0;
+}
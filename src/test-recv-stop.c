@@ -0,0 +1,244 @@
+/*
+ * Linux WiMax
+ * Test of how callbacks stop wimaxll_recv()
+ *
+ *
+ * Copyright (C) 2007-2009 Intel Corporation. All rights reserved.
+ * Inaky Perez-Gonzalez <inaky.perez-gonzalez@intel.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *   * Neither the name of Intel Corporation nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ *
+ * Usage: test-recv-stop
+ *
+ * A callback returning -EBUSY makes wimaxll_recv() stop and return
+ * 0, leaving what is still queued for the next call. This checks it
+ * for each way a callback can be called from the receive, using a
+ * mock device:
+ *
+ * - a message to user callback
+ *
+ * - the state change callback, with the notice that notifications
+ *   were lost (socket overflow)
+ *
+ * - the coalesced state change callback, when the socket is drained
+ *
+ * - the coalesced state change callback, flushing a held notice of
+ *   lost notifications and then, on the way out, the state change
+ *   held when the receive stopped.
+ *
+ * Stop requests left by a handle sharing the RX socket (which make
+ * the receive return -EALREADY) can't be tested with mock devices.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <wimaxll.h>
+#include <wimaxll/mock.h>
+
+struct test_ctx {
+	struct wimaxll_mock *mock;
+	unsigned msgs, state_changes, lost, coalesced, transitions;
+};
+
+
+static
+int test_msg_to_user_cb(struct wimaxll_handle *wmx, void *priv,
+			const char *pipe_name,
+			const void *data, size_t size)
+{
+	struct test_ctx *ctx = priv;
+
+	ctx->msgs++;
+	return -EBUSY;
+}
+
+
+static
+int test_state_change_cb(struct wimaxll_handle *wmx, void *priv,
+			 enum wimax_st old_state, enum wimax_st new_state)
+{
+	struct test_ctx *ctx = priv;
+
+	ctx->state_changes++;
+	if (old_state == WIMAXLL_STATE_LOST) {
+		ctx->lost++;
+		return -EBUSY;
+	}
+	return 0;
+}
+
+
+static
+int test_coalesced_cb(struct wimaxll_handle *wmx, void *priv,
+		      enum wimax_st old_state, enum wimax_st new_state,
+		      const struct wimaxll_state_log *log)
+{
+	struct test_ctx *ctx = priv;
+
+	ctx->coalesced++;
+	ctx->transitions += log->transitions;
+	if (old_state == WIMAXLL_STATE_LOST)
+		ctx->lost++;
+	return -EBUSY;
+}
+
+
+/* Check a receive returned @expected and an event count */
+static
+int test_check(const char *name, const char *what, ssize_t result,
+	       ssize_t expected, unsigned count, unsigned count_expected)
+{
+	if (result != expected) {
+		fprintf(stderr, "E: %s: receive returned %zd (%s), "
+			"expected %zd\n", name, result,
+			result < 0 ? strerror(-result) : "ok", expected);
+		return -1;
+	}
+	if (count != count_expected) {
+		fprintf(stderr, "E: %s: %u %s, expected %u\n",
+			name, count, what, count_expected);
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Message to user callback stops; the next message is left queued */
+static
+int test_msg_to_user(struct test_ctx *ctx, struct wimaxll_handle *wmx)
+{
+	static const char *name = "msg_to_user";
+
+	wimaxll_set_cb_msg_to_user(wmx, test_msg_to_user_cb, ctx);
+	wimaxll_mock_msg_to_user(ctx->mock, NULL, "1", 1, 0);
+	wimaxll_mock_msg_to_user(ctx->mock, NULL, "2", 1, 0);
+	if (test_check(name, "messages", wimaxll_recv_timeout(wmx, 0),
+		       0, ctx->msgs, 1)
+	    || test_check(name, "messages", wimaxll_recv_timeout(wmx, 0),
+			  0, ctx->msgs, 2))
+		return -1;
+	return 0;
+}
+
+
+/* The notice of lost notifications stops before the next message */
+static
+int test_overrun(struct test_ctx *ctx, struct wimaxll_handle *wmx)
+{
+	static const char *name = "overrun";
+
+	wimaxll_set_cb_msg_to_user(wmx, test_msg_to_user_cb, ctx);
+	wimaxll_set_cb_state_change(wmx, test_state_change_cb, ctx);
+	wimaxll_mock_overrun(ctx->mock);
+	wimaxll_mock_msg_to_user(ctx->mock, NULL, "1", 1, 0);
+	if (test_check(name, "lost notices", wimaxll_recv_timeout(wmx, 0),
+		       0, ctx->lost, 1)
+	    || test_check(name, "messages", 0, 0, ctx->msgs, 0)
+	    || test_check(name, "messages", wimaxll_recv_timeout(wmx, 0),
+			  0, ctx->msgs, 1))
+		return -1;
+	return 0;
+}
+
+
+/* Coalesced state changes delivered once the socket is drained */
+static
+int test_flush(struct test_ctx *ctx, struct wimaxll_handle *wmx)
+{
+	static const char *name = "flush";
+
+	wimaxll_set_cb_state_change_coalesced(wmx, test_coalesced_cb, ctx);
+	wimaxll_mock_state_change(ctx->mock, WIMAX_ST_RADIO_OFF, 0);
+	wimaxll_mock_state_change(ctx->mock, WIMAX_ST_READY, 0);
+	if (test_check(name, "coalesced calls",
+		       wimaxll_recv_timeout(wmx, 0), 0, ctx->coalesced, 1)
+	    || test_check(name, "transitions", 0, 0, ctx->transitions, 2))
+		return -1;
+	return 0;
+}
+
+
+/*
+ * A state change after a notice of lost notifications flushes the
+ * notice, whose callback stops; the state change, held, is
+ * delivered on the way out and the next one is left queued.
+ */
+static
+int test_flush_held(struct test_ctx *ctx, struct wimaxll_handle *wmx)
+{
+	static const char *name = "flush_held";
+
+	wimaxll_set_cb_state_change_coalesced(wmx, test_coalesced_cb, ctx);
+	wimaxll_mock_overrun(ctx->mock);
+	wimaxll_mock_state_change(ctx->mock, WIMAX_ST_RADIO_OFF, 0);
+	wimaxll_mock_state_change(ctx->mock, WIMAX_ST_READY, 0);
+	if (test_check(name, "coalesced calls",
+		       wimaxll_recv_timeout(wmx, 0), 0, ctx->coalesced, 2)
+	    || test_check(name, "lost notices", 0, 0, ctx->lost, 1)
+	    || test_check(name, "coalesced calls",
+			  wimaxll_recv_timeout(wmx, 0), 0, ctx->coalesced, 3))
+		return -1;
+	return 0;
+}
+
+
+static
+int test_run(const char *name,
+	     int (*fn)(struct test_ctx *, struct wimaxll_handle *))
+{
+	int result;
+	struct test_ctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.mock = wimaxll_mock_create("wmx-test", 1);
+	if (ctx.mock == NULL) {
+		fprintf(stderr, "E: %s: cannot create mock device: %m\n",
+			name);
+		return -1;
+	}
+	result = fn(&ctx, wimaxll_mock_handle(ctx.mock));
+	wimaxll_mock_destroy(ctx.mock);
+	if (result == 0)
+		printf("I: %s: ok\n", name);
+	return result;
+}
+
+
+int main(int argc, char **argv)
+{
+	int result = 0;
+
+	result |= test_run("msg_to_user", test_msg_to_user);
+	result |= test_run("overrun", test_overrun);
+	result |= test_run("flush", test_flush);
+	result |= test_run("flush_held", test_flush_held);
+	return result < 0 ? 1 : 0;
+}